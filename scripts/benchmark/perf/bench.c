@@ -0,0 +1,332 @@
+/* Micro-benchmarks of the per-read and per-SNP routines on synthetic reads
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "htslib/sam.h"
+#include "csp.h"
+#include "jfile.h"
+#include "jstring.h"
+#include "mplp.h"
+#include "bench.h"
+
+double bench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void bench_report(const char *name, size_t nop, const char *unit, double t) {
+    fprintf(stdout, "%-28s %12ld %-6s %10.3f s %10.1f ns/op %12.0f %s/s\n", name, nop, unit, t,
+            nop ? t * 1e9 / nop : 0.0, t > 0 ? nop / t : 0.0, unit);
+}
+
+/* xorshift64*, so that the data is the same on all platforms given the seed. */
+static inline uint64_t bench_rand(uint64_t *s) {
+    *s ^= *s >> 12; *s ^= *s << 25; *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+/* encode the integer @p x into the string @p s of @p n bases. */
+static void bench_encode(uint64_t x, char *s, int n) {
+    int i;
+    for (i = n - 1; i >= 0; i--) { s[i] = "ACGT"[x & 3]; x >>= 2; }
+    s[n] = '\0';
+}
+
+/*@abstract    Fill the bam1_t with one aligned read having CB and UR tags.
+@param b       Pointer of bam1_t.
+@param pos     Start pos of the alignment. 0-based.
+@param cigar   Pointer of the CIGAR operations.
+@param ncigar  Num of CIGAR operations.
+@param seq     Read seq.
+@param lseq    Length of @p seq.
+@param cb      Cell barcode.
+@param umi     UMI.
+@return        0 if success, -1 otherwise.
+ */
+static int bench_read_fill(bam1_t *b, hts_pos_t pos, uint32_t *cigar, int ncigar, const char *seq, int lseq,
+                           const char *cb, const char *umi) {
+    int lcb = strlen(cb) + 4, lumi = strlen(umi) + 4;     // tag(2) + type(1) + string + NUL(1).
+    size_t l = 4 + ncigar * 4 + ((lseq + 1) >> 1) + lseq + lcb + lumi;
+    uint8_t *p;
+    int i;
+    if (l > b->m_data) {
+        if (NULL == (p = (uint8_t*) realloc(b->data, l))) { return -1; }
+        b->data = p; b->m_data = l;
+    }
+    p = b->data;
+    memcpy(p, "r\0\0\0", 4); p += 4;    // qname "r" padded by 2 extra NULs.
+    memcpy(p, cigar, ncigar * 4); p += ncigar * 4;
+    memset(p, 0, (lseq + 1) >> 1);
+    for (i = 0; i < lseq; i++) { p[i >> 1] |= seq_nt16_table[(uint8_t) seq[i]] << ((~i & 1) << 2); }
+    p += (lseq + 1) >> 1;
+    memset(p, BENCH_QUAL, lseq); p += lseq;
+    p[0] = 'C'; p[1] = 'B'; p[2] = 'Z'; memcpy(p + 3, cb, lcb - 3); p += lcb;
+    p[0] = 'U'; p[1] = 'R'; p[2] = 'Z'; memcpy(p + 3, umi, lumi - 3);
+    b->l_data = l;
+    memset(&b->core, 0, sizeof(bam1_core_t));
+    b->core.tid = 0; b->core.pos = pos; b->core.qual = 60;
+    b->core.l_qname = 4; b->core.l_extranul = 2;
+    b->core.n_cigar = ncigar; b->core.l_qseq = lseq;
+    b->core.mtid = -1; b->core.mpos = -1;
+    return 0;
+}
+
+static void bench_data_destroy(bench_data_t *d) {
+    int i;
+    if (d->r) { for (i = 0; i < d->n; i++) { if (d->r[i]) { csp_read_destroy(d->r[i]); } } free(d->r); }
+    if (d->p) { for (i = 0; i < d->n; i++) { if (d->p[i]) { csp_pileup_destroy(d->p[i]); } } free(d->p); }
+    free(d->bp); free(d->pos);
+    if (d->gs) { gll_setting_free(d->gs); free(d->gs); }
+}
+
+/*@note  Read j of site i starts within the read length before the site, and every 4th read is spliced
+         right after the site.
+ */
+static int bench_data_init(bench_data_t *d, bench_opt_t *o) {
+    global_settings *gs;
+    uint32_t cigar[3];
+    uint64_t s = o->seed * 0x9E3779B97F4A7C15ULL + 1;
+    char *seq = NULL, umi[11];
+    int i, j, k, off, a, ncigar;
+    memset(d, 0, sizeof(bench_data_t));
+    d->depth = o->depth; d->n = o->nsite * o->depth;
+    if (NULL == (d->gs = gs = (global_settings*) calloc(1, sizeof(global_settings)))) { goto fail; }
+    gs->cell_tag = strdup("CB"); gs->umi_tag = strdup("UR");
+    gs->min_count = 20; gs->min_maf = 0.1; gs->min_len = 30; gs->min_mapq = 20; gs->double_gl = 0;
+    gs->nbarcode = o->ncell;
+    if (NULL == gs->cell_tag || NULL == gs->umi_tag) { goto fail; }
+    if (NULL == (gs->barcodes = (char**) calloc(o->ncell, sizeof(char*)))) { goto fail; }
+    for (i = 0; i < o->ncell; i++) {
+        if (NULL == (gs->barcodes[i] = (char*) malloc(19))) { goto fail; }
+        bench_encode(i, gs->barcodes[i], 16); strcat(gs->barcodes[i], "-1");
+    }
+    if (NULL == (gs->bcd = csp_bcd_build(gs->barcodes, gs->nbarcode))) { goto fail; }
+    d->pos = (hts_pos_t*) malloc(sizeof(hts_pos_t) * o->nsite);
+    d->r = (csp_read_t**) calloc(d->n, sizeof(csp_read_t*));
+    d->p = (csp_pileup_t**) calloc(d->n, sizeof(csp_pileup_t*));
+    d->bp = (bam_pileup1_t*) calloc(d->n, sizeof(bam_pileup1_t));
+    seq = (char*) malloc(o->rlen + 1);
+    if (NULL == d->pos || NULL == d->r || NULL == d->p || NULL == d->bp || NULL == seq) { goto fail; }
+    for (i = 0; i < o->nsite; i++) {
+        d->pos[i] = o->rlen + BENCH_REFSKIP + (hts_pos_t) i * BENCH_GAP;
+        for (j = 0; j < o->depth; j++) {
+            k = i * o->depth + j;
+            if (NULL == (d->r[k] = csp_read_init()) || NULL == (d->p[k] = csp_pileup_init())) { goto fail; }
+            for (a = 0; a < o->rlen; a++) { seq[a] = "ACGT"[bench_rand(&s) & 3]; }
+            if (j % 4 == 3) {
+                a = o->rlen / 2; off = bench_rand(&s) % a;
+                cigar[0] = bam_cigar_gen(off + 1, BAM_CMATCH);
+                cigar[1] = bam_cigar_gen(BENCH_REFSKIP, BAM_CREF_SKIP);
+                cigar[2] = bam_cigar_gen(o->rlen - off - 1, BAM_CMATCH);
+                ncigar = 3;
+            } else {
+                off = bench_rand(&s) % o->rlen;
+                cigar[0] = bam_cigar_gen(o->rlen, BAM_CMATCH);
+                ncigar = 1;
+            }
+            seq[off] = bench_rand(&s) % 10 < 3 ? 'G' : 'A';     // the alt allele is G while the ref is A.
+            bench_encode(bench_rand(&s) % o->numi, umi, 10);
+            if (bench_read_fill(d->r[k]->b, d->pos[i] - off, cigar, ncigar, seq, o->rlen,
+                                gs->barcodes[bench_rand(&s) % o->ncell], umi) < 0) { goto fail; }
+        }
+    }
+    free(seq);
+    return 0;
+  fail:
+    fprintf(stderr, "[E::%s] could not create the synthetic data.\n", __func__);
+    free(seq);
+    bench_data_destroy(d);
+    memset(d, 0, sizeof(bench_data_t));
+    return -1;
+}
+
+/*@abstract    Push all pileup results of site @p i into @p mplp.
+@return        0 if success, -1 otherwise.
+ */
+static inline int bench_mplp_fill(bench_data_t *d, csp_mplp_t *mplp, int i) {
+    int j, k;
+    csp_mplp_reset(mplp);
+    mplp->ref_idx = mplp->alt_idx = -1;
+    for (j = 0, k = i * d->depth; j < d->depth; j++, k++) {
+        if (csp_mplp_push(d->p[k], mplp, d->r[k]->idx, d->gs) != 0) { return -1; }
+    }
+    return 0;
+}
+
+static int bench_mplp_push(bench_data_t *d, csp_mplp_t *mplp, int niter) {
+    double t0, t;
+    int i, k, nsite = d->n / d->depth;
+    t0 = bench_now();
+    for (k = 0; k < niter; k++) {
+        for (i = 0; i < nsite; i++) { if (bench_mplp_fill(d, mplp, i) < 0) { return -1; } }
+    }
+    t = bench_now() - t0;
+    bench_report("csp_mplp_push", (size_t) niter * d->n, "reads", t);
+    return 0;
+}
+
+/*@note  Only csp_mplp_stat() is timed, the reads are pushed beforehand for each site. */
+static int bench_mplp_stat(bench_data_t *d, csp_mplp_t *mplp, int niter, const char *name) {
+    double t0, t = 0;
+    size_t npass = 0;
+    int i, k, r, nsite = d->n / d->depth;
+    for (k = 0; k < niter; k++) {
+        for (i = 0; i < nsite; i++) {
+            if (bench_mplp_fill(d, mplp, i) < 0) { return -1; }
+            t0 = bench_now();
+            if ((r = csp_mplp_stat(mplp, d->gs)) < 0) { return -1; }
+            t += bench_now() - t0;
+            if (0 == r) { npass++; }
+        }
+    }
+    bench_report(name, (size_t) niter * nsite, "snps", t);
+    if (npass < (size_t) niter * nsite) {
+        fprintf(stderr, "[W::%s] %ld of %ld sites fail the filters.\n", __func__, (size_t) niter * nsite - npass,
+                (size_t) niter * nsite);
+    }
+    return 0;
+}
+
+/*@note  1. The sites are split into BENCH_NTMP contiguous units written by csp_mplp_to_out() into tmp mtx files
+            (varint-packed) as in the multi-thread mode, which are then merged by merge_mtx() into one plain mtx file.
+         2. The cells VCF is outputed too when genotyping, whose fixed fields are formatted beforehand as in
+            thdata_output_snp(). The mtx files are the same then, so they are merged only when not genotyping.
+ */
+static int bench_out(bench_data_t *d, csp_mplp_t *mplp, bench_opt_t *o, const char *name) {
+    jfile_t *base = NULL, *bvcf = NULL, **tfs[4] = {NULL, NULL, NULL, NULL};
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    double t0, t_out = 0, t_merge = 0;
+    size_t nrec = 0, ns, nr;
+    int i, j, k, ret = -1, nf = d->gs->is_genotype ? 4 : 3, nsite = d->n / d->depth;
+    if (NULL == (base = jf_init()) || NULL == (base->fn = join_path(o->out_dir, "csp_bench.mtx"))) { goto fail; }
+    if (NULL == (bvcf = jf_init()) || NULL == (bvcf->fn = join_path(o->out_dir, "csp_bench.cells.vcf"))) { goto fail; }
+    base->fm = bvcf->fm = "wb";
+    for (j = 0; j < nf; j++) { if (NULL == (tfs[j] = create_tmp_files(j < 3 ? base : bvcf, BENCH_NTMP, 0))) { goto fail; } }
+    for (k = 0; k < o->niter; k++) {
+        for (i = 0; i < BENCH_NTMP; i++) {
+            for (j = 0; j < nf; j++) { if (jf_open(tfs[j][i], NULL) <= 0) { goto fail; } }
+        }
+        for (i = 0; i < nsite; i++) {
+            if (bench_mplp_fill(d, mplp, i) < 0 || csp_mplp_stat(mplp, d->gs) < 0) { goto fail; }
+            j = (size_t) i * BENCH_NTMP / nsite;
+            if (tfs[3]) {
+                ks_clear(s);
+                if (csp_mplp_str_vcf_base(mplp, "chr1", d->pos[i], s) < 0) { goto fail; }
+                jf_puts(ks_str(s), tfs[3][j]); jf_puts("\tGT:AD:DP:OTH:PL:ALL", tfs[3][j]);
+            }
+            t0 = bench_now();
+            if (csp_mplp_to_out(mplp, tfs[0][j], tfs[1][j], tfs[2][j], i + 1, tfs[3] ? tfs[3][j] : NULL,
+                                NULL, NULL) < 0) { goto fail; }
+            t_out += bench_now() - t0;
+            if (tfs[3]) { jf_putc('\n', tfs[3][j]); }
+        }
+        for (i = 0; i < BENCH_NTMP; i++) {
+            for (j = 0; j < nf; j++) { if (jf_close(tfs[j][i]) < 0) { goto fail; } }
+        }
+        if (tfs[3]) { continue; }
+        t0 = bench_now();
+        for (j = 0; j < 3; j++) {
+            merge_mtx(base, tfs[j], BENCH_NTMP, 1, &ns, &nr, &ret);
+            if (ret < 0 || jf_close(base) < 0) { goto fail; }
+            nrec += nr;
+        }
+        t_merge += bench_now() - t0;
+    }
+    bench_report(name, (size_t) o->niter * nsite, "snps", t_out);
+    if (NULL == tfs[3]) { bench_report("merge_mtx", nrec, "recs", t_merge); }
+    ret = 0;
+  fail:
+    if (ret < 0) { fprintf(stderr, "[E::%s] failed to output or merge the mtx files.\n", __func__); }
+    for (j = 0; j < nf; j++) { if (tfs[j]) { destroy_tmp_files(tfs[j], BENCH_NTMP); } }
+    if (base) { remove(base->fn); jf_destroy(base); }
+    if (bvcf) { jf_destroy(bvcf); }
+    ks_free(s);
+    return ret;
+}
+
+static void print_usage(FILE *fp) {
+    fprintf(fp, "\n");
+    fprintf(fp, "Usage: csp-bench [options]\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "Micro-benchmarks of fetch_read(), pileup_read(), csp_mplp_push(), csp_mplp_stat(), csp_mplp_to_out()\n");
+    fprintf(fp, "(with and without the cells VCF) and merge_mtx() on synthetic reads, each covering one site.\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -c, --cells INT     Num of cells [%d]\n", BENCH_NCELL);
+    fprintf(fp, "  -d, --depth INT     Num of reads covering each site [%d]\n", BENCH_DEPTH);
+    fprintf(fp, "  -u, --umis INT      Num of distinct UMIs of each site [%d]\n", BENCH_NUMI);
+    fprintf(fp, "  -n, --sites INT     Num of sites [%d]\n", BENCH_NSITE);
+    fprintf(fp, "  -i, --iters INT     Num of times each benchmark is repeated [%d]\n", BENCH_NITER);
+    fprintf(fp, "  -l, --readLen INT   Length of the reads [%d]\n", BENCH_RLEN);
+    fprintf(fp, "  -s, --seed INT      Seed of the random numbers [%d]\n", BENCH_SEED);
+    fprintf(fp, "  -O, --outDir DIR    Dir of the tmp mtx and VCF files [.]\n");
+    fprintf(fp, "  -h, --help          This message.\n");
+    fprintf(fp, "\n");
+}
+
+int main(int argc, char **argv) {
+    bench_opt_t o = {BENCH_NCELL, BENCH_DEPTH, BENCH_NUMI, BENCH_NSITE, BENCH_NITER, BENCH_RLEN, BENCH_SEED, "."};
+    bench_data_t d;
+    csp_mplp_t *mplp = NULL;
+    double t0;
+    int c, ret = 1;
+    struct option lopts[] = {
+        {"cells", required_argument, NULL, 'c'},
+        {"depth", required_argument, NULL, 'd'},
+        {"umis", required_argument, NULL, 'u'},
+        {"sites", required_argument, NULL, 'n'},
+        {"iters", required_argument, NULL, 'i'},
+        {"readLen", required_argument, NULL, 'l'},
+        {"seed", required_argument, NULL, 's'},
+        {"outDir", required_argument, NULL, 'O'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((c = getopt_long(argc, argv, "c:d:u:n:i:l:s:O:h", lopts, NULL)) != -1) {
+        switch (c) {
+            case 'c': o.ncell = atoi(optarg); break;
+            case 'd': o.depth = atoi(optarg); break;
+            case 'u': o.numi = atoi(optarg); break;
+            case 'n': o.nsite = atoi(optarg); break;
+            case 'i': o.niter = atoi(optarg); break;
+            case 'l': o.rlen = atoi(optarg); break;
+            case 's': o.seed = strtoul(optarg, NULL, 10); break;
+            case 'O': o.out_dir = optarg; break;
+            case 'h': print_usage(stdout); return 0;
+            default: print_usage(stderr); return 1;
+        }
+    }
+    if (o.ncell <= 0 || o.depth <= 0 || o.numi <= 0 || o.nsite <= 0 || o.niter <= 0 || o.rlen < 64) {
+        fprintf(stderr, "[E::%s] the cells, depth, umis, sites and iters should be positive, and the readLen no less than 64.\n",
+                __func__);
+        return 1;
+    }
+    fprintf(stdout, "# cells=%d depth=%d umis=%d sites=%d iters=%d readLen=%d seed=%ld\n", o.ncell, o.depth, o.numi,
+            o.nsite, o.niter, o.rlen, o.seed);
+    t0 = bench_now();
+    if (bench_data_init(&d, &o) < 0) { return 1; }
+    if (bench_fetch_decode(&d) < 0) { goto fail; }
+    fprintf(stdout, "# synthetic data: %d reads, created in %.3f s\n", d.n, bench_now() - t0);
+    if (bench_fetch_read(&d, o.niter) < 0) { goto fail; }
+    if (bench_pileup_read(&d, o.niter) < 0) { goto fail; }
+    if (NULL == (mplp = csp_mplp_init()) || csp_mplp_prepare(mplp, d.gs) < 0) { goto fail; }
+    if (bench_mplp_push(&d, mplp, o.niter) < 0) { goto fail; }
+    if (bench_mplp_stat(&d, mplp, o.niter, "csp_mplp_stat") < 0) { goto fail; }
+    if (csp_qual_lut_init() < 0) { goto fail; }
+    d.gs->is_genotype = 1;
+    if (bench_mplp_stat(&d, mplp, o.niter, "csp_mplp_stat --genotype") < 0) { goto fail; }
+    if (bench_out(&d, mplp, &o, "csp_mplp_to_out --genotype") < 0) { goto fail; }
+    d.gs->is_genotype = 0;
+    if (bench_out(&d, mplp, &o, "csp_mplp_to_out") < 0) { goto fail; }
+    ret = 0;
+  fail:
+    if (ret) { fprintf(stderr, "[E::%s] the benchmarks failed.\n", __func__); }
+    if (mplp) { csp_mplp_destroy(mplp); }
+    bench_data_destroy(&d);
+    return ret;
+}
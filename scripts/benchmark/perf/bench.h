@@ -0,0 +1,88 @@
+/* Micro-benchmarks of the per-read and per-SNP routines on synthetic reads
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef CSP_BENCH_H
+#define CSP_BENCH_H
+
+#include <stdint.h>
+#include "htslib/sam.h"
+#include "csp.h"
+#include "mplp.h"
+
+/* default values of the synthetic data. */
+#define BENCH_NCELL 400
+#define BENCH_DEPTH 100
+#define BENCH_NUMI 50
+#define BENCH_NSITE 2000
+#define BENCH_NITER 5
+#define BENCH_RLEN 98
+#define BENCH_SEED 1
+
+#define BENCH_GAP 50         // distance between two adjacent sites.
+#define BENCH_REFSKIP 200    // length of the N block of the spliced reads.
+#define BENCH_QUAL 30        // base quality of all bases.
+#define BENCH_NTMP 4         // num of tmp mtx files merged by merge_mtx(), i.e. num of simulated work units.
+
+/*@abstract    Options of the synthetic data.
+@param ncell   Num of cells, i.e. barcodes.
+@param depth   Num of reads covering each site.
+@param numi    Num of distinct UMIs of each site. The UMI of each read is randomly picked from them.
+@param nsite   Num of sites.
+@param niter   Num of times each benchmark is repeated.
+@param rlen    Length of the reads.
+@param seed    Seed of the random numbers.
+@param out_dir Dir of the tmp mtx and VCF files.
+ */
+typedef struct {
+    int ncell, depth, numi, nsite, niter, rlen;
+    unsigned long seed;
+    char *out_dir;
+} bench_opt_t;
+
+/*@abstract    The synthetic data shared by all benchmarks.
+@param gs      Pointer of global settings, using barcodes and UMIs.
+@param pos     Pos of each site. 0-based.
+@param r       Decoded reads, read j of site i is r[i * depth + j].
+@param p       Pileup result of each read at its site, set by bench_fetch_read().
+@param bp      The bam_pileup1_t of each read at its site, as given by the mpileup.
+@param depth   Num of reads of each site.
+@param n       Num of elements in @p r, @p p and @p bp, i.e. nsite * depth.
+
+@note          1. Each read covers exactly one site, with 1/4 of them spliced, and 30% of them carrying the alt base.
+               2. The @p umi and @p cb of @p p point to the data of the reads.
+ */
+typedef struct {
+    global_settings *gs;
+    hts_pos_t *pos;
+    csp_read_t **r;
+    csp_pileup_t **p;
+    bam_pileup1_t *bp;
+    int depth, n;
+} bench_data_t;
+
+/* current time in seconds. */
+double bench_now(void);
+
+/*@abstract    Print the result of one benchmark.
+@param name    Name of the benchmark.
+@param nop     Num of operations, e.g. reads or SNPs.
+@param unit    Name of the operation.
+@param t       Total time (seconds) of all operations.
+ */
+void bench_report(const char *name, size_t nop, const char *unit, double t);
+
+/*@abstract    Decode the reads by fetch_read_decode().
+@return        0 if success, -1 otherwise.
+@note          All synthetic reads should pass the filters.
+ */
+int bench_fetch_decode(bench_data_t *d);
+
+/*@abstract    Benchmark fetch_read() on all reads, and save the results into @p d->p.
+@return        0 if success, -1 otherwise.
+ */
+int bench_fetch_read(bench_data_t *d, int niter);
+
+/* Benchmark pileup_read() on @p d->bp. Return 0 if success, -1 otherwise. */
+int bench_pileup_read(bench_data_t *d, int niter);
+
+#endif
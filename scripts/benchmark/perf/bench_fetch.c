@@ -0,0 +1,44 @@
+/* Benchmark of fetch_read(), which is static so the whole csp_fetch.c is compiled into this file
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#include "csp_fetch.c"
+#include "bench.h"
+
+int bench_fetch_decode(bench_data_t *d) {
+    csp_prof_t pf;
+    int i;
+    memset(&pf, 0, sizeof(pf));
+    for (i = 0; i < d->n; i++) {
+        if (fetch_read_decode(d->r[i], d->gs, &pf) != 0) {
+            fprintf(stderr, "[E::%s] the synthetic read %d does not pass the filters.\n", __func__, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bench_fetch_read(bench_data_t *d, int niter) {
+    hts_pos_t pos;
+    double t0, t;
+    int i, k, ret;
+    t0 = bench_now();
+    for (k = 0; k < niter; k++) {
+        for (i = 0; i < d->n; i++) {
+            pos = d->pos[i / d->depth];
+            if ((ret = fetch_read(pos, d->r[i], d->p[i])) != 0) {
+                fprintf(stderr, "[E::%s] fetch_read() returns %d for the synthetic read %d.\n", __func__, ret, i);
+                return -1;
+            }
+        }
+    }
+    t = bench_now() - t0;
+    bench_report("fetch_read", (size_t) niter * d->n, "reads", t);
+    /* the bam_pileup1_t as given by the mpileup, used by bench_pileup_read(). */
+    for (i = 0; i < d->n; i++) {
+        d->bp[i].b = d->r[i]->b;
+        d->bp[i].qpos = d->p[i]->qpos;
+        d->bp[i].is_del = d->p[i]->is_del;
+        d->bp[i].is_refskip = d->p[i]->is_refskip;
+    }
+    return 0;
+}
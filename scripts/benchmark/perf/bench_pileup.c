@@ -0,0 +1,26 @@
+/* Benchmark of pileup_read(), which is static so the whole csp_pileup.c is compiled into this file
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#include "csp_pileup.c"
+#include "bench.h"
+
+int bench_pileup_read(bench_data_t *d, int niter) {
+    csp_pileup_t *p = NULL;
+    double t0, t;
+    int i, k, ret;
+    if (NULL == (p = csp_pileup_init())) { fprintf(stderr, "[E::%s] could not init csp_pileup_t.\n", __func__); return -1; }
+    t0 = bench_now();
+    for (k = 0; k < niter; k++) {
+        for (i = 0; i < d->n; i++) {
+            if ((ret = pileup_read(d->pos[i / d->depth], d->bp + i, p, d->gs)) != 0) {
+                fprintf(stderr, "[E::%s] pileup_read() returns %d for the synthetic read %d.\n", __func__, ret, i);
+                csp_pileup_destroy(p);
+                return -1;
+            }
+        }
+    }
+    t = bench_now() - t0;
+    bench_report("pileup_read", (size_t) niter * d->n, "reads", t);
+    csp_pileup_destroy(p);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+#this script is aimed to benchmark the end-to-end throughput of cellsnp-lite on the 10x test data.
+#hxj5<hxj5@hku.hk>
+
+## Usage: e2e_10x.sh [BIN] [NTHREAD] [DAT_DIR]
+##   BIN      Path to cellsnp-lite [cellsnp-lite]
+##   NTHREAD  Num of threads passed to -p [1]
+##   DAT_DIR  Dir of the test data downloaded by test/test_10x.sh [$HOME/test_cellSNP]
+## The throughput is calculated from the wall time and the counters in the profile written by --profile.
+
+BIN=${1:-cellsnp-lite}
+NTHREAD=${2:-1}
+DAT_DIR=${3:-$HOME/test_cellSNP}
+
+BAM=$DAT_DIR/demux.B.lite.bam
+BARCODE=$DAT_DIR/demux.B.barcodes.400.tsv
+REGION=$DAT_DIR/genome1K.subset.hg19.vcf.gz
+OUT_DIR=$DAT_DIR/e2e_bench
+
+if [ ! -f $BAM ] || [ ! -f $BARCODE ] || [ ! -f $REGION ]; then
+    echo "[W::e2e_10x] test data not found in $DAT_DIR, run 'sh test/test_10x.sh TRUE' to download it." >&2
+    exit 0
+fi
+
+#@abstract  Get the reads and SNPs counters from the profile.
+#@param $1  Path to the profile [STR]
+#@return    RetCode: 0. RetContent: "<reads> <snps> <passed snps>".
+get_counts() {
+    awk '
+        /"reads": \{/ { sec = "reads" }
+        /"snps": \{/  { sec = "snps" }
+        sec == "reads" && /"read":/   { gsub(/[^0-9]/, ""); nread = $0 }
+        sec == "snps"  && /"pileup":/ { gsub(/[^0-9]/, ""); nsnp = $0 }
+        sec == "snps"  && /"passed":/ { gsub(/[^0-9]/, ""); npass = $0; sec = "" }
+        END { print nread, nsnp, npass }
+    ' $1
+}
+
+#@abstract  Run cellsnp-lite once and print the throughput.
+#@param $1  Name of the run [STR]
+#@param $@  Options passed to cellsnp-lite [STR]
+#@return    RetCode: 0 if success, 1 otherwise. RetContent: the result line.
+run_one() {
+    local name=$1 out=$OUT_DIR/$1
+    shift
+    local t0=`date +%s.%N`
+    $BIN -s $BAM -O $out -b $BARCODE -p $NTHREAD --profile "$@" > $out.log 2>&1 || {
+        echo "[E::e2e_10x] $name failed, see $out.log" >&2; return 1; }
+    local t1=`date +%s.%N`
+    get_counts $out/cellSNP.profile.json | awk -v name=$name -v p=$NTHREAD -v t0=$t0 -v t1=$t1 '{
+        t = t1 - t0
+        printf "%-8s %4d %10.3f %12d %12.0f %10d %10.0f %10d\n", name, p, t, $1, $1 / t, $2, $2 / t, $3
+    }'
+}
+
+mkdir -p $OUT_DIR
+printf "%-8s %4s %10s %12s %12s %10s %10s %10s\n" mode p wall_s reads reads/s snps snps/s passed
+run_one mode1 -R $REGION --minCOUNT 20 || exit 1
+run_one mode2 --minCOUNT 20 --minMAF 0.1 || exit 1
@@ -0,0 +1,108 @@
+/* Barcode dictionary API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "barcode.h"
+
+/* 1 + 2-bit code of each base, 0 means not ACGT. */
+static const uint8_t bcd_nt4[256] = { ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4 };
+
+/*@abstract  Pack the first @p l bases of the barcode into an integer.
+@return      0 if success, -1 if any of the bases is not ACGT.
+ */
+static inline int bcd_pack(const char *s, int l, uint64_t *x) {
+    uint64_t v = 0;
+    int i, c;
+    for (i = 0; i < l; i++) {
+        if (0 == (c = bcd_nt4[(uint8_t) s[i]])) { return -1; }
+        v = v << 2 | (c - 1);
+    }
+    *x = v;
+    return 0;
+}
+
+typedef struct { uint64_t key; int idx; } bcd_pair_t;
+
+static int cmp_bcd_pair(const void *x, const void *y) {
+    uint64_t a = ((bcd_pair_t*) x)->key, b = ((bcd_pair_t*) y)->key;
+    return a < b ? -1 : (a > b);
+}
+
+/*@note  Packing is tried first, the HashMap is used only when some barcode could not be packed. */
+csp_bcd_t* csp_bcd_build(char **s, int n) {
+    csp_bcd_t *d = NULL;
+    bcd_pair_t *pr = NULL;
+    map_bi_iter k;
+    int i, l, r;
+    if (NULL == s || n <= 0) { return NULL; }
+    if (NULL == (d = (csp_bcd_t*) calloc(1, sizeof(csp_bcd_t)))) { goto fail; }
+    d->n = n;
+    for (l = 0; l < 32 && bcd_nt4[(uint8_t) s[0][l]]; l++);
+    d->sfx = s[0] + l;
+    if (l > 0) {
+        if (NULL == (pr = (bcd_pair_t*) malloc(sizeof(bcd_pair_t) * n))) { goto fail; }
+        for (i = 0; i < n; i++) {
+            if (bcd_pack(s[i], l, &pr[i].key) < 0 || strcmp(s[i] + l, d->sfx) != 0) { break; }
+            pr[i].idx = i;
+        }
+        if (i >= n) { d->l = l; }
+    }
+    if (d->l) {
+        qsort(pr, n, sizeof(bcd_pair_t), cmp_bcd_pair);
+        d->key = (uint64_t*) malloc(sizeof(uint64_t) * n);
+        d->idx = (int*) malloc(sizeof(int) * n);
+        if (NULL == d->key || NULL == d->idx) { goto fail; }
+        for (i = 0; i < n; i++) {
+            if (i > 0 && pr[i].key == pr[i - 1].key) {
+                fprintf(stderr, "[E::%s] repeated barcode '%s'.\n", __func__, s[pr[i].idx]);
+                goto fail;
+            }
+            d->key[i] = pr[i].key; d->idx[i] = pr[i].idx;
+        }
+    } else {
+        if (NULL == (d->h = map_bi_init())) { goto fail; }
+        for (i = 0; i < n; i++) {
+            k = map_bi_put(d->h, s[i], &r);
+            if (r < 0) { goto fail; }
+            else if (r == 0) { fprintf(stderr, "[E::%s] repeated barcode '%s'.\n", __func__, s[i]); goto fail; }
+            map_bi_val(d->h, k) = i;
+        }
+    }
+    free(pr);
+    return d;
+  fail:
+    free(pr);
+    csp_bcd_destroy(d);
+    return NULL;
+}
+
+void csp_bcd_destroy(csp_bcd_t *d) {
+    if (d) {
+        free(d->key);
+        free(d->idx);
+        if (d->h) { map_bi_destroy(d->h); }
+        free(d);
+    }
+}
+
+/*@note  The sorted keys are searched by a branchless binary search. */
+inline int csp_bcd_get(csp_bcd_t *d, const char *s) {
+    if (d->l) {
+        const uint64_t *base = d->key;
+        uint64_t x;
+        int n = d->n, half;
+        if (bcd_pack(s, d->l, &x) < 0 || strcmp(s + d->l, d->sfx) != 0) { return -1; }
+        while (n > 1) {
+            half = n >> 1;
+            base = (base[half] <= x) ? base + half : base;
+            n -= half;
+        }
+        return *base == x ? d->idx[base - d->key] : -1;
+    } else {
+        map_bi_iter k = map_bi_get(d->h, s);
+        return k == map_bi_end(d->h) ? -1 : map_bi_val(d->h, k);
+    }
+}
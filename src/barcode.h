@@ -0,0 +1,63 @@
+/* Barcode dictionary API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef CSP_BARCODE_H
+#define CSP_BARCODE_H
+
+#include <stdint.h>
+#include "htslib/khash.h"
+
+/*@abstract    The HashMap maps barcode (char*) to its index (int).
+@example       Refer to a simple example in khash.h.
+ */
+KHASH_MAP_INIT_STR(bi, int)
+typedef khash_t(bi) map_bi_t;
+#define map_bi_iter khiter_t
+#define map_bi_init() kh_init(bi)
+#define map_bi_put(h, k, r)  kh_put(bi, h, k, r)
+#define map_bi_get(h, k) kh_get(bi, h, k)
+#define map_bi_val(h, x) kh_val(h, x)
+#define map_bi_end(h) kh_end(h)
+#define map_bi_destroy(h) kh_destroy(bi, h)
+
+/*@abstract  The dictionary maps each barcode to a dense integer index, i.e. the index of the barcode in
+             the input barcode list.
+@param n     Num of barcodes.
+@param l     Length of the ACGT part of the barcodes that are packed into integers. 0 means the barcodes
+             could not be packed, then @p h is used.
+@param sfx   The suffix (e.g. "-1" in 10x barcodes) right after the ACGT part, shared by all barcodes.
+@param key   Sorted array of packed barcodes, 2 bits for each base.
+@param idx   idx[i] is the index of the barcode whose packed value is key[i].
+@param h     Pointer of HashMap used for barcodes that could not be packed.
+
+@note        1. Barcodes could be packed only if all of them are made of an ACGT part of the same length
+                (no more than 32) and a common suffix. Otherwise, the barcodes are looked up in @p h.
+             2. The keys of @p h and the @p sfx are pointers to the input barcodes, do not free them.
+ */
+typedef struct {
+    int n, l;
+    const char *sfx;
+    uint64_t *key;
+    int *idx;
+    map_bi_t *h;
+} csp_bcd_t;
+
+/*@abstract  Build the barcode dictionary.
+@param s     Pointer of array of barcodes.
+@param n     Num of barcodes.
+@return      Pointer of csp_bcd_t structure if success, NULL otherwise (e.g. repeated barcodes).
+
+@note        The array @p s should not be modified or freed until csp_bcd_destroy() is called.
+ */
+csp_bcd_t* csp_bcd_build(char **s, int n);
+
+void csp_bcd_destroy(csp_bcd_t *d);
+
+/*@abstract  Get the index of one barcode.
+@param d     Pointer of csp_bcd_t structure.
+@param s     Pointer of the barcode.
+@return      Index of the barcode if found, -1 otherwise.
+ */
+inline int csp_bcd_get(csp_bcd_t *d, const char *s);
+
+#endif
@@ -5,10 +5,6 @@
 /* TODO: 
 - Fix the inline issue (error when compiled by gcc/clang and fixed by adding -fgnu89-inline CFLAG)
 - add -f option to use fasta
-- ?change -T method, use qsort & linear search instead of regidx_t of htslib:
-  * note the bug of qsort in lower version of glibc, refer to https://sourceware.org/bugzilla/show_bug.cgi?id=11655)
-  * as the linear searching assume that the bam has been sortted by start pos, then how to deal with the partly aligned reads
-    and one read in paired reads aligned to query chrom.
 - Try multi-process (process pool) for multi input samples
 - Output vcf header according to input bam header
 - separate htsFile from csp_bam_fs as it cannot be shared among threads
@@ -35,8 +31,8 @@
 #include <time.h>
 #include "thpool.h"
 #include "htslib/sam.h"
-#include "htslib/regidx.h"
 #include "config.h"
+#include "barcode.h"
 #include "csp.h"
 #include "jfile.h"
 #include "jsam.h"
@@ -56,15 +52,22 @@ static void gll_set_default(global_settings *gs) {
         gs->out_dir = NULL; 
         gs->out_vcf_base = NULL; gs->out_vcf_cells = NULL; gs->out_samples = NULL;
         gs->out_mtx_ad = NULL; gs->out_mtx_dp = NULL; gs->out_mtx_oth = NULL;
-        gs->is_genotype = 0; gs->is_out_zip = 0;
+        gs->out_mtx_gt = NULL; gs->out_mtx_pl = NULL;
+        gs->is_genotype = 0; gs->is_sparse_geno = 0; gs->is_out_zip = 0;
+        gs->is_out_bcf = 0; gs->bcf_hdr_base = NULL; gs->bcf_hdr_cells = NULL;
+        gs->is_out_stream = 0; gs->stream_buf = CSP_STREAM_BUF_SIZE >> 20;
         gs->snp_list_file = NULL; snplist_init(gs->pl); gs->is_target = 0; gs->targets = NULL;
-        gs->barcode_file = NULL; gs->nbarcode = 0; gs->barcodes = NULL; 
+        gs->barcode_file = NULL; gs->nbarcode = 0; gs->barcodes = NULL; gs->bcd = NULL;
         gs->sid_list_file = NULL; gs->sample_ids = NULL; gs->nsid = 0;
         char *chrom_tmp[] = CSP_CHROM_ALL;
         gs->chroms = (char**) calloc(CSP_NCHROM, sizeof(char*));
         for (gs->nchrom = 0; gs->nchrom < CSP_NCHROM; gs->nchrom++) { gs->chroms[gs->nchrom] = safe_strdup(chrom_tmp[gs->nchrom]); }
         gs->cell_tag = safe_strdup(CSP_CELL_TAG); gs->umi_tag = safe_strdup(CSP_UMI_TAG);
-        gs->nthread = CSP_NTHREAD; gs->tp = NULL; gs->tp_max_open = TP_MAX_OPEN;
+        gs->nthread = CSP_NTHREAD; gs->tp = NULL; gs->htp = NULL; gs->tp_max_open = TP_MAX_OPEN;
+        gs->prefetch = CSP_PREFETCH; gs->win_size = CSP_PILEUP_WIN_SIZE;
+        gs->shard = 0; gs->nshard = 1;
+        gs->is_resume = 0;
+        gs->is_profile = 0;
         gs->mthread = CSP_NTHREAD; gs->tp_errno = 0; gs->tp_ntry = 0;
         gs->min_count = CSP_MIN_COUNT; gs->min_maf = CSP_MIN_MAF; 
         gs->double_gl = 0;
@@ -79,6 +82,155 @@ static inline int run_mode1(global_settings *gs) { return csp_fetch(gs); }
 static inline int run_mode2(global_settings *gs) { return csp_pileup(gs); }
 static inline int run_mode3(global_settings *gs) { return csp_fetch(gs); }
 
+/*@abstract  Compile a SNP VCF into a panel file that could be used by -R/-T, i.e. the "panel" subcommand.
+@param argc  Num of arguments, including the subcommand itself.
+@param argv  Arguments, argv[0] is "panel".
+@return      0 if success, 1 otherwise.
+ */
+static int run_panel(int argc, char **argv) {
+    snplist_t pl;
+    int ret, print_skip_snp = 0;
+    snplist_init(pl);
+    if (4 == argc && 0 == strcmp(argv[1], "--printSkipSNPs")) { print_skip_snp = 1; argc--; argv++; }
+    if (3 != argc) {
+        fprintf(stderr, "\nUsage: %s panel [--printSkipSNPs] <in.vcf> <out.panel>\n\n", CSP_NAME);
+        return 1;
+    }
+    fprintf(stderr, "[I::%s] loading the VCF file '%s' ...\n", __func__, argv[1]);
+    if (get_snplist_from_vcf(argv[1], &pl, &ret, print_skip_snp) <= 0 || ret < 0) {
+        fprintf(stderr, "[E::%s] get SNP list from '%s' failed.\n", __func__, argv[1]);
+        goto fail;
+    }
+    fprintf(stderr, "[I::%s] writing %ld SNPs on %d chroms into '%s' ...\n", __func__, snplist_size(pl), pl.nchrom, argv[2]);
+    if (snp_panel_write(argv[2], &pl) < 0) {
+        fprintf(stderr, "[E::%s] failed to write panel '%s'.\n", __func__, argv[2]);
+        goto fail;
+    }
+    snplist_destroy(pl);
+    fprintf(stderr, "[I::%s] All Done!\n", __func__);
+    return 0;
+  fail:
+    snplist_destroy(pl);
+    return 1;
+}
+
+/*@abstract  Create the jfile_t structures of one output file in the output dir of each shard.
+@param dir   Output dirs of the shards.
+@param n     Num of shards.
+@param name  Filename of the output file.
+@param is_zip  If the files are zipped.
+@return      Pointer of array of jfile_t if success, NULL otherwise.
+ */
+static jfile_t** shard_files_init(char **dir, int n, const char *name, int is_zip) {
+    jfile_t **fs;
+    int i;
+    if (NULL == (fs = (jfile_t**) calloc(n, sizeof(jfile_t*)))) { return NULL; }
+    for (i = 0; i < n; i++) {
+        if (NULL == (fs[i] = jf_init())) { goto fail; }
+        fs[i]->fn = join_path(dir[i], name); fs[i]->is_zip = is_zip;
+    }
+    return fs;
+  fail:
+    for (i = 0; i < n; i++) { jf_destroy(fs[i]); }
+    free(fs);
+    return NULL;
+}
+
+/*@abstract  Merge the output files of the shards (refer to --shard) into the standard output files, i.e. the
+             "merge" subcommand.
+@param argc  Num of arguments, including the subcommand itself.
+@param argv  Arguments, argv[0] is "merge".
+@return      0 if success, 1 otherwise.
+
+@note        1. The output dirs of the shards should be given in order of shards, i.e., from 1/N to N/N.
+             2. The files to be merged are those in the output dir of the first shard, e.g., the BCF files if the
+                shards were run with --bcf, and they should also exist in the others.
+ */
+static int run_merge(int argc, char **argv) {
+    const char *mtx_fn[] = {CSP_OUT_MTX_AD, CSP_OUT_MTX_DP, CSP_OUT_MTX_OTH, CSP_OUT_MTX_GT, CSP_OUT_MTX_PL};
+    const char *vcf_fn[2][3] = {{CSP_OUT_VCF_BASE, CSP_OUT_VCF_BASE ".gz", CSP_OUT_BCF_BASE},
+                                {CSP_OUT_VCF_CELLS, CSP_OUT_VCF_CELLS ".gz", CSP_OUT_BCF_CELLS}};
+    char **dir = argv + 2, **smp = NULL, **t = NULL, **fn = NULL, *out_dir = argv[1], *p = NULL;
+    jfile_t **in = NULL, *out = NULL;
+    int i, j, k, n = argc - 2, nsmp = 0, nt = 0;
+    if (argc < 3) {
+        fprintf(stderr, "\nUsage: %s merge <out_dir> <shard_dir1> <shard_dir2> ...\n\n", CSP_NAME);
+        return 1;
+    }
+    if (0 != access(out_dir, F_OK) && 0 != mkdir(out_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)) {
+        fprintf(stderr, "[E::%s] '%s' does not exist and could not be created.\n", __func__, out_dir);
+        return 1;
+    }
+    /* the samples should be the same in all shards. */
+    if (NULL == (fn = (char**) calloc(n, sizeof(char*)))) { goto fail; }
+    for (i = 0; i < n; i++) {
+        fn[i] = join_path(dir[i], CSP_OUT_SAMPLES);
+        if (NULL == (t = hts_readlines(fn[i], &nt))) {
+            fprintf(stderr, "[E::%s] could not read '%s'.\n", __func__, fn[i]);
+            goto fail;
+        }
+        if (0 == i) { smp = t; nsmp = nt; t = NULL; continue; }
+        for (j = 0; j < nsmp && nt == nsmp && 0 == strcmp(t[j], smp[j]); j++);
+        str_arr_destroy(t, nt); t = NULL;
+        if (j < nsmp || nt != nsmp) {
+            fprintf(stderr, "[E::%s] the samples in '%s' differ from those in '%s'.\n", __func__, fn[i], fn[0]);
+            goto fail;
+        }
+    }
+    p = join_path(out_dir, CSP_OUT_SAMPLES);
+    if (merge_files(fn, 1, p) < 1) { fprintf(stderr, "[E::%s] failed to write '%s'.\n", __func__, p); goto fail; }
+    fprintf(stderr, "[I::%s] merging the outputs of %d shards with %d samples ...\n", __func__, n, nsmp);
+    /* merge the mtx files. */
+    for (k = 0; k < 5; k++) {
+        free(p); p = join_path(dir[0], mtx_fn[k]);
+        if (0 != access(p, F_OK)) { continue; }      // e.g., no GT and PL files.
+        free(p); p = NULL;
+        if (NULL == (in = shard_files_init(dir, n, mtx_fn[k], 0)) || NULL == (out = jf_init())) { goto fail; }
+        out->fn = join_path(out_dir, mtx_fn[k]);
+        if (merge_shard_mtx(out, in, n) < 0) { fprintf(stderr, "[E::%s] failed to merge '%s'.\n", __func__, mtx_fn[k]); goto fail; }
+        for (i = 0; i < n; i++) { jf_destroy(in[i]); }
+        free(in); in = NULL;
+        jf_destroy(out); out = NULL;
+    }
+    /* merge the base and cells vcf files, which could be zipped or in BCF format. */
+    for (k = 0; k < 2; k++) {
+        for (j = 0; j < 3; j++) {
+            free(p); p = join_path(dir[0], vcf_fn[k][j]);
+            if (0 == access(p, F_OK)) { break; }
+        }
+        free(p); p = NULL;
+        if (j >= 3) { continue; }       // e.g., no cells vcf.
+        if (2 == j) {
+            for (i = 0; i < n; i++) { free(fn[i]); fn[i] = join_path(dir[i], vcf_fn[k][j]); }
+            p = join_path(out_dir, vcf_fn[k][j]);
+            if ((i = merge_shard_bcf(p, fn, n, 1)) < 0) { fprintf(stderr, "[E::%s] failed to merge '%s'.\n", __func__, vcf_fn[k][j]); goto fail; }
+            else if (i > 0) { fprintf(stderr, "[W::%s] failed to index '%s', the SNPs may be unsorted.\n", __func__, p); }
+            free(p); p = NULL;
+            continue;
+        }
+        if (NULL == (in = shard_files_init(dir, n, vcf_fn[k][j], j)) || NULL == (out = jf_init())) { goto fail; }
+        out->fn = join_path(out_dir, vcf_fn[k][j]); out->is_zip = j;
+        if (merge_shard_vcf(out, in, n) < 0) { fprintf(stderr, "[E::%s] failed to merge '%s'.\n", __func__, vcf_fn[k][j]); goto fail; }
+        for (i = 0; i < n; i++) { jf_destroy(in[i]); }
+        free(in); in = NULL;
+        jf_destroy(out); out = NULL;
+    }
+    str_arr_destroy(fn, n);
+    str_arr_destroy(smp, nsmp);
+    fprintf(stderr, "[I::%s] All Done!\n", __func__);
+    return 0;
+  fail:
+    if (in) {
+        for (i = 0; i < n; i++) { jf_destroy(in[i]); }
+        free(in);
+    }
+    if (out) { jf_destroy(out); }
+    if (fn) { str_arr_destroy(fn, n); }
+    if (smp) { str_arr_destroy(smp, nsmp); }
+    free(p);
+    return 1;
+}
+
 static void print_usage(FILE *fp) {
     char *tmp_require = bam_flag2str(CSP_INCL_FMASK);
     char *tmp_filter_umi  = bam_flag2str(CSP_EXCL_FMASK_UMI);
@@ -86,7 +238,9 @@ static void print_usage(FILE *fp) {
 
     fprintf(fp, 
         "\n"
-        "Usage: %s [options]\n", CSP_NAME);
+        "Usage: %s [options]\n"
+        "       %s panel [--printSkipSNPs] <in.vcf> <out.panel>\n"
+        "       %s merge <out_dir> <shard_dir1> <shard_dir2> ...\n", CSP_NAME, CSP_NAME, CSP_NAME);
     fprintf(fp,
         "\n"
         "Options:\n"
@@ -100,6 +254,7 @@ static void print_usage(FILE *fp) {
         "                           If None, pileup the genome. Needed for bulk samples.\n"
         "  -T, --targetsVCF FILE    Similar as -R, but the next position is accessed by streaming rather\n"
         "                           than indexing/jumping (like -T in samtools/bcftools mpileup).\n"
+        "                           Both -R and -T also accept a panel file made by the panel subcommand.\n"
         "  -b, --barcodeFile FILE   A plain file listing all effective cell barcode.\n"
         "  -i, --sampleList FILE    A list file containing sample IDs, each per line.\n"
         "  -I, --sampleIDs STR      Comma separated sample ids.\n"
@@ -108,9 +263,26 @@ static void print_usage(FILE *fp) {
         "\n"
         "Optional arguments:\n"
         "  --genotype           If use, do genotyping in addition to counting.\n"
+        "  --sparseGeno         If use, do genotyping and output GT and PL of the cells with reads into\n"
+        "                       cellSNP.tag.GT.mtx and cellSNP.tag.PL.txt, instead of cellSNP.cells.vcf.\n"
         "  --gzip               If use, the output files will be zipped into BGZF format.\n"
+        "  --bcf                If use, output the base and cells VCF as indexed BCF files.\n"
+        "  --streamOut          If use, the subprocesses hand the output to one writer thread in memory,\n"
+        "                       which writes the output files directly, instead of writing tmp files.\n"
         "  --printSkipSNPs      If use, the SNPs skipped when loading VCF will be printed.\n");
     fprintf(fp, "  -p, --nproc INT      Number of subprocesses [%d]\n", CSP_NTHREAD);
+    fprintf(fp, "  --prefetch INT       Number of reads buffered for each input file by one extra reader thread\n"
+                "                       of each subprocess, 0 means reading in the subprocesses [%d]\n", CSP_PREFETCH);
+    fprintf(fp, "  --winSize INT        Size (bp) of the windows that chroms are split into in Mode 2 with multiple\n"
+                "                       subprocesses or shards, a multiple of 16384 [%d]\n", CSP_PILEUP_WIN_SIZE);
+    fprintf(fp, "  --streamBuf INT      Max size (MB) of the output of the later units kept in memory with --streamOut,\n"
+                "                       beyond which their subprocesses wait for the writer [%d]\n", CSP_STREAM_BUF_SIZE >> 20);
+    fprintf(fp, "  --shard i/N          Only run the i-th of N shards of the SNPs (Mode 1&3) or the genome windows\n"
+                "                       (Mode 2 and -T), whose outputs could be merged by the merge subcommand [1/1]\n");
+    fprintf(fp, "  --resume             If use, skip the work units finished by a previous run of the same command\n"
+                "                       that failed or was killed, whose outputs are kept in OUT_DIR.\n");
+    fprintf(fp, "  --profile            If use, time the stages of the subprocesses and output the counters of reads\n"
+                "                       and SNPs into %s in OUT_DIR.\n", CSP_OUT_PROFILE);
     fprintf(fp, "  --chrom STR          The chromosomes to use, comma separated [1 to %d]\n", CSP_NCHROM);
     fprintf(fp, "  --cellTAG STR        Tag for cell barcodes, turn off with None [%s]\n", CSP_CELL_TAG);
     fprintf(fp, "  --UMItag STR         Tag for UMI: UR, Auto, None. For Auto mode, use UR if barcodes is inputted,\n"
@@ -199,7 +371,13 @@ static int check_args(global_settings *gs) {
         } else if (NULL == (gs->barcodes = hts_readlines(gs->barcode_file, &gs->nbarcode))) {
             fprintf(stderr, "[E::%s] could not read barcode file '%s'\n", __func__, gs->barcode_file); 
             return -2;
-        } else { qsort(gs->barcodes, gs->nbarcode, sizeof(char*), cmp_barcodes); }
+        } else { 
+            qsort(gs->barcodes, gs->nbarcode, sizeof(char*), cmp_barcodes);
+            if (NULL == (gs->bcd = csp_bcd_build(gs->barcodes, gs->nbarcode))) {
+                fprintf(stderr, "[E::%s] could not build barcode dictionary.\n", __func__);
+                return -2;
+            }
+        }
     } else if ((NULL == gs->cell_tag) ^ (NULL == gs->barcode_file)) {
         fprintf(stderr, "[E::%s] should not specify barcodes or cell-tag alone.\n", __func__); 
         return -1;
@@ -241,6 +419,20 @@ static int check_args(global_settings *gs) {
     }
     //if (gs->max_flag < 0) { gs->max_flag = gs->umi_tag ? CSP_MAX_FLAG_WITH_UMI : CSP_MAX_FLAG_WITHOUT_UMI; }
     if (gs->rflag_filter < 0) gs->rflag_filter = use_umi(gs) ? CSP_EXCL_FMASK_UMI : CSP_EXCL_FMASK_NOUMI;
+    if (gs->prefetch < 0) { fprintf(stderr, "[E::%s] --prefetch should be no less than 0.\n", __func__); return -1; }
+    if (gs->stream_buf < 0) { fprintf(stderr, "[E::%s] --streamBuf should be no less than 0.\n", __func__); return -1; }
+    if (gs->win_size <= 0 || gs->win_size % 16384) {
+        fprintf(stderr, "[E::%s] --winSize should be a positive multiple of 16384.\n", __func__);
+        return -1;
+    }
+    if (gs->nshard < 1 || gs->shard < 0 || gs->shard >= gs->nshard) {
+        fprintf(stderr, "[E::%s] --shard should be i/N, where 1 <= i <= N.\n", __func__);
+        return -1;
+    }
+    if (gs->is_resume && gs->is_out_stream) {
+        fprintf(stderr, "[E::%s] --resume could not be used with --streamOut, which keeps no tmp files.\n", __func__);
+        return -1;
+    }
     // increase number of max open files
     if (gs->nin > 1) {
         if (getrlimit(RLIMIT_NOFILE, &r) < 0) { fprintf(stderr, "[E::%s] getrlimit error.\n", __func__); return -2; }
@@ -283,11 +475,6 @@ static inline char* format_fn(char *fn, int is_zip, kstring_t *s) {
     } else { return fn; }
 }
 
-static inline void regidx_payload_free(void *payload) {
-    biallele_t **data = (biallele_t**) payload;
-    biallele_destroy(*data);
-}
-
 int main(int argc, char **argv) {
     /* timing */
     time_t start_time, end_time;
@@ -296,6 +483,8 @@ int main(int argc, char **argv) {
     time(&start_time);
     time_info = localtime(&start_time);
     strftime(time_str, 30, "%Y-%m-%d %H:%M:%S", time_info);
+    if (argc > 1 && 0 == strcmp(argv[1], "panel")) { return run_panel(argc - 1, argv + 1); }
+    if (argc > 1 && 0 == strcmp(argv[1], "merge")) { return run_merge(argc - 1, argv + 1); }
     /* Formal part */
     global_settings gs;
     gll_set_default(&gs);
@@ -341,7 +530,16 @@ int main(int argc, char **argv) {
         {"printSkipSNPs", no_argument, NULL, 13},
         {"inclFLAG", required_argument, NULL, 14},
         {"exclFLAG", required_argument, NULL, 15},
-        {"countORPHAN", no_argument, NULL, 16}
+        {"countORPHAN", no_argument, NULL, 16},
+        {"sparseGeno", no_argument, NULL, 17},
+        {"bcf", no_argument, NULL, 18},
+        {"prefetch", required_argument, NULL, 19},
+        {"streamOut", no_argument, NULL, 20},
+        {"shard", required_argument, NULL, 21},
+        {"resume", no_argument, NULL, 22},
+        {"profile", no_argument, NULL, 23},
+        {"winSize", required_argument, NULL, 24},
+        {"streamBuf", required_argument, NULL, 25}
     };
     if (1 == argc) { print_usage(stderr); goto fail; }
     while ((c = getopt_long(argc, argv, "hVs:S:O:R:T:b:i:I:p:", lopts, NULL)) != -1) {
@@ -411,6 +609,15 @@ int main(int argc, char **argv) {
                         goto fail;
                     } else { break; }
             case 16: gs.no_orphan = 0; break;
+            case 17: gs.is_genotype = gs.is_sparse_geno = 1; break;
+            case 18: gs.is_out_bcf = 1; break;
+            case 19: gs.prefetch = atoi(optarg); break;
+            case 20: gs.is_out_stream = 1; break;
+            case 21: if (2 == sscanf(optarg, "%d/%d", &gs.shard, &gs.nshard)) { gs.shard--; } else { gs.nshard = 0; } break;
+            case 22: gs.is_resume = 1; break;
+            case 23: gs.is_profile = 1; break;
+            case 24: gs.win_size = atoll(optarg); break;
+            case 25: gs.stream_buf = atoi(optarg); break;
             default:  fprintf(stderr,"Invalid option: '%c'\n", c); goto fail;													
         }
     }
@@ -429,10 +636,15 @@ int main(int argc, char **argv) {
     fprintf(stderr, "[D::%s] global settings after checking:\n", __func__);
     gll_setting_print(stderr, &gs, "\t");
   #endif
+    if (gs.is_genotype && csp_qual_lut_init() < 0) {
+        fprintf(stderr, "[E::%s] failed to init qual lookup table.\n", __func__);
+        goto fail;
+    }
     /* prepare output files. */
     if (NULL == (gs.out_mtx_ad = jf_init()) || NULL == (gs.out_mtx_dp = jf_init()) || \
         NULL == (gs.out_mtx_oth = jf_init()) || NULL == (gs.out_samples = jf_init()) || \
-        NULL == (gs.out_vcf_base = jf_init()) || (gs.is_genotype && NULL == (gs.out_vcf_cells = jf_init()))) {
+        NULL == (gs.out_vcf_base = jf_init()) || (use_vcf_cells(&gs) && NULL == (gs.out_vcf_cells = jf_init())) || \
+        (gs.is_sparse_geno && (NULL == (gs.out_mtx_gt = jf_init()) || NULL == (gs.out_mtx_pl = jf_init())))) {
         fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__);
         goto fail;
     }
@@ -442,14 +654,38 @@ int main(int argc, char **argv) {
     gs.out_mtx_dp->fn = format_fn(join_path(gs.out_dir, CSP_OUT_MTX_DP), gs.out_mtx_dp->is_zip, s); ks_clear(s); 
     gs.out_mtx_oth->is_zip = 0; gs.out_mtx_oth->is_tmp = 0;
     gs.out_mtx_oth->fn = format_fn(join_path(gs.out_dir, CSP_OUT_MTX_OTH), gs.out_mtx_oth->is_zip, s); ks_clear(s);
-    gs.out_vcf_base->is_zip = gs.is_out_zip; gs.out_vcf_base->is_tmp = 0;
-    gs.out_vcf_base->fn = format_fn(join_path(gs.out_dir, CSP_OUT_VCF_BASE), gs.out_vcf_base->is_zip, s); ks_clear(s);
+    if (gs.is_out_bcf) {      // the BCF files are written by htslib, only the filenames are used.
+        gs.out_vcf_base->is_zip = 0; gs.out_vcf_base->is_tmp = 0;
+        gs.out_vcf_base->fn = join_path(gs.out_dir, CSP_OUT_BCF_BASE);
+    } else {
+        gs.out_vcf_base->is_zip = gs.is_out_zip; gs.out_vcf_base->is_tmp = 0;
+        gs.out_vcf_base->fn = format_fn(join_path(gs.out_dir, CSP_OUT_VCF_BASE), gs.out_vcf_base->is_zip, s); ks_clear(s);
+    }
     gs.out_samples->is_zip = 0; gs.out_samples->is_tmp = 0;
     gs.out_samples->fn = format_fn(join_path(gs.out_dir, CSP_OUT_SAMPLES), gs.out_samples->is_zip, s); ks_clear(s);
-    if (gs.is_genotype) { 
+    if (use_vcf_cells(&gs) && gs.is_out_bcf) {
+        gs.out_vcf_cells->is_zip = 0; gs.out_vcf_cells->is_tmp = 0;
+        gs.out_vcf_cells->fn = join_path(gs.out_dir, CSP_OUT_BCF_CELLS);
+    } else if (use_vcf_cells(&gs)) { 
         gs.out_vcf_cells->is_zip = gs.is_out_zip; gs.out_vcf_cells->is_tmp = 0;
         gs.out_vcf_cells->fn = format_fn(join_path(gs.out_dir, CSP_OUT_VCF_CELLS), gs.out_vcf_cells->is_zip, s); ks_clear(s);
     } // no need to set is_tmp for these out files.
+    if (gs.is_sparse_geno) {
+        gs.out_mtx_gt->is_zip = 0; gs.out_mtx_gt->is_tmp = 0;
+        gs.out_mtx_gt->fn = format_fn(join_path(gs.out_dir, CSP_OUT_MTX_GT), gs.out_mtx_gt->is_zip, s); ks_clear(s);
+        gs.out_mtx_pl->is_zip = 0; gs.out_mtx_pl->is_tmp = 0;
+        gs.out_mtx_pl->fn = format_fn(join_path(gs.out_dir, CSP_OUT_MTX_PL), gs.out_mtx_pl->is_zip, s); ks_clear(s);
+    }
+    if (gs.nthread > 1) {     // also used by tmp files and input files.
+        if (NULL == (gs.htp = hts_tpool_init(gs.nthread))) {
+            fprintf(stderr, "[E::%s] fail to create htslib thread pool.\n", __func__);
+            goto fail;
+        }
+        jf_set_tpool(gs.out_vcf_base, gs.htp);
+        if (use_vcf_cells(&gs)) { jf_set_tpool(gs.out_vcf_cells, gs.htp); }
+        jf_set_tpool(gs.out_mtx_ad, gs.htp); jf_set_tpool(gs.out_mtx_dp, gs.htp); jf_set_tpool(gs.out_mtx_oth, gs.htp);
+        if (gs.is_sparse_geno) { jf_set_tpool(gs.out_mtx_gt, gs.htp); jf_set_tpool(gs.out_mtx_pl, gs.htp); }
+    }
     /* output headers to files. */
     kputs(CSP_MTX_HEADER, s);
     if (output_headers(gs.out_mtx_ad, "wb", ks_str(s), ks_len(s)) < 0) {   // output header to mtx_AD
@@ -464,6 +700,18 @@ int main(int argc, char **argv) {
         fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_mtx_oth->fn);
         goto fail;
     } ks_clear(s);
+    if (gs.is_sparse_geno) {
+        kputs(CSP_MTX_GT_HEADER, s);
+        if (output_headers(gs.out_mtx_gt, "wb", ks_str(s), ks_len(s)) < 0) {   // output header to mtx_GT
+            fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_mtx_gt->fn);
+            goto fail;
+        } ks_clear(s);
+        kputs(CSP_MTX_PL_HEADER, s);
+        if (output_headers(gs.out_mtx_pl, "wb", ks_str(s), ks_len(s)) < 0) {   // output header to mtx_PL
+            fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_mtx_pl->fn);
+            goto fail;
+        } ks_clear(s);
+    }
     if (use_barcodes(&gs)) {                     // output samples.
         for (k = 0; k < gs.nbarcode; k++) { kputs(gs.barcodes[k], s); kputc('\n', s); }
     } else if (use_sid(&gs)) {
@@ -473,13 +721,15 @@ int main(int argc, char **argv) {
         fprintf(stderr, "[E::%s] fail to write samples to '%s'\n", __func__, gs.out_samples->fn);
         goto fail;
     } ks_clear(s);
-    kputs(CSP_VCF_BASE_HEADER, s);             // output header to vcf base.
-    kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n", s);
-    if (output_headers(gs.out_vcf_base, "wb", ks_str(s), ks_len(s)) < 0) {
-        fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_vcf_base->fn);
-        goto fail;
-    } ks_clear(s);
-    if (gs.is_genotype) {
+    if (! gs.is_out_bcf) {                    // the BCF headers are outputed when merging, refer to output_bcf().
+        kputs(CSP_VCF_BASE_HEADER, s);         // output header to vcf base.
+        kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n", s);
+        if (output_headers(gs.out_vcf_base, "wb", ks_str(s), ks_len(s)) < 0) {
+            fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_vcf_base->fn);
+            goto fail;
+        } ks_clear(s);
+    }
+    if (use_vcf_cells(&gs) && ! gs.is_out_bcf) {
         kputs(CSP_VCF_CELLS_HEADER, s);           // output header to vcf cells.
         kputs(CSP_VCF_CELLS_CONTIG, s);
         kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT", s);
@@ -497,7 +747,8 @@ int main(int argc, char **argv) {
     /* set file modes. */
     gs.out_mtx_ad->fm = gs.out_mtx_dp->fm = gs.out_mtx_oth->fm = "ab";
     gs.out_vcf_base->fm = "ab";
-    if (gs.is_genotype) { gs.out_vcf_cells->fm = "ab"; }
+    if (use_vcf_cells(&gs)) { gs.out_vcf_cells->fm = "ab"; }
+    if (gs.is_sparse_geno) { gs.out_mtx_gt->fm = gs.out_mtx_pl->fm = "ab"; }
     /* run based on the mode of input. 
         Mode1: pileup a list of SNPs for a single BAM/SAM file with barcodes.
         Mode2: pileup whole chromosome(s) for one or multiple BAM/SAM files
@@ -506,47 +757,25 @@ int main(int argc, char **argv) {
     if (gs.snp_list_file) {
         fprintf(stderr, "[I::%s] loading the VCF file for given SNPs ...\n", __func__);
         if (gs.is_target) {
-            char **tmp; 
-            int ntmp;
-            size_t i, n;
-            snp_t *snp = NULL;
-            biallele_t **ale = NULL;
-            if (NULL == (ale = (biallele_t**) calloc(1, sizeof(biallele_t*)))) {
-                fprintf(stderr, "[E::%s] out of space for biallele_t**!\n", __func__);
-                print_time = 1; goto fail;
-            }
             if (get_snplist(gs.snp_list_file, &gs.pl, &ret, print_skip_snp) <= 0 || ret < 0) {
                 fprintf(stderr, "[E::%s] get SNP list from '%s' failed.\n", __func__, gs.snp_list_file);
                 print_time = 1; goto fail;
             } else { 
-                n = snplist_size(gs.pl);
-                fprintf(stderr, "[I::%s] pileuping %ld candidate variants ...\n", __func__, n); 
+                fprintf(stderr, "[I::%s] pileuping %ld candidate variants ...\n", __func__, snplist_size(gs.pl)); 
             }
-            if (NULL == (gs.targets = regidx_init(NULL, NULL, regidx_payload_free, sizeof(biallele_t*), NULL))) {
-                fprintf(stderr, "[E::%s] failed to init regidx for '%s'.\n", __func__, gs.snp_list_file);
+            if (NULL == (gs.targets = snp_tgt_build(&gs.pl))) {
+                fprintf(stderr, "[E::%s] failed to build targets for '%s'.\n", __func__, gs.snp_list_file);
                 print_time = 1; goto fail;
             } 
-            for (i = 0; i < n; i++) {
-                snp = snplist_A(gs.pl, i);
-                if (NULL == (*ale = biallele_init())) { 
-                   fprintf(stderr, "[E::%s] failed to create biallele_t.\n", __func__);
-                   print_time = 1; goto fail;
-                } else { (*ale)->ref = snp->ref; (*ale)->alt = snp->alt; }
-                if (regidx_push(gs.targets, snp->chr, snp->chr + strlen(snp->chr) - 1, snp->pos, snp->pos, ale) < 0) {
-                   fprintf(stderr, "[E::%s] failed to push regidx.\n", __func__);
-                   free(ale); ale = NULL;    // FIXME!! *ale should be safely freed.
-                   print_time = 1; goto fail;
-                } 
-            } free(ale); ale = NULL;
             snplist_destroy(gs.pl);
-            tmp = regidx_seq_names(gs.targets, &ntmp);
+            // the chroms are in the same order as gs.targets->chrom, refer to csp_pileup_core().
             if (gs.chroms) { str_arr_destroy(gs.chroms, gs.nchrom); gs.nchrom = 0; }
-            if (NULL == (gs.chroms = (char**) calloc(ntmp, sizeof(char*)))) {
+            if (NULL == (gs.chroms = (char**) calloc(gs.targets->nchrom, sizeof(char*)))) {
                 fprintf(stderr, "[E::%s] failed to allocate space for gs.chroms\n", __func__);
                 print_time = 1; goto fail;
             }
-            for (gs.nchrom = 0; gs.nchrom < ntmp; gs.nchrom++) {
-                gs.chroms[gs.nchrom] = strdup(tmp[gs.nchrom]);
+            for (gs.nchrom = 0; gs.nchrom < gs.targets->nchrom; gs.nchrom++) {
+                gs.chroms[gs.nchrom] = strdup(gs.targets->chrom[gs.nchrom]);
             }
             if (gs.barcodes) { fprintf(stderr, "[I::%s] modeT: pileup %d whole chromosomes in %d single cells.\n", __func__, gs.nchrom, gs.nbarcode); }
             else { fprintf(stderr, "[I::%s] modeT: pileup %d whole chromosomes in %d sample(s).\n", __func__, gs.nchrom, gs.nin); }
@@ -41,6 +41,13 @@ typedef struct _gll_settings global_settings;
 #define CSP_OUT_MTX_AD      "cellSNP.tag.AD.mtx"
 #define CSP_OUT_MTX_DP      "cellSNP.tag.DP.mtx"
 #define CSP_OUT_MTX_OTH     "cellSNP.tag.OTH.mtx"
+#define CSP_OUT_MTX_GT      "cellSNP.tag.GT.mtx"
+#define CSP_OUT_MTX_PL      "cellSNP.tag.PL.txt"
+#define CSP_OUT_BCF_CELLS   "cellSNP.cells.bcf"
+#define CSP_OUT_BCF_BASE    "cellSNP.base.bcf"
+#define CSP_OUT_CKPT        "cellSNP.ckpt"
+#define CSP_OUT_CKPT_TMP    "cellSNP.ckpt.tmp"   // the manifest is re-written into it, then renamed to CSP_OUT_CKPT.
+#define CSP_OUT_PROFILE     "cellSNP.profile.json"
 
 /* default values of pileup */
 // default excluding flag mask, reads with any flag mask bit set would be filtered.
@@ -52,9 +59,30 @@ typedef struct _gll_settings global_settings;
 #define CSP_PLP_MAX_DEPTH   0
 // if discard orphan reads
 #define CSP_NO_ORPHAN   1
+// max gap (bp) between adjacent SNPs that could be fetched by one region iterator in Mode 1 and 3.
+#define CSP_FETCH_MAX_GAP   10000
+// num of work units for each thread in Mode 1 and 3, the idle threads would take the remaining units.
+#define CSP_FETCH_UNITS_PER_THREAD   8
+// default size (bp) of the windows that chroms are split into in Mode 2 with multiple threads, refer to --winSize. 
+// It should be a multiple of 16384, i.e. the size of the smallest bins in the BAI/CSI index, so that the windows 
+// are aligned to the bins.
+#define CSP_PILEUP_WIN_SIZE   (1 << 24)
+// num of reads buffered for each input file by the reader thread of each worker, 0 means no reader threads.
+#define CSP_PREFETCH   0
 
 // if the tmp files to be zipped: 0: no, 1: yes.
 #define CSP_TMP_ZIP 1
+// if the tmp mtx files to be zipped. The tmp mtx files are binary and already compact, so no by default.
+#define CSP_TMP_MTX_ZIP 0
+
+// size (bytes) of the output of one worker handed to the writer thread at once when streaming the output.
+#define CSP_STREAM_CHUNK_SIZE   (1 << 20)
+// default max size (bytes) of the output waiting in the reorder buffer of the writer thread, refer to --streamBuf.
+// The worker of the unit being written is never blocked by this limit, so it's a soft limit.
+#define CSP_STREAM_BUF_SIZE     (64 << 20)
+// size (bytes) reserved for the stat line of the mtx files when streaming the output, as the stat is known only
+// when all units are written. It should be larger than the longest stat line.
+#define CSP_MTX_STAT_SIZE       64
 
 // output settings
 #define CSP_VCF_CELLS_HEADER "##fileformat=VCFv4.2\n" 			\
@@ -80,6 +108,37 @@ typedef struct _gll_settings global_settings;
 #define CSP_MTX_HEADER "%%MatrixMarket matrix coordinate integer general\n"           \
     "%\n"
 
+// headers of the sparse genotype files, only the cells with reads are outputed.
+#define CSP_MTX_GT_HEADER "%%MatrixMarket matrix coordinate integer general\n"        \
+    "% GT: 1 for 0/0, 2 for 1/0, 3 for 1/1\n"
+
+// the PL file is laid out as the coordinate mtx files, i.e. '%' comment lines, the stat line and "SNP cell value"
+// records, but the value is a list of integers, which is not valid MatrixMarket, hence it's not named as .mtx.
+#define CSP_MTX_PL_HEADER "% cellSNP sparse PL, in the coordinate layout of MatrixMarket, one list of PL per record\n" \
+    "% PL: comma separated Phred-scaled genotype likelihoods for 0/0,1/0,1/1 (and 0/0+1/0,1/0+1/1 with --doubletGL)\n"
+
 #define CSP_VCF_BASE_HEADER "##fileformat=VCFv4.2\n"
 
+// header lines of the BCF files, the contigs and samples are added when building the headers.
+#define CSP_BCF_INFO_LINES {                                                                                \
+    "##source=cellSNP_v" CSP_VERSION,                                                                       \
+    "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"total counts for ALT and REF\">",                    \
+    "##INFO=<ID=AD,Number=1,Type=Integer,Description=\"total counts for ALT\">",                            \
+    "##INFO=<ID=OTH,Number=1,Type=Integer,Description=\"total counts for other bases from REF and ALT\">"   \
+}
+#define CSP_BCF_NINFO_LINES 4
+
+#define CSP_BCF_FORMAT_LINES {                                                                              \
+    "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">",                                       \
+    "##FORMAT=<ID=AD,Number=1,Type=Integer,Description=\"total counts for ALT\">",                          \
+    "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"total counts for ALT and REF\">",                  \
+    "##FORMAT=<ID=OTH,Number=1,Type=Integer,Description=\"total counts for other bases from REF and ALT\">",\
+    "##FORMAT=<ID=ALL,Number=5,Type=Integer,Description=\"total counts for all bases in order of A,C,G,T,N\">" \
+}
+#define CSP_BCF_NFORMAT_LINES 5
+
+// PL has 5 values rather than G (3 for biallelic SNPs) when keeping the doublet GT likelihood.
+#define CSP_BCF_FORMAT_PL    "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"List of Phred-scaled genotype likelihoods\">"
+#define CSP_BCF_FORMAT_PL_DB "##FORMAT=<ID=PL,Number=5,Type=Integer,Description=\"List of Phred-scaled genotype likelihoods\">"
+
 #endif
@@ -4,11 +4,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
+#include "htslib/bgzf.h"
+#include "htslib/vcf.h"
 #include "config.h"
 #include "mplp.h"
 #include "jfile.h"
+#include "jnumeric.h"
 #include "jstring.h"
 #include "jsam.h"
 #include "csp.h"
@@ -27,10 +37,15 @@ void gll_setting_free(global_settings *gs) {
         if (gs->out_mtx_ad) { jf_destroy(gs->out_mtx_ad); gs->out_mtx_ad = NULL; }
         if (gs->out_mtx_dp) { jf_destroy(gs->out_mtx_dp); gs->out_mtx_dp = NULL; }
         if (gs->out_mtx_oth) { jf_destroy(gs->out_mtx_oth); gs->out_mtx_oth = NULL; } 
+        if (gs->out_mtx_gt) { jf_destroy(gs->out_mtx_gt); gs->out_mtx_gt = NULL; }
+        if (gs->out_mtx_pl) { jf_destroy(gs->out_mtx_pl); gs->out_mtx_pl = NULL; }
+        if (gs->bcf_hdr_base) { bcf_hdr_destroy(gs->bcf_hdr_base); gs->bcf_hdr_base = NULL; }
+        if (gs->bcf_hdr_cells) { bcf_hdr_destroy(gs->bcf_hdr_cells); gs->bcf_hdr_cells = NULL; }
         if (gs->snp_list_file) { free(gs->snp_list_file); gs->snp_list_file = NULL; }
         snplist_destroy(gs->pl);
-        if (gs->targets) { regidx_destroy(gs->targets); gs->targets = NULL; }
+        if (gs->targets) { snp_tgt_destroy(gs->targets); gs->targets = NULL; }
         if (gs->barcode_file) { free(gs->barcode_file); gs->barcode_file = NULL; }
+        if (gs->bcd) { csp_bcd_destroy(gs->bcd); gs->bcd = NULL; }
         if (gs->barcodes) { str_arr_destroy(gs->barcodes, gs->nbarcode); gs->barcodes = NULL; }
         if (gs->sid_list_file) { free(gs->sid_list_file); gs->sid_list_file = NULL; }
         if (gs->sample_ids) { str_arr_destroy(gs->sample_ids, gs->nsid); gs->sample_ids = NULL; }
@@ -38,6 +53,7 @@ void gll_setting_free(global_settings *gs) {
         if (gs->cell_tag) { free(gs->cell_tag); gs->cell_tag = NULL; }
         if (gs->umi_tag) { free(gs->umi_tag); gs->umi_tag = NULL; }
         if (gs->tp) { thpool_destroy(gs->tp); gs->tp = NULL; }
+        if (gs->htp) { hts_tpool_destroy(gs->htp); gs->htp = NULL; }    // after all BGZF handles are closed.
     }
 }
 
@@ -47,17 +63,21 @@ void gll_setting_print(FILE *fp, global_settings *gs, char *prefix) {
         int i;
         fprintf(fp, "%snum of input files = %d\n", prefix, gs->nin);
         fprintf(fp, "%sout_dir = %s\n", prefix, gs->out_dir);
-        fprintf(fp, "%sis_out_zip = %d, is_genotype = %d\n", prefix, gs->is_out_zip, gs->is_genotype);
+        fprintf(fp, "%sis_out_zip = %d, is_out_bcf = %d, is_out_stream = %d, is_genotype = %d, is_sparse_geno = %d\n", prefix, 
+                      gs->is_out_zip, gs->is_out_bcf, gs->is_out_stream, gs->is_genotype, gs->is_sparse_geno);
         fprintf(fp, "%sis_target = %d, num_of_pos = %ld\n", prefix, gs->is_target, 
                       gs->is_target ? 
-                        (gs->targets ? (long) regidx_nregs(gs->targets) : 0) :
+                        (gs->targets ? (long) gs->targets->n : 0) :
                         (long) snplist_size(gs->pl));
         fprintf(fp, "%snum_of_barcodes = %d, num_of_samples = %d\n", prefix, gs->nbarcode, gs->nsid);
         fprintf(fp, "%s%d chroms: ", prefix, gs->nchrom);
         for (i = 0; i < gs->nchrom; i++) fprintf(fp, "%s ", gs->chroms[i]);
         fputc('\n', fp);
         fprintf(fp, "%scell-tag = %s, umi-tag = %s\n", prefix, gs->cell_tag, gs->umi_tag);
-        fprintf(fp, "%snthreads = %d, tp_max_open = %d\n", prefix, gs->nthread, gs->tp_max_open);
+        fprintf(fp, "%snthreads = %d, tp_max_open = %d, prefetch = %d, win_size = %ld\n", prefix, gs->nthread, 
+                      gs->tp_max_open, gs->prefetch, (long) gs->win_size);
+        fprintf(fp, "%sshard = %d/%d, is_resume = %d, is_profile = %d\n", prefix, gs->shard + 1, gs->nshard, gs->is_resume, 
+                      gs->is_profile);
         fprintf(fp, "%smthreads = %d, tp_errno = %d, tp_ntry = %d\n", prefix, gs->mthread, gs->tp_errno, gs->tp_ntry);
         fprintf(fp, "%smin_count = %d, min_maf = %.2f, double_gl = %d\n", prefix, gs->min_count, gs->min_maf, gs->double_gl);
         fprintf(fp, "%smin_len = %d, min_mapq = %d\n", prefix, gs->min_len, gs->min_mapq);
@@ -72,11 +92,8 @@ void gll_setting_print(FILE *fp, global_settings *gs, char *prefix) {
  */
 int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs) {
     char **sgnames;
-    int i, nsg;
-    csp_plp_t *plp;
-    /* init HashMap, pool of ul, pool of uu for mplp. */
-    mplp->hsg = map_sg_init();
-    if (NULL == mplp->hsg) { fprintf(stderr, "[E::%s] could not init map_sg_t structure.\n", __func__); return -1; }
+    int nsg;
+    /* init pool of ul, pool of uu for mplp. */
     if (use_umi(gs)) {
         #if DEVELOP
             mplp->pl = pool_ul_init();
@@ -84,63 +101,72 @@ int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs) {
             mplp->pu = pool_uu_init();
             if (NULL == mplp->pu) { fprintf(stderr, "[E::%s] could not init pool_uu_t structure.\n", __func__); return -1; }
         #endif
-        mplp->su = pool_ps_init();
-        if (NULL == mplp->su) { fprintf(stderr, "[E::%s] could not init pool_su_t structure.\n", __func__); return -1; }
+        mplp->su = jarena_init(0);
+        if (NULL == mplp->su) { fprintf(stderr, "[E::%s] could not init jarena_t structure.\n", __func__); return -1; }
+        mplp->us = csp_umi_set_init();
+        if (NULL == mplp->us) { fprintf(stderr, "[E::%s] could not init csp_umi_set_t structure.\n", __func__); return -1; }
     }
     /* set sample names for sample groups. */
     if (use_barcodes(gs)) { sgnames = gs->barcodes; nsg = gs->nbarcode; }
     else if (use_sid(gs)) { sgnames = gs->sample_ids; nsg = gs->nsid; }
     else { fprintf(stderr, "[E::%s] failed to set sample names.\n", __func__); return -1; }  // should not come here!
     if (csp_mplp_set_sg(mplp, sgnames, nsg) < 0) { fprintf(stderr, "[E::%s] failed to set sample names.\n", __func__); return -1; }
-    /* init plp for each sample group in mplp->hsg and init HashMap plp->hug for UMI grouping. */
-    for (i = 0; i < nsg; i++) {
-        if (NULL == (plp = map_sg_val(mplp->hsg, mplp->hsg_iter[i]))) { 
-            if (NULL == (map_sg_val(mplp->hsg, mplp->hsg_iter[i]) = plp = csp_plp_init())) {
-                fprintf(stderr, "[E::%s] failed to init csp_plp_t for sg HashMap of csp_mplp_t.\n", __func__);
-                return -1;
-            }
-        }
-        if (use_umi(gs)) {
-            plp->hug = map_ug_init();
-            if (NULL == plp->hug) { fprintf(stderr, "[E::%s] could not init map_ug_t structure.\n", __func__); return -1; }
-        }
-    }
+    /* the HashMap plp->hug of each sample group is created when first used, refer to csp_mplp_push(). */
     return 0;
 }
 
+/* accumulate the qual vector of one base into the qual matrix. */
+static inline void csp_plp_push_qual(csp_plp_t *plp, int idx, int8_t qual) {
+    double *qv = csp_qual_lut[(uint8_t) qual];
+    int k;
+    for (k = 0; k < 4; k++) { plp->qmat[idx][k] += qv[k]; }
+}
+
 /*@note 1. To speed up, the caller should guarantee that:
            a) the parameters are valid, i.e. mplp and gs must not be NULL. In fact, this function is supposed to be 
-              called after csp_mplp_t is created and set names of sample-groups, so mplp, mplp->hsg could not be NULL.
+              called after csp_mplp_t is created and set names of sample-groups, so mplp, mplp->plp could not be NULL.
            b) the csp_pileup_t must have passed the read filtering, refer to pileup_read_with_fetch() for details.
-           c) each key (sample group name) in map_sg_t already has a valid, not NULL, value (csp_plp_t*);
-              This usually can be done by calling csp_mplp_prepare().
+           c) the csp_plp_t of each sample group has been prepared and the barcode dictionary gs->bcd has been built
+              when using barcodes. This usually can be done by calling csp_mplp_prepare() and check_args().
         2. This function is expected to be used by Mode1 & Mode2 & Mode3.
+        3. The UMI groups are looked up in the HashSet mplp->us by packed (sample group, UMI) keys, so no memory is
+           allocated for each read. Only the UMIs that could not be packed are copied into plp->hug.
 
 @discuss  In current version, only the result (base and qual) of the first read in one UMI group will be used for mplp statistics.
           TODO: store results of all reads in one UMI group (maybe could do consistency correction in each UMI group) and then 
           do mplp statistics.
  */
 int csp_mplp_push(csp_pileup_t *pileup, csp_mplp_t *mplp, int sid, global_settings *gs) {
-    map_sg_iter k;
     map_ug_iter u;
     csp_plp_t *plp = NULL;
-    char **s;
+    char *s;
+    uint64_t x;
     int r, idx;
     /* Push one csp_pileup_t into csp_mplp_t.
     *  The pileup->cb, pileup->umi could not be NULL as the pileuped read has passed filtering.
     */
     if (use_barcodes(gs)) { 
-        if ((k = map_sg_get(mplp->hsg, pileup->cb)) == map_sg_end(mplp->hsg)) { return 1; }
-        plp = map_sg_val(mplp->hsg, k);
+        if ((idx = sid) < 0 && (idx = csp_bcd_get(gs->bcd, pileup->cb)) < 0) { return 1; }
+        plp = mplp->plp + idx;
     } else if (use_sid(gs)) { 
-        plp = map_sg_val(mplp->hsg, mplp->hsg_iter[sid]);
+        plp = mplp->plp + (idx = sid);
     } else { return -1; }  // should not come here!
+    if (! plp->is_touched) { plp->is_touched = 1; mplp->tsg[mplp->ntsg++] = idx; }
     if (use_umi(gs)) {
+        if (idx < (1 << 27) && 0 == csp_umi_set_key(idx, pileup->umi, &x)) {
+            if ((r = csp_umi_set_put(mplp->us, x)) < 0) { return -2; }
+            else if (r > 0) {
+                idx = seq_nt16_idx2int(pileup->base);
+                plp->bc[idx]++;
+                if (gs->is_genotype) { csp_plp_push_qual(plp, idx, pileup->qual); }
+            } // else: do nothing.
+            return 0;
+        }
+        if (NULL == plp->hug && NULL == (plp->hug = map_ug_init())) { return -2; }
         u = map_ug_get(plp->hug, pileup->umi);
         if (u == map_ug_end(plp->hug)) {
-            s = pool_ps_get(mplp->su);
-            *s = strdup(pileup->umi);
-            u = map_ug_put(plp->hug, *s, &r);
+            if (NULL == (s = jarena_strdup(mplp->su, pileup->umi))) { return -2; }
+            u = map_ug_put(plp->hug, s, &r);
             if (r < 0) { return -2; }
             /* An example for pushing base & qual into HashMap of umi group.
             list_uu_t *ul = pool_ul_get(mplp->pl);
@@ -151,26 +177,30 @@ int csp_mplp_push(csp_pileup_t *pileup, csp_mplp_t *mplp, int sid, global_settin
              */
             idx = seq_nt16_idx2int(pileup->base);
             plp->bc[idx]++;
-            list_qu_push(plp->qu[idx], pileup->qual);
+            if (gs->is_genotype) { csp_plp_push_qual(plp, idx, pileup->qual); }
         } // else: do nothing.
     } else {
         idx = seq_nt16_idx2int(pileup->base);
         plp->bc[idx]++;
-        list_qu_push(plp->qu[idx], pileup->qual);
+        if (gs->is_genotype) { csp_plp_push_qual(plp, idx, pileup->qual); }
     }
     return 0;
 }
 
-/*@discuss  In current version, only the result (base and qual) of the first read in one UMI group will be used for mplp statistics.
+static int cmp_tsg(const void *x, const void *y) { return *((int*) x) - *((int*) y); }
+
+/*@note     Only the touched sample groups, i.e. those having pushed reads, are processed, as the stat info of other
+            sample groups are all 0.
+
+@discuss  In current version, only the result (base and qual) of the first read in one UMI group will be used for mplp statistics.
             TODO: store results of all reads in one UMI group (maybe could do consistency correction in each UMI group) and then 
             do mplp statistics.
  */
 int csp_mplp_stat(csp_mplp_t *mplp, global_settings *gs) {
     csp_plp_t *plp = NULL;
-    int i, j, k;
-    size_t l;
-    for (i = 0; i < mplp->nsg; i++) {
-        plp = map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
+    int i, j;
+    for (i = 0; i < mplp->ntsg; i++) {
+        plp = mplp->plp + mplp->tsg[i];
         for (j = 0; j < 5; j++) { 
             plp->tc += plp->bc[j]; 
             mplp->bc[j] += plp->bc[j];
@@ -185,19 +215,15 @@ int csp_mplp_stat(csp_mplp_t *mplp, global_settings *gs) {
         mplp->alt_idx = mplp->inf_aid;
     }
     mplp->ad = mplp->bc[mplp->alt_idx]; mplp->dp = mplp->bc[mplp->ref_idx] + mplp->ad; mplp->oth = mplp->tc - mplp->dp;
-    for (i = 0; i < mplp->nsg; i++) {
-        plp = map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
+    qsort(mplp->tsg, mplp->ntsg, sizeof(int), cmp_tsg);   // the records in mtx files are in order of sample groups.
+    for (i = 0; i < mplp->ntsg; i++) {
+        plp = mplp->plp + mplp->tsg[i];
         plp->ad = plp->bc[mplp->alt_idx]; if (plp->ad) mplp->nr_ad++;
         plp->dp = plp->bc[mplp->ref_idx] + plp->ad; if (plp->dp) mplp->nr_dp++;
         plp->oth = plp->tc - plp->dp; if (plp->oth) mplp->nr_oth++;
         if (gs->is_genotype) {
-            for (j = 0; j < 5; j++) {
-                for (l = 0; l < list_qu_size(plp->qu[j]); l++) {
-                    if (get_qual_vector(list_qu_A(plp->qu[j], l), 45, 0.25, mplp->qvec) < 0) { return -1; }
-                    for (k = 0; k < 4; k++) plp->qmat[j][k] += mplp->qvec[k];
-                }
-            }
             if (qual_matrix_to_geno(plp->qmat, plp->bc, mplp->ref_idx, mplp->alt_idx, gs->double_gl, plp->gl, &plp->ngl) < 0) { return -1; }
+            if (plp->tc) mplp->nr_gt++;
         }
     }
     return 0;
@@ -218,6 +244,370 @@ inline void csp_bam_fs_destroy(csp_bam_fs* p) {
     }
 }
 
+csp_hts_pool_t* csp_hts_pool_init(char **fns, int n, int max_open, int fields, hts_tpool *tpool, csp_bam_fs **bfs,
+                                  int nunit) {
+    csp_hts_pool_t *p;
+    int i;
+    if (NULL == (p = (csp_hts_pool_t*) calloc(1, sizeof(csp_hts_pool_t)))) { return NULL; }
+    p->fns = fns; p->n = n; p->fields = fields; p->tpool = tpool;
+    p->max_open = max_open < n ? n : max_open;
+    p->nunit = nunit; p->next = 0;
+    p->fp = (htsFile**) malloc(sizeof(htsFile*) * p->max_open);
+    p->fid = (int*) malloc(sizeof(int) * p->max_open);
+    p->is_turned = nunit > 0 ? (uint8_t*) calloc(nunit, sizeof(uint8_t)) : NULL;
+    if (NULL == p->fp || NULL == p->fid || (nunit > 0 && NULL == p->is_turned)) { 
+        free(p->fp); free(p->fid); free(p->is_turned); free(p); 
+        return NULL; 
+    }
+    if (bfs) {
+        for (i = 0; i < n; i++) {
+            if (bfs[i]->fp->is_cram) { continue; }    // the CRAM index refers to the handle, refer to csp_bam_fs.
+            p->fp[p->nidle] = bfs[i]->fp; p->fid[p->nidle++] = i; bfs[i]->fp = NULL;
+        }
+        p->nopen = p->nidle;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    return p;
+}
+
+void csp_hts_pool_destroy(csp_hts_pool_t *p) {
+    int i;
+    if (p) {
+        for (i = 0; i < p->nidle; i++) { hts_close(p->fp[i]); }
+        free(p->fp); free(p->fid); free(p->is_turned);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        free(p);
+    }
+}
+
+/* wait, within the lock, until the units before unit @p u have taken their turns. 
+   Return 1 if @p u should take its turn, 0 if the units are not ordered or @p u has taken its turn. */
+static int csp_hts_pool_wait_turn(csp_hts_pool_t *p, int u) {
+    if (p->nunit <= 0 || u < 0 || u >= p->nunit || p->is_turned[u]) { return 0; }
+    while (p->next < u) { pthread_cond_wait(&p->cond, &p->lock); }
+    return 1;
+}
+
+/* take the turn of unit @p u within the lock, and wake up the units waiting for their turns. */
+static void csp_hts_pool_take_turn(csp_hts_pool_t *p, int u) {
+    p->is_turned[u] = 1;
+    while (p->next < p->nunit && p->is_turned[p->next]) { p->next++; }
+    pthread_cond_broadcast(&p->cond);
+}
+
+/*@note  The idle handles are closed within the lock as it rarely happens, while the new handles are opened
+         outside, for which the room has been reserved in p->nopen. */
+int csp_hts_pool_get(csp_hts_pool_t *p, htsFile **fp, int u) {
+    int i, j, k, nget, nnew, is_turn, err = 0;
+    for (i = 0; i < p->n; i++) { fp[i] = NULL; }
+    pthread_mutex_lock(&p->lock);
+    is_turn = csp_hts_pool_wait_turn(p, u);
+    while (p->nopen - p->nidle + p->n > p->max_open) { pthread_cond_wait(&p->cond, &p->lock); }
+    if (is_turn) { csp_hts_pool_take_turn(p, u); }
+    for (j = p->nidle - 1, nget = 0; j >= 0; j--) {      // the most recently used ones first.
+        if (NULL == fp[p->fid[j]]) { fp[p->fid[j]] = p->fp[j]; p->fp[j] = NULL; nget++; }
+    }
+    nnew = p->n - nget;
+    for (j = k = 0; j < p->nidle; j++) {
+        if (NULL == p->fp[j]) { continue; }
+        if (p->nopen + nnew > p->max_open) { hts_close(p->fp[j]); p->nopen--; }
+        else { p->fp[k] = p->fp[j]; p->fid[k++] = p->fid[j]; }
+    }
+    p->nidle = k;
+    p->nopen += nnew;
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->n && nnew > 0; i++) {
+        if (fp[i]) { continue; }
+        if (NULL == (fp[i] = csp_sam_open(p->fns[i], p->fields, p->tpool))) {
+            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, p->fns[i]);
+            err = errno; break;
+        }
+        nnew--;
+    }
+    if (nnew > 0) {
+        pthread_mutex_lock(&p->lock);
+        p->nopen -= nnew;
+        pthread_mutex_unlock(&p->lock);
+        csp_hts_pool_put(p, fp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void csp_hts_pool_pass(csp_hts_pool_t *p, int u) {
+    pthread_mutex_lock(&p->lock);
+    if (csp_hts_pool_wait_turn(p, u)) { csp_hts_pool_take_turn(p, u); }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void csp_hts_pool_put(csp_hts_pool_t *p, htsFile **fp) {
+    int i;
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < p->n; i++) {
+        if (fp[i]) { p->fp[p->nidle] = fp[i]; p->fid[p->nidle++] = i; fp[i] = NULL; }
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*@note  The counting of files is the same with infer_nthread() in csp_fetch.c and csp_pileup.c. */
+int csp_hts_pool_size(global_settings *gs, int nthread) {
+    int n0 = 3;      // the initial files opened by this program.
+    int nout = 4 + gs->is_genotype + gs->is_sparse_geno;
+    int m = gs->tp_max_open - n0 - (nthread + 1) * nout;    // the output files of each thread and the merged ones.
+    return m < gs->nin ? gs->nin : m;
+}
+
+/*
+ * Output writer
+ */
+
+static void csp_chunk_destroy(csp_chunk_t *c) {
+    int i, k;
+    for (i = 0; i < 5; i++) { ks_free(c->mtx + i); }
+    ks_free(&c->vcf_base); ks_free(&c->vcf_cells);
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < c->mbcf[k]; i++) { if (c->bcf[k][i]) { bcf_destroy(c->bcf[k][i]); } }
+        free(c->bcf[k]);
+    }
+    free(c);
+}
+
+/*@note  The allocated memory of the chunk is kept for reusing. The caller should hold the lock of @p w. */
+static inline void csp_writer_recycle(csp_writer_t *w, csp_chunk_t *c) {
+    int i;
+    for (i = 0; i < 5; i++) { ks_clear(c->mtx + i); }
+    ks_clear(&c->vcf_base); ks_clear(&c->vcf_cells);
+    c->nbcf[0] = c->nbcf[1] = 0; c->size = 0;
+    c->next = w->pool; w->pool = c;
+}
+
+static csp_chunk_t* csp_writer_get_chunk(csp_writer_t *w) {
+    csp_chunk_t *c;
+    pthread_mutex_lock(&w->lock);
+    if (NULL != (c = w->pool)) { w->pool = c->next; c->next = NULL; }
+    pthread_mutex_unlock(&w->lock);
+    return c ? c : (csp_chunk_t*) calloc(1, sizeof(csp_chunk_t));
+}
+
+/*@note  The record is copied into the chunk, as the record of the thread is reused by the next SNP. */
+static int csp_chunk_add_bcf(csp_chunk_t *c, int k, bcf1_t *rec) {
+    bcf1_t **a, *b;
+    int m;
+    if (c->nbcf[k] >= c->mbcf[k]) {
+        m = c->mbcf[k] ? c->mbcf[k] * 2 : 64;
+        if (NULL == (a = (bcf1_t**) realloc(c->bcf[k], sizeof(bcf1_t*) * m))) { return -1; }
+        memset(a + c->mbcf[k], 0, sizeof(bcf1_t*) * (m - c->mbcf[k]));
+        c->bcf[k] = a; c->mbcf[k] = m;
+    }
+    if (NULL == (b = c->bcf[k][c->nbcf[k]]) && NULL == (b = c->bcf[k][c->nbcf[k]] = bcf_init())) { return -1; }
+    if (NULL == bcf_copy(b, rec)) { return -1; }
+    c->size += b->shared.l + b->indiv.l;
+    c->nbcf[k]++;
+    return 0;
+}
+
+/*@abstract  Output the tmp mtx records of one chunk into mtx file.
+@param out   Pointer of jfile_t of the mtx file.
+@param s     Pointer of kstring_t of the records, refer to merge_mtx().
+@param nv    Num of values in each record.
+@param k     Num of SNPs that have been outputed, the SNPs of the chunk are indexed from @p k + 1.
+@param ns    Pointer of num of SNPs in the chunk.
+@param nr    Pointer of num of records outputed, which is increased by the records of the chunk.
+@return      0 if success, -1 if the records are truncated.
+@note        The same as merge_mtx() except that the records are read from memory.
+ */
+static int csp_mtx_put_packed(jfile_t *out, kstring_t *s, int nv, size_t k, size_t *ns, size_t *nr) {
+    size_t i = 0, k0 = k++;
+    uint64_t d, v;
+    int j = 0, l, r;
+    while ((r = kgetvarint(s->s, s->l, &i, &d)) > 0) {
+        if (0 == d) { k++; j = 0; continue; }    // meaning ending of a SNP.
+        if (kgetvarint(s->s, s->l, &i, &v) <= 0) { return -1; }
+        j += d;
+        if (nv > 1) {
+            jf_put_uint(k, out); jf_putc_('\t', out);
+            jf_put_uint(j, out); jf_putc_('\t', out);
+            jf_put_uint(v, out);
+            for (l = 1; l < nv; l++) {
+                if (kgetvarint(s->s, s->l, &i, &v) <= 0) { return -1; }
+                jf_putc_(',', out); jf_put_uint(v, out);
+            }
+            jf_putc_('\n', out);
+        } else { csp_mtx_put_rec(out, k, j, (size_t) v); }
+        (*nr)++;
+    }
+    *ns = k - 1 - k0;
+    return r < 0 ? -1 : 0;
+}
+
+static int csp_writer_write(csp_writer_t *w, csp_chunk_t *c) {
+    global_settings *gs = w->gs;
+    size_t ns0 = 0, ns;
+    int i, k;
+    for (i = 0; i < w->nmtx; i++) {
+        if (csp_mtx_put_packed(w->mtx[i], c->mtx + i, w->nv[i], w->ns, &ns, w->nr + i) < 0) { return -1; }
+        if (0 == i) { ns0 = ns; }
+        else if (ns != ns0) { return -1; }
+    }
+    w->ns += ns0;
+    if (gs->is_out_bcf) {
+        for (k = 0; k < 2; k++) {
+            for (i = 0; w->bcf[k] && i < c->nbcf[k]; i++) {
+                if (bcf_write(w->bcf[k], k ? gs->bcf_hdr_cells : gs->bcf_hdr_base, c->bcf[k][i]) < 0) { return -1; }
+            }
+        }
+    } else {
+        if (ks_len(&c->vcf_base) && jf_write(gs->out_vcf_base, ks_str(&c->vcf_base), ks_len(&c->vcf_base)) < 0) { return -1; }
+        if (use_vcf_cells(gs) && ks_len(&c->vcf_cells) && \
+            jf_write(gs->out_vcf_cells, ks_str(&c->vcf_cells), ks_len(&c->vcf_cells)) < 0) { return -1; }
+    }
+    return 0;
+}
+
+/*@note  The units are written one by one, the next unit is started only when all chunks of the current one are written. */
+static void* csp_writer_run(void *args) {
+    csp_writer_t *w = (csp_writer_t*) args;
+    csp_chunk_t *c;
+    int u = 0, r;
+    while (u < w->n) {
+        pthread_mutex_lock(&w->lock);
+        while (NULL == w->head[u] && ! w->is_done[u] && ! w->is_err) { pthread_cond_wait(&w->cond_get, &w->lock); }
+        if (w->is_err) { pthread_mutex_unlock(&w->lock); goto fail; }
+        if (NULL == (c = w->head[u])) {       // all chunks of the unit have been written.
+            w->cur = ++u;
+            pthread_cond_broadcast(&w->cond_put);
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+        if (NULL == (w->head[u] = c->next)) { w->tail[u] = NULL; }
+        w->size -= c->size;
+        pthread_cond_broadcast(&w->cond_put);
+        pthread_mutex_unlock(&w->lock);
+        r = csp_writer_write(w, c);
+        pthread_mutex_lock(&w->lock);
+        csp_writer_recycle(w, c);
+        pthread_mutex_unlock(&w->lock);
+        if (r < 0) { fprintf(stderr, "[E::%s] failed to write the output of unit %d.\n", __func__, u); goto fail; }
+    }
+    pthread_mutex_lock(&w->lock);
+    w->state = 1;
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+  fail:
+    pthread_mutex_lock(&w->lock);
+    w->state = -1; w->is_err = 1;
+    pthread_cond_broadcast(&w->cond_put);
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+csp_writer_t* csp_writer_init(global_settings *gs, int n) {
+    csp_writer_t *w;
+    jfile_t *vcf[2] = {gs->out_vcf_base, use_vcf_cells(gs) ? gs->out_vcf_cells : NULL};
+    struct stat st;
+    int i, k;
+    if (NULL == (w = (csp_writer_t*) calloc(1, sizeof(csp_writer_t)))) { return NULL; }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond_put, NULL);
+    pthread_cond_init(&w->cond_get, NULL);
+    for (i = 0; i < 7; i++) { w->off[i] = -1; }    // nothing to be truncated.
+    w->gs = gs; w->n = n; w->max_size = (size_t) gs->stream_buf << 20;
+    w->head = (csp_chunk_t**) calloc(n, sizeof(csp_chunk_t*));
+    w->tail = (csp_chunk_t**) calloc(n, sizeof(csp_chunk_t*));
+    w->is_done = (uint8_t*) calloc(n, sizeof(uint8_t));
+    if (NULL == w->head || NULL == w->tail || NULL == w->is_done) { goto fail; }
+    w->mtx[0] = gs->out_mtx_ad; w->mtx[1] = gs->out_mtx_dp; w->mtx[2] = gs->out_mtx_oth; w->nmtx = 3;
+    if (gs->is_sparse_geno) { w->mtx[3] = gs->out_mtx_gt; w->mtx[4] = gs->out_mtx_pl; w->nmtx = 5; }
+    for (i = 0; i < 5; i++) { w->nv[i] = 1; }
+    w->nv[4] = gs->double_gl ? 5 : 3;
+    for (i = 0; i < w->nmtx; i++) {
+        if (stat(w->mtx[i]->fn, &st) < 0 || jf_open(w->mtx[i], NULL) < 0) { goto fail; }
+        w->off[i] = st.st_size;
+        for (k = 1; k < CSP_MTX_STAT_SIZE; k++) { jf_putc_(' ', w->mtx[i]); }   // filled by csp_mtx_fix_stat().
+        jf_putc('\n', w->mtx[i]);
+    }
+    if (gs->is_out_bcf) {
+        for (k = 0; k < 2 && vcf[k]; k++) {
+            if (NULL == (w->bcf[k] = hts_open(vcf[k]->fn, "wb"))) { goto fail; }
+            if (csp_hts_set_tpool(w->bcf[k], gs->htp) < 0) { goto fail; }
+            if (bcf_hdr_write(w->bcf[k], k ? gs->bcf_hdr_cells : gs->bcf_hdr_base) < 0) { goto fail; }
+        }
+    } else {
+        for (k = 0; k < 2 && vcf[k]; k++) {
+            if (stat(vcf[k]->fn, &st) < 0 || jf_open(vcf[k], NULL) < 0) { goto fail; }
+            w->off[5 + k] = st.st_size;
+        }
+    }
+    if (pthread_create(&w->tid, NULL, csp_writer_run, w) != 0) { goto fail; }
+    w->is_started = 1;
+    return w;
+  fail:
+    csp_writer_destroy(w);
+    return NULL;
+}
+
+int csp_writer_finish(csp_writer_t *w) {
+    global_settings *gs = w->gs;
+    jfile_t *vcf[2] = {gs->out_vcf_base, use_vcf_cells(gs) ? gs->out_vcf_cells : NULL};
+    int nsmp = use_barcodes(gs) ? gs->nbarcode : gs->nsid;
+    int i, k, ret = 0;
+    if (w->is_started) { pthread_join(w->tid, NULL); w->is_started = 0; }
+    if (w->state != 1) { return -1; }
+    for (i = 0; i < w->nmtx; i++) {
+        if (jf_close(w->mtx[i]) < 0) { return -1; }
+        if (csp_mtx_fix_stat(w->mtx[i]->fn, w->off[i], w->ns, nsmp, w->nr[i]) < 0) { return -1; }
+    }
+    for (k = 0; k < 2 && vcf[k]; k++) {
+        if (gs->is_out_bcf) {
+            i = hts_close(w->bcf[k]); w->bcf[k] = NULL;
+            if (i < 0) { return -1; }
+            if (bcf_index_build3(vcf[k]->fn, NULL, 14, gs->nthread) < 0) { ret = 1; }
+        } else if (jf_close(vcf[k]) < 0) { return -1; }
+    }
+    for (i = 0; i < 7; i++) { w->off[i] = -1; }
+    return ret;
+}
+
+void csp_writer_destroy(csp_writer_t *w) {
+    global_settings *gs;
+    jfile_t *fs[7] = {NULL};
+    csp_chunk_t *c;
+    int i;
+    if (NULL == w) { return; }
+    gs = w->gs;
+    if (w->is_started) {
+        pthread_mutex_lock(&w->lock);
+        w->is_err = 1;
+        pthread_cond_broadcast(&w->cond_get);
+        pthread_cond_broadcast(&w->cond_put);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->tid, NULL);
+    }
+    for (i = 0; i < w->nmtx; i++) { fs[i] = w->mtx[i]; }
+    if (! gs->is_out_bcf) { fs[5] = gs->out_vcf_base; fs[6] = use_vcf_cells(gs) ? gs->out_vcf_cells : NULL; }
+    for (i = 0; i < 7; i++) {
+        if (NULL == fs[i]) { continue; }
+        if (jf_isopen(fs[i])) { jf_close(fs[i]); }
+        if (w->off[i] >= 0 && truncate(fs[i]->fn, w->off[i]) < 0) {
+            fprintf(stderr, "[W::%s] failed to truncate '%s'.\n", __func__, fs[i]->fn);
+        }
+    }
+    for (i = 0; i < 2; i++) { if (w->bcf[i]) { hts_close(w->bcf[i]); } }
+    for (i = 0; w->head && i < w->n; i++) {
+        while (NULL != (c = w->head[i])) { w->head[i] = c->next; csp_chunk_destroy(c); }
+    }
+    while (NULL != (c = w->pool)) { w->pool = c->next; csp_chunk_destroy(c); }
+    free(w->head); free(w->tail); free(w->is_done);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond_put);
+    pthread_cond_destroy(&w->cond_get);
+    free(w);
+}
+
 /* 
 * Thread API
 */
@@ -234,6 +624,377 @@ inline void thdata_print(FILE *fp, thread_data *p) {
     fprintf(fp, "\ti = %d, ret = %d\n", p->i, p->ret);
 }
 
+inline void thdata_add_rdr_stat(thread_data *d, jring_t *r) {
+    d->rdr_wait_put += r->wait_put; d->rdr_wait_get += r->wait_get;
+    d->rdr_nget += r->nget; d->rdr_ndepth += r->ndepth;
+}
+
+void thdata_print_rdr_stat(FILE *fp, thread_data **td, int n, int m) {
+    double wait_put = 0, wait_get = 0;
+    size_t nget = 0, ndepth = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        wait_put += td[i]->rdr_wait_put; wait_get += td[i]->rdr_wait_get;
+        nget += td[i]->rdr_nget; ndepth += td[i]->rdr_ndepth;
+    }
+    fprintf(fp, "[I::%s] prefetch: average depth %.1f of %d, readers waited %.2fs for room, workers waited %.2fs for reads.\n",
+            __func__, nget ? (double) ndepth / nget : 0.0, m, wait_put, wait_get);
+}
+
+inline double csp_prof_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+inline void csp_prof_start(csp_prof_t *pf, int is_on) {
+    if ((pf->is_on = is_on)) { pf->t0 = csp_prof_now(); }
+}
+
+inline void csp_prof_tick_(csp_prof_t *pf, int k) {
+    double t = csp_prof_now();
+    pf->t[k] += t - pf->t0;
+    pf->t0 = t;
+}
+
+inline void csp_prof_add(csp_prof_t *a, const csp_prof_t *b) {
+    int i;
+    a->nread += b->nread;
+    for (i = 0; i < CSP_NREJ; i++) { a->nrej[i] += b->nrej[i]; }
+    a->nsnp += b->nsnp; a->npass += b->npass;
+    for (i = 0; i < CSP_NSTG; i++) { a->t[i] += b->t[i]; }
+}
+
+int csp_prof_output(global_settings *gs, const char *mode, thread_data **td, int n, double t_run, double t_merge) {
+    const char *rej[CSP_NREJ] = {"tag_missing", "off_whitelist", "unmapped", "mapq", "flag", "orphan", "min_len", 
+                                 "off_target", "del_refskip"};
+    const char *stg[CSP_NSTG] = {"decode", "filter", "umi_cb", "pileup", "wait", "stat", "output"};
+    csp_prof_t a, *p;
+    char *fn = NULL;
+    FILE *fp = NULL;
+    size_t nrej = 0;
+    double t;
+    int i, k;
+    memset(&a, 0, sizeof(csp_prof_t));
+    for (i = 0; i < n; i++) { csp_prof_add(&a, &td[i]->prof); }
+    for (k = 0; k < CSP_NREJ; k++) { if (CSP_REJ_DEL != k) { nrej += a.nrej[k]; } }
+    if (NULL == (fn = join_path(gs->out_dir, CSP_OUT_PROFILE))) { goto fail; }
+    if (NULL == (fp = fopen(fn, "w"))) { goto fail; }
+    fprintf(fp, "{\n  \"mode\": \"%s\",\n  \"nthread\": %d,\n  \"prefetch\": %d,\n  \"nunit\": %d,\n", mode, gs->nthread, 
+            gs->prefetch, n);
+    fprintf(fp, "  \"reads\": {\n    \"read\": %ld,\n    \"passed\": %ld,\n    \"rejected\": {\n", a.nread, a.nread - nrej);
+    for (k = 0; k < CSP_NREJ; k++) { fprintf(fp, "      \"%s\": %ld%s\n", rej[k], a.nrej[k], k < CSP_NREJ - 1 ? "," : ""); }
+    fprintf(fp, "    }\n  },\n");
+    fprintf(fp, "  \"snps\": {\n    \"pileup\": %ld,\n    \"passed\": %ld,\n    \"failed\": %ld\n  },\n", a.nsnp, a.npass, 
+            a.nsnp - a.npass);
+    fprintf(fp, "  \"time\": {\n");
+    for (k = 0; k < CSP_NSTG; k++) { fprintf(fp, "    \"%s\": %.3f,\n", stg[k], a.t[k]); }
+    fprintf(fp, "    \"run\": %.3f,\n    \"merge\": %.3f\n  },\n", t_run, t_merge);
+    fprintf(fp, "  \"units\": [\n");
+    for (i = 0; i < n; i++) {
+        p = &td[i]->prof;
+        for (k = 0, t = 0; k < CSP_NSTG; k++) { t += p->t[k]; }
+        fprintf(fp, "    {\"i\": %d, \"reads\": %ld, \"snps\": %ld, \"passed\": %ld, \"time\": %.3f}%s\n", i, p->nread, p->nsnp, 
+                p->npass, t, i < n - 1 ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    if (fclose(fp) != 0) { fp = NULL; goto fail; }
+    fprintf(stderr, "[I::%s] the profile has been written into '%s'.\n", __func__, fn);
+    free(fn);
+    return 0;
+  fail:
+    if (fp) { fclose(fp); }
+    free(fn);
+    return -1;
+}
+
+int thdata_bcf_open(thread_data *d, int nsg) {
+    global_settings *gs = d->gs;
+    if (NULL == d->wrt) {      // else: the records are handed to the writer, refer to thdata_put_bcf().
+        if (NULL == (d->out_bcf_base = hts_open(d->out_vcf_base->fn, "wb"))) { return -1; }
+        if (csp_hts_set_tpool(d->out_bcf_base, gs->htp) < 0) { return -1; }
+        if (use_vcf_cells(gs)) {
+            if (NULL == (d->out_bcf_cells = hts_open(d->out_vcf_cells->fn, "wb"))) { return -1; }
+            if (csp_hts_set_tpool(d->out_bcf_cells, gs->htp) < 0) { return -1; }
+        }
+    }
+    if (use_vcf_cells(gs)) {
+        if (NULL == (d->bcf_buf = (int32_t*) malloc(sizeof(int32_t) * nsg * 5))) { return -1; }
+    }
+    if (NULL == (d->bcf_rec = bcf_init())) { return -1; }
+    return 0;
+}
+
+int thdata_bcf_close(thread_data *d) {
+    int ret = 0;
+    if (d->out_bcf_base) { if (hts_close(d->out_bcf_base) < 0) { ret = -1; } d->out_bcf_base = NULL; }
+    if (d->out_bcf_cells) { if (hts_close(d->out_bcf_cells) < 0) { ret = -1; } d->out_bcf_cells = NULL; }
+    if (d->bcf_rec) { bcf_destroy(d->bcf_rec); d->bcf_rec = NULL; }
+    free(d->bcf_buf); d->bcf_buf = NULL;
+    return ret;
+}
+
+/* output the BCF record of the thread into the base (k = 0) or cells (k = 1) BCF. */
+static inline int thdata_put_bcf(thread_data *d, int k, bcf_hdr_t *hdr) {
+    if (NULL == d->wrt) { return bcf_write(k ? d->out_bcf_cells : d->out_bcf_base, hdr, d->bcf_rec); }
+    if (NULL == d->chunk && NULL == (d->chunk = csp_writer_get_chunk(d->wrt))) { return -1; }
+    return csp_chunk_add_bcf(d->chunk, k, d->bcf_rec);
+}
+
+/*@note  The text VCF lines are outputed as in csp_mplp_str_vcf_base() and csp_mplp_to_out(). */
+int thdata_output_snp(thread_data *d, csp_mplp_t *mplp, const char *chr, hts_pos_t pos, kstring_t *s) {
+    global_settings *gs = d->gs;
+    if (gs->is_out_bcf) {
+        if (csp_mplp_to_bcf(mplp, gs->bcf_hdr_base, d->bcf_rec, chr, pos) < 0) { return -1; }
+        if (thdata_put_bcf(d, 0, gs->bcf_hdr_base) < 0) { return -1; }
+        if (use_vcf_cells(gs)) {
+            if (csp_mplp_to_bcf_fmt(mplp, gs->bcf_hdr_cells, d->bcf_rec, gs->double_gl ? 5 : 3, d->bcf_buf) < 0) { return -1; }
+            if (thdata_put_bcf(d, 1, gs->bcf_hdr_cells) < 0) { return -1; }
+        }
+        return csp_mplp_to_out(mplp, d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->ns, NULL,
+                               d->out_mtx_gt, d->out_mtx_pl);
+    }
+    if (csp_mplp_str_vcf_base(mplp, chr, pos, s) < 0) { return -1; }
+    jf_puts(ks_str(s), d->out_vcf_base); jf_putc('\n', d->out_vcf_base);
+    if (use_vcf_cells(gs)) {
+        jf_puts(ks_str(s), d->out_vcf_cells);
+        jf_puts("\tGT:AD:DP:OTH:PL:ALL", d->out_vcf_cells);
+    }
+    if (csp_mplp_to_out(mplp, d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->ns, d->out_vcf_cells,
+                        d->out_mtx_gt, d->out_mtx_pl) < 0) { return -1; }
+    if (use_vcf_cells(gs)) { jf_putc('\n', d->out_vcf_cells); }
+    return 0;
+}
+
+/*@note  The buffers of the out_* files are exchanged with the ones of the chunk, so the content is never copied. */
+int thdata_stream_push(thread_data *d, int is_end) {
+    csp_writer_t *w = d->wrt;
+    csp_chunk_t *c;
+    jfile_t *fs[7] = {d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->out_mtx_gt, d->out_mtx_pl, 
+                      d->out_vcf_base, d->out_vcf_cells};
+    kstring_t *ks[7], t;
+    size_t size = d->chunk ? d->chunk->size : 0;
+    int i, u = d->i;
+    for (i = 0; i < 7; i++) { if (fs[i]) { size += ks_len(fs[i]->buf); } }
+    if (! is_end && size < CSP_STREAM_CHUNK_SIZE) { return 0; }
+    if (NULL == (c = d->chunk) && NULL == (c = csp_writer_get_chunk(w))) { return -1; }
+    d->chunk = NULL;
+    for (i = 0; i < 5; i++) { ks[i] = c->mtx + i; }
+    ks[5] = &c->vcf_base; ks[6] = &c->vcf_cells;
+    for (i = 0; i < 7; i++) {
+        if (NULL == fs[i]) { continue; }
+        t = *fs[i]->buf; *fs[i]->buf = *ks[i]; *ks[i] = t;
+        if (is_end) { ks_free(fs[i]->buf); }
+    }
+    c->size = size;
+    pthread_mutex_lock(&w->lock);
+    while (! w->is_err && w->size >= w->max_size && (u != w->cur || w->head[u])) { pthread_cond_wait(&w->cond_put, &w->lock); }
+    if (w->is_err) { csp_writer_recycle(w, c); pthread_mutex_unlock(&w->lock); return -1; }
+    if (w->tail[u]) { w->tail[u]->next = c; } else { w->head[u] = c; }
+    w->tail[u] = c;
+    w->size += size;
+    if (is_end) { w->is_done[u] = 1; }
+    pthread_cond_signal(&w->cond_get);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+void thdata_stream_fail(thread_data *d) {
+    csp_writer_t *w = d->wrt;
+    pthread_mutex_lock(&w->lock);
+    w->is_err = 1; w->is_done[d->i] = 1;
+    if (d->chunk) { csp_writer_recycle(w, d->chunk); d->chunk = NULL; }
+    pthread_cond_broadcast(&w->cond_get);
+    pthread_cond_broadcast(&w->cond_put);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* the tmp files of one unit, i.e. its output segments. */
+static inline int thdata_tmp_files(thread_data *d, jfile_t **fs) {
+    jfile_t *a[7] = {d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->out_mtx_gt, d->out_mtx_pl, 
+                     d->out_vcf_base, d->out_vcf_cells};
+    int i, n;
+    for (i = n = 0; i < 7; i++) { if (a[i] && a[i]->is_tmp) { fs[n++] = a[i]; } }
+    return n;
+}
+
+/* flush the file, which has been closed, to disk. */
+static inline int fsync_file(const char *fn) {
+    int fd, ret;
+    if ((fd = open(fn, O_RDONLY)) < 0) { return -1; }
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/* FNV-1a hash of @p n bytes of @p p, continuing from @p h. */
+static inline uint64_t ckpt_hash(uint64_t h, const void *p, size_t n) {
+    const uint8_t *b = (const uint8_t*) p;
+    size_t i;
+    for (i = 0; i < n; i++) { h = (h ^ b[i]) * 1099511628211ULL; }
+    return h;
+}
+
+/* hash of the strings in array @p a of size @p n, each with its ending '\0'. */
+static inline uint64_t ckpt_hash_strs(uint64_t h, char **a, int n) {
+    int i;
+    for (i = 0; i < n; i++) { h = ckpt_hash(h, a[i], strlen(a[i]) + 1); }
+    return h;
+}
+
+/* flush the entries of the dir to disk, e.g. after a file in it is renamed. */
+static inline int fsync_dir(const char *dir) {
+    int fd, ret;
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) { return -1; }
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/*@note  The key is "#<mode>\t<num of units>\t<hash>", where the hash (FNV-1a) is calculated on the options that
+         change the output, the input files, the loaded SNPs, barcodes, sample IDs and chroms, and the regions of
+         the units. The SNPs are hashed as loaded (gs->pl or gs->targets), so that editing the -R/-T file in place
+         changes the key even if its name is the same.
+ */
+static void csp_ckpt_key(global_settings *gs, const char *mode, thread_data **td, int n, kstring_t *s) {
+    kstring_t ks = KS_INITIALIZE, *t = &ks;
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+    ksprintf(t, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%f\t%d\t%d\t%d\t%d\t%d\t%d\t%s\t%s\t%d\t%d\t%d\t%s\n", \
+             gs->shard, gs->nshard, gs->nbarcode, gs->nsid, gs->is_genotype, gs->is_sparse_geno, gs->is_out_bcf, \
+             gs->double_gl, gs->min_count, gs->min_maf, gs->min_len, gs->min_mapq, gs->rflag_filter, \
+             gs->rflag_require, gs->plp_max_depth, gs->no_orphan, gs->cell_tag ? gs->cell_tag : "None", \
+             gs->umi_tag ? gs->umi_tag : "None", gs->is_target, gs->nchrom, gs->nin, \
+             gs->snp_list_file ? gs->snp_list_file : "None");
+    for (i = 0; i < gs->nin; i++) { ksprintf(t, "%s\n", gs->in_fns[i]); }
+    for (i = 0; i < n; i++) { ksprintf(t, "%ld\t%ld\t%ld\t%ld\n", td[i]->n, td[i]->m, td[i]->beg, td[i]->end); }
+    h = ckpt_hash(h, ks_str(t), ks_len(t));
+    h = ckpt_hash_strs(h, gs->barcodes, gs->nbarcode);
+    h = ckpt_hash_strs(h, gs->sample_ids, gs->nsid);
+    h = ckpt_hash_strs(h, gs->chroms, gs->nchrom);
+    if (snplist_size(gs->pl) > 0) {
+        h = ckpt_hash_strs(h, gs->pl.chrom, gs->pl.nchrom);
+        h = ckpt_hash(h, gs->pl.cid, gs->pl.n * sizeof(int32_t));
+        h = ckpt_hash(h, gs->pl.pos, gs->pl.n * sizeof(hts_pos_t));
+        h = ckpt_hash(h, gs->pl.ale, gs->pl.n * sizeof(uint8_t));
+    } else if (gs->targets) {
+        h = ckpt_hash_strs(h, gs->targets->chrom, gs->targets->nchrom);
+        h = ckpt_hash(h, gs->targets->off, (gs->targets->nchrom + 1) * sizeof(size_t));
+        h = ckpt_hash(h, gs->targets->pos, gs->targets->n * sizeof(hts_pos_t));
+        h = ckpt_hash(h, gs->targets->ale, gs->targets->n * sizeof(uint8_t));
+    }
+    ksprintf(s, "#%s\t%d\t%016llx", mode, n, (unsigned long long) h);
+    ks_free(t);
+}
+
+csp_ckpt_t* csp_ckpt_init(global_settings *gs, const char *mode, thread_data **td, int n) {
+    csp_ckpt_t *ck = NULL;
+    kstring_t ks = KS_INITIALIZE, *key = &ks;
+    jfile_t *fs[7];
+    FILE *fp = NULL;
+    char buf[1024], *tmp_fn = NULL;
+    size_t v[5];
+    int i, j, k, nf, r;
+    if (NULL == (ck = (csp_ckpt_t*) calloc(1, sizeof(csp_ckpt_t)))) { goto fail; }
+    ck->n = n;
+    pthread_mutex_init(&ck->lock, NULL);
+    if (NULL == (ck->is_done = (uint8_t*) calloc(n, sizeof(uint8_t)))) { goto fail; }
+    if (NULL == (ck->fn = join_path(gs->out_dir, CSP_OUT_CKPT))) { goto fail; }
+    csp_ckpt_key(gs, mode, td, n, key);
+    /* restore the units finished by the previous run. */
+    if (gs->is_resume) {
+        if (NULL == (fp = fopen(ck->fn, "r"))) {
+            fprintf(stderr, "[W::%s] no checkpoint '%s' is found, all units would be run.\n", __func__, ck->fn);
+        } else if (NULL == fgets(buf, sizeof(buf), fp) || strncmp(buf, ks_str(key), ks_len(key)) || '\n' != buf[ks_len(key)]) {
+            fprintf(stderr, "[W::%s] the checkpoint does not match the current command, all units would be run.\n", __func__);
+        } else {
+            while (fgets(buf, sizeof(buf), fp)) {
+                if ('\n' != buf[strlen(buf) - 1]) { break; }     // the last line could be incomplete if the run is killed.
+                r = sscanf(buf, "%d\t%zu\t%zu\t%zu\t%zu\t%zu", &i, v, v + 1, v + 2, v + 3, v + 4);
+                if (6 != r || i < 0 || i >= n || ck->is_done[i]) { continue; }
+                nf = thdata_tmp_files(td[i], fs);
+                for (j = 0; j < nf && 0 == access(fs[j]->fn, F_OK); j++) ;
+                if (j < nf) { continue; }
+                td[i]->ns = v[0]; td[i]->nr_ad = v[1]; td[i]->nr_dp = v[2]; td[i]->nr_oth = v[3]; td[i]->nr_gt = v[4];
+                td[i]->ret = 0;
+                ck->is_done[i] = 1; ck->nskip++;
+            }
+        }
+        if (fp) { fclose(fp); fp = NULL; }
+        fprintf(stderr, "[I::%s] resume: %d of %d units have been finished and would be skipped.\n", __func__, ck->nskip, n);
+    }
+    ck->ndone = ck->nskip;
+    /* re-write the manifest into the tmp file, which then replaces the old one, so that the old one is kept
+       if the run is killed while writing. The renamed fp is kept for appending. */
+    if (NULL == (tmp_fn = join_path(gs->out_dir, CSP_OUT_CKPT_TMP))) { goto fail; }
+    if (NULL == (ck->fp = fopen(tmp_fn, "w"))) {
+        fprintf(stderr, "[E::%s] failed to open the checkpoint '%s'.\n", __func__, tmp_fn);
+        goto fail;
+    }
+    fprintf(ck->fp, "%s\n", ks_str(key));
+    for (k = 0; k < n; k++) {
+        if (ck->is_done[k]) { 
+            fprintf(ck->fp, "%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", k, td[k]->ns, td[k]->nr_ad, td[k]->nr_dp, 
+                    td[k]->nr_oth, td[k]->nr_gt);
+        }
+    }
+    if (fflush(ck->fp) != 0 || fsync(fileno(ck->fp)) < 0) {
+        fprintf(stderr, "[E::%s] failed to write the checkpoint '%s'.\n", __func__, tmp_fn);
+        goto fail;
+    }
+    if (rename(tmp_fn, ck->fn) < 0 || fsync_dir(gs->out_dir) < 0) {
+        fprintf(stderr, "[E::%s] failed to rename the checkpoint '%s' to '%s'.\n", __func__, tmp_fn, ck->fn);
+        goto fail;
+    }
+    free(tmp_fn);
+    ks_free(key);
+    return ck;
+  fail:
+    if (tmp_fn) { remove(tmp_fn); free(tmp_fn); }
+    ks_free(key);
+    if (ck) {
+        if (ck->fp) { fclose(ck->fp); }
+        pthread_mutex_destroy(&ck->lock);
+        free(ck->fn); free(ck->is_done);
+        free(ck);
+    }
+    return NULL;
+}
+
+int csp_ckpt_put(csp_ckpt_t *ck, thread_data *d) {
+    jfile_t *fs[7];
+    int i, nf, ret = 0;
+    nf = thdata_tmp_files(d, fs);
+    for (i = 0; i < nf; i++) { 
+        if (fsync_file(fs[i]->fn) < 0) { return -1; }
+    }
+    pthread_mutex_lock(&ck->lock);
+    fprintf(ck->fp, "%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", d->i, d->ns, d->nr_ad, d->nr_dp, d->nr_oth, d->nr_gt);
+    if (fflush(ck->fp) != 0 || fsync(fileno(ck->fp)) < 0) { ret = -1; }
+    else { ck->is_done[d->i] = 1; ck->ndone++; }
+    pthread_mutex_unlock(&ck->lock);
+    return ret;
+}
+
+void csp_ckpt_destroy(csp_ckpt_t *ck, thread_data **td) {
+    jfile_t *fs[7];
+    int i, j, nf;
+    if (NULL == ck) { return; }
+    fclose(ck->fp);
+    if (td && ck->ndone > 0) {
+        for (i = 0; i < ck->n; i++) {
+            if (! ck->is_done[i]) { continue; }
+            nf = thdata_tmp_files(td[i], fs);
+            for (j = 0; j < nf; j++) { fs[j]->is_tmp = 0; }
+        }
+        fprintf(stderr, "[I::%s] %d of %d units have been finished and are kept, which could be skipped by re-running " 
+                        "the same command with --resume.\n", __func__, ck->ndone, ck->n);
+    } else { remove(ck->fn); }
+    pthread_mutex_destroy(&ck->lock);
+    free(ck->fn); free(ck->is_done);
+    free(ck);
+}
+
 /*
  * File Routine
  */
@@ -242,9 +1003,15 @@ inline jfile_t* create_tmp_fs(jfile_t *fs, int idx, int is_zip, kstring_t *s) {
     if (NULL == (t = jf_init())) { return NULL; }
     ksprintf(s, "%s.%d", fs->fn, idx); 
     t->fn = strdup(ks_str(s)); t->fm = "wb"; t->is_zip = is_zip; t->is_tmp = 1;
+    t->tpool = fs->tpool;
     return t;
 }
 
+inline int csp_hts_set_tpool(htsFile *fp, hts_tpool *tpool) {
+    htsThreadPool p = {tpool, 0};
+    return tpool ? hts_set_thread_pool(fp, &p) : 0;
+}
+
 jfile_t** create_tmp_files(jfile_t *fs, int n, int is_zip) {
     kstring_t ks = KS_INITIALIZE, *s = &ks;
     jfile_t *t = NULL, **tfs = NULL;
@@ -264,38 +1031,70 @@ jfile_t** create_tmp_files(jfile_t *fs, int n, int is_zip) {
     return NULL; 
 }
 
+jfile_t** create_mem_files(jfile_t *fs, int n) {
+    jfile_t **tfs = NULL;
+    int i, j;
+    if (NULL == (tfs = (jfile_t**) calloc(n, sizeof(jfile_t*)))) { return NULL; }
+    for (i = 0; i < n; i++) {
+        if (NULL == (tfs[i] = jf_init()) || NULL == (tfs[i]->fn = strdup(fs->fn))) { goto fail; }
+        tfs[i]->fm = "wb"; tfs[i]->is_tmp = 1; tfs[i]->is_mem = 1;
+        jf_set_bufsize(tfs[i], SIZE_MAX);     // never flushed, refer to thdata_stream_push().
+    }
+    return tfs;
+  fail:
+    for (j = 0; j <= i; j++) { if (tfs[j]) { jf_destroy(tfs[j]); } }
+    free(tfs);
+    return NULL;
+}
+
 inline int destroy_tmp_files(jfile_t **fs, const int n) {
-    int i, m;
-    m = jf_remove_all(fs, n);
+    int i, m, r;
+    for (i = 0, m = 0; i < n; i++) {
+        if (! fs[i]->is_tmp) { continue; }
+        if ((r = jf_remove(fs[i])) < 0) { m = -1; break; }
+        else { m += r; }
+    }
     for (i = 0; i < n; i++) { jf_destroy(fs[i]); }
     free(fs);
     return m;
 }
 
-int merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t *ns, size_t *nr, int *ret) {
+/*@note  The records in tmp mtx files are varint-packed, refer to csp_mplp_to_out(). */
+int merge_mtx(jfile_t *out, jfile_t **in, const int n, const int nv, size_t *ns, size_t *nr, int *ret) {
     size_t k = 1, m = 0;
-    int i = 0;
-    kstring_t in_ks = KS_INITIALIZE, *in_buf = &in_ks;
+    uint64_t d, v;
+    int i = 0, j, l, r;
     *ret = -1;
     if (! jf_isopen(out) && jf_open(out, NULL) <= 0) { *ret = -2; goto fail; }
     for (; i < n; i++) {
         if (jf_open(in[i], "rb") <= 0) { *ret = -2; goto fail; }
-        while (jf_getln(in[i], in_buf) >= 0) {
-            if (0 == ks_len(in_buf)) {    // empty line, meaning ending of a SNP.
-                k++;
+        j = 0;
+        while ((r = jf_get_varint(in[i], &d)) > 0) {
+            if (0 == d) {    // meaning ending of a SNP.
+                k++; j = 0;
             } else {
-                jf_printf(out, "%ld\t%s\n", k, ks_str(in_buf));
-                m++; ks_clear(in_buf);
+                if (jf_get_varint(in[i], &v) <= 0) { *ret = -2; goto fail; }
+                j += d;
+                if (nv > 1) {
+                    jf_put_uint(k, out); jf_putc_('\t', out);
+                    jf_put_uint(j, out); jf_putc_('\t', out);
+                    jf_put_uint(v, out);
+                    for (l = 1; l < nv; l++) {
+                        if (jf_get_varint(in[i], &v) <= 0) { *ret = -2; goto fail; }
+                        jf_putc_(',', out); jf_put_uint(v, out);
+                    }
+                    jf_putc_('\n', out);
+                } else { csp_mtx_put_rec(out, k, j, (size_t) v); }
+                m++;
             }
         }
+        if (r < 0) { *ret = -2; goto fail; }
         jf_close(in[i]);
     }
-    ks_free(in_buf); in_buf = NULL;
     *ns = k - 1; *nr = m;
     *ret = 0; 
     return i;
   fail:
-    if (in_buf) { ks_free(in_buf); }
     if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
     return i;
 }
@@ -323,50 +1122,258 @@ int merge_vcf(jfile_t *out, jfile_t **in, const int n, int *ret) {
 #undef TMP_BUFSIZE
 }
 
-/*@note      1. When proc = 1, the origial outputed mtx file was not filled with stat info:
-                (totol SNPs, total samples, total records),
-                so use this function to fill and rewrite.
-             2. @p fs is not open when this function is just called and will keep not open when this function ends.
+/*@note  The stat line is known once all threads finish, so it's outputed right before the records, no need to
+         rewrite the whole file afterwards.
  */
-int rewrite_mtx(jfile_t *fs, size_t ns, int nsmp, size_t nr) {
-#define TMP_BUFSIZE 1048576
+int output_mtx(jfile_t *out, jfile_t **in, const int n, const int nv, size_t ns, int nsmp, size_t nr) {
+    size_t ns_merge, nr_merge;
+    int ret;
+    if (jf_open(out, NULL) < 0) { return -1; }
+    jf_printf(out, "%ld\t%d\t%ld\n", ns, nsmp, nr);
+    merge_mtx(out, in, n, nv, &ns_merge, &nr_merge, &ret);
+    if (ret < 0 || ns_merge != ns || nr_merge != nr) { jf_close(out); return -2; }
+    if (jf_close(out) < 0) { return -1; }
+    return 0;
+}
+
+int csp_mtx_fix_stat(const char *fn, off_t off, size_t ns, int nsmp, size_t nr) {
+    char buf[CSP_MTX_STAT_SIZE + 1], t[CSP_MTX_STAT_SIZE];
+    FILE *fp;
+    int l, r;
+    l = snprintf(t, CSP_MTX_STAT_SIZE, "%ld\t%d\t%ld\n", (long) ns, nsmp, (long) nr);
+    if (l < 0 || l >= CSP_MTX_STAT_SIZE || off < 1) { return -1; }
+    memset(buf, ' ', CSP_MTX_STAT_SIZE - l);      // buf replaces the newline of the header and the reserved bytes.
+    buf[CSP_MTX_STAT_SIZE - l] = '\n';
+    memcpy(buf + CSP_MTX_STAT_SIZE - l + 1, t, l);
+    if (NULL == (fp = fopen(fn, "r+b"))) { return -1; }
+    r = fseeko(fp, off - 1, SEEK_SET) < 0 || fgetc(fp) != '\n' || fseeko(fp, off - 1, SEEK_SET) < 0 || \
+        fwrite(buf, 1, CSP_MTX_STAT_SIZE + 1, fp) != CSP_MTX_STAT_SIZE + 1;
+    if (fclose(fp) != 0 || r) { return -1; }
+    return 0;
+}
+
+int csp_bcf_hdr_build(global_settings *gs, sam_hdr_t *sh, char **chroms, int n) {
+    char *info[] = CSP_BCF_INFO_LINES, *fmt[] = CSP_BCF_FORMAT_LINES;
+    char **smp;
+    bcf_hdr_t *h = NULL, *hc = NULL;
     kstring_t ks = KS_INITIALIZE, *s = &ks;
-    jfile_t *new = NULL;
-    char buf[TMP_BUFSIZE];
-    int r, ret = -1;
-    size_t lr, lw;
-    if (NULL == (new = create_tmp_fs(fs, 0, fs->is_zip, s))) { goto fail; }
-    ks_clear(s);
-    if (jf_open(fs, "rb") <= 0 || jf_open(new, "wb") <= 0) { goto fail; }
-    while ((r = jf_getln(fs, s)) >= 0 && ks_len(s) && ks_str(s)[0] == '%') {
-        jf_puts(ks_str(s), new); jf_putc('\n', new);
-        ks_clear(s);
+    kstring_t kt = KS_INITIALIZE, *t = &kt;
+    int i, tid, nsmp;
+    if (NULL == (h = bcf_hdr_init("w"))) { goto fail; }
+    for (i = 0; i < CSP_BCF_NINFO_LINES; i++) {
+        if (bcf_hdr_append(h, info[i]) < 0) { goto fail; }
     }
-    if (r < 0 || 0 == ks_len(s)) { // has no records. TODO: distinguish EOF and error when r = 1.
-        if (nr != 0) { ret = 1; goto fail; }
+    for (i = 0; i < n; i++) {
+        ks_clear(s); ks_clear(t);
+        kputs("##contig=<ID=", s); kputs(chroms[i], s);
+        if ((tid = csp_sam_hdr_name2id(sh, chroms[i], t)) >= 0) { ksprintf(s, ",length=%ld", (long) sam_hdr_tid2len(sh, tid)); }
+        kputc('>', s);
+        if (bcf_hdr_append(h, ks_str(s)) < 0) { goto fail; }
     }
-    jf_printf(new, "%ld\t%d\t%ld\n", ns, nsmp, nr);
-    if (nr) { 
-        jf_puts(ks_str(s), new); jf_putc('\n', new);
-        ks_clear(s);
-    }  
-    while ((lr = jf_read(fs, buf, TMP_BUFSIZE)) > 0) {
-        lw = jf_write(new, buf, lr);
-        if (lw != lr) { goto fail; }
-    }
-    jf_close(fs); jf_close(new);
-    jf_remove(fs);
-    if (rename(new->fn, fs->fn) != 0) { goto fail; }
-    jf_destroy(new); new = NULL;
-    ks_free(s);
+    if (bcf_hdr_sync(h) < 0) { goto fail; }
+    if (use_vcf_cells(gs)) {
+        if (NULL == (hc = bcf_hdr_dup(h))) { goto fail; }
+        for (i = 0; i < CSP_BCF_NFORMAT_LINES; i++) {
+            if (bcf_hdr_append(hc, fmt[i]) < 0) { goto fail; }
+        }
+        if (bcf_hdr_append(hc, gs->double_gl ? CSP_BCF_FORMAT_PL_DB : CSP_BCF_FORMAT_PL) < 0) { goto fail; }
+        if (use_barcodes(gs)) { smp = gs->barcodes; nsmp = gs->nbarcode; }
+        else { smp = gs->sample_ids; nsmp = gs->nsid; }
+        for (i = 0; i < nsmp; i++) {
+            if (bcf_hdr_add_sample(hc, smp[i]) < 0) { goto fail; }
+        }
+        if (bcf_hdr_sync(hc) < 0) { goto fail; }
+    }
+    gs->bcf_hdr_base = h; gs->bcf_hdr_cells = hc;
+    ks_free(s); ks_free(t);
     return 0;
   fail:
-    ks_free(s);
-    if (jf_isopen(fs)) { jf_close(fs); }
-    if (new) {
-        if (jf_isopen(new)) { jf_close(new); }
+    if (h) { bcf_hdr_destroy(h); }
+    if (hc) { bcf_hdr_destroy(hc); }
+    ks_free(s); ks_free(t);
+    return -1;
+}
+
+/*@note  The tmp files are read as raw bytes rather than by htslib. */
+int output_bcf(jfile_t *out, bcf_hdr_t *hdr, jfile_t **in, const int n, int nthread) {
+#define TMP_BUFSIZE 1048576
+#define BGZF_EOF_LEN 28
+    static const char eof[BGZF_EOF_LEN] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+    char tail[BGZF_EOF_LEN];
+    char *buf = NULL;
+    htsFile *fp = NULL;
+    BGZF *bgzf;
+    FILE *fi = NULL;
+    long len;
+    size_t lr;
+    int i;
+    if (NULL == (buf = (char*) malloc(TMP_BUFSIZE))) { goto fail; }
+    if (NULL == (fp = hts_open(out->fn, "wb"))) { goto fail; }
+    if (bcf_hdr_write(fp, hdr) < 0) { goto fail; }
+    bgzf = hts_get_bgzfp(fp);
+    if (bgzf_flush(bgzf) < 0) { goto fail; }     // the raw blocks should start after the header blocks.
+    for (i = 0; i < n; i++) {
+        if (NULL == (fi = fopen(in[i]->fn, "rb"))) { goto fail; }
+        if (fseek(fi, 0, SEEK_END) < 0 || (len = ftell(fi)) < 0) { goto fail; }
+        if (len >= BGZF_EOF_LEN && 0 == fseek(fi, -BGZF_EOF_LEN, SEEK_END) && \
+            BGZF_EOF_LEN == fread(tail, 1, BGZF_EOF_LEN, fi) && 0 == memcmp(tail, eof, BGZF_EOF_LEN)) {
+            len -= BGZF_EOF_LEN;
+        }
+        rewind(fi);
+        while (len > 0 && (lr = fread(buf, 1, min2(len, TMP_BUFSIZE), fi)) > 0) {
+            if (bgzf_raw_write(bgzf, buf, lr) != (ssize_t) lr) { goto fail; }
+            len -= lr;
+        }
+        if (len > 0) { goto fail; }
+        fclose(fi); fi = NULL;
     }
-    return ret;
+    i = hts_close(fp); fp = NULL;
+    if (i < 0) { goto fail; }
+    free(buf);
+    return bcf_index_build3(out->fn, NULL, 14, nthread) < 0 ? 1 : 0;
+  fail:
+    if (fi) { fclose(fi); }
+    if (fp) { hts_close(fp); }
+    free(buf);
+    return -1;
+#undef BGZF_EOF_LEN
 #undef TMP_BUFSIZE
 }
 
+/*@note  The headers of the mtx and text vcf files have been outputed before running, hence only the stat lines
+         and the BCF files are left. */
+int output_empty(global_settings *gs, int nsmp) {
+    jfile_t *mtx[5] = {gs->out_mtx_ad, gs->out_mtx_dp, gs->out_mtx_oth, gs->out_mtx_gt, gs->out_mtx_pl};
+    int i, n = gs->is_sparse_geno ? 5 : 3;
+    for (i = 0; i < n; i++) {
+        if (output_mtx(mtx[i], NULL, 0, 1, 0, nsmp, 0) < 0) { return -1; }
+    }
+    if (gs->is_out_bcf) {
+        if (output_bcf(gs->out_vcf_base, gs->bcf_hdr_base, NULL, 0, gs->nthread) < 0) { return -1; }
+        if (use_vcf_cells(gs) && output_bcf(gs->out_vcf_cells, gs->bcf_hdr_cells, NULL, 0, gs->nthread) < 0) { return -1; }
+    }
+    return 0;
+}
+
+/*@abstract  Read the header and the stat line of one mtx file.
+@param fp    Pointer of jfile_t opened for reading.
+@param hdr   Pointer of kstring_t into which the comment lines are appended, NULL to skip them.
+@param ns    Pointer of num of SNPs.
+@param nsmp  Pointer of num of samples.
+@param nr    Pointer of num of records.
+@param s     Pointer of kstring_t used as buffer.
+@return      0 if success, -1 otherwise.
+ */
+static int read_mtx_head(jfile_t *fp, kstring_t *hdr, size_t *ns, int *nsmp, size_t *nr, kstring_t *s) {
+    long a, c;
+    size_t l;
+    while (1) {
+        ks_clear(s);
+        if (jf_getln(fp, s) < 0 || 0 == ks_len(s)) { return -1; }
+        if ('%' != ks_str(s)[0]) { break; }
+        if (hdr) {
+            for (l = ks_len(s); l > 1 && ' ' == ks_str(s)[l - 1]; l--);
+            kputsn(ks_str(s), l, hdr); kputc('\n', hdr);
+        }
+    }
+    if (3 != sscanf(ks_str(s), "%ld\t%d\t%ld", &a, nsmp, &c) || a < 0 || c < 0) { return -1; }
+    *ns = a; *nr = c;
+    return 0;
+}
+
+int merge_shard_mtx(jfile_t *out, jfile_t **in, const int n) {
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    kstring_t kh = KS_INITIALIZE, *h = &kh;
+    size_t ns = 0, nr = 0, ns_i, nr_i, k, m, off;
+    int i, nsmp = 0, nsmp_i, ret = -2;
+    char *p;
+    /* sum up the stat lines first. */
+    for (i = 0; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { ret = -1; goto fail; }
+        if (read_mtx_head(in[i], i ? NULL : h, &ns_i, &nsmp_i, &nr_i, s) < 0) { goto fail; }
+        jf_close(in[i]);
+        if (i && nsmp_i != nsmp) { goto fail; }
+        nsmp = nsmp_i; ns += ns_i; nr += nr_i;
+    }
+    if (jf_open(out, "wb") <= 0) { ret = -1; goto fail; }
+    if (ks_len(h)) { jf_puts(ks_str(h), out); }
+    jf_printf(out, "%ld\t%d\t%ld\n", ns, nsmp, nr);
+    /* renumber the SNPs of the records. */
+    for (i = 0, off = 0; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { ret = -1; goto fail; }
+        if (read_mtx_head(in[i], NULL, &ns_i, &nsmp_i, &nr_i, s) < 0) { goto fail; }
+        for (m = 0; ks_clear(s), jf_getln(in[i], s) >= 0; m++) {
+            if (0 == ks_len(s)) { goto fail; }
+            k = strtoul(ks_str(s), &p, 10);
+            if (0 == k || k > ns_i || '\t' != *p) { goto fail; }
+            jf_put_uint(k + off, out); jf_puts(p, out); jf_putc('\n', out);
+        }
+        jf_close(in[i]);
+        if (m != nr_i) { goto fail; }
+        off += ns_i;
+    }
+    ks_free(s); ks_free(h);
+    return jf_close(out) < 0 ? -1 : 0;
+  fail:
+    if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
+    if (jf_isopen(out)) { jf_close(out); }
+    ks_free(s); ks_free(h);
+    return ret;
+}
+
+int merge_shard_vcf(jfile_t *out, jfile_t **in, const int n) {
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    int i = 0, ret;
+    if (jf_open(out, "wb") <= 0) { goto fail; }
+    merge_vcf(out, in, min2(n, 1), &ret);
+    if (ret < 0) { goto fail; }
+    for (i = 1; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { goto fail; }
+        while (ks_clear(s), jf_getln(in[i], s) >= 0) {
+            if (0 == ks_len(s) || '#' == ks_str(s)[0]) { continue; }    // the header has been copied from the first file.
+            jf_puts(ks_str(s), out); jf_putc('\n', out);
+        }
+        jf_close(in[i]);
+    }
+    ks_free(s);
+    return jf_close(out) < 0 ? -1 : 0;
+  fail:
+    if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
+    if (jf_isopen(out)) { jf_close(out); }
+    ks_free(s);
+    return -1;
+}
+
+int merge_shard_bcf(const char *out_fn, char **in_fn, const int n, int nthread) {
+    htsFile *fi = NULL, *fo = NULL;
+    bcf_hdr_t *h = NULL, *t = NULL;
+    bcf1_t *rec = NULL;
+    int i, r;
+    if (NULL == (rec = bcf_init())) { goto fail; }
+    if (NULL == (fo = hts_open(out_fn, "wb"))) { goto fail; }
+    for (i = 0; i < n; i++) {
+        if (NULL == (fi = hts_open(in_fn[i], "rb")) || NULL == (t = bcf_hdr_read(fi))) { goto fail; }
+        if (0 == i) {
+            if (bcf_hdr_write(fo, t) < 0) { goto fail; }
+            h = t; t = NULL;
+        }
+        while (0 == (r = bcf_read(fi, t ? t : h, rec))) {
+            if (bcf_write(fo, h, rec) < 0) { goto fail; }
+        }
+        if (r < -1) { goto fail; }      // -1 means the end of file.
+        if (t) { bcf_hdr_destroy(t); t = NULL; }
+        hts_close(fi); fi = NULL;
+    }
+    bcf_hdr_destroy(h); h = NULL;
+    bcf_destroy(rec); rec = NULL;
+    i = hts_close(fo); fo = NULL;
+    if (i < 0) { goto fail; }
+    return bcf_index_build3(out_fn, NULL, 14, nthread) < 0 ? 1 : 0;
+  fail:
+    if (fi) { hts_close(fi); }
+    if (fo) { hts_close(fo); }
+    if (t) { bcf_hdr_destroy(t); }
+    if (h) { bcf_hdr_destroy(h); }
+    if (rec) { bcf_destroy(rec); }
+    return -1;
+}
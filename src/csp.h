@@ -5,12 +5,17 @@
 #define CSP_CSP_H
 
 #include <stdio.h>
+#include <pthread.h>
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
-#include "htslib/regidx.h"
+#include "htslib/thread_pool.h"
+#include "htslib/vcf.h"
 #include "config.h"
+#include "barcode.h"
 #include "mplp.h"
 #include "jfile.h"
+#include "jring.h"
+#include "jsam.h"
 #include "snp.h"
 #include "thpool.h"
 
@@ -35,15 +40,22 @@ struct _gll_settings {
     char *out_dir;         // Pointer to the path of dir containing the output files.
     jfile_t *out_vcf_cells, *out_vcf_base, *out_samples;
     jfile_t *out_mtx_ad, *out_mtx_dp, *out_mtx_oth;
+    jfile_t *out_mtx_gt, *out_mtx_pl;   // Sparse genotype mtx files, only used when is_sparse_geno is 1.
     int is_out_zip;        // If output files need to be zipped.
     int is_genotype;       // If need to do genotyping in addition to counting.
+    int is_sparse_geno;    // If output the genotypes of the cells with reads into GT/PL mtx files instead of the cells VCF.
+    int is_out_bcf;        // If output the base and cells VCF as BCF files, written by htslib.
+    bcf_hdr_t *bcf_hdr_base, *bcf_hdr_cells;   // Headers of the BCF files, built from the header of the first input file.
+    int is_out_stream;     // If the workers hand the output to one writer thread in memory instead of writing tmp files.
+    int stream_buf;        // Max size (MB) of the output waiting in the writer when streaming, refer to CSP_STREAM_BUF_SIZE.
     char *snp_list_file;   // Name of file containing a list of SNPs, usually a vcf file.
     snplist_t pl;      // List of the input SNPs. TODO: local variable.
     int is_target;         // If the provided snp list should be used as target (like -T in samtools/bcftools mpileup). 1, yes; 0, no
-    regidx_t *targets;     // Target regions.
+    snp_tgt_t *targets;    // Target SNPs, sorted by pos within each chrom.
     char *barcode_file;    // Name of the file containing a list of barcodes, one barcode per line.
     char **barcodes;       // Pointer to the array of barcodes.
     int nbarcode;          // Num of the barcodes.
+    csp_bcd_t *bcd;        // Dictionary mapping barcodes to their indexes in barcodes.
     char *sid_list_file;   // Name of the file containing a list of sample IDs, one sample-ID per line.
     char **sample_ids;     // Pointer to the array of sample IDs.
     int nsid;              // Num of sample IDs.
@@ -53,10 +65,16 @@ struct _gll_settings {
     char *umi_tag;         // Tag for UMI: UR, NULL. NULL means no UMI but read counts.
     int nthread;           // Num of threads to be used.
     threadpool tp;         // Pointer to thread pool.
+    hts_tpool *htp;        // Pointer to htslib thread pool shared by BGZF outputs and input files, NULL if nthread = 1.
     int mthread;           // Num of threads that user specified.
     int tp_errno;          // Error number, each bit could be used.
     int tp_ntry;           // Num of try
     int tp_max_open;       // Max num of open files for one process
+    int prefetch;          // Num of reads buffered for each input file by the reader thread of each worker, 0 to disable.
+    hts_pos_t win_size;    // Size of the windows that chroms are split into in Mode 2, refer to CSP_PILEUP_WIN_SIZE.
+    int shard, nshard;     // Index (0-based) of the shard to run and num of shards the SNPs or windows are split into.
+    int is_resume;         // If skip the work units finished by a previous run of the same command, refer to csp_ckpt_t.
+    int is_profile;        // If time the stages of each thread and output the profile, refer to csp_prof_t.
     int min_count;     // Minimum aggragated count.
     double min_maf;    // Minimum minor allele frequency.
     int double_gl;     // 0 or 1. 1: keep doublet GT likelihood, i.e., GT=0.5 and GT=1.5. 0: not keep.
@@ -83,6 +101,13 @@ struct _gll_settings {
 */
 #define use_sid(gs) ((gs)->sample_ids)
 
+/*@abstract  Whether to output the genotypes into the cells VCF, in which every sample group has a field.
+@param gs    Pointer of global settings structure [global_settings*].
+@return      1, yes; 0, no.
+@note        The genotypes are outputed into the sparse GT/PL mtx files instead when is_sparse_geno is 1.
+*/
+#define use_vcf_cells(gs) ((gs)->is_genotype && ! (gs)->is_sparse_geno)
+
 /*@abstract  Whether to use UMI for reads grouping during pileup.
 @param gs    Pointer of global settings structure [global_settings*].
 @return      1, yes; 0, no.
@@ -95,6 +120,16 @@ struct _gll_settings {
 */
 #define use_target(gs) ((gs)->is_target)
 
+/*@abstract  The fields of alignment records to be decoded, refer to csp_sam_open().
+@param gs    Pointer of global settings structure [global_settings*]
+@return      Bitwise OR of the SAM_* macros [int].
+@note        1. The aux tags are needed only for the cell barcodes and UMIs.
+             2. The mate fields are needed only when --inclFLAG or --exclFLAG tests the mate flags, refer to
+                CSP_SAM_MATE_FIELDS. So it should be used after the flag filters are set in check_args().
+*/
+#define csp_sam_fields(gs) (CSP_SAM_FIELDS | (use_barcodes(gs) || use_umi(gs) ? SAM_AUX : 0) |                \
+                            (((gs)->rflag_filter | (gs)->rflag_require) & CSP_SAM_MATE_FLAGS ? CSP_SAM_MATE_FIELDS : 0))
+
 void gll_setting_free(global_settings *gs); 
 void gll_setting_print(FILE *fp, global_settings *gs, char *prefix);
 
@@ -112,21 +147,22 @@ int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs);
 /*@abstract    Push content of one csp_pileup_t structure into the csp_mplp_t structure.
 @param pileup  Pointer of csp_pileup_t structure to be pushed.
 @param mplp    Pointer of csp_mplp_t structure pushing into.
-@param sid     Index of Sample ID in the input Sample IDs.
+@param sid     Index of the sample group, i.e. index of Sample ID in the input Sample IDs, or index of the barcode
+               in the input barcodes. When using barcodes, a negative value means looking up @p pileup->cb.
 @param gs      Pointer of global_settings structure.
 @return        0 if success;
                Negative numbers for error:
                  -1, neither barcodes or Sample IDs are used.
-                 -2, khash_put error.
+                 -2, error when putting the UMI into HashSet/HashMap.
                Positive numbers for warning:
                  1, cell-barcode is not in input barcode-list;
 
 @note   1. To speed up, the caller should guarantee that:
            a) the parameters are valid, i.e. mplp and gs must not be NULL. In fact, this function is supposed to be 
-              called after csp_mplp_t is created and set names of sample-groups, so mplp, mplp->hsg could not be NULL.
+              called after csp_mplp_t is created and set names of sample-groups, so mplp, mplp->plp could not be NULL.
            b) the csp_pileup_t must have passed the read filtering, refer to pileup_read_with_fetch() for details.
-           c) each key (sample group name) in map_sg_t already has a valid, not NULL, value (csp_plp_t*);
-              This usually can be done by calling csp_mplp_prepare().
+           c) the csp_plp_t of each sample group has been prepared and the barcode dictionary gs->bcd has been built
+              when using barcodes. This usually can be done by calling csp_mplp_prepare() and check_args().
         2. This function is expected to be used by Mode1 & Mode2 & Mode3.
 
 @discuss  In current version, only the result (base and qual) of the first read in one UMI group will be used for mplp statistics.
@@ -140,6 +176,8 @@ int csp_mplp_push(csp_pileup_t *pileup, csp_mplp_t *mplp, int sid, global_settin
 @param gs      Pointer of global_settings structure.
 @return        0 if success; -1 if error; 1 if not passing filters.
 
+@note          Only the touched sample groups (mplp->tsg) are processed, which are sorted by index in this function.
+
 @discuss  In current version, only the result (base and qual) of the first read in one UMI group will be used for mplp statistics.
           TODO: store results of all reads in one UMI group (maybe could do consistency correction in each UMI group) and then 
           do mplp statistics.
@@ -150,7 +188,11 @@ int csp_mplp_stat(csp_mplp_t *mplp, global_settings *gs);
 * BAM/SAM/CRAM File
  */
 
-/*@abstract  Packing the common bam file related pointers into a structure. */
+/*@abstract  Packing the common bam file related pointers into a structure.
+@note        The hdr and idx are loaded once and shared read-only by all threads, which create their own iterators
+             from them. A CRAM index refers to the handle it was loaded with, hence the @p fp of CRAM files is
+             kept here instead of being moved into csp_hts_pool_t, refer to csp_hts_pool_init().
+ */
 typedef struct {
     htsFile *fp;
     sam_hdr_t *hdr;   // hdr is needed by sam_read1().
@@ -166,6 +208,281 @@ typedef struct {
 inline csp_bam_fs* csp_bam_fs_init(void);
 inline void csp_bam_fs_destroy(csp_bam_fs* p);
 
+/*@abstract    A bounded pool of open htsFile handles of the input files, shared by all threads.
+@param fns       Array of input filenames, not owned by the pool.
+@param n         Num of input files.
+@param fields    The fields of records to be decoded by the newly opened handles, refer to csp_sam_open().
+@param tpool     Pointer of htslib thread pool attached to the newly opened handles.
+@param fp        Array of idle handles, the least recently used one first.
+@param fid       Index of input file of each idle handle.
+@param nidle     Num of idle handles.
+@param nopen     Num of open handles, both idle and in use.
+@param max_open  Max num of handles that could be open at the same time.
+@param nunit     Num of work units that take the handles in order of their indexes, 0 if in any order.
+@param next      Index of the unit whose turn it is to take the handles, only used when @p nunit > 0.
+@param is_turned If the unit has taken its turn, i.e., has taken the handles or passed, of size @p nunit.
+
+@note          1. One thread takes one handle for each input file at once (refer to csp_hts_pool_get()) and waits
+                  if there is not enough room, so that the threads never hold part of the handles while waiting for
+                  the others, and the run never fails with too many open files as long as @p max_open is large
+                  enough for one thread.
+               2. The idle handles are reused by the following work units of any thread, instead of being closed
+                  and re-opened for each unit.
+               3. When streaming the output (refer to csp_writer_t), the worker of a later unit could be blocked by
+                  the writer while holding its handles, so the unit being written should never wait behind it for
+                  the handles. Hence, the handles are taken in order of units (@p nunit > 0), and the unit being
+                  written always has its handles before any later unit.
+ */
+typedef struct {
+    char **fns;
+    int n;
+    int fields;
+    hts_tpool *tpool;
+    htsFile **fp;
+    int *fid;
+    int nidle, nopen, max_open;
+    int nunit, next;
+    uint8_t *is_turned;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} csp_hts_pool_t;
+
+/*@abstract    Create the csp_hts_pool_t structure.
+@param fns       Array of input filenames.
+@param n         Num of input files.
+@param max_open  Max num of open handles. It would be raised to @p n if less than @p n.
+@param fields    Bitwise OR of the SAM_* macros, refer to csp_sam_open().
+@param tpool     Pointer of htslib thread pool. Could be NULL.
+@param bfs       Array of @p n csp_bam_fs whose input files have been opened. The handles except those of CRAM
+                 files are moved into the pool if success, i.e., the fp of each element is set to NULL. Could be NULL.
+@param nunit     Num of work units that should take the handles in order, 0 if in any order. 
+@return          Pointer to the structure if success, NULL otherwise.
+ */
+csp_hts_pool_t* csp_hts_pool_init(char **fns, int n, int max_open, int fields, hts_tpool *tpool, csp_bam_fs **bfs,
+                                  int nunit);
+
+/*@note  All handles should have been put back into the pool before calling this function. */
+void csp_hts_pool_destroy(csp_hts_pool_t *p);
+
+/*@abstract  Take one handle for each input file from the pool.
+@param p     Pointer of csp_hts_pool_t structure.
+@param fp    Array of size p->n to store the handles.
+@param u     Index of the work unit, only used when p->nunit > 0.
+@return      0 if success, -1 otherwise, with errno set by hts_open().
+
+@note        1. The idle handles of the same files are reused first, then new handles are opened, after
+                closing the idle handles of the other files if needed.
+             2. The handles should be put back by csp_hts_pool_put() when no longer used.
+             3. When p->nunit > 0, it waits until all units before @p u have taken their turns, and the turn
+                of @p u is taken even if it fails.
+ */
+int csp_hts_pool_get(csp_hts_pool_t *p, htsFile **fp, int u);
+
+/*@abstract  Pass the turn of one unit which would not take the handles, e.g. because of errors.
+@param p     Pointer of csp_hts_pool_t structure.
+@param u     Index of the work unit.
+@note        It does nothing if p->nunit is 0 or @p u has taken its turn, so it is safe to be called in the fail
+             path of any unit, and it waits until the units before @p u have taken their turns.
+ */
+void csp_hts_pool_pass(csp_hts_pool_t *p, int u);
+
+/*@abstract  Put the handles back into the pool.
+@param p     Pointer of csp_hts_pool_t structure.
+@param fp    Array of size p->n returned by csp_hts_pool_get(). NULL elements are skipped and all
+             elements are set to NULL after calling this function.
+ */
+void csp_hts_pool_put(csp_hts_pool_t *p, htsFile **fp);
+
+/*@abstract  Infer the max num of open input handles of the pool.
+@param gs    Pointer of global_settings structure.
+@param nthread  Num of threads that run at the same time.
+@return      The max num, no less than gs->nin.
+@note        The output files opened by the program and by each thread are excluded from gs->tp_max_open.
+ */
+int csp_hts_pool_size(global_settings *gs, int nthread);
+
+/*
+ * Output writer
+ */
+
+/*@abstract    A chunk of the output of one work unit, handed from the worker to the writer thread.
+@param mtx     Records of the AD, DP, OTH, GT and PL mtx, in the format of the tmp mtx files, refer to merge_mtx().
+@param vcf_base   Lines of the base VCF, used when not is_out_bcf.
+@param vcf_cells  Lines of the cells VCF, used when not is_out_bcf.
+@param bcf     Records of the base (bcf[0]) and cells (bcf[1]) BCF, used when is_out_bcf.
+@param nbcf    Num of records in @p bcf[0] and @p bcf[1].
+@param mbcf    Num of records allocated, which are reused by the following chunks.
+@param size    Num of bytes of the content, used for bounding the reorder buffer.
+@param next    Pointer of the next chunk in the same queue.
+ */
+typedef struct csp_chunk_s {
+    kstring_t mtx[5];
+    kstring_t vcf_base, vcf_cells;
+    bcf1_t **bcf[2];
+    int nbcf[2], mbcf[2];
+    size_t size;
+    struct csp_chunk_s *next;
+} csp_chunk_t;
+
+/*@abstract    The reorder buffer and the writer thread that streams the chunks of all work units in order of units
+               straight into the output files.
+@param gs      Pointer of global_settings structure.
+@param n       Num of work units.
+@param cur     Index of the unit being written.
+@param head    Array of size @p n, the first chunk in the queue of each unit.
+@param tail    Array of size @p n, the last chunk in the queue of each unit.
+@param is_done Array of size @p n, if all chunks of the unit have been handed to the writer.
+@param pool    Free chunks that could be reused.
+@param size    Num of bytes of the chunks in the queues.
+@param max_size  Max value of @p size, i.e., gs->stream_buf in bytes.
+@param nmtx    Num of output mtx files, 3 or 5 (with GT and PL).
+@param mtx     The output mtx files: AD, DP, OTH, GT, PL.
+@param nv      Num of values in each record of each mtx file.
+@param off     Size of each output file before streaming, i.e. the size of the header, the 5 mtx files then the
+               base and cells VCF files.
+@param bcf     Output BCF files, base bcf[0] and cells bcf[1].
+@param ns      Num of SNPs written.
+@param nr      Num of records written into each mtx file.
+@param state   0 if running, 1 if finished, -1 if failed.
+@param is_err  If any worker or the writer failed, then all of them stop.
+
+@note          1. The worker of unit @p cur is never blocked by @p max_size unless its own chunks are waiting,
+                  so the writer always has a chunk to write as long as the units are taken by the workers in order,
+                  and the input handles are taken in order of units too, refer to csp_hts_pool_t.
+               2. The SNP indexes in the mtx records are renumbered on the fly when written, as in merge_mtx().
+ */
+typedef struct {
+    global_settings *gs;
+    int n, cur;
+    csp_chunk_t **head, **tail;
+    uint8_t *is_done;
+    csp_chunk_t *pool;
+    size_t size, max_size;
+    int nmtx;
+    jfile_t *mtx[5];
+    int nv[5];
+    off_t off[7];
+    htsFile *bcf[2];
+    size_t ns, nr[5];
+    pthread_t tid;
+    int is_started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_put, cond_get;
+    int state, is_err;
+} csp_writer_t;
+
+/*@abstract  Create the writer, open the output files and start the writer thread.
+@param gs    Pointer of global_settings structure, whose output headers have been written.
+@param n     Num of work units.
+@return      Pointer to the structure if success, NULL otherwise.
+@note        The stat lines of the mtx files are reserved by the writer and filled by csp_writer_finish(), as
+             the num of SNPs and records are known only after all units are written, refer to csp_mtx_fix_stat().
+ */
+csp_writer_t* csp_writer_init(global_settings *gs, int n);
+
+/*@abstract  Wait for the writer thread to write all units, then close the output files.
+@param w     Pointer of csp_writer_t structure.
+@return      0 if success, -1 if failed, 1 if success but failed to build the index of BCF files.
+ */
+int csp_writer_finish(csp_writer_t *w);
+
+/*@note  If the writer has not finished, it's stopped and the output files are truncated to the headers, so that
+         the run could be re-tried.
+ */
+void csp_writer_destroy(csp_writer_t *w);
+
+/*@abstract    Checkpoint of the work units, so that a run that failed or was killed could be resumed (--resume).
+@param fn      Filename of the manifest in the output dir, i.e. CSP_OUT_CKPT.
+@param fp      Pointer of FILE of the manifest, opened for appending.
+@param n       Num of work units.
+@param is_done Array of size @p n, if the unit has been finished, by this run or by a previous one.
+@param ndone   Num of units that have been finished.
+@param nskip   Num of units finished by a previous run, which are skipped by this run.
+@param lock    Lock of @p fp, @p is_done and @p ndone.
+
+@note          1. The tmp files of the units are kept in the output dir as the output segments. The first line of the
+                  manifest is the key of the run, and each following line "idx ns nr_ad nr_dp nr_oth nr_gt" is one
+                  finished unit, i.e. its index and its stat values in thread_data.
+               2. The line of one unit is appended only after its tmp files are flushed to disk (fsync), so the units
+                  in the manifest always have complete tmp files, even if the run is killed.
+               3. The key is built from the options that change the output, from the loaded SNPs, barcodes, sample
+                  IDs and chroms, and from the regions of all units, hence the units are reused only if the command
+                  and the contents of these lists are the same, including -p in Mode 1 and 3.
+               4. The manifest is re-written at start into CSP_OUT_CKPT_TMP, which is synced and then renamed,
+                  so a previous manifest is never left half-written.
+ */
+typedef struct {
+    char *fn;
+    FILE *fp;
+    int n;
+    uint8_t *is_done;
+    int ndone, nskip;
+    pthread_mutex_t lock;
+} csp_ckpt_t;
+
+/* reasons why the reads are rejected, refer to csp_prof_t. */
+#define CSP_REJ_TAG     0         // UMI or cell tag missing.
+#define CSP_REJ_BCD     1         // cell barcode not in the input barcodes.
+#define CSP_REJ_UNMAP   2         // unmapped.
+#define CSP_REJ_MAPQ    3         // MAPQ less than min_mapq.
+#define CSP_REJ_FLAG    4         // FLAG filtered by rflag_filter or rflag_require.
+#define CSP_REJ_ORPHAN  5         // orphan reads, if no_orphan.
+#define CSP_REJ_LEN     6         // length of bases within alignment less than min_len.
+#define CSP_REJ_TARGET  7         // not covering any target SNP (-T) in Mode 2.
+#define CSP_REJ_DEL     8         // the SNP is in deletion or ref-skip of the read.
+#define CSP_NREJ        9
+
+/* stages of pileup timed by the profiler, refer to csp_prof_t. */
+#define CSP_STG_DECODE  0         // reading the records from the input files, i.e. decompressing and decoding them.
+#define CSP_STG_FILTER  1         // filtering the reads, except by the UMI and cell tags.
+#define CSP_STG_UMI_CB  2         // getting the UMI and cell tags, looking up the barcodes and pushing the reads into
+                                  // the sample groups, including the UMI hashing of csp_mplp_push().
+#define CSP_STG_PILEUP  3         // the rest of pileup, e.g. locating the SNPs in the reads, and mpileup of htslib.
+#define CSP_STG_WAIT    4         // waiting for the reads from the reader thread, only with --prefetch.
+#define CSP_STG_STAT    5         // csp_mplp_stat(), i.e. counting alleles and genotyping.
+#define CSP_STG_OUTPUT  6         // formatting and writing the output of the SNPs.
+#define CSP_NSTG        7
+
+/*@abstract    Counters and stage timer of one thread (or one reader thread), the profile of the run (--profile).
+@param nread   Num of reads read from the input files, including those rejected.
+@param nrej    Num of reads rejected by each reason, CSP_REJ_*. CSP_REJ_DEL is counted once for each SNP and read.
+@param nsnp    Num of SNPs (or pos in Mode 2) that are pileup-ed.
+@param npass   Num of SNPs that passed all filters.
+@param is_on   If the stages are timed, i.e. gs->is_profile.
+@param t0      Time when the last stage ended.
+@param t       Time (seconds) spent in each stage, CSP_STG_*.
+
+@note          1. The counters are always updated as they cost almost nothing, while the time is taken only if
+                  @p is_on, refer to csp_prof_tick().
+               2. The stages of one thread are consecutive, hence each one is timed from the end of the previous
+                  one, and the time of setting up the regions is attributed to the stage following it. The stages
+                  switch for every read, so timing costs one read of the clock per read and stage.
+               3. With --prefetch, the reads are decoded and filtered by the reader thread, whose idle time is
+                  skipped by csp_prof_skip(), and its time is added into the worker, which times CSP_STG_WAIT.
+ */
+typedef struct {
+    size_t nread, nrej[CSP_NREJ];
+    size_t nsnp, npass;
+    int is_on;
+    double t0, t[CSP_NSTG];
+} csp_prof_t;
+
+/*@abstract  Current time (seconds) of the monotonic clock. */
+inline double csp_prof_now(void);
+
+/*@abstract  Start timing the stages if @p is_on. */
+inline void csp_prof_start(csp_prof_t *pf, int is_on);
+
+/*@abstract  Add the time since the end of the previous stage into stage @p k. */
+inline void csp_prof_tick_(csp_prof_t *pf, int k);
+#define csp_prof_tick(pf, k) do { if ((pf)->is_on) { csp_prof_tick_(pf, k); } } while (0)
+
+/*@abstract  Drop the time since the end of the previous stage, e.g. the idle time of the reader thread. */
+#define csp_prof_skip(pf) do { if ((pf)->is_on) { (pf)->t0 = csp_prof_now(); } } while (0)
+
+/*@abstract  Add the counters and time of @p b into @p a, e.g. those of the reader thread into the worker. */
+inline void csp_prof_add(csp_prof_t *a, const csp_prof_t *b);
+
 /* 
  * Thread operatoins API/routine
  */
@@ -177,28 +494,48 @@ inline void csp_bam_fs_destroy(csp_bam_fs* p);
 @param gs      Pointer to the global_settings structure.
 @param bfs     Array of csp_bam_fs.
 @param nfs     Size (Number of elements) of @p bfs.
+@param hp      Pointer of the pool of input handles shared by all threads.
 @param iter    Array of hts_itr_t**. 
 @param niter   Size of @p iter.
 @param nitr    Size of one element of @p iter.
 @param n       Pos of next element in the snp-list/chrom-list to be used by certain thread.
 @param m       Total size of elements to be used by certain thread, must not be changed.
+@param beg     Start pos (0-based, inclusive) of the region in the chrom to be used by Mode2 when chroms are split.
+@param end     End pos (0-based, exclusive) of the region. [beg, end) is [0, HTS_POS_MAX) for whole chroms.
 @param i       Id of the thread data.
 @param ret     Running state of the thread.
 @param ns      Num of SNPs that passed all filters.
 @param nr_*    Num of records for each output matrix file. 
 @param out_*   Pointers of output files.
+@param rdr_*   Statistics of the reader thread when prefetching, refer to jring_t.
+@param wrt     Pointer of the writer when streaming the output, NULL otherwise. The out_* files are then in memory.
+@param chunk   Pointer of the chunk holding the BCF records of the unit that have not been handed to the writer.
+@param ck      Pointer of the checkpoint of the units, NULL if the units are not checkpointed.
+@param prof    Counters and time of the unit, refer to csp_prof_t.
  */
 typedef struct {
     global_settings *gs;
     csp_bam_fs **bfs;
     int nfs;
+    csp_hts_pool_t *hp;
     hts_itr_t ***iter;
     int niter, nitr;
     size_t m, n;   // for snp-list or chrom-list.
+    hts_pos_t beg, end;
     int i;
     int ret;
-    size_t ns, nr_ad, nr_dp, nr_oth;
+    size_t ns, nr_ad, nr_dp, nr_oth, nr_gt;
     jfile_t *out_mtx_ad, *out_mtx_dp, *out_mtx_oth, *out_vcf_base, *out_vcf_cells;
+    jfile_t *out_mtx_gt, *out_mtx_pl;
+    htsFile *out_bcf_base, *out_bcf_cells;   // opened on the tmp files out_vcf_base and out_vcf_cells if is_out_bcf.
+    bcf1_t *bcf_rec;
+    int32_t *bcf_buf;     // buffer of FORMAT values, refer to csp_mplp_to_bcf_fmt().
+    double rdr_wait_put, rdr_wait_get;
+    size_t rdr_nget, rdr_ndepth;
+    csp_writer_t *wrt;
+    csp_chunk_t *chunk;
+    csp_ckpt_t *ck;
+    csp_prof_t prof;
 } thread_data;
 
 /*@abstract  Create the thread_data structure.
@@ -210,6 +547,96 @@ inline thread_data* thdata_init(void);
 inline void thdata_destroy(thread_data *p);
 inline void thdata_print(FILE *fp, thread_data *p);
 
+/*@abstract  Add the statistics of the ring buffers of the reader thread, which has been stopped, into the thread data. */
+inline void thdata_add_rdr_stat(thread_data *d, jring_t *r);
+
+/*@abstract  Print the statistics of prefetching summed over all thread data.
+@param fp    Pointer of FILE to print into.
+@param td    Array of pointers of thread_data.
+@param n     Size of @p td.
+@param m     Num of slots of each ring, i.e., gs->prefetch.
+@note        The time that the reader threads waited for room (the workers are slow) and the time that the workers
+             waited for reads (the readers are slow) help to choose the number of threads and size of buffers.
+ */
+void thdata_print_rdr_stat(FILE *fp, thread_data **td, int n, int m);
+
+/*@abstract  Open the tmp BCF files of the thread and create the record and buffer for writing.
+@param d     Pointer of thread_data structure.
+@param nsg   Num of sample groups.
+@return      0 if success, -1 otherwise.
+@note        The tmp BCF files contain records only, the header is outputed when merging, refer to output_bcf().
+ */
+int thdata_bcf_open(thread_data *d, int nsg);
+
+/*@abstract  Close the tmp BCF files of the thread and free the record and buffer.
+@param d     Pointer of thread_data structure.
+@return      0 if success, -1 otherwise.
+ */
+int thdata_bcf_close(thread_data *d);
+
+/*@abstract  Output the stat info of one SNP into the tmp vcf/BCF and mtx files of the thread.
+@param d     Pointer of thread_data structure.
+@param mplp  Pointer of the csp_mplp_t structure of the SNP, whose stat info has been calculated.
+@param chr   Name of the chrom.
+@param pos   0-based pos.
+@param s     Pointer of kstring_t used for the text VCF line, it's not cleared inside.
+@return      0 if success, -1 otherwise.
+ */
+int thdata_output_snp(thread_data *d, csp_mplp_t *mplp, const char *chr, hts_pos_t pos, kstring_t *s);
+
+/*@abstract  Hand the output of the thread into the writer, if the output reaches CSP_STREAM_CHUNK_SIZE or the unit ends.
+@param d     Pointer of thread_data structure.
+@param is_end  If the unit ends, i.e. no more output from @p d.
+@return      0 if success, -1 if the writer or other workers failed.
+@note        The worker waits here if the reorder buffer is full, refer to csp_writer_t.
+ */
+int thdata_stream_push(thread_data *d, int is_end);
+
+/*@abstract  Tell the writer that the unit failed, then the writer and all other workers stop. */
+void thdata_stream_fail(thread_data *d);
+
+/*@abstract    Output the profile of the run as a JSON file in the output dir, i.e. CSP_OUT_PROFILE.
+@param gs      Pointer of global_settings structure.
+@param mode    Name of the method, e.g. "fetch" or "pileup".
+@param td      Array of thread data of the units.
+@param n       Num of units.
+@param t_run   Wall time (seconds) of running the units.
+@param t_merge Wall time (seconds) of merging the tmp files or waiting for the writer.
+@return        0 if success, -1 otherwise.
+@note          The counters and time of the units are summed, hence the time of the stages is the total time of
+               all threads, which could be compared with @p t_run * gs->nthread, plus the time of the reader threads
+               with --prefetch.
+ */
+int csp_prof_output(global_settings *gs, const char *mode, thread_data **td, int n, double t_run, double t_merge);
+
+/*@abstract  Create the checkpoint of the units and the manifest.
+@param gs    Pointer of global_settings structure.
+@param mode  Name of the method, e.g. "fetch" or "pileup", which is part of the key.
+@param td    Array of thread data of the units, whose regions and tmp files have been set.
+@param n     Num of units.
+@return      Pointer to the structure if success, NULL otherwise.
+@note        If gs->is_resume, the units in the manifest of a previous run with the same key, whose tmp files 
+             still exist, are marked done and their stat values are restored into @p td, with ret set to 0.
+             The manifest is then re-written with these units only, refer to csp_ckpt_t.
+ */
+csp_ckpt_t* csp_ckpt_init(global_settings *gs, const char *mode, thread_data **td, int n);
+
+/*@abstract  Record that the unit has been finished, after its tmp files have been closed.
+@param ck    Pointer of csp_ckpt_t structure.
+@param d     Pointer of the thread data of the unit.
+@return      0 if success, -1 otherwise.
+@note        It's called by the threads.
+ */
+int csp_ckpt_put(csp_ckpt_t *ck, thread_data *d);
+
+/*@abstract  Destroy the checkpoint.
+@param ck    Pointer of csp_ckpt_t structure.
+@param td    Array of thread data of the units. If not NULL, the run failed and its finished units are kept,
+             i.e. their tmp files would not be removed by destroy_tmp_files(), nor the manifest.
+             If NULL, the manifest is removed.
+ */
+void csp_ckpt_destroy(csp_ckpt_t *ck, thread_data **td);
+
 /*
  * File Routine
  */
@@ -220,9 +647,18 @@ inline void thdata_print(FILE *fp, thread_data *p);
 @param is_zip  If the tmp files should be zipped.
 @param s       Pointer of kstring_t.
 @return        Pointer to jfile_t for tmp file if success, NULL otherwise.
+
+@note          The thread pool of @p fs is shared with the tmp file.
  */
 inline jfile_t* create_tmp_fs(jfile_t *fs, int idx, int is_zip, kstring_t *s);
 
+/*@abstract  Attach the shared htslib thread pool to input file for (de)compression.
+@param fp    Pointer of htsFile.
+@param tpool Pointer of htslib thread pool. If NULL, do nothing.
+@return      0 if success, negative numbers otherwise.
+ */
+inline int csp_hts_set_tpool(htsFile *fp, hts_tpool *tpool);
+
 /*@abstract    Create array of tmp filen structures based on the given file structure.
 @param fs      The file struct that the tmp file structs are based on.
 @param n       Number of tmp file structs to be created.
@@ -231,10 +667,21 @@ inline jfile_t* create_tmp_fs(jfile_t *fs, int idx, int is_zip, kstring_t *s);
  */
 jfile_t** create_tmp_files(jfile_t *fs, int n, int is_zip);
 
+/*@abstract    Create array of in-memory file structures (refer to jfile_t is_mem) for streaming the output.
+@param fs      The file struct that the in-memory file structs are based on, only the filename is used.
+@param n       Number of file structs to be created.
+@return        Pointer to the array of file structs if success, NULL otherwise.
+@note          The file structs are in tmp mode, i.e. the mtx records are varint-packed, and could be freed by
+               destroy_tmp_files().
+ */
+jfile_t** create_mem_files(jfile_t *fs, int n);
+
 /*@abstract  Remove tmp files and free memory.
 @param fs    Pointer of array of jfile_t structures to be removed and freed.
 @param n     Size of array.
 @return      Num of tmp files that are removed if no error, -1 otherwise.
+@note        The files whose is_tmp is unset are kept, e.g. the tmp files of the finished units of a failed run, 
+             refer to csp_ckpt_destroy().
  */
 inline int destroy_tmp_files(jfile_t **fs, const int n);
 
@@ -242,14 +689,21 @@ inline int destroy_tmp_files(jfile_t **fs, const int n);
 @param out    Pointer of file structure merged into.
 @param in     Pointer of array of tmp mtx files to be merged.
 @param n      Num of tmp mtx files.
+@param nv     Num of values in each record, e.g. 1 for AD; it's the num of PL for the PL mtx, whose values are
+              outputed comma separated.
 @param ns     Pointer to num of SNPs in all input mtx files.
 @param nr     Pointer to num of records in all input mtx files.
 @param ret    Pointer to the running state. 0 if success, negative numbers for error:
                 -1, unknown error;
                 -2, I/O error.
 @return       Num of tmp mtx files that are successfully merged.
+
+@note         1. The records of each SNP in the tmp files are (sample index delta, value) varint pairs ending with a
+                 0, refer to csp_mplp_to_out(). There are @p nv values in one pair when @p nv > 1.
+              2. The MatrixMarket stat line should be outputed into @p out before calling this function, as the
+                 num of SNPs and records are known once all threads finish.
 */
-int merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t *ns, size_t *nr, int *ret);
+int merge_mtx(jfile_t *out, jfile_t **in, const int n, const int nv, size_t *ns, size_t *nr, int *ret);
 
 /*@abstract   Merge several tmp vcf files.
 @param out    Pointer of file structure merged into.
@@ -262,19 +716,100 @@ int merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t *ns, size_t *nr, i
 */
 int merge_vcf(jfile_t *out, jfile_t **in, const int n, int *ret);
 
-/*@abstract  Rewrite mtx file to fill in the stat info.
-@param fs    Pointer of jfile_t that to be rewriten.
+/*@abstract  Output the stat line (num of SNPs, samples and records) and merge the tmp mtx files into mtx file.
+@param out   Pointer of jfile_t of the mtx file, into which the MatrixMarket header has been outputed.
+@param in    Pointer of array of tmp mtx files to be merged.
+@param n     Num of tmp mtx files.
+@param nv    Num of values in each record, refer to merge_mtx().
 @param ns    Num of SNPs.
 @param nsmp  Num of samples.
 @param nr    Num of records.
-@return      0 if success, -1 if error, 1 if the original file has no records while nr != 0.
+@return      0 if success, -1 if I/O error, -2 if failed to merge or the stat info does not match the tmp files.
 
-@note        1. When proc = 1, the origial outputed mtx file was not filled with stat info:
-                (totol SNPs, total samples, total records),
-                so use this function to fill and rewrite.
-             2. @p fs is not open when this function is just called and will keep not open when this function ends.
+@note        @p out is opened with its default mode (usually "ab") and is closed when this function ends.
+ */
+int output_mtx(jfile_t *out, jfile_t **in, const int n, const int nv, size_t ns, int nsmp, size_t nr);
+
+/*@abstract  Fill the stat line reserved by the writer (refer to csp_writer_init()) in the mtx file.
+@param fn    Filename of the mtx file, which has been closed.
+@param off   Size of the header of the mtx file, which ends with a comment line.
+@param ns    Num of SNPs.
+@param nsmp  Num of samples.
+@param nr    Num of records.
+@return      0 if success, -1 otherwise.
+@note        The reserved CSP_MTX_STAT_SIZE bytes are filled with the stat line, while the unused bytes are padded
+             as spaces into the end of the last comment line of the header, so the file is still a valid mtx file.
+ */
+int csp_mtx_fix_stat(const char *fn, off_t off, size_t ns, int nsmp, size_t nr);
+
+/*@abstract  Output the stat lines of the mtx files and the BCF headers when there is nothing to pileup, e.g., in
+             a shard without any windows (refer to --shard).
+@param gs    Pointer of global_settings structure, whose headers of mtx and text vcf files have been outputed.
+@param nsmp  Num of samples.
+@return      0 if success, -1 otherwise.
+ */
+int output_empty(global_settings *gs, int nsmp);
+
+/*@abstract  Merge the mtx files of several shards (refer to --shard) into one mtx file.
+@param out   Pointer of jfile_t of the merged mtx file, which is opened with "wb" and closed when this function ends.
+@param in    Pointer of array of the mtx files of the shards, in order of shards.
+@param n     Num of mtx files.
+@return      0 if success, -1 if I/O error, -2 if the files are not valid mtx files or their num of samples differ.
+
+@note        1. The header of the first file is kept, except that the trailing spaces of the comment lines are
+                removed (refer to csp_mtx_fix_stat()). The stat line is the sum of the stat lines of all files, hence
+                only the headers are read before the records are merged in one pass.
+             2. The SNP indexes in the records are renumbered by adding the num of SNPs in previous files, as in
+                merge_mtx().
+ */
+int merge_shard_mtx(jfile_t *out, jfile_t **in, const int n);
+
+/*@abstract  Merge the text vcf files of several shards into one vcf file.
+@param out   Pointer of jfile_t of the merged vcf file, which is opened with "wb" and closed when this function ends.
+@param in    Pointer of array of the vcf files of the shards, in order of shards.
+@param n     Num of vcf files.
+@return      0 if success, -1 otherwise.
+@note        The first file is copied as a whole by merge_vcf(), while the header lines of the others are skipped.
+ */
+int merge_shard_vcf(jfile_t *out, jfile_t **in, const int n);
+
+/*@abstract    Merge the BCF files of several shards into one indexed BCF file.
+@param out_fn  Filename of the merged BCF file.
+@param in_fn   Filenames of the BCF files of the shards, in order of shards.
+@param n       Num of BCF files.
+@param nthread Num of threads used for building the index.
+@return        0 if success, 1 if failed to build the index, -1 otherwise.
+@note          The header of the first file is used, the records are decoded and encoded by htslib.
+ */
+int merge_shard_bcf(const char *out_fn, char **in_fn, const int n, int nthread);
+
+/*@abstract    Build the headers of the base and cells BCF files, i.e. gs->bcf_hdr_base and gs->bcf_hdr_cells.
+@param gs      Pointer of global settings structure.
+@param sh      Pointer of the header of input sam/bam/cram file, from which the lengths of contigs are taken.
+@param chroms  Pointer of array of names of chroms outputed, each is a contig of the BCF files.
+@param n       Num of chroms.
+@return        0 if success, -1 otherwise.
+
+@note          1. The cells header is duplicated from the base header before the FORMAT lines and samples are added,
+                  so that the two headers share the ids of contigs, FILTER and INFO, and one bcf1_t could be written
+                  into both files.
+               2. gs->bcf_hdr_cells is built only when use_vcf_cells(gs).
+ */
+int csp_bcf_hdr_build(global_settings *gs, sam_hdr_t *sh, char **chroms, int n);
+
+/*@abstract  Output the header and merge the tmp BCF files into the BCF file, then index it.
+@param out   Pointer of jfile_t of the BCF file, only the filename is used.
+@param hdr   Pointer of the BCF header.
+@param in    Pointer of array of tmp BCF files to be merged, which contain records only.
+@param n     Num of tmp BCF files.
+@param nthread  Num of threads used for building the index.
+@return      0 if success, -1 if failed to output or merge, 1 if merged but failed to build the index.
+
+@note        The tmp files are BGZF-compressed streams, so they are appended as raw blocks without being 
+             decompressed or re-parsed, only the EOF block in the end of each tmp file is dropped. The CSI index 
+             could not be built if the SNPs are not sorted, e.g. an unsorted -R file.
  */
-int rewrite_mtx(jfile_t *fs, size_t ns, int nsmp, size_t nr);
+int output_bcf(jfile_t *out, bcf_hdr_t *hdr, jfile_t **in, const int n, int nthread);
 
 /*
  * Subcommands
@@ -12,6 +12,7 @@
 #include "jfile.h"
 #include "jsam.h"
 #include "jnumeric.h"
+#include "jring.h"
 #include "jstring.h"
 #include "mplp.h"
 #include "snp.h"
@@ -20,136 +21,376 @@
     #include <errno.h>
 #endif
 
-/*@abstract  Pileup one read obtained by sam_itr_next().
-@param pos   Pos of the reference sequence. 0-based.
-@param p     Pointer of csp_pileup_t structure coming from csp_pileup_init() or csp_pileup_reset().
+/*@abstract  Get the UMI and cell tags of the read, and the index of its barcode, refer to fetch_read_decode(). */
+static inline int fetch_read_tags(csp_read_t *r, global_settings *gs, csp_prof_t *pf) {
+    if (use_umi(gs) && NULL == (r->umi = get_bam_aux_str(r->b, gs->umi_tag))) { pf->nrej[CSP_REJ_TAG]++; return 1; }
+    if (use_barcodes(gs)) {
+        if (NULL == (r->cb = get_bam_aux_str(r->b, gs->cell_tag))) { pf->nrej[CSP_REJ_TAG]++; return 1; }
+        if ((r->idx = csp_bcd_get(gs->bcd, r->cb)) < 0) { pf->nrej[CSP_REJ_BCD]++; return 2; }
+    }
+    return 0;
+}
+
+/*@abstract  Filter the read by its alignment, refer to fetch_read_decode(). */
+static inline int fetch_read_filter(csp_read_t *r, global_settings *gs, csp_prof_t *pf) {
+    bam1_core_t *c = &(r->b->core);
+    if (c->tid < 0 || c->flag & BAM_FUNMAP) { pf->nrej[CSP_REJ_UNMAP]++; return 2; }
+    if (c->qual < gs->min_mapq) { pf->nrej[CSP_REJ_MAPQ]++; return 2; }
+    //if (c->flag > gs->max_flag) { return 2; }
+    if (gs->rflag_filter && gs->rflag_filter & c->flag) { pf->nrej[CSP_REJ_FLAG]++; return 2; }
+    if (gs->rflag_require && ! (gs->rflag_require & c->flag)) { pf->nrej[CSP_REJ_FLAG]++; return 2; }
+    if (gs->no_orphan && c->flag & BAM_FPAIRED && ! (c->flag & BAM_FPROPER_PAIR)) { pf->nrej[CSP_REJ_ORPHAN]++; return 2; }
+    if (csp_read_set_cigar(r) < 0) { return -1; }
+    if (r->laln < gs->min_len) { pf->nrej[CSP_REJ_LEN]++; return 2; }
+    return 0;
+}
+
+/*@abstract  Decode one read obtained by sam_itr_next() and filter it.
+@param r     Pointer of csp_read_t structure containing the read.
 @param gs    Pointer of global settings.
+@param pf    Pointer of the counters into which the read and the reason why it's rejected are counted.
 @return      0 if success, -1 if error, 1 if the reads extracted are not in proper format, 2 if not passing filters.
 
-@note        1. This function is modified from cigar_resolve2() function in sam.c of htslib.
-             2. Reads filtering is also applied inside this function, including:
-                   UMI and cell tags, read mapping quality, mapping flag and length of bases within alignment.
-             3. To speed up, parameters will not be checked, so the caller should guarantee the parameters are valid, i.e.
-                && p != NULL && gs != NULL.
-
-@TODO        1. Filter unmapped reads (the read itself unmapped or the mate read unmapped) ?
-             2. All elements of csp_pileup_t other than 'base' and 'qual' would be overwritten in this function, while 'base' and
-                'qual' would not be overwritten when the next op after finding the pos is BAM_CDEL or BAM_CREF_SKIP, in which case
-                the read would be filtered as being DEL in current version. So 'base' and 'qual' would not be misused for the moment.
-                But it's better to call csp_pileup_reset*() in case that we donot filter DEL.
+@note        1. Reads filtering is applied inside this function, including:
+                   UMI and cell tags (the barcode should be in the input barcodes), read mapping quality, mapping flag
+                   and length of bases within alignment.
+                All these filters do not depend on the query pos, so each read is decoded and filtered only once
+                no matter how many SNPs it covers. Then fetch_read() would pileup the read for each SNP.
+             2. To speed up, parameters will not be checked, so the caller should guarantee the parameters are valid, i.e.
+                && r != NULL && gs != NULL.
+             3. The tags and the other filters are timed as CSP_STG_UMI_CB and CSP_STG_FILTER respectively.
+
+@TODO        Filter unmapped reads (the read itself unmapped or the mate read unmapped) ?
  */
-static int fetch_read(hts_pos_t pos, csp_pileup_t *p, global_settings *gs) {
+static int fetch_read_decode(csp_read_t *r, global_settings *gs, csp_prof_t *pf) {
     /* Filter reads in order. For example, filtering according to umi tag and cell tag would speed up in the case
        that do not use UMI or Cell-barcode at all. */
-    if (use_umi(gs) && NULL == (p->umi = get_bam_aux_str(p->b, gs->umi_tag))) { return 1; }
-    if (use_barcodes(gs) && NULL == (p->cb = get_bam_aux_str(p->b, gs->cell_tag))) { return 1; }
-    bam1_core_t *c = &(p->b->core);
-    if (c->tid < 0 || c->flag & BAM_FUNMAP) { return 2; }
-    if (c->qual < gs->min_mapq) { return 2; }
-    //if (c->flag > gs->max_flag) { return 2; }
-    if (gs->rflag_filter && gs->rflag_filter & c->flag) { return 2; }
-    if (gs->rflag_require && ! (gs->rflag_require & c->flag)) { return 2; }
-    if (gs->no_orphan && c->flag & BAM_FPAIRED && ! (c->flag & BAM_FPROPER_PAIR)) { return 2; }
-    uint32_t *cigar = bam_get_cigar(p->b);
-    hts_pos_t x, px;       /* x is the coordinate of the reference. */
-    int k, y, py, op, l;   /* y is the query coordinate. */
-    uint32_t laln;
-    assert(c->pos <= pos);   // otherwise a bug.
-    /* find the pos. */
-    p->qpos = 0; p->is_refskip = p->is_del = 0;
-    for (k = 0, px = x = c->pos, py = y = 0, laln = 0; k < c->n_cigar; k++, px = x, py = y) {
-        op = get_cigar_op(cigar[k]);
-        l = get_cigar_len(cigar[k]);
-        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { x += l; y += l; laln += l; }
-        else if (op == BAM_CDEL || op == BAM_CREF_SKIP) { x += l; }
-        else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) { y += l; }
-        // else, do nothing.
-        if (x > pos) { break; }
-    }
-    /* pileup */
-    assert(k < c->n_cigar);   // otherwise a bug.
-    if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
-        p->qpos = py + (pos - px); 
-        p->base = bam_seqi(bam_get_seq(p->b), p->qpos);
-        p->qual = bam_get_qual(p->b)[p->qpos];
-    } else if (op == BAM_CDEL || op == BAM_CREF_SKIP) {
-        p->is_del = 1; p->qpos = py; // FIXME: distinguish D and N!!!!!
-        p->is_refskip = (op == BAM_CREF_SKIP);
-    } // cannot be other operations; otherwise a bug
-    if (p->is_del) { return 2; }
-    if (p->is_refskip) { return 2; }
-    /* continue processing cigar string. */
-    for (k++; k < c->n_cigar; k++) {
-        op = get_cigar_op(cigar[k]);
-        l = get_cigar_len(cigar[k]);
-        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { laln += l; }
-    }
-    if (laln < gs->min_len) { return 2; }
-    else { p->laln = laln; }
+    int ret;
+    pf->nread++;
+    ret = fetch_read_tags(r, gs, pf);
+    csp_prof_tick(pf, CSP_STG_UMI_CB);
+    if (ret) { return ret; }
+    ret = fetch_read_filter(r, gs, pf);
+    csp_prof_tick(pf, CSP_STG_FILTER);
+    return ret;
+}
+
+/*@abstract  Pileup one read decoded by fetch_read_decode().
+@param pos   Pos of the reference sequence. 0-based.
+@param r     Pointer of csp_read_t structure.
+@param p     Pointer of csp_pileup_t structure.
+@return      0 if success, 2 if not passing filters.
+
+@note        1. The query pos is located by binary searching the CIGAR block table of the read, which is
+                modified from cigar_resolve2() function in sam.c of htslib.
+             2. The SNPs in deletion or ref-skip region would be filtered.
+ */
+static int fetch_read(hts_pos_t pos, csp_read_t *r, csp_pileup_t *p) {
+    csp_cigar_blk_t *blk;
+    int k;
+    assert(r->b->core.pos <= pos);   // otherwise a bug.
+    if ((k = csp_read_locate(r, pos)) < 0) { return 2; }
+    blk = r->blk + k;
+    p->is_refskip = p->is_del = 0;
+    if (blk->op == BAM_CDEL || blk->op == BAM_CREF_SKIP) {
+        p->is_del = 1; p->qpos = blk->qpos; // FIXME: distinguish D and N!!!!!
+        p->is_refskip = (blk->op == BAM_CREF_SKIP);
+        return 2;
+    }
+    p->qpos = blk->qpos + (pos - blk->rpos);
+    p->base = bam_seqi(bam_get_seq(r->b), p->qpos);
+    p->qual = bam_get_qual(r->b)[p->qpos];
+    p->umi = r->umi; p->cb = r->cb;
+    p->laln = r->laln;
+    return 0;
+}
+
+/* end codes of the batches passed by the reader thread, refer to jring_read_f. */
+#define FETCH_RDR_END  1
+#define FETCH_RDR_SKIP 2
+
+/*@abstract    A sliding window of reads fetched from one input file, used when sweeping a batch of SNPs.
+@param iter    Pointer of hts_itr_t covering all SNPs in current batch.
+@param a       Reads (in file order) that cover the current SNP and possibly the following ones.
+@param pool    Recycled csp_read_t structures.
+@param nxt     The read that has been fetched but starts after the current SNP. NULL if not exists.
+@param is_eof  If @p iter has reached its end.
+@param rdr     Ring buffers filled by the reader thread, NULL if not prefetching. Refer to fetch_rdr_t.
+@param id      Index of the input file, i.e. the stream of @p rdr.
+@param is_skip If the reader skipped current batch, i.e. the batch fails as in csp_fetch_core().
+@param pf      Pointer of the counters of the worker.
+
+@note          1. Each read in the batch region is fetched and decoded only once, reads not passing filters are
+                  dropped immediately while others are dropped as soon as their alignments end before the current
+                  SNP. Refer to fetch_win_seek().
+               2. When prefetching, @p iter is not used, the decoded reads of the batch are taken from @p rdr
+                  until the end of the batch.
+ */
+typedef struct {
+    hts_itr_t *iter;
+    kvec_t(csp_read_t*) a;
+    kvec_t(csp_read_t*) pool;
+    csp_read_t *nxt;
+    int is_eof;
+    jring_t *rdr;
+    int id;
+    int is_skip;
+    csp_prof_t *pf;
+} fetch_win_t;
+
+static inline fetch_win_t* fetch_win_init(void) {
+    fetch_win_t *w = (fetch_win_t*) calloc(1, sizeof(fetch_win_t));
+    if (w) { kv_init(w->a); kv_init(w->pool); }
+    return w;
+}
+
+/*@abstract  Reset the window for the next batch.
+@return      0 if success, -1 otherwise.
+@note        1. The csp_read_t structures are kept in the pool for the next batch.
+             2. When prefetching, the reads of the previous batch left in @p w->rdr, i.e. those after the last
+                SNP, are taken and dropped.
+ */
+static inline int fetch_win_reset(fetch_win_t *w) {
+    csp_read_t *r = NULL;
+    size_t j;
+    int ret;
+    if (w->iter) { hts_itr_destroy(w->iter); w->iter = NULL; }
+    for (j = 0; j < w->a.n; j++) { kv_push(csp_read_t*, w->pool, w->a.a[j]); }
+    w->a.n = 0;
+    if (w->nxt) { kv_push(csp_read_t*, w->pool, w->nxt); w->nxt = NULL; }
+    if (w->rdr && ! w->is_eof) {
+        if (NULL == (r = w->pool.n ? kv_pop(w->pool) : csp_read_init())) { return -1; }
+        while ((ret = jring_get(w->rdr, w->id, (void**) &r)) == 0) { }
+        kv_push(csp_read_t*, w->pool, r);
+        if (ret < 0) { return -1; }
+    }
+    w->is_eof = w->is_skip = 0;
+    return 0;
+}
+
+static inline void fetch_win_destroy(fetch_win_t *w) {
+    size_t j;
+    if (w) {
+        w->rdr = NULL;
+        fetch_win_reset(w);
+        for (j = 0; j < w->pool.n; j++) { csp_read_destroy(w->pool.a[j]); }
+        kv_destroy(w->pool); kv_destroy(w->a);
+        free(w);
+    }
+}
+
+/*@abstract  Move the window to the query pos.
+@param w     Pointer of fetch_win_t structure whose @p iter has been set.
+@param fp    Pointer of htsFile of the input file.
+@param pos   Pos of the reference sequence. 0-based. Should be no less than previous query pos.
+@param gs    Pointer of global settings.
+@return      0 if success, -1 if error, 1 if the batch is skipped by the reader thread.
+
+@note        After calling this function, @p w->a contains exactly the reads passing filters of fetch_read_decode()
+             whose alignment covers @p pos, i.e. the same reads returned by sam_itr_queryi(pos, pos + 1).
+ */
+static int fetch_win_seek(fetch_win_t *w, htsFile *fp, hts_pos_t pos, global_settings *gs) {
+    csp_read_t *r;
+    size_t j, k;
+    int ret;
+    for (j = k = 0; j < w->a.n; j++) {
+        r = w->a.a[j];
+        if (r->endpos > pos) { w->a.a[k++] = r; }
+        else { kv_push(csp_read_t*, w->pool, r); }
+    }
+    w->a.n = k;
+    while (1) {
+        if (NULL == w->nxt) {
+            if (w->is_eof) { break; }
+            r = w->pool.n ? kv_pop(w->pool) : csp_read_init();
+            if (NULL == r) { return -1; }
+            if (w->rdr) {        // the read has been decoded and filtered by the reader.
+                if ((ret = jring_get(w->rdr, w->id, (void**) &r)) != 0) {
+                    kv_push(csp_read_t*, w->pool, r);
+                    if (ret < 0) { return -1; }
+                    w->is_eof = 1; w->is_skip = (FETCH_RDR_SKIP == ret);
+                    break;
+                }
+            } else {
+                ret = sam_itr_next(fp, w->iter, r->b);
+                csp_prof_tick(w->pf, CSP_STG_DECODE);
+                if (ret < 0) {
+                    kv_push(csp_read_t*, w->pool, r);
+                    if (ret < -1) { return -1; }
+                    w->is_eof = 1;
+                    break;
+                }
+                if ((ret = fetch_read_decode(r, gs, w->pf)) != 0) {
+                    kv_push(csp_read_t*, w->pool, r);
+                    if (ret < 0) { return -1; }
+                    continue;
+                }
+            }
+            w->nxt = r;
+        }
+        if (w->nxt->b->core.pos > pos) { break; }
+        if (w->nxt->endpos > pos) { kv_push(csp_read_t*, w->a, w->nxt); }
+        else { kv_push(csp_read_t*, w->pool, w->nxt); }
+        w->nxt = NULL;
+    }
+    return w->is_skip;
+}
+
+/*@abstract    Get the batch of SNPs that could be swept by one region iterator for each input file.
+@param cid     Pointer of array of chrom indexes of SNPs.
+@param pos     Pointer of array of pos of SNPs.
+@param n       Index of the first SNP of the batch.
+@param m       Size of @p cid and @p pos.
+@return        Index of the SNP next to the last one of the batch.
+
+@note          SNPs in one batch are on the same chrom and sorted by pos, and the gap between two adjacent
+               SNPs is no more than CSP_FETCH_MAX_GAP. The input order of SNPs is never changed, so unsorted
+               SNPs would simply be fetched in smaller batches.
+ */
+static size_t fetch_batch_end(const int32_t *cid, const hts_pos_t *pos, size_t n, size_t m) {
+    size_t e;
+    for (e = n + 1; e < m; e++) {
+        if (pos[e] < pos[e - 1] || pos[e] - pos[e - 1] > CSP_FETCH_MAX_GAP || cid[e] != cid[n]) { break; }
+    }
+    return e;
+}
+
+/*@abstract  Data of the reader thread of csp_fetch_core(), refer to jring_t.
+@param d     Pointer of the thread_data of the worker.
+@param fp    Array of htsFile* of input files, shared with the worker, who does not read them then.
+@param iter  Array of iterators of current batch, one for each input file. All are NULL if the batch is skipped.
+@param n     Index of the first SNP of current batch.
+@param e     Index of the SNP next to the last one of current batch.
+@param s     Pointer of kstring_t.
+@param prof  Counters of the reads decoded by the reader, added into the worker when the reader stops.
+
+@note        The reader splits the SNPs into batches in the same way with csp_fetch_core(), and skips the batch
+             if any iterator could not be created, for which FETCH_RDR_SKIP is passed to the worker.
+ */
+typedef struct {
+    thread_data *d;
+    htsFile **fp;
+    hts_itr_t **iter;
+    size_t n, e;
+    kstring_t s;
+    csp_prof_t prof;
+} fetch_rdr_t;
+
+/*@note  The reader thread should have been stopped. */
+static inline void fetch_rdr_free(fetch_rdr_t *r, int n) {
+    int i;
+    if (r->iter) {
+        for (i = 0; i < n; i++) { if (r->iter[i]) { hts_itr_destroy(r->iter[i]); } }
+        free(r->iter); r->iter = NULL;
+    }
+    ks_free(&r->s);
+}
+
+static void* fetch_rdr_item_init(void) { return csp_read_init(); }
+static void fetch_rdr_item_destroy(void *x) { csp_read_destroy((csp_read_t*) x); }
+
+static int fetch_rdr_next(void *args) {
+    fetch_rdr_t *r = (fetch_rdr_t*) args;
+    thread_data *d = r->d;
+    global_settings *gs = d->gs;
+    const int32_t *cid = gs->pl.cid + d->n;
+    const hts_pos_t *pos = gs->pl.pos + d->n;
+    int i, tid;
+    for (i = 0; i < d->nfs; i++) {
+        if (r->iter[i]) { hts_itr_destroy(r->iter[i]); r->iter[i] = NULL; }
+    }
+    if ((r->n = r->e) >= d->m) { return 1; }
+    r->e = fetch_batch_end(cid, pos, r->n, d->m);
+    for (i = 0; i < d->nfs; i++) {
+        tid = csp_sam_hdr_name2id(d->bfs[i]->hdr, gs->pl.chrom[cid[r->n]], &r->s);
+        ks_clear(&r->s);
+        if (tid < 0 || NULL == (r->iter[i] = sam_itr_queryi(d->bfs[i]->idx, tid, pos[r->n], pos[r->e - 1] + 1))) { break; }
+    }
+    if (i < d->nfs) {
+        for (i = 0; i < d->nfs; i++) {
+            if (r->iter[i]) { hts_itr_destroy(r->iter[i]); r->iter[i] = NULL; }
+        }
+    }
     return 0;
 }
 
+static int fetch_rdr_read(void *args, int i, void *x) {
+    fetch_rdr_t *r = (fetch_rdr_t*) args;
+    csp_read_t *p = (csp_read_t*) x;
+    int ret;
+    if (NULL == r->iter[i]) { return FETCH_RDR_SKIP; }
+    csp_prof_skip(&r->prof);     // the reader could have waited for the worker.
+    while (1) {
+        ret = sam_itr_next(r->fp[i], r->iter[i], p->b);
+        csp_prof_tick(&r->prof, CSP_STG_DECODE);
+        if (ret < 0) { return ret < -1 ? -1 : FETCH_RDR_END; }
+        if ((ret = fetch_read_decode(p, r->d->gs, &r->prof)) == 0) { return 0; }
+        else if (ret < 0) { return -1; }
+    }
+}
+
 /*@abstract    Pileup one SNP with method fetch.
-@param snp     Pointer of snp_t structure.
-@param fs      Pointer of array of pointers to the csp_bam_fs structures.
+@param pos     0-based pos of the SNP.
+@param ale     Packed alleles of the SNP. Refer to snp_ale_pack().
+@param ws      Pointer of array of pointers to the fetch_win_t structures, one for each input file.
 @param fp      Pointer of array of htsFile* of input files.
-@param nfs     Size of @p fs.
+@param nfs     Size of @p ws.
 @param pileup  Pointer of csp_pileup_t structure.
 @param mplp    Pointer of csp_mplp_t structure.
+@param pf      Pointer of the counters and stage timer of the thread.
 @param gs      Pointer of global_settings structure.
 @return        0 if success, -1 if error, 1 if pileup failure without error.
 
 @note          1. This function is mainly called by csp_fetch_core(). Refer to csp_fetch_core() for notes.
                2. The statistics results of all pileuped reads for one SNP is stored in the csp_mplp_t after calling this function.
+               3. The iterators in @p ws should have been created for the batch that the SNP belongs to.
 */
-static int fetch_snp(snp_t *snp, csp_bam_fs **fs, htsFile **fp, int nfs, csp_pileup_t *pileup, csp_mplp_t *mplp, global_settings *gs) 
+static int fetch_snp(hts_pos_t pos, uint8_t ale, fetch_win_t **ws, htsFile **fp, int nfs, csp_pileup_t *pileup, csp_mplp_t *mplp, csp_prof_t *pf, global_settings *gs) 
 {
-    csp_bam_fs *bs = NULL;
-    hts_itr_t *iter = NULL;
-    int i, tid, r, ret, st, state = -1;
-    size_t npushed = 0;
-    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    fetch_win_t *w = NULL;
+    int i, r, ret, st, state = -1;
+    size_t j, npushed = 0;
   #if DEBUG
     size_t npileup = 0;
   #endif
-    mplp->ref_idx = snp->ref ? seq_nt16_char2int(snp->ref) : -1;
-    mplp->alt_idx = snp->alt ? seq_nt16_char2int(snp->alt) : -1;
+    mplp->ref_idx = snp_ale_idx(snp_ale_ref(ale));
+    mplp->alt_idx = snp_ale_idx(snp_ale_alt(ale));
     for (i = 0; i < nfs; i++) {
-        bs = fs[i];
-        tid = csp_sam_hdr_name2id(bs->hdr, snp->chr, s);
-        ks_clear(s);
-        if (tid < 0) { state = 1; goto fail; }
-        if (NULL == (iter = sam_itr_queryi(bs->idx, tid, snp->pos, snp->pos + 1))) { state = 1; goto fail; }
-        while ((ret = sam_itr_next(fp[i], iter, pileup->b)) >= 0) {   // TODO: check if need to be reset in_fp?
+        w = ws[i];
+        r = fetch_win_seek(w, fp[i], pos, gs);
+        csp_prof_tick(pf, w->rdr ? CSP_STG_WAIT : CSP_STG_PILEUP);
+        if (r != 0) { state = r < 0 ? -1 : 1; goto fail; }
+        for (j = 0; j < w->a.n; j++) {
           #if DEBUG
             npileup++;
           #endif
-            if (0 == (st = fetch_read(snp->pos, pileup, gs))) { // no need to reset pileup as the values in it will be immediately overwritten.
-                if (use_barcodes(gs)) { r = csp_mplp_push(pileup, mplp, -1, gs); }
+            st = fetch_read(pos, w->a.a[j], pileup);  // no need to reset pileup as the values in it will be immediately overwritten.
+            csp_prof_tick(pf, CSP_STG_PILEUP);
+            if (0 == st) {
+                if (use_barcodes(gs)) { r = csp_mplp_push(pileup, mplp, w->a.a[j]->idx, gs); }
                 else if (use_sid(gs)) { r = csp_mplp_push(pileup, mplp, i, gs); }
                 else { state = -1; goto fail; }
+                csp_prof_tick(pf, CSP_STG_UMI_CB);
                 if (r < 0) { state = -1; goto fail; }  // else if r == 1: pileuped barcode is not in the input barcode list.
                 else if (r == 0) { npushed++; }
             } else if (st < 0) { state = -1; goto fail; }
+            else { pf->nrej[CSP_REJ_DEL]++; }
         }
-        if (ret < -1) { state = -1; goto fail; } 
-        else { hts_itr_destroy(iter); iter = NULL; }  // TODO: check if could reset iter?
     }
   #if DEBUG
     fprintf(stderr, "[D::%s] before mplp statistics: npileup = %ld; npushed = %ld; the mplp is:\n", __func__, npileup, npushed);
     csp_mplp_print_(stderr, mplp, "\t");
   #endif
     if (npushed < gs->min_count) { state = 1; goto fail; }
-    if ((ret = csp_mplp_stat(mplp, gs)) != 0) { state = (ret > 0) ? 1 : -1; goto fail; }
+    ret = csp_mplp_stat(mplp, gs);
+    csp_prof_tick(pf, CSP_STG_STAT);
+    if (ret != 0) { state = (ret > 0) ? 1 : -1; goto fail; }
   #if DEBUG
     fprintf(stderr, "[D::%s] after mplp statistics: the mplp is:\n", __func__);
     csp_mplp_print_(stderr, mplp, "\t");
   #endif
-    ks_free(s); s = NULL;
     return 0;
   fail:
-    if (s) { ks_free(s); }
-    if (iter) { hts_itr_destroy(iter); }
     return state;
 }
 
@@ -164,20 +405,34 @@ static int fetch_snp(snp_t *snp, csp_bam_fs **fs, htsFile **fp, int nfs, csp_pil
                   -1, undefined errno in this thread.
                   -2, open error in this thread.
              3. This function could be used by Mode1 and Mode3.		 
+             4. Adjacent SNPs on the same chrom are grouped into batches (refer to fetch_batch_end()), the reads
+                covering one batch are fetched only once by one iterator for each input file and then shared by
+                the SNPs in the batch (refer to fetch_win_seek()), instead of querying the index for every SNP.
+             5. If gs->prefetch > 0, a reader thread fetches and decodes the reads of each batch for all input
+                files into ring buffers (refer to fetch_rdr_t), from which fetch_win_seek() takes the reads.
+             6. The reads and SNPs are counted into d->prof, and the stages are timed if gs->is_profile, refer to
+                csp_prof_t.
  */
 static size_t csp_fetch_core(void *args) {
     thread_data *d = (thread_data*) args;
     global_settings *gs = d->gs;
-    snp_t **a = gs->pl.a + d->n;  /* here we use directly the internal variables in snplist_t structure to speed up. */
+    /* here we use directly the columns of snplist_t structure to speed up. */
+    char **chrom = gs->pl.chrom;
+    const int32_t *cid = gs->pl.cid + d->n;
+    const hts_pos_t *pos = gs->pl.pos + d->n;
+    const uint8_t *ale = gs->pl.ale + d->n;
     size_t n = 0;             /* n is the num of SNPs that are successfully processed. */
     csp_bam_fs **bam_fs = d->bfs;
     int nfs = d->nfs;
     htsFile **fp = NULL;
-    int nfp = 0;
     csp_pileup_t *pileup = NULL;
     csp_mplp_t *mplp = NULL;
-    int i, ret;
+    fetch_win_t **ws = NULL;
+    size_t e;                 /* SNPs in [n, e) belong to current batch. */
+    int i, tid, ret, is_batch_ok = 0;
     kstring_t ks = KS_INITIALIZE, *s = &ks;
+    jring_t *rdr = NULL;
+    fetch_rdr_t rd = {.d = d, .fp = NULL, .iter = NULL, .n = 0, .e = 0, .s = KS_INITIALIZE};   // .prof is zeroed.
   #if CSP_FIT_MULTI_SMP
     if (gs->tp_errno) { d->ret = 1; goto fail; }
   #endif
@@ -186,7 +441,7 @@ static size_t csp_fetch_core(void *args) {
     thdata_print(stderr, d);
   #endif
     d->ret = -1;
-    d->ns = d->nr_ad = d->nr_dp = d->nr_oth = 0;
+    d->ns = d->nr_ad = d->nr_dp = d->nr_oth = d->nr_gt = 0;
     /* prepare data and structures. 
     */
   #if CSP_FIT_MULTI_SMP
@@ -204,29 +459,40 @@ static size_t csp_fetch_core(void *args) {
         fprintf(stderr, "[E::%s] failed to open tmp mtx OTH file '%s'.\n", __func__, d->out_mtx_oth->fn);
         d->ret = -2; goto fail;
     }
-    if (jf_open(d->out_vcf_base, NULL) <= 0) { 
+    if (gs->is_out_bcf) {
+        if (thdata_bcf_open(d, use_barcodes(gs) ? gs->nbarcode : gs->nsid) < 0) {
+            fprintf(stderr, "[E::%s] failed to open tmp BCF files '%s'.\n", __func__, d->out_vcf_base->fn);
+            d->ret = -2; goto fail;
+        }
+    } else if (jf_open(d->out_vcf_base, NULL) <= 0) { 
         fprintf(stderr, "[E::%s] failed to open tmp vcf BASE file '%s'.\n", __func__, d->out_vcf_base->fn);
         d->ret = -2; goto fail;
     }
-    if (gs->is_genotype) {
+    if (use_vcf_cells(gs) && ! gs->is_out_bcf) {
         if (jf_open(d->out_vcf_cells, NULL) <= 0) { 
             fprintf(stderr, "[E::%s] failed to open tmp vcf CELLS file '%s'.\n", __func__, d->out_vcf_cells->fn);
             d->ret = -2; goto fail;
         }
     }
+    if (gs->is_sparse_geno) {
+        if (jf_open(d->out_mtx_gt, NULL) <= 0) { 
+            fprintf(stderr, "[E::%s] failed to open tmp mtx GT file '%s'.\n", __func__, d->out_mtx_gt->fn);
+            d->ret = -2; goto fail;
+        }
+        if (jf_open(d->out_mtx_pl, NULL) <= 0) { 
+            fprintf(stderr, "[E::%s] failed to open tmp mtx PL file '%s'.\n", __func__, d->out_mtx_pl->fn);
+            d->ret = -2; goto fail;
+        }
+    }
     /* open input files */ 
   #if CSP_FIT_MULTI_SMP
     if (gs->tp_errno) { d->ret = 1; goto fail; }
   #endif
     fp = (htsFile**) calloc(gs->nin, sizeof(htsFile*));
     if (NULL == fp) { fprintf(stderr, "[E::%s] failed to open input files\n", __func__); goto fail; }                 
-    for (; nfp < gs->nin; ) {
-        if (d->i == 0) {               // the caller has opened input files for Thread-0 
-            fp[nfp] = bam_fs[nfp]->fp; nfp++;
-        } else if (NULL == (fp[nfp] = hts_open(gs->in_fns[nfp], "rb"))) {
-            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfp]);
-            d->ret = -2; goto fail;
-        } else { nfp++; }
+    if (csp_hts_pool_get(d->hp, fp, d->i) < 0) {      // wait here if the other threads hold too many handles.
+        fprintf(stderr, "[E::%s] failed to open input files.\n", __func__);
+        d->ret = -2; goto fail;
     }
     /* prepare mplp for pileup. */
   #if CSP_FIT_MULTI_SMP
@@ -238,14 +504,41 @@ static size_t csp_fetch_core(void *args) {
         fprintf(stderr, "[E::%s] Out of memory allocating csp_pileup_t struct.\n", __func__); 
         goto fail; 
     }
+    if (NULL == (ws = (fetch_win_t**) calloc(nfs, sizeof(fetch_win_t*)))) {
+        fprintf(stderr, "[E::%s] could not allocate fetching windows.\n", __func__);
+        goto fail;
+    }
+    for (i = 0; i < nfs; i++) {
+        if (NULL == (ws[i] = fetch_win_init())) { fprintf(stderr, "[E::%s] could not init fetch_win_t structure.\n", __func__); goto fail; }
+        ws[i]->pf = &d->prof;
+    }
+    if (gs->prefetch > 0) {
+        rd.fp = fp;
+        if (NULL == (rd.iter = (hts_itr_t**) calloc(nfs, sizeof(hts_itr_t*)))) {
+            fprintf(stderr, "[E::%s] could not allocate iterators for the reader.\n", __func__);
+            goto fail;
+        }
+        if (NULL == (rdr = jring_init(nfs, gs->prefetch, fetch_rdr_item_init, fetch_rdr_item_destroy))) {
+            fprintf(stderr, "[E::%s] failed to create the ring buffers for prefetching.\n", __func__);
+            goto fail;
+        }
+        for (i = 0; i < nfs; i++) { ws[i]->rdr = rdr; ws[i]->id = i; ws[i]->is_eof = 1; }   // nothing to drain for the first batch.
+        csp_prof_start(&rd.prof, gs->is_profile);
+        if (jring_start(rdr, fetch_rdr_read, fetch_rdr_next, &rd) < 0) {
+            fprintf(stderr, "[E::%s] failed to start the reader thread.\n", __func__);
+            goto fail;
+        }
+    }
   #if VERBOSE
     double pos_m, pos_n, pos_r, nprints = 50;
     pos_n = pos_m = d->m / nprints;
     pos_r = 100.0 / d->m;
   #endif
     /* pileup each SNP. 
+       SNPs are processed batch by batch, each batch is swept by one region iterator per input file.
     */
-    for (; n < d->m; n++) {
+    csp_prof_start(&d->prof, gs->is_profile);
+    for (e = 0; n < d->m; n++) {
       #if CSP_FIT_MULTI_SMP
         if (gs->tp_errno) { d->ret = 1; goto fail; }
       #endif
@@ -256,42 +549,75 @@ static size_t csp_fetch_core(void *args) {
             pos_n = pos_n <= d->m ? pos_n : d->m;
         }
       #endif
+        if (n >= e) {     /* start a new batch. */
+            e = fetch_batch_end(cid, pos, n, d->m);
+            for (i = 0, is_batch_ok = 1; i < nfs; i++) {
+                if (fetch_win_reset(ws[i]) < 0) {
+                    fprintf(stderr, "[E::%s] failed to reset the window of batch (%s:%ld)\n", __func__, chrom[cid[n]], pos[n] + 1);
+                    goto fail;
+                }
+                if (is_batch_ok && NULL == rdr) {    // else: the batch is checked by the reader, refer to fetch_rdr_next().
+                    tid = csp_sam_hdr_name2id(bam_fs[i]->hdr, chrom[cid[n]], s);
+                    ks_clear(s);
+                    if (tid < 0 || NULL == (ws[i]->iter = sam_itr_queryi(bam_fs[i]->idx, tid, pos[n], pos[e - 1] + 1))) {
+                        is_batch_ok = 0;
+                    }
+                }
+            }
+        }
       #if DEBUG
         fputc('\n', stderr);
-        fprintf(stderr, "[D::%s] chr = %s; pos = %ld; ref = %c; alt = %c;\n", __func__, a[n]->chr, a[n]->pos + 1, a[n]->ref, a[n]->alt);
+        fprintf(stderr, "[D::%s] chr = %s; pos = %ld; ref = %d; alt = %d;\n", __func__, chrom[cid[n]], pos[n] + 1, \
+            snp_ale_idx(snp_ale_ref(ale[n])), snp_ale_idx(snp_ale_alt(ale[n])));
       #endif
-        if ((ret = fetch_snp(a[n], bam_fs, fp, nfs, pileup, mplp, gs)) != 0) {
+        d->prof.nsnp++;
+        if ((ret = is_batch_ok ? fetch_snp(pos[n], ale[n], ws, fp, nfs, pileup, mplp, &d->prof, gs) : 1) != 0) {
             if (ret < 0) {
-                fprintf(stderr, "[E::%s] failed to pileup snp (%s:%ld)\n", __func__, a[n]->chr, a[n]->pos + 1);
+                fprintf(stderr, "[E::%s] failed to pileup snp (%s:%ld)\n", __func__, chrom[cid[n]], pos[n] + 1);
                 goto fail; 
             }
           #if DEBUG
-            fprintf(stderr, "[W::%s] snp (%s:%ld) filtered, error code = %d\n", __func__, a[n]->chr, a[n]->pos + 1, ret);
+            fprintf(stderr, "[W::%s] snp (%s:%ld) filtered, error code = %d\n", __func__, chrom[cid[n]], pos[n] + 1, ret);
           #endif
             csp_mplp_reset(mplp); ks_clear(s);
             continue;
-        } else { d->ns++; }
-        d->nr_ad += mplp->nr_ad; d->nr_dp += mplp->nr_dp; d->nr_oth += mplp->nr_oth;
+        } else { d->ns++; d->prof.npass++; }
+        d->nr_ad += mplp->nr_ad; d->nr_dp += mplp->nr_dp; d->nr_oth += mplp->nr_oth; d->nr_gt += mplp->nr_gt;
         /* output mplp to mtx and vcf. */
-        csp_mplp_to_mtx(mplp, d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->ns);
-        ksprintf(s, "%s\t%ld\t.\t%c\t%c\t.\tPASS\tAD=%ld;DP=%ld;OTH=%ld", a[n]->chr, a[n]->pos + 1, \
-                seq_nt16_int2char(mplp->ref_idx), seq_nt16_int2char(mplp->alt_idx), mplp->ad, mplp->dp, mplp->oth);
-        jf_puts(ks_str(s), d->out_vcf_base); jf_putc('\n', d->out_vcf_base);
-        if (gs->is_genotype) {
-            jf_puts(ks_str(s), d->out_vcf_cells);
-            jf_puts("\tGT:AD:DP:OTH:PL:ALL", d->out_vcf_cells);
-            csp_mplp_to_vcf(mplp, d->out_vcf_cells);
-            jf_putc('\n', d->out_vcf_cells);
+        if (thdata_output_snp(d, mplp, chrom[cid[n]], pos[n], s) < 0) {
+            fprintf(stderr, "[E::%s] failed to output snp (%s:%ld)\n", __func__, chrom[cid[n]], pos[n] + 1);
+            goto fail;
+        }
+        if (d->wrt && thdata_stream_push(d, 0) < 0) {
+            fprintf(stderr, "[E::%s] failed to hand the output to the writer.\n", __func__);
+            goto fail;
         }
         csp_mplp_reset(mplp); ks_clear(s);
+        csp_prof_tick(&d->prof, CSP_STG_OUTPUT);
     }
     // clean
     ks_free(s); s = NULL;
     jf_close(d->out_mtx_ad); jf_close(d->out_mtx_dp); jf_close(d->out_mtx_oth);
-    jf_close(d->out_vcf_base); if (gs->is_genotype) { jf_close(d->out_vcf_cells); }
-    if (d->i > 0) {
-        for (i = 0; i < nfp; i++) { hts_close(fp[i]); }
-    } free(fp); fp = NULL;
+    if (gs->is_out_bcf) {
+        if (thdata_bcf_close(d) < 0) { fprintf(stderr, "[E::%s] failed to close tmp BCF files.\n", __func__); d->ret = -2; goto fail; }
+    } else { jf_close(d->out_vcf_base); if (use_vcf_cells(gs)) { jf_close(d->out_vcf_cells); } }
+    if (gs->is_sparse_geno) { jf_close(d->out_mtx_gt); jf_close(d->out_mtx_pl); }
+    if (d->ck && csp_ckpt_put(d->ck, d) < 0) {
+        fprintf(stderr, "[E::%s] failed to checkpoint the unit.\n", __func__);
+        goto fail;
+    }
+    if (d->wrt && thdata_stream_push(d, 1) < 0) {
+        fprintf(stderr, "[E::%s] failed to hand the output to the writer.\n", __func__);
+        goto fail;
+    }
+    if (rdr) {
+        if (jring_stop(rdr) < 0) { fprintf(stderr, "[E::%s] the reader thread failed.\n", __func__); goto fail; }
+        thdata_add_rdr_stat(d, rdr); csp_prof_add(&d->prof, &rd.prof);
+        jring_destroy(rdr); rdr = NULL;
+    } fetch_rdr_free(&rd, nfs);
+    csp_hts_pool_put(d->hp, fp); free(fp); fp = NULL;
+    for (i = 0; i < nfs; i++) { fetch_win_destroy(ws[i]); }
+    free(ws); ws = NULL;
     csp_pileup_destroy(pileup);
     csp_mplp_destroy(mplp);
     d->ret = 0;
@@ -305,12 +631,19 @@ static size_t csp_fetch_core(void *args) {
     if (jf_isopen(d->out_mtx_ad)) { jf_close(d->out_mtx_ad); }
     if (jf_isopen(d->out_mtx_dp)) { jf_close(d->out_mtx_dp); }
     if (jf_isopen(d->out_mtx_oth)) { jf_close(d->out_mtx_oth); }
+    if (gs->is_out_bcf) { thdata_bcf_close(d); }
     if (jf_isopen(d->out_vcf_base)) { jf_close(d->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(d->out_vcf_cells)) { jf_close(d->out_vcf_cells); }
-    if (fp) {
-        if (d->i > 0) {
-            for (i = 0; i < nfp; i++) { hts_close(fp[i]); }
-        } free(fp);
+    if (use_vcf_cells(gs) && jf_isopen(d->out_vcf_cells)) { jf_close(d->out_vcf_cells); }
+    if (gs->is_sparse_geno && jf_isopen(d->out_mtx_gt)) { jf_close(d->out_mtx_gt); }
+    if (gs->is_sparse_geno && jf_isopen(d->out_mtx_pl)) { jf_close(d->out_mtx_pl); }
+    if (d->wrt) { thdata_stream_fail(d); }
+    if (rdr) { jring_destroy(rdr); }    // stop the reader before the input files are put back.
+    fetch_rdr_free(&rd, nfs);
+    csp_hts_pool_pass(d->hp, d->i);     // in case that the handles have not been taken.
+    if (fp) { csp_hts_pool_put(d->hp, fp); free(fp); }
+    if (ws) {
+        for (i = 0; i < nfs; i++) { fetch_win_destroy(ws[i]); }
+        free(ws);
     }
     if (pileup) csp_pileup_destroy(pileup);
     if (mplp) { csp_mplp_destroy(mplp); }
@@ -327,7 +660,7 @@ static inline int infer_nthread(global_settings *gs) {
     if (gs->tp_ntry == 0) { return gs->mthread; }  // the first time to try, just use the value user specified
     if (gs->tp_ntry == 1) { 
         int n0 = 3;      // FIXME!!! the initial files opened by this program. eg. the program itself and lz, lhts etc.
-        int n = gs->nin + 4 + gs->is_genotype;    // 4 is the 4 output files: base.vcf, ad.mtx, dp.mtx and oth.mtx
+        int n = gs->nin + 4 + gs->is_genotype + gs->is_sparse_geno;    // 4 is the 4 output files: base.vcf, ad.mtx, dp.mtx and oth.mtx
         int m = (gs->tp_max_open - n0) / n;
         if (m >= gs->mthread) { m = gs->mthread - 1; }
         if (m < 1) { m = 1; }
@@ -360,33 +693,68 @@ int csp_fetch(global_settings *gs) {
     csp_bam_fs **bam_fs = NULL;       /* use array instead of single element to compatible with multi-input-files. */
     int nfs = 0;
     csp_bam_fs *bs = NULL;
+    csp_hts_pool_t *hp = NULL;
+    csp_writer_t *wrt = NULL;
+    csp_ckpt_t *ck = NULL;
+    int is_retry = 0;
+    double t0 = 0, t_run = 0;
     int i, ret;
-    size_t npos, mpos, rpos, tpos, ns, nr_ad, nr_dp, nr_oth, ns_merge, nr_merge;
+    size_t npos, mpos, rpos, tpos, pbeg, pend, ns, nr_ad, nr_dp, nr_oth, nr_gt;
     jfile_t **out_tmp_mtx_ad, **out_tmp_mtx_dp, **out_tmp_mtx_oth, **out_tmp_vcf_base, **out_tmp_vcf_cells;
+    jfile_t **out_tmp_mtx_gt, **out_tmp_mtx_pl;
     out_tmp_mtx_ad = out_tmp_mtx_dp = out_tmp_mtx_oth = out_tmp_vcf_base = out_tmp_vcf_cells = NULL;
-    /* calc number of threads and number of SNPs for each thread. */
-    mtd = min2(snplist_size(gs->pl), nthread);
-    mpos = snplist_size(gs->pl) / mtd;
-    rpos = snplist_size(gs->pl) - mpos * mtd;     // number of remaining positions
+    out_tmp_mtx_gt = out_tmp_mtx_pl = NULL;
+    /* the SNPs are split into gs->nshard contiguous shards of (almost) the same size, and only the SNPs
+       [pbeg, pend) of shard gs->shard are processed, refer to --shard. */
+    pbeg = snplist_size(gs->pl) * gs->shard / gs->nshard;
+    pend = snplist_size(gs->pl) * (gs->shard + 1) / gs->nshard;
+    if (gs->nshard > 1) {
+        fprintf(stderr, "[I::%s] shard %d/%d: fetching %ld of %ld SNPs.\n", __func__, gs->shard + 1, gs->nshard, \
+                pend - pbeg, snplist_size(gs->pl));
+    }
+    /* calc number of work units and number of SNPs for each unit.
+       The SNPs are split into more units than threads, which are queued in the thread pool and taken by
+       whichever thread is idle, so that the threads processing dense regions would not delay the others.
+       The units are merged in order, hence the output is the same for any number of threads. */
+    mtd = nthread > 1 ? max2(min2(pend - pbeg, nthread * CSP_FETCH_UNITS_PER_THREAD), 1) : 1;
+    mpos = (pend - pbeg) / mtd;
+    rpos = (pend - pbeg) - mpos * mtd;     // number of remaining positions
     /* create output tmp filenames. */
-    if (NULL == (out_tmp_mtx_ad = create_tmp_files(gs->out_mtx_ad, mtd, CSP_TMP_ZIP))) {
+    if (NULL == (out_tmp_mtx_ad = gs->is_out_stream ? create_mem_files(gs->out_mtx_ad, mtd) : \
+                     create_tmp_files(gs->out_mtx_ad, mtd, CSP_TMP_MTX_ZIP))) {
         fprintf(stderr, "[E::%s] fail to create tmp files for mtx_AD.\n", __func__);
         goto fail;
     }
-    if (NULL == (out_tmp_mtx_dp = create_tmp_files(gs->out_mtx_dp, mtd, CSP_TMP_ZIP))) {
+    if (NULL == (out_tmp_mtx_dp = gs->is_out_stream ? create_mem_files(gs->out_mtx_dp, mtd) : \
+                     create_tmp_files(gs->out_mtx_dp, mtd, CSP_TMP_MTX_ZIP))) {
         fprintf(stderr, "[E::%s] fail to create tmp files for mtx_DP.\n", __func__);
         goto fail;
     }
-    if (NULL == (out_tmp_mtx_oth = create_tmp_files(gs->out_mtx_oth, mtd, CSP_TMP_ZIP))) {
+    if (NULL == (out_tmp_mtx_oth = gs->is_out_stream ? create_mem_files(gs->out_mtx_oth, mtd) : \
+                     create_tmp_files(gs->out_mtx_oth, mtd, CSP_TMP_MTX_ZIP))) {
         fprintf(stderr, "[E::%s] fail to create tmp files for mtx_OTH.\n", __func__);
         goto fail;
     }
-    if (mtd > 1) {
-        if (NULL == (out_tmp_vcf_base = create_tmp_files(gs->out_vcf_base, mtd, CSP_TMP_ZIP))) {
+    if (gs->is_sparse_geno) {
+        if (NULL == (out_tmp_mtx_gt = gs->is_out_stream ? create_mem_files(gs->out_mtx_gt, mtd) : \
+                     create_tmp_files(gs->out_mtx_gt, mtd, CSP_TMP_MTX_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for mtx_GT.\n", __func__);
+            goto fail;
+        }
+        if (NULL == (out_tmp_mtx_pl = gs->is_out_stream ? create_mem_files(gs->out_mtx_pl, mtd) : \
+                     create_tmp_files(gs->out_mtx_pl, mtd, CSP_TMP_MTX_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for mtx_PL.\n", __func__);
+            goto fail;
+        }
+    }
+    if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {     // the BCF records are always written into tmp files (or memory), refer to output_bcf().
+        if (NULL == (out_tmp_vcf_base = gs->is_out_stream ? create_mem_files(gs->out_vcf_base, mtd) : \
+                     create_tmp_files(gs->out_vcf_base, mtd, CSP_TMP_ZIP))) {
             fprintf(stderr, "[E::%s] fail to create tmp files for vcf_BASE.\n", __func__);
             goto fail;
         }
-        if (gs->is_genotype && NULL == (out_tmp_vcf_cells = create_tmp_files(gs->out_vcf_cells, mtd, CSP_TMP_ZIP))) {
+        if (use_vcf_cells(gs) && NULL == (out_tmp_vcf_cells = gs->is_out_stream ? \
+                create_mem_files(gs->out_vcf_cells, mtd) : create_tmp_files(gs->out_vcf_cells, mtd, CSP_TMP_ZIP))) {
             fprintf(stderr, "[E::%s] fail to create tmp files for vcf_CELLS.\n", __func__);
             goto fail;
         }
@@ -396,7 +764,7 @@ int csp_fetch(global_settings *gs) {
     if (NULL == bam_fs) { fprintf(stderr, "[E::%s] could not initialize csp_bam_fs array.\n", __func__); goto fail; }
     for (nfs = 0; nfs < gs->nin; nfs++) {
         if (NULL == (bs = csp_bam_fs_init())) { fprintf(stderr, "[E::%s] failed to create csp_bam_fs.\n", __func__); goto fail; }
-        if (NULL == (bs->fp = hts_open(gs->in_fns[nfs], "rb"))) {
+        if (NULL == (bs->fp = csp_sam_open(gs->in_fns[nfs], csp_sam_fields(gs), gs->htp))) {
             fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfs]); 
             goto fail;
         }
@@ -410,27 +778,54 @@ int csp_fetch(global_settings *gs) {
         }
         bam_fs[nfs] = bs;
     } bs = NULL;
+    if (gs->is_out_bcf && NULL == gs->bcf_hdr_base && csp_bcf_hdr_build(gs, bam_fs[0]->hdr, gs->pl.chrom, gs->pl.nchrom) < 0) {
+        fprintf(stderr, "[E::%s] failed to build the BCF headers.\n", __func__);
+        goto fail;
+    }
+    /* move the input handles into the pool shared by threads. */
+    if (NULL == (hp = csp_hts_pool_init(gs->in_fns, nfs, csp_hts_pool_size(gs, min2(gs->nthread, mtd)), \
+                     csp_sam_fields(gs), gs->htp, bam_fs, gs->is_out_stream ? mtd : 0))) {
+        fprintf(stderr, "[E::%s] could not create the pool of input files.\n", __func__);
+        goto fail;
+    }
+    /* start the writer, into which the threads hand their output in memory. */
+    if (gs->is_out_stream && NULL == (wrt = csp_writer_init(gs, mtd))) {
+        fprintf(stderr, "[E::%s] could not start the writer of the output files.\n", __func__);
+        goto fail;
+    }
     /* prepare data for thread pool. */
     td = (thread_data**) calloc(mtd, sizeof(thread_data*));
     if (NULL == td) { fprintf(stderr, "[E::%s] could not initialize the array of thread_data structure.\n", __func__); goto fail; }
-    for (npos = 0; ntd < mtd; ntd++, npos += tpos) {
+    for (npos = pbeg; ntd < mtd; ntd++, npos += tpos) {
         if (NULL == (d = thdata_init())) {
             fprintf(stderr, "[E::%s] could not initialize the thread_data structure.\n", __func__); 
             goto fail; 
         }
         tpos = ntd < rpos ? mpos + 1 : mpos;
-        d->i = ntd; d->gs = gs; d->bfs = bam_fs; d->nfs = nfs; d->n = npos; d->m = tpos;
+        d->i = ntd; d->gs = gs; d->bfs = bam_fs; d->nfs = nfs; d->hp = hp; d->wrt = wrt; d->n = npos; d->m = tpos;
         d->out_mtx_ad = out_tmp_mtx_ad[ntd]; d->out_mtx_dp = out_tmp_mtx_dp[ntd]; d->out_mtx_oth = out_tmp_mtx_oth[ntd];
-        if (mtd > 1) {
-            d->out_vcf_base = out_tmp_vcf_base[ntd]; d->out_vcf_cells = gs->is_genotype ? out_tmp_vcf_cells[ntd] : NULL;
+        if (gs->is_sparse_geno) { d->out_mtx_gt = out_tmp_mtx_gt[ntd]; d->out_mtx_pl = out_tmp_mtx_pl[ntd]; }
+        if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {
+            d->out_vcf_base = out_tmp_vcf_base[ntd]; d->out_vcf_cells = use_vcf_cells(gs) ? out_tmp_vcf_cells[ntd] : NULL;
         } else {
-            d->out_vcf_base = gs->out_vcf_base; d->out_vcf_cells = gs->is_genotype ? gs->out_vcf_cells : NULL;
+            d->out_vcf_base = gs->out_vcf_base; d->out_vcf_cells = use_vcf_cells(gs) ? gs->out_vcf_cells : NULL;
         }
         td[ntd] = d;
     } d = NULL;
+    /* checkpoint the units, whose tmp files are then kept in the output dir if the run fails, refer to --resume.
+       With one unit, the vcf is written into the output file directly, hence not checkpointed. */
+    if (mtd > 1 && NULL == wrt) {
+        if (NULL == (ck = csp_ckpt_init(gs, "fetch", td, mtd))) {
+            fprintf(stderr, "[E::%s] could not create the checkpoint.\n", __func__);
+            goto fail;
+        }
+        for (i = 0; i < mtd; i++) { td[i]->ck = ck; }
+    }
     // run the threads
+    t0 = csp_prof_now();
     if (mtd > 1) {
         for (i = 0; i < ntd; i++) {
+            if (ck && ck->is_done[i]) { continue; }     // finished by the previous run.
             if (thpool_add_work(gs->tp, (void*) csp_fetch_core, td[i]) < 0) {
                 fprintf(stderr, "[E::%s] could not add thread work (No. %d)\n", __func__, i);
                 goto fail;
@@ -443,46 +838,76 @@ int csp_fetch(global_settings *gs) {
     for (i = 0; i < mtd; i++) { fprintf(stderr, "[D::%s] ret of thread-%d is %d\n", __func__, i, td[i]->ret); }
   #endif
     for (i = 0; i < mtd; i++) { if (td[i]->ret < 0) goto fail; }
-    /* merge tmp files. */
-    ns = nr_ad = nr_dp = nr_oth = 0;
-    for (i = 0; i < mtd; i++) {
-        nr_ad += td[i]->nr_ad; nr_dp += td[i]->nr_dp; nr_oth += td[i]->nr_oth;
-        ns += td[i]->ns;
-    }
-    if (jf_open(gs->out_mtx_ad, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx AD.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_ad, "%ld\t%d\t%ld\n", ns, nsample, nr_ad);
-    merge_mtx(gs->out_mtx_ad, out_tmp_mtx_ad, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_ad) { fprintf(stderr, "[E::%s] failed to merge mtx AD.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_ad);
-
-    if (jf_open(gs->out_mtx_dp, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx DP.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_dp, "%ld\t%d\t%ld\n", ns, nsample, nr_dp);
-    merge_mtx(gs->out_mtx_dp, out_tmp_mtx_dp, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_dp) { fprintf(stderr, "[E::%s] failed to merge mtx DP.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_dp);
-
-    if (jf_open(gs->out_mtx_oth, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx OTH.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_oth, "%ld\t%d\t%ld\n", ns, nsample, nr_oth);
-    merge_mtx(gs->out_mtx_oth, out_tmp_mtx_oth, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_oth) { fprintf(stderr, "[E::%s] failed to merge mtx OTH.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_oth);
-
-    if (mtd > 1) {
-        if (jf_open(gs->out_vcf_base, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf BASE.\n", __func__); goto fail; }
-        merge_vcf(gs->out_vcf_base, out_tmp_vcf_base, mtd, &ret);
-        if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf BASE.\n", __func__); goto fail; }
-        jf_close(gs->out_vcf_base);
+    if (gs->prefetch > 0) { thdata_print_rdr_stat(stderr, td, mtd, gs->prefetch); }
+    t_run = csp_prof_now() - t0; t0 = csp_prof_now();
+    /* merge tmp files, or wait for the writer, which has written the output while the threads run. */
+    if (wrt) {
+        if ((ret = csp_writer_finish(wrt)) < 0) {
+            fprintf(stderr, "[E::%s] failed to write the output.\n", __func__);
+            goto fail;
+        } else if (ret > 0) { fprintf(stderr, "[W::%s] failed to index the BCF files, the SNPs may be unsorted.\n", __func__); }
+    } else {
+        ns = nr_ad = nr_dp = nr_oth = nr_gt = 0;
+        for (i = 0; i < mtd; i++) {
+            nr_ad += td[i]->nr_ad; nr_dp += td[i]->nr_dp; nr_oth += td[i]->nr_oth; nr_gt += td[i]->nr_gt;
+            ns += td[i]->ns;
+        }
+        if (output_mtx(gs->out_mtx_ad, out_tmp_mtx_ad, mtd, 1, ns, nsample, nr_ad) < 0) {
+            fprintf(stderr, "[E::%s] failed to merge mtx AD.\n", __func__);
+            goto fail;
+        }
+        if (output_mtx(gs->out_mtx_dp, out_tmp_mtx_dp, mtd, 1, ns, nsample, nr_dp) < 0) {
+            fprintf(stderr, "[E::%s] failed to merge mtx DP.\n", __func__);
+            goto fail;
+        }
+        if (output_mtx(gs->out_mtx_oth, out_tmp_mtx_oth, mtd, 1, ns, nsample, nr_oth) < 0) {
+            fprintf(stderr, "[E::%s] failed to merge mtx OTH.\n", __func__);
+            goto fail;
+        }
+        if (gs->is_sparse_geno) {
+            if (output_mtx(gs->out_mtx_gt, out_tmp_mtx_gt, mtd, 1, ns, nsample, nr_gt) < 0) {
+                fprintf(stderr, "[E::%s] failed to merge mtx GT.\n", __func__);
+                goto fail;
+            }
+            if (output_mtx(gs->out_mtx_pl, out_tmp_mtx_pl, mtd, gs->double_gl ? 5 : 3, ns, nsample, nr_gt) < 0) {
+                fprintf(stderr, "[E::%s] failed to merge mtx PL.\n", __func__);
+                goto fail;
+            }
+        }
+        if (gs->is_out_bcf) {
+            if ((ret = output_bcf(gs->out_vcf_base, gs->bcf_hdr_base, out_tmp_vcf_base, mtd, gs->nthread)) < 0) {
+                fprintf(stderr, "[E::%s] failed to merge BCF BASE.\n", __func__);
+                goto fail;
+            } else if (ret > 0) { fprintf(stderr, "[W::%s] failed to index BCF BASE, the SNPs may be unsorted.\n", __func__); }
+            if (use_vcf_cells(gs)) {
+                if ((ret = output_bcf(gs->out_vcf_cells, gs->bcf_hdr_cells, out_tmp_vcf_cells, mtd, gs->nthread)) < 0) {
+                    fprintf(stderr, "[E::%s] failed to merge BCF CELLS.\n", __func__);
+                    goto fail;
+                } else if (ret > 0) { fprintf(stderr, "[W::%s] failed to index BCF CELLS, the SNPs may be unsorted.\n", __func__); }
+            }
+        } else if (mtd > 1) {
+            if (jf_open(gs->out_vcf_base, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf BASE.\n", __func__); goto fail; }
+            merge_vcf(gs->out_vcf_base, out_tmp_vcf_base, mtd, &ret);
+            if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf BASE.\n", __func__); goto fail; }
+            jf_close(gs->out_vcf_base);
 
-        if (gs->is_genotype) {
-            if (jf_open(gs->out_vcf_cells, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf CELLS.\n", __func__); goto fail; }
-            merge_vcf(gs->out_vcf_cells, out_tmp_vcf_cells, mtd, &ret);
-            if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf CELLS.\n", __func__); goto fail; }    
-            jf_close(gs->out_vcf_cells);     
+            if (use_vcf_cells(gs)) {
+                if (jf_open(gs->out_vcf_cells, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf CELLS.\n", __func__); goto fail; }
+                merge_vcf(gs->out_vcf_cells, out_tmp_vcf_cells, mtd, &ret);
+                if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf CELLS.\n", __func__); goto fail; }    
+                jf_close(gs->out_vcf_cells);     
+            }
         }
     }
+    if (gs->is_profile && csp_prof_output(gs, "fetch", td, mtd, t_run, csp_prof_now() - t0) < 0) {
+        fprintf(stderr, "[W::%s] failed to output the profile.\n", __func__);
+    }
     /* clean */
+    csp_ckpt_destroy(ck, NULL); ck = NULL;
+    csp_writer_destroy(wrt); wrt = NULL;
     for (i = 0; i < mtd; i++) { thdata_destroy(td[i]); }
     free(td); td = NULL;
+    csp_hts_pool_destroy(hp); hp = NULL;
     for (i = 0; i < nfs; i++) { csp_bam_fs_destroy(bam_fs[i]); }
     free(bam_fs); bam_fs = NULL;
     if (destroy_tmp_files(out_tmp_mtx_ad, mtd) < 0) {
@@ -494,11 +919,19 @@ int csp_fetch(global_settings *gs) {
     if (destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
         fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
     } out_tmp_mtx_oth = NULL;
-    if (mtd > 1) {
+    if (gs->is_sparse_geno) {
+        if (destroy_tmp_files(out_tmp_mtx_gt, mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp mtx GT files.\n", __func__);
+        } out_tmp_mtx_gt = NULL;
+        if (destroy_tmp_files(out_tmp_mtx_pl, mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp mtx PL files.\n", __func__);
+        } out_tmp_mtx_pl = NULL;
+    }
+    if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {
         if (destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
             fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
         } out_tmp_vcf_base = NULL;
-        if (gs->is_genotype) {         
+        if (use_vcf_cells(gs)) {         
             if (destroy_tmp_files(out_tmp_vcf_cells, mtd) < 0) {
                 fprintf(stderr, "[W::%s] failed to remove tmp vcf CELLS files.\n", __func__);
             } out_tmp_vcf_cells = NULL;
@@ -506,6 +939,11 @@ int csp_fetch(global_settings *gs) {
     }
     return 0;
   fail:
+  #if CSP_FIT_MULTI_SMP
+    is_retry = gs->tp_errno & TP_EMFILE && ! (gs->tp_errno & TP_EUNDEF) && gs->nthread > 1;
+  #endif
+    if (ck) { csp_ckpt_destroy(ck, is_retry ? NULL : td); }  // the units would be re-split when re-trying.
+    if (wrt) { csp_writer_destroy(wrt); }    // the output files are truncated to the headers.
     if (td) {
         for (i = 0; i < mtd; i++) { thdata_destroy(td[i]); }
         free(td);
@@ -516,6 +954,7 @@ int csp_fetch(global_settings *gs) {
         free(bam_fs);
     }
     if (bs) { csp_bam_fs_destroy(bs); }
+    if (hp) { csp_hts_pool_destroy(hp); }
     if (out_tmp_mtx_ad && destroy_tmp_files(out_tmp_mtx_ad, mtd) < 0) {
         fprintf(stderr, "[W::%s] failed to remove tmp mtx AD files.\n", __func__);
     }
@@ -525,7 +964,13 @@ int csp_fetch(global_settings *gs) {
     if (out_tmp_mtx_oth && destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
         fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
     }
-    if (mtd > 1) {
+    if (out_tmp_mtx_gt && destroy_tmp_files(out_tmp_mtx_gt, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp mtx GT files.\n", __func__);
+    }
+    if (out_tmp_mtx_pl && destroy_tmp_files(out_tmp_mtx_pl, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp mtx PL files.\n", __func__);
+    }
+    if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {
         if (out_tmp_vcf_base && destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
             fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
         }
@@ -537,9 +982,11 @@ int csp_fetch(global_settings *gs) {
     if (jf_isopen(gs->out_mtx_dp)) { jf_close(gs->out_mtx_dp); }
     if (jf_isopen(gs->out_mtx_oth)) { jf_close(gs->out_mtx_oth); }
     if (jf_isopen(gs->out_vcf_base)) { jf_close(gs->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(gs->out_vcf_cells)) { jf_close(gs->out_vcf_cells); }
+    if (use_vcf_cells(gs) && jf_isopen(gs->out_vcf_cells)) { jf_close(gs->out_vcf_cells); }
+    if (gs->is_sparse_geno && jf_isopen(gs->out_mtx_gt)) { jf_close(gs->out_mtx_gt); }
+    if (gs->is_sparse_geno && jf_isopen(gs->out_mtx_pl)) { jf_close(gs->out_mtx_pl); }
   #if CSP_FIT_MULTI_SMP
-    if (gs->tp_errno & TP_EMFILE && ! (gs->tp_errno & TP_EUNDEF) && gs->nthread > 1) {
+    if (is_retry) {
         fprintf(stderr, "================================================================================\n");
         fprintf(stderr, "[W::%s] Last try (nthreads = %d) failed due to the issue of too many open files.\n",
                          __func__, gs->nthread);
@@ -10,6 +10,8 @@
 #include "config.h"
 #include "csp.h"
 #include "jfile.h"
+#include "jnumeric.h"
+#include "jring.h"
 #include "jsam.h"
 #include "jstring.h"
 #include "mplp.h"
@@ -19,13 +21,26 @@
     #include <errno.h>
 #endif
 
-/* auxiliary data used by @func mp_func. */
+/* auxiliary data used by @func mp_func. 
+@param tc     Cursor of the targets of the query chrom, used only when use_target(gs).
+@param rdr    Ring buffers filled by the reader thread, NULL if not prefetching. Refer to mp_rdr_t.
+@param id     Index of the input file, i.e. the stream of @p rdr.
+@param spare  The bam1_t exchanged with the ring. Refer to jring_get().
+@param is_eof If the end of current chrom has been taken from @p rdr.
+@param pf     Pointer of the counters into which the reads read by mp_read() are counted.
+ */
 typedef struct {
     htsFile *fp;
     //sam_hdr_t *hdr;
     hts_itr_t *itr;
     const char *chrom;
     global_settings *gs;
+    snp_tcur_t tc;
+    jring_t *rdr;
+    int id;
+    bam1_t *spare;
+    int is_eof;
+    csp_prof_t *pf;
 } mp_aux_t;
 
 /*@return   Pointer to mp_aux_t structure if success, NULL otherwise. */
@@ -33,42 +48,171 @@ static inline mp_aux_t* mp_aux_init(void) {
     return (mp_aux_t*) calloc(1, sizeof(mp_aux_t));
 }
 
-/*@note  As all elements are from external sources so no need to be freed/reset. */
+/*@note  As all elements except @p spare are from external sources so no need to be freed/reset. */
 static inline void mp_aux_destroy(mp_aux_t *p) {
-    if (p) { free(p); }
+    if (p) { 
+        if (p->spare) { bam_destroy1(p->spare); }
+        free(p);
+    }
+}
+
+static inline void mp_aux_reset(mp_aux_t *p) { p->is_eof = 0; }
+
+/*@abstract  Take and drop the reads of current chrom left in the ring buffer, for which mpileup was finished early.
+@return      0 if success, -1 otherwise.
+ */
+static inline int mp_aux_drain(mp_aux_t *p) {
+    int ret;
+    while (p->rdr && ! p->is_eof) {
+        if ((ret = jring_get(p->rdr, p->id, (void**) &p->spare)) < 0) { return -1; }
+        else if (ret > 0) { p->is_eof = 1; }
+    }
+    return 0;
+}
+
+/*@abstract  Filter the read by its alignment and by the targets, refer to mp_read().
+@return      0 if passing, 1 if not, -1 if there are no more targets.
+ */
+static inline int mp_read_filter(mp_aux_t *dat, bam1_t *b) {
+    global_settings *gs = dat->gs;
+    csp_prof_t *pf = dat->pf;
+    bam1_core_t *c = &(b->core);
+    hts_pos_t tpos;
+    if (c->tid < 0 || c->flag & BAM_FUNMAP) { pf->nrej[CSP_REJ_UNMAP]++; return 1; }
+    if (c->qual < gs->min_mapq) { pf->nrej[CSP_REJ_MAPQ]++; return 1; }
+    //if (c->flag > gs->max_flag) { return 1; }
+    if (gs->rflag_filter && gs->rflag_filter & c->flag ) { pf->nrej[CSP_REJ_FLAG]++; return 1; }
+    if (gs->rflag_require && ! (gs->rflag_require & c->flag)) { pf->nrej[CSP_REJ_FLAG]++; return 1; }
+    if (gs->no_orphan && c->flag & BAM_FPAIRED && ! (c->flag & BAM_FPROPER_PAIR)) { pf->nrej[CSP_REJ_ORPHAN]++; return 1; }
+    if (use_target(gs)) {    // the reads are sorted by pos, so the cursor moves along with them.
+        if ((tpos = snp_tcur_seek(&dat->tc, c->pos)) >= bam_endpos(b)) {
+            pf->nrej[CSP_REJ_TARGET]++;
+            return HTS_POS_MAX == tpos ? -1 : 1;     // -1: no more targets.
+        }
+    }
+    if (gs->min_len > 0 && get_bam_laln(b) < gs->min_len) { pf->nrej[CSP_REJ_LEN]++; return 1; }
+    return 0;
 }
 
-static inline void mp_aux_reset(mp_aux_t *p) { }
+/*@abstract  Check the UMI and cell tags of the read, refer to mp_read().
+@return      0 if passing, 1 if not.
+ */
+static inline int mp_read_tags(mp_aux_t *dat, bam1_t *b) {
+    global_settings *gs = dat->gs;
+    csp_prof_t *pf = dat->pf;
+    char *cb;
+    if (use_umi(gs) && NULL == get_bam_aux_str(b, gs->umi_tag)) { pf->nrej[CSP_REJ_TAG]++; return 1; }
+    if (use_barcodes(gs)) {
+        if (NULL == (cb = get_bam_aux_str(b, gs->cell_tag))) { pf->nrej[CSP_REJ_TAG]++; return 1; }
+        if (csp_bcd_get(gs->bcd, cb) < 0) { pf->nrej[CSP_REJ_BCD]++; return 1; }
+    }
+    return 0;
+}
+
+/*@abstract  Read the next valid read of the query chrom from the input file.
+@param dat   Pointer to auxiliary data.
+@param b     Pointer to bam1_t structure.
+@return      0 on success, -1 on end, < -1 on non-recoverable errors. refer to htslib/sam.h @func bam_plp_init.
+
+@note        1. This function refers to @func mplp_func in bcftools/mpileup.c.   
+             2. The read filters here are applied before the read is buffered by htslib, so the rejected reads
+                are not counted in the max depth of bam_mplp_set_maxcnt().
+             3. None of the filters depend on the pileup pos, so the reads are dropped here instead of in
+                pileup_read(), so that they never enter the pileup buffer. The tags are checked last, and are
+                timed as CSP_STG_UMI_CB.
+*/
+static int mp_read(mp_aux_t *dat, bam1_t *b) {
+    csp_prof_t *pf = dat->pf;
+    int ret;
+    do {
+        ret = sam_itr_next(dat->fp, dat->itr, b);
+        csp_prof_tick(pf, CSP_STG_DECODE);
+        if (ret < 0) { break; }
+        pf->nread++;
+        ret = mp_read_filter(dat, b);
+        csp_prof_tick(pf, CSP_STG_FILTER);
+        if (ret < 0) { break; } else if (ret > 0) { continue; }
+        ret = mp_read_tags(dat, b);
+        csp_prof_tick(pf, CSP_STG_UMI_CB);
+    } while (ret);
+    return ret;
+}
 
 /*@abstract  bam_plp_auto_f used by bam_mplp_init to extract valid reads to be pushed into bam_mpileup stack.
 @param data  Pointer to auxiliary data.
 @param b     Pointer to bam1_t structure.
 @return      0 on success, -1 on end, < -1 on non-recoverable errors. refer to htslib/sam.h @func bam_plp_init.
 
-@note        This function refers to @func mplp_func in bcftools/mpileup.c.   
+@note        When prefetching, the reads have been read and filtered by mp_read() in the reader thread, and the
+             data of the read is swapped into @p b, which is copied by htslib once returned.
 */
 static int mp_func(void *data, bam1_t *b) {
-    int ret;
     mp_aux_t *dat = (mp_aux_t*) data;
-    global_settings *gs = dat->gs;
-    bam1_core_t *c;
-    do {
-        if ((ret = sam_itr_next(dat->fp, dat->itr, b)) < 0) { break; }
-        c = &(b->core);
-        if (c->tid < 0 || c->flag & BAM_FUNMAP) { continue; }
-        if (c->qual < gs->min_mapq) { continue; }
-        //if (c->flag > gs->max_flag) { continue; }
-        if (gs->rflag_filter && gs->rflag_filter & c->flag ) { continue; }
-        if (gs->rflag_require && ! (gs->rflag_require & c->flag)) { continue; }
-        if (gs->no_orphan && c->flag & BAM_FPAIRED && ! (c->flag & BAM_FPROPER_PAIR)) { continue; }
-        if (use_target(gs)) {
-            int beg = c->pos, end = bam_endpos(b) - 1;
-            int overlap = regidx_overlap(gs->targets, dat->chrom, beg, end, NULL);
-            if (! overlap) { continue; }
-        }
-        break;
-    } while (1);
-    return ret;
+    bam1_t t;
+    int ret;
+    csp_prof_tick(dat->pf, CSP_STG_PILEUP);
+    if (NULL == dat->rdr) { return mp_read(dat, b); }
+    ret = jring_get(dat->rdr, dat->id, (void**) &dat->spare);
+    csp_prof_tick(dat->pf, CSP_STG_WAIT);
+    if (ret != 0) {
+        if (ret < 0) { return -2; }
+        dat->is_eof = 1;
+        return -1;
+    }
+    t = *b; *b = *dat->spare; *dat->spare = t;
+    return 0;
+}
+
+/*@abstract  Data of the reader thread of csp_pileup_core(), refer to jring_t.
+@param d     Pointer of the thread_data of the worker.
+@param data  Array of mp_aux_t of the reader, one for each input file, sharing the fp and iter of the worker.
+@param n     Index of current chrom in the chroms of @p d.
+@param prof  Counters of the reads read by the reader, added into the worker when the reader stops.
+ */
+typedef struct {
+    thread_data *d;
+    mp_aux_t *data;
+    int n;
+    csp_prof_t prof;
+} mp_rdr_t;
+
+static void* mp_rdr_item_init(void) { return bam_init1(); }
+static void mp_rdr_item_destroy(void *x) { bam_destroy1((bam1_t*) x); }
+
+/*@note  The reader visits the chroms in the same order as csp_pileup_core(). */
+static int mp_rdr_next(void *args) {
+    mp_rdr_t *r = (mp_rdr_t*) args;
+    thread_data *d = r->d;
+    global_settings *gs = d->gs;
+    int i;
+    if (++r->n >= d->m) { return 1; }
+    for (i = 0; i < d->nfs; i++) {
+        r->data[i].itr = d->iter[r->n][i]; r->data[i].chrom = gs->chroms[d->n + r->n];
+        if (use_target(gs)) { snp_tcur_set(&r->data[i].tc, gs->targets, d->n + r->n, d->beg); }
+    }
+    return 0;
+}
+
+static int mp_rdr_read(void *args, int i, void *x) {
+    int ret;
+    csp_prof_skip(&((mp_rdr_t*) args)->prof);     // the reader could have waited for the worker.
+    ret = mp_read(((mp_rdr_t*) args)->data + i, (bam1_t*) x);
+    return ret >= 0 ? 0 : (-1 == ret ? 1 : -1);
+}
+
+/*@abstract  bam_mplp_constructor callback, which saves the index of the barcode into @p cd for each new read,
+             so that the barcode is looked up once per read rather than once per pileup pos.
+@return      0. Refer to htslib/sam.h @func bam_plp_constructor.
+ */
+static int mp_cd_func(void *data, const bam1_t *b, bam_pileup_cd *cd) {
+    global_settings *gs = ((mp_aux_t*) data)->gs;
+    csp_prof_t *pf = ((mp_aux_t*) data)->pf;
+    char *cb;
+    cd->i = -1;
+    csp_prof_tick(pf, CSP_STG_PILEUP);
+    if (use_barcodes(gs) && (cb = get_bam_aux_str((bam1_t*) b, gs->cell_tag))) { cd->i = csp_bcd_get(gs->bcd, cb); }
+    csp_prof_tick(pf, CSP_STG_UMI_CB);
+    return 0;
 }
 
 /*@abstract  Pileup one read.
@@ -79,43 +223,64 @@ static int mp_func(void *data, bam1_t *b) {
 @return      0 if success, -1 if error, 1 if the reads extracted are not in proper format, 2 if not passing filters.
 
 @note        1. This function is modified from cigar_resolve2() function in sam.c of htslib.
-             2. Reads filtering is also applied inside this function, including:
-                   UMI and cell tags and length of bases within alignment.
+             2. Reads filtering on UMI and cell tags and length of bases within alignment has been applied
+                in mp_func(), only the tags are extracted here.
              3. To speed up, parameters will not be checked, so the caller should guarantee the parameters are valid, i.e.
                 bp != NULL && p != NULL && gs != NULL.
  */
 static int pileup_read(hts_pos_t pos, const bam_pileup1_t *bp, csp_pileup_t *p, global_settings *gs) {
     /* Filter reads in order. For example, filtering according to umi tag and cell tag would speed up in the case
        that do not use UMI or Cell-barcode at all. */
-    p->b = bp->b;
-    if (use_umi(gs) && NULL == (p->umi = get_bam_aux_str(p->b, gs->umi_tag))) { return 1; }
-    if (use_barcodes(gs) && NULL == (p->cb = get_bam_aux_str(p->b, gs->cell_tag))) { return 1; }
-    bam1_core_t *c = &(p->b->core);
-    uint32_t *cigar = bam_get_cigar(p->b);
-    int k, op, l;  
-    uint32_t laln;
+    bam1_t *b = bp->b;      // owned by the mpileup, so do not save it into @p p, which would be freed with @p p.
+    if (use_umi(gs) && NULL == (p->umi = get_bam_aux_str(b, gs->umi_tag))) { return 1; }
+    if (use_barcodes(gs) && NULL == (p->cb = get_bam_aux_str(b, gs->cell_tag))) { return 1; }
+    bam1_core_t *c = &(b->core);
     assert(c->pos <= pos);   // otherwise a bug.
     if (bp->is_del) { return 2; }
     if (bp->is_refskip) { return 2; }
-    /* processing cigar string to get number of mapped positions. */
-    if (gs->min_len > 0) {
-        for (k = 0, laln = 0; k < c->n_cigar; k++) {
-            op = get_cigar_op(cigar[k]);
-            l = get_cigar_len(cigar[k]);
-            if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { laln += l; }
-        }
-        if (laln < gs->min_len) { return 2; }
-        else { p->laln = laln; }
-    }
     p->qpos = bp->qpos; 
     p->is_del = bp->is_del; p->is_refskip = bp->is_refskip;
     if (p->qpos < c->l_qseq) { 
-        p->base = bam_seqi(bam_get_seq(p->b), p->qpos); 
-        p->qual = bam_get_qual(p->b)[p->qpos]; 
+        p->base = bam_seqi(bam_get_seq(b), p->qpos); 
+        p->qual = bam_get_qual(b)[p->qpos]; 
     } else { p->base = seq_nt16_char2idx('N'); p->qual = 0; }
     return 0;
 }
 
+/*@abstract    Screen one pos by the pooled base counts of the pileup-ed reads from all files.
+@param mp_n    Pointer of array containing numbers of bam_pileup1_t* pileup-ed from each file.
+@param mp_plp  Pointer of array containing bam_pileup1_t* pileup-ed from each file.
+@param nfs     Size of @p mp_nplp and @p mp_plp.
+@param gs      Pointer of global_settings structure.
+@return        1 if the pos could pass the min_count and min_maf filters of csp_mplp_stat(), 0 otherwise.
+
+@note          1. The reads are counted as in pileup_read() but without any barcode or UMI lookup, as the reads
+                  without valid tags have been dropped in mp_func().
+               2. Without UMI, the counts are exactly those calculated in csp_mplp_stat(). With UMI, the pooled
+                  count of each base is no less than the UMI-collapsed one, and so is the count of the inferred alt
+                  allele, hence the pos is rejected only if the collapsed counts would fail @p min_count or
+                  @p min_count * @p min_maf, i.e., the results are not changed by the screening.
+ */
+static int pileup_screen(int *mp_n, const bam_pileup1_t **mp_plp, int nfs, global_settings *gs) {
+    const bam_pileup1_t *bp = NULL;
+    const bam1_t *b;
+    size_t bc[5] = {0, 0, 0, 0, 0}, tc;
+    int8_t k1, k2;
+    int i, j;
+    for (i = 0; i < nfs; i++) {
+        for (j = 0, bp = mp_plp[i]; j < mp_n[i]; j++, bp++) {
+            if (bp->is_del || bp->is_refskip) { continue; }
+            b = bp->b;
+            bc[bp->qpos < b->core.l_qseq ? seq_nt16_idx2int(bam_seqi(bam_get_seq(b), bp->qpos)) : 4]++;
+        }
+    }
+    tc = bc[0] + bc[1] + bc[2] + bc[3] + bc[4];
+    if (tc < gs->min_count) { return 0; }
+    infer_allele(bc, &k1, &k2);
+    if (bc[k2] < (use_umi(gs) ? (size_t) gs->min_count : tc) * gs->min_maf) { return 0; }
+    return 1;
+}
+
 /*@abstract    Pileup One SNP.
 @param pos     Pos of pileup-ed snp.
 @param mp_n    Pointer of array containing numbers of bam_pileup1_t* pileup-ed from each file.
@@ -123,13 +288,16 @@ static int pileup_read(hts_pos_t pos, const bam_pileup1_t *bp, csp_pileup_t *p,
 @param nfs     Size of @p mp_nplp and @p mp_plp.
 @param pileup  Pointer of csp_pileup_t structure.
 @param mplp    Pointer of csp_mplp_t structure.
+@param pf      Pointer of the counters and stage timer of the thread.
 @param gs      Pointer of global_settings structure.
 @return        0 if success, -1 if error, 1 if pileup failure without error.
 
 @note          1. This function is mainly called by csp_pileup_core(). Refer to csp_pileup_core() for notes.
                2. The statistics result of all pileuped reads for one SNP is stored in the csp_mplp_t after calling this function.
+               3. The pos is screened by pileup_screen() first, so that the reads are pushed into per sample group
+                  states only for the pos that could pass the filters.
 */
-static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, int nfs, csp_pileup_t *pileup, csp_mplp_t *mplp, global_settings *gs) 
+static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, int nfs, csp_pileup_t *pileup, csp_mplp_t *mplp, csp_prof_t *pf, global_settings *gs) 
 {
     const bam_pileup1_t *bp = NULL;
     int i, j, r, ret, st, state = -1;
@@ -137,6 +305,9 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
   #if DEBUG
     size_t npileup = 0;
   #endif
+    r = pileup_screen(mp_n, mp_plp, nfs, gs);
+    csp_prof_tick(pf, CSP_STG_PILEUP);
+    if (! r) { return 1; }
     for (i = 0; i < nfs; i++) {
         for (j = 0; j < mp_n[i]; j++) {
             bp = mp_plp[i] + j;
@@ -144,20 +315,24 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
             npileup++;
           #endif
             if (0 == (st = pileup_read(pos, bp, pileup, gs))) { // no need to reset pileup as the values in it will be immediately overwritten.
-                if (use_barcodes(gs)) { r = csp_mplp_push(pileup, mplp, -1, gs); }
+                if (use_barcodes(gs)) { r = csp_mplp_push(pileup, mplp, (int) bp->cd.i, gs); }
                 else if (use_sid(gs)) { r = csp_mplp_push(pileup, mplp, i, gs); }
                 else { state = -1; goto fail; }
                 if (r < 0) { state = -1; goto fail; }  // else if r == 1: pileuped barcode is not in the input barcode list.
                 else if (r == 0) { npushed++; }
             } else if (st < 0) { state = -1; goto fail; }
+            else { pf->nrej[CSP_REJ_DEL]++; }
         }
     }
+    csp_prof_tick(pf, CSP_STG_UMI_CB);     // mostly getting the tags and csp_mplp_push(), refer to pileup_read().
   #if DEBUG
     fprintf(stderr, "[D::%s] before mplp statistics: npileup = %ld; npushed = %ld; the mplp is:\n", __func__, npileup, npushed);
     csp_mplp_print_(stderr, mplp, "\t");
   #endif
     if (npushed < gs->min_count) { state = 1; goto fail; }
-    if ((ret = csp_mplp_stat(mplp, gs)) != 0) { state = (ret > 0) ? 1 : -1; goto fail; }
+    ret = csp_mplp_stat(mplp, gs);
+    csp_prof_tick(pf, CSP_STG_STAT);
+    if (ret != 0) { state = (ret > 0) ? 1 : -1; goto fail; }
   #if DEBUG
     fprintf(stderr, "[D::%s] after mplp statistics: the mplp is:\n", __func__);
     csp_mplp_print_(stderr, mplp, "\t");
@@ -167,7 +342,103 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
     return state;
 }
 
-/*@abstract  Pileup regions (several chromosomes).
+/*@abstract  Create the iterator of the target clusters of one chrom in mode T.
+@param t     Pointer of snp_tgt_t structure.
+@param ci    Index of the chrom in @p t.
+@param beg   Only the targets within [beg, end) are used.
+@param end   See @p beg.
+@param bs    Pointer of csp_bam_fs whose hdr and idx have been loaded.
+@param tid   Id of the chrom in the header of @p bs.
+@return      Pointer of the multi-region iterator if success, NULL otherwise.
+
+@note        1. The adjacent targets whose gap is no more than CSP_FETCH_MAX_GAP are grouped into one cluster, and 
+                each cluster is one interval of the iterator, so that only the reads overlapping the clusters would
+                be extracted from the file, instead of all reads of the chrom.
+             2. The intervals are given by @p tid rather than by region strings, which could not be parsed when the
+                chrom name contains ':' or '-'.
+             3. NULL is returned if there is no target within [beg, end). The chroms of @p t all have targets
+                (refer to snp_tgt_build()), and split_chroms() only drops the windows without targets when the
+                chroms are split, so a whole chrom [0, HTS_POS_MAX) always has one.
+ */
+static hts_itr_t* tgt_itr_query(const snp_tgt_t *t, int ci, hts_pos_t beg, hts_pos_t end, csp_bam_fs *bs, int tid) {
+    kvec_t(hts_pair_pos_t) iv;
+    hts_pair_pos_t r;
+    hts_reglist_t *rl = NULL;
+    snp_tcur_t tc;
+    size_t i;
+    kv_init(iv);
+    snp_tcur_set(&tc, t, ci, beg);
+    for (i = tc.i; i < tc.n && t->pos[i] < end; ) {
+        for (r.beg = r.end = t->pos[i++]; i < tc.n && t->pos[i] < end && t->pos[i] - r.end <= CSP_FETCH_MAX_GAP; ) {
+            r.end = t->pos[i++];
+        }
+        r.end++;       // the interval is half-open, i.e., [beg, end).
+        kv_push(hts_pair_pos_t, iv, r);
+    }
+    if (0 == kv_size(iv)) { goto fail; }
+    if (NULL == (rl = (hts_reglist_t*) calloc(1, sizeof(hts_reglist_t)))) { goto fail; }
+    rl->reg = NULL;    // use @p tid directly.
+    rl->tid = tid;
+    rl->intervals = iv.a;
+    rl->count = kv_size(iv);
+    rl->min_beg = kv_A(iv, 0).beg;
+    rl->max_end = kv_A(iv, kv_size(iv) - 1).end;
+    return sam_itr_regions(bs->idx, bs->hdr, rl, 1);     // @p rl would be freed along with the iterator.
+  fail:
+    kv_destroy(iv);
+    return NULL;
+}
+
+/*@abstract  Create the iterators of all regions of one work unit, one for each input file.
+@param d     Pointer of thread_data whose regions have been set, refer to csp_pileup().
+@param s     Pointer of kstring_t used as buffer.
+@return      0 if success, -1 otherwise.
+
+@note        1. The iterators are created by the worker right before the unit is pileup-ed, by querying the headers
+                and indexes that are loaded once and shared read-only by all threads (refer to csp_bam_fs), so that
+                the setup of the units runs in parallel and the units skipped by --resume cost nothing.
+             2. The iterators should be freed by plp_itr_destroy() once the unit is finished.
+ */
+static int plp_itr_create(thread_data *d, kstring_t *s) {
+    global_settings *gs = d->gs;
+    char **a = gs->chroms + d->n;
+    const char *ref = NULL;
+    hts_itr_t **itr;
+    int i, j, tid;
+    if (NULL == (d->iter = (hts_itr_t***) calloc(d->m, sizeof(hts_itr_t**)))) { return -1; }
+    d->niter = d->m; d->nitr = d->nfs;
+    for (i = 0; i < d->m; i++) {
+        if (NULL == (itr = d->iter[i] = (hts_itr_t**) calloc(d->nfs, sizeof(hts_itr_t*)))) { return -1; }
+        for (j = 0; j < d->nfs; j++) {
+            if (NULL == (ref = csp_fmt_chr_name(a[i], d->bfs[j]->hdr, s))) {
+                fprintf(stderr, "[E::%s] could not parse name for chrom %s.\n", __func__, a[i]);
+                return -1;
+            } else { ks_clear(s); }
+            if ((tid = sam_hdr_name2tid(d->bfs[j]->hdr, ref)) >= 0) {
+                itr[j] = use_target(gs) ? tgt_itr_query(gs->targets, d->n + i, d->beg, d->end, d->bfs[j], tid) : \
+                         sam_itr_queryi(d->bfs[j]->idx, tid, d->beg, d->end);
+            }
+            if (NULL == itr[j]) {
+                fprintf(stderr, "[E::%s] could not parse region for chrom %s.\n", __func__, a[i]);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void plp_itr_destroy(thread_data *d) {
+    int i, j;
+    if (NULL == d->iter) { return; }
+    for (i = 0; i < d->niter; i++) {
+        if (NULL == d->iter[i]) { continue; }
+        for (j = 0; j < d->nitr; j++) { if (d->iter[i][j]) { hts_itr_destroy(d->iter[i][j]); } }
+        free(d->iter[i]);
+    }
+    free(d->iter); d->iter = NULL;
+}
+
+/*@abstract  Pileup regions (several chromosomes or one region of a chromosome).
 @param args  Pointer to thread_data structure.
 @return      Num of SNPs, including those filtered, that are processed.
 
@@ -182,19 +453,23 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
              4. TODO: check consistency among headers. For now not sure the pileup-ed @p tid from @func 
                   bam_mplp_auto() is corresponded to which file's header for different files may have different 
                   target_names in their headers.
-             5. TODO: Refering to @func mpileup from bam_plcmd.c in @repo samtools, the hts_itr_t* structure is
-                  reused directly without destroying-creating again. is it a good way? it may speed up if 
-                  donot repeat the create-destroy-create-... process.
+             5. The iterators of the unit are created here rather than by the main thread, refer to plp_itr_create().
+                As in @func mpileup from bam_plcmd.c in @repo samtools, one @p mp_iter is created for the unit and
+                reset by bam_mplp_reset() for each region, instead of being created and destroyed per region.
+             6. When chroms are split into windows (refer to csp_pileup()), only one region [d->beg, d->end) is
+                processed by this function.
+             7. If gs->prefetch > 0, a reader thread reads and filters the reads of all input files into ring
+                buffers (refer to mp_rdr_t), from which mp_func() takes the reads for mpileup.
+             8. The reads and pos are counted into d->prof, and the stages are timed if gs->is_profile, refer to
+                csp_prof_t.
  */
 static int csp_pileup_core(void *args) {
     thread_data *d = (thread_data*) args;
     global_settings *gs = d->gs;
     char **a = gs->chroms + d->n;
     int n = 0;                   /* n is the num of chroms that are successfully processed. */
-    csp_bam_fs **bam_fs = d->bfs;
     int nfs = d->nfs;
     htsFile **fp = NULL;
-    int nfp = 0;
     csp_pileup_t *pileup = NULL;
     csp_mplp_t *mplp = NULL;
     bam_mplp_t mp_iter = NULL;
@@ -202,11 +477,14 @@ static int csp_pileup_core(void *args) {
     int *mp_n = NULL;
     mp_aux_t **data = NULL;
     int ndat = 0;                 // num of elements in array of mp_aux_t data.
+    jring_t *rdr = NULL;
+    mp_rdr_t rd = {.d = d, .data = NULL, .n = -1};   // .prof is zeroed.
     int tid, max_depth;
-    int pos;
+    hts_pos_t pos;
     int i, r, ret;
     size_t msnp, nsnp, unit = 200000;
-    regitr_t *itr = NULL;
+    snp_tcur_t tc = {NULL, 0, 0};
+    uint8_t ale;
     kstring_t ks = KS_INITIALIZE, *s = &ks;
   #if CSP_FIT_MULTI_SMP
     if (gs->tp_errno) { d->ret = 1; goto fail; }
@@ -216,10 +494,8 @@ static int csp_pileup_core(void *args) {
     thdata_print(stderr, d);
   #endif
     assert(d->nfs == gs->nin);
-    assert(d->niter == d->m);
-    assert(d->nitr == gs->nin);
     d->ret = -1;
-    d->ns = d->nr_ad = d->nr_dp = d->nr_oth = 0;
+    d->ns = d->nr_ad = d->nr_dp = d->nr_oth = d->nr_gt = 0;
     /* prepare data and structures. 
     */
   #if CSP_FIT_MULTI_SMP
@@ -237,30 +513,42 @@ static int csp_pileup_core(void *args) {
         fprintf(stderr, "[E::%s] failed to open tmp mtx OTH file '%s'.\n", __func__, d->out_mtx_oth->fn);
         d->ret = -2; goto fail;
     }
-    if (jf_open(d->out_vcf_base, NULL) <= 0) { 
+    if (gs->is_out_bcf) {
+        if (thdata_bcf_open(d, use_barcodes(gs) ? gs->nbarcode : gs->nsid) < 0) {
+            fprintf(stderr, "[E::%s] failed to open tmp BCF files '%s'.\n", __func__, d->out_vcf_base->fn);
+            d->ret = -2; goto fail;
+        }
+    } else if (jf_open(d->out_vcf_base, NULL) <= 0) { 
         fprintf(stderr, "[E::%s] failed to open tmp vcf BASE file '%s'.\n", __func__, d->out_vcf_base->fn);
         d->ret = -2; goto fail;
     }
-    if (gs->is_genotype) {
+    if (use_vcf_cells(gs) && ! gs->is_out_bcf) {
         if (jf_open(d->out_vcf_cells, NULL) <= 0) { 
             fprintf(stderr, "[E::%s] failed to open tmp vcf CELLS file '%s'.\n", __func__, d->out_vcf_cells->fn);
             d->ret = -2; goto fail;
         }
     }
+    if (gs->is_sparse_geno) {
+        if (jf_open(d->out_mtx_gt, NULL) <= 0) { 
+            fprintf(stderr, "[E::%s] failed to open tmp mtx GT file '%s'.\n", __func__, d->out_mtx_gt->fn);
+            d->ret = -2; goto fail;
+        }
+        if (jf_open(d->out_mtx_pl, NULL) <= 0) { 
+            fprintf(stderr, "[E::%s] failed to open tmp mtx PL file '%s'.\n", __func__, d->out_mtx_pl->fn);
+            d->ret = -2; goto fail;
+        }
+    }
     /* open input files */ 
   #if CSP_FIT_MULTI_SMP
     if (gs->tp_errno) { d->ret = 1; goto fail; }
   #endif
     fp = (htsFile**) calloc(gs->nin, sizeof(htsFile*));
     if (NULL == fp) { fprintf(stderr, "[E::%s] failed to open input files\n", __func__); goto fail; }                 
-    for (; nfp < gs->nin; ) {
-        if (d->i == 0) {               // the caller has opened input files for Thread-0 
-            fp[nfp] = bam_fs[nfp]->fp; nfp++;
-        } else if (NULL == (fp[nfp] = hts_open(gs->in_fns[nfp], "rb"))) {
-            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfp]);
-            d->ret = -2; goto fail;
-        } else { nfp++; }
+    if (csp_hts_pool_get(d->hp, fp, d->i) < 0) {      // wait here if the other threads hold too many handles.
+        fprintf(stderr, "[E::%s] failed to open input files.\n", __func__);
+        d->ret = -2; goto fail;
     }
+    if (plp_itr_create(d, s) < 0) { fprintf(stderr, "[E::%s] failed to create the iterators.\n", __func__); goto fail; }
     /* prepare mplp for pileup. */
   #if CSP_FIT_MULTI_SMP
     if (gs->tp_errno) { d->ret = 1; goto fail; }
@@ -280,7 +568,27 @@ static int csp_pileup_core(void *args) {
         if (NULL == (data[ndat] = mp_aux_init())) {
             fprintf(stderr, "[E::%s] failed to allocate space for mp_aux_t.\n", __func__);
             goto fail;
-        } else { data[ndat]->fp = fp[ndat]; data[ndat]->gs = gs; }
+        } else { data[ndat]->fp = fp[ndat]; data[ndat]->gs = gs; data[ndat]->pf = &d->prof; }
+    }
+    if (gs->prefetch > 0) {
+        if (NULL == (rd.data = (mp_aux_t*) calloc(nfs, sizeof(mp_aux_t)))) {
+            fprintf(stderr, "[E::%s] failed to allocate space for mp_aux_t of the reader.\n", __func__);
+            goto fail;
+        }
+        for (i = 0; i < nfs; i++) { rd.data[i].fp = fp[i]; rd.data[i].gs = gs; rd.data[i].pf = &rd.prof; }
+        if (NULL == (rdr = jring_init(nfs, gs->prefetch, mp_rdr_item_init, mp_rdr_item_destroy))) {
+            fprintf(stderr, "[E::%s] failed to create the ring buffers for prefetching.\n", __func__);
+            goto fail;
+        }
+        for (i = 0; i < nfs; i++) {
+            data[i]->rdr = rdr; data[i]->id = i;
+            if (NULL == (data[i]->spare = bam_init1())) { fprintf(stderr, "[E::%s] failed to init bam1_t.\n", __func__); goto fail; }
+        }
+        csp_prof_start(&rd.prof, gs->is_profile);
+        if (jring_start(rdr, mp_rdr_read, mp_rdr_next, &rd) < 0) {
+            fprintf(stderr, "[E::%s] failed to start the reader thread.\n", __func__);
+            goto fail;
+        }
     }
     if (NULL == (mp_plp = (const bam_pileup1_t**) calloc(nfs, sizeof(bam_pileup1_t*)))) {
         fprintf(stderr, "[E::%s] failed to allocate space for mp_plp.\n", __func__);
@@ -290,11 +598,6 @@ static int csp_pileup_core(void *args) {
         fprintf(stderr, "[E::%s] failed to allocate space for mp_nplp.\n", __func__);
         goto fail;
     }
-    // init reg itr
-    if (use_target(gs) && NULL == (itr = regitr_init(gs->targets))) {
-        fprintf(stderr, "[E::%s] failed to init regitr.\n", __func__);
-        goto fail;
-    }
     /* pileup each SNP. 
     */
     // init mpileup 
@@ -307,57 +610,66 @@ static int csp_pileup_core(void *args) {
             fprintf(stderr, "[W::%s] Combined max depth is above 1M. Potential memory hog!\n", __func__);
         }
     }
+    if (NULL == (mp_iter = bam_mplp_init(nfs, mp_func, (void**) data))) {
+        fprintf(stderr, "[E::%s] failed to create mp_iter.\n", __func__);
+        goto fail;
+    }
+    bam_mplp_set_maxcnt(mp_iter, max_depth);
+    if (use_barcodes(gs)) { bam_mplp_constructor(mp_iter, mp_cd_func); }
+    // As each query region is a chrom or one window of it, so no need to call bam_mplp_init_overlaps() here?
+    csp_prof_start(&d->prof, gs->is_profile);
     for (msnp = nsnp = 0; n < d->m; n++, msnp = nsnp = 0) {
       #if CSP_FIT_MULTI_SMP
         if (gs->tp_errno) { d->ret = 1; goto fail; }
       #endif
       #if VERBOSE
-        fprintf(stderr, "[I::%s][Thread-%d] processing chrom %s ...\n", __func__, d->i, a[n]);
+        if (d->end < HTS_POS_MAX) { fprintf(stderr, "[I::%s][Thread-%d] processing chrom %s:%ld-%ld ...\n", __func__, d->i, a[n], d->beg + 1, d->end); }
+        else if (d->beg > 0) { fprintf(stderr, "[I::%s][Thread-%d] processing chrom %s:%ld- ...\n", __func__, d->i, a[n], d->beg + 1); }
+        else { fprintf(stderr, "[I::%s][Thread-%d] processing chrom %s ...\n", __func__, d->i, a[n]); }
       #endif
-        /* create bam_mplp_* mpileup structure from htslib */
-        for (i = 0; i < ndat; i++) { data[i]->itr = d->iter[n][i]; data[i]->chrom = a[n]; }
-        if (NULL == (mp_iter = bam_mplp_init(nfs, mp_func, (void**) data))) {
-            fprintf(stderr, "[E::%s] failed to create mp_iter for chrom %s.\n", __func__, a[n]);
-            goto fail;
+        /* point the mpileup to the region, whose buffered reads have been cleared by bam_mplp_reset(). */
+        for (i = 0; i < ndat; i++) { 
+            data[i]->itr = d->iter[n][i]; data[i]->chrom = a[n];
+            // the chroms are in the same order as the targets, refer to main().
+            if (use_target(gs)) { snp_tcur_set(&data[i]->tc, gs->targets, d->n + n, d->beg); }
         }
-        bam_mplp_set_maxcnt(mp_iter, max_depth);
-        // As each query region is a chrom, so no need to call bam_mplp_init_overlaps() here?
+        if (use_target(gs)) { snp_tcur_set(&tc, gs->targets, d->n + n, d->beg); }
         /* begin mpileup */
         while ((ret = bam_mplp_auto(mp_iter, &tid, &pos, mp_n, mp_plp)) > 0) {
           #if CSP_FIT_MULTI_SMP
             if (gs->tp_errno) { d->ret = 1; goto fail; }
           #endif
+            csp_prof_tick(&d->prof, CSP_STG_PILEUP);
             if (tid < 0) { break; }
+            /* the reads straddling the boundaries of the region are pileuped, while only the pos inside the region
+               are used, the others belong to the adjacent regions. */
+            if (pos < d->beg) { continue; }
+            if (pos >= d->end) { break; }
             if (use_target(gs)) {
-                int overlap = regidx_overlap(gs->targets, a[n], pos, pos, itr);
-                biallele_t *ale = NULL;
-                if (! overlap) { continue; }   // no need to reset mplp_t here
-                while (regitr_overlap(itr)) {
-                    ale = regitr_payload(itr, biallele_t*);
-                    break;
-                }
-                mplp->ref_idx = ale->ref ? seq_nt16_char2int(ale->ref) : -1;
-                mplp->alt_idx = ale->alt ? seq_nt16_char2int(ale->alt) : -1;                
+                if (snp_tcur_seek(&tc, pos) != pos) { continue; }   // no need to reset mplp_t here
+                ale = gs->targets->ale[tc.i];
+                mplp->ref_idx = snp_ale_idx(snp_ale_ref(ale));
+                mplp->alt_idx = snp_ale_idx(snp_ale_alt(ale));
             } else { mplp->ref_idx = -1; mplp->alt_idx = -1; }
-            if ((r = pileup_snp(pos, mp_n, mp_plp, nfs, pileup, mplp, gs)) != 0) {
+            d->prof.nsnp++;
+            if ((r = pileup_snp(pos, mp_n, mp_plp, nfs, pileup, mplp, &d->prof, gs)) != 0) {
                 if (r < 0) {
-                    fprintf(stderr, "[E::%s] failed to pileup snp for %s:%d\n", __func__, a[n], pos);
+                    fprintf(stderr, "[E::%s] failed to pileup snp for %s:%ld\n", __func__, a[n], pos);
                     goto fail; 
                 } else { csp_mplp_reset(mplp); continue; }
-            } else { d->ns++; }
-            d->nr_ad += mplp->nr_ad; d->nr_dp += mplp->nr_dp; d->nr_oth += mplp->nr_oth;
+            } else { d->ns++; d->prof.npass++; }
+            d->nr_ad += mplp->nr_ad; d->nr_dp += mplp->nr_dp; d->nr_oth += mplp->nr_oth; d->nr_gt += mplp->nr_gt;
             /* output mplp to mtx and vcf. */
-            csp_mplp_to_mtx(mplp, d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->ns);
-            ksprintf(s, "%s\t%d\t.\t%c\t%c\t.\tPASS\tAD=%ld;DP=%ld;OTH=%ld", a[n], pos + 1, \
-                    seq_nt16_int2char(mplp->ref_idx), seq_nt16_int2char(mplp->alt_idx), mplp->ad, mplp->dp, mplp->oth);
-            jf_puts(ks_str(s), d->out_vcf_base); jf_putc('\n', d->out_vcf_base);
-            if (gs->is_genotype) {
-                jf_puts(ks_str(s), d->out_vcf_cells);
-                jf_puts("\tGT:AD:DP:OTH:PL:ALL", d->out_vcf_cells);
-                csp_mplp_to_vcf(mplp, d->out_vcf_cells);
-                jf_putc('\n', d->out_vcf_cells);
+            if (thdata_output_snp(d, mplp, a[n], pos, s) < 0) {
+                fprintf(stderr, "[E::%s] failed to output snp (%s:%ld)\n", __func__, a[n], pos + 1);
+                goto fail;
+            }
+            if (d->wrt && thdata_stream_push(d, 0) < 0) {
+                fprintf(stderr, "[E::%s] failed to hand the output to the writer.\n", __func__);
+                goto fail;
             }
             csp_mplp_reset(mplp); ks_clear(s);
+            csp_prof_tick(&d->prof, CSP_STG_OUTPUT);
           #if VERBOSE
             if ((++nsnp) - msnp >= unit) {
                 fprintf(stderr, "[I::%s][Thread-%d] has pileup-ed %.2fM SNPs for chrom %s\n", __func__, d->i, nsnp / 1000000.0, a[n]);
@@ -369,26 +681,42 @@ static int csp_pileup_core(void *args) {
             fprintf(stderr, "[E::%s] failed to pileup chrom %s\n", __func__, a[n]);
             goto fail;
         }
-        for (i = 0; i < ndat; i++) { mp_aux_reset(data[i]); }
+        bam_mplp_reset(mp_iter);
+        for (i = 0; i < ndat; i++) {
+            if (mp_aux_drain(data[i]) < 0) { fprintf(stderr, "[E::%s] failed to drain the reads of chrom %s\n", __func__, a[n]); goto fail; }
+            mp_aux_reset(data[i]);
+        }
       #if VERBOSE
         fprintf(stderr, "[I::%s][Thread-%d] has pileup-ed in total %ld SNPs for chrom %s\n", __func__, d->i, nsnp, a[n]);
       #endif
     }
     ks_free(s); s = NULL;
     jf_close(d->out_mtx_ad); jf_close(d->out_mtx_dp); jf_close(d->out_mtx_oth);
-    jf_close(d->out_vcf_base); if (gs->is_genotype) { jf_close(d->out_vcf_cells); }
+    if (gs->is_out_bcf) {
+        if (thdata_bcf_close(d) < 0) { fprintf(stderr, "[E::%s] failed to close tmp BCF files.\n", __func__); d->ret = -2; goto fail; }
+    } else { jf_close(d->out_vcf_base); if (use_vcf_cells(gs)) { jf_close(d->out_vcf_cells); } }
+    if (gs->is_sparse_geno) { jf_close(d->out_mtx_gt); jf_close(d->out_mtx_pl); }
+    if (d->ck && csp_ckpt_put(d->ck, d) < 0) {
+        fprintf(stderr, "[E::%s] failed to checkpoint the unit.\n", __func__);
+        goto fail;
+    }
+    if (d->wrt && thdata_stream_push(d, 1) < 0) {
+        fprintf(stderr, "[E::%s] failed to hand the output to the writer.\n", __func__);
+        goto fail;
+    }
+    if (rdr) {
+        if (jring_stop(rdr) < 0) { fprintf(stderr, "[E::%s] the reader thread failed.\n", __func__); goto fail; }
+        thdata_add_rdr_stat(d, rdr); csp_prof_add(&d->prof, &rd.prof);
+        jring_destroy(rdr); rdr = NULL;
+    } free(rd.data); rd.data = NULL;
+    plp_itr_destroy(d);
+    bam_mplp_destroy(mp_iter); mp_iter = NULL;
     for (i = 0; i < ndat; i++) { mp_aux_destroy(data[i]); }
     free(data);
-    if (d->i > 0) {
-        for (i = 0; i < nfp; i++) { hts_close(fp[i]); }
-    } free(fp); fp = NULL;
+    csp_hts_pool_put(d->hp, fp); free(fp); fp = NULL;
     free(mp_plp); free(mp_n);
-    // do not free mp_iter here, otherwise will lead to double free error!!!
-    // seems bam_mplp_* will free the mp_iter by default.
-    //bam_mplp_destroy(mp_iter);   
     csp_pileup_destroy(pileup);
     csp_mplp_destroy(mplp);
-    if (itr) { regitr_destroy(itr); }
     d->ret = 0;
     return n;
   fail:
@@ -400,25 +728,144 @@ static int csp_pileup_core(void *args) {
     if (jf_isopen(d->out_mtx_ad)) { jf_close(d->out_mtx_ad); }
     if (jf_isopen(d->out_mtx_dp)) { jf_close(d->out_mtx_dp); }
     if (jf_isopen(d->out_mtx_oth)) { jf_close(d->out_mtx_oth); }
+    if (gs->is_out_bcf) { thdata_bcf_close(d); }
     if (jf_isopen(d->out_vcf_base)) { jf_close(d->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(d->out_vcf_cells)) { jf_close(d->out_vcf_cells); }
+    if (use_vcf_cells(gs) && jf_isopen(d->out_vcf_cells)) { jf_close(d->out_vcf_cells); }
+    if (gs->is_sparse_geno && jf_isopen(d->out_mtx_gt)) { jf_close(d->out_mtx_gt); }
+    if (gs->is_sparse_geno && jf_isopen(d->out_mtx_pl)) { jf_close(d->out_mtx_pl); }
+    if (d->wrt) { thdata_stream_fail(d); }
+    if (rdr) { jring_destroy(rdr); }    // stop the reader before the input files are put back.
+    free(rd.data);
+    plp_itr_destroy(d);
+    if (mp_iter) { bam_mplp_destroy(mp_iter); mp_iter = NULL; }
     if (data) {
         for (i = 0; i < ndat; i++) { mp_aux_destroy(data[i]); }
         free(data); 
     }
-    if (fp) {
-        if (d->i > 0) {
-            for (i = 0; i < nfp; i++) { hts_close(fp[i]); }
-        } free(fp);
-    }
+    csp_hts_pool_pass(d->hp, d->i);     // in case that the handles have not been taken.
+    if (fp) { csp_hts_pool_put(d->hp, fp); free(fp); }
     if (mp_plp) free(mp_plp);
     if (mp_n) free(mp_n);
     if (pileup) csp_pileup_destroy(pileup);
     if (mplp) { csp_mplp_destroy(mplp); }
-    if (itr) { regitr_destroy(itr); }
     return n;
 }
 
+/*@abstract  Estimate the workload of one chrom.
+@param bfs   Pointer of array of csp_bam_fs whose hdr and idx have been loaded.
+@param nfs   Size of @p bfs.
+@param chrom Name of the chrom.
+@param s     Pointer of kstring_t used as buffer.
+@return      The estimated workload.
+
+@note        The workload is the num of reads in the indexes of all input files, or the length 
+             of the chrom if the index does not have such stat info. 
+ */
+static uint64_t estimate_chrom_work(csp_bam_fs **bfs, int nfs, const char *chrom, kstring_t *s) {
+    uint64_t w = 0, mapped, unmapped;
+    const char *ref;
+    int i, tid;
+    for (i = 0; i < nfs; i++) {
+        ref = csp_fmt_chr_name(chrom, bfs[i]->hdr, s);
+        tid = ref ? sam_hdr_name2tid(bfs[i]->hdr, ref) : -1;
+        ks_clear(s);
+        if (tid < 0) { continue; }
+        if (hts_idx_get_stat(bfs[i]->idx, tid, &mapped, &unmapped) >= 0) { w += mapped + unmapped; }
+        else { w += sam_hdr_tid2len(bfs[i]->hdr, tid); }
+    }
+    return w;
+}
+
+typedef struct { uint64_t w; int i; } unit_work_t;
+
+/*@abstract  One work unit of Mode2, i.e. the region [beg, end) of chrom gs->chroms[ci].
+@param w     Estimated workload of the unit.
+ */
+typedef struct { int ci; hts_pos_t beg, end; uint64_t w; } plp_unit_t;
+
+/*@abstract  Split the chroms into windows of size gs->win_size.
+@param gs    Pointer of global_settings structure.
+@param bfs   Pointer of array of csp_bam_fs whose hdr and idx have been loaded.
+@param nfs   Size of @p bfs.
+@param n     Pointer of num of units returned.
+@return      Pointer of array of units in order of chroms and pos if success, NULL otherwise.
+
+@note        1. The length of one chrom is the max length among the headers of input files. The last window of
+                each chrom ends at HTS_POS_MAX in case that some reads are beyond the length.
+             2. The workload of one chrom (refer to estimate_chrom_work()) is shared by its windows by length.
+             3. In mode T (use_target(gs)), the windows without any targets are skipped.
+ */
+static plp_unit_t* split_chroms(global_settings *gs, csp_bam_fs **bfs, int nfs, int *n) {
+    plp_unit_t *u = NULL, *t;
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    const char *ref;
+    snp_tcur_t tc;
+    hts_pos_t len, l, beg, end;
+    uint64_t w;
+    int i, j, tid, m = 0;
+    *n = 0;
+    for (i = 0; i < gs->nchrom; i++) {
+        for (j = 0, len = 0; j < nfs; j++) {
+            ref = csp_fmt_chr_name(gs->chroms[i], bfs[j]->hdr, s);
+            tid = ref ? sam_hdr_name2tid(bfs[j]->hdr, ref) : -1;
+            ks_clear(s);
+            if (tid >= 0 && (l = sam_hdr_tid2len(bfs[j]->hdr, tid)) > len) { len = l; }
+        }
+        w = estimate_chrom_work(bfs, nfs, gs->chroms[i], s);
+        for (beg = 0; beg == 0 || beg < len; beg += gs->win_size) {
+            end = len - beg > gs->win_size ? beg + gs->win_size : HTS_POS_MAX;
+            if (use_target(gs)) {      // skip the windows without targets.
+                snp_tcur_set(&tc, gs->targets, i, beg);
+                if (snp_tcur_seek(&tc, beg) >= end) { continue; }
+            }
+            if (*n >= m) {
+                m = m ? m << 1 : 64;
+                if (NULL == (t = (plp_unit_t*) realloc(u, sizeof(plp_unit_t) * m))) { goto fail; }
+                u = t;
+            }
+            t = u + (*n)++;
+            t->ci = i; t->beg = beg; t->end = end;
+            t->w = len > 0 ? (uint64_t) ((double) w * (min2(end, len) - beg) / len) : w;
+        }
+    }
+    ks_free(s);
+    return u;
+  fail:
+    ks_free(s);
+    free(u);
+    *n = 0;
+    return NULL;
+}
+
+/*@abstract  Keep only the units of one shard (refer to --shard).
+@param u     Pointer of array of units in order, returned by split_chroms().
+@param n     Pointer of num of units, which is updated to the num of units kept.
+@param i     Index of the shard, 0-based.
+@param m     Num of shards.
+@return      Void.
+
+@note        The units are split into @p m contiguous shards of about the same total workload, i.e., unit j goes to
+             shard floor(m * c / W), where c is the workload of the units before j plus half of unit j and W is the
+             total workload. One is added to each workload so that the windows without reads are also split. The
+             shards depend only on the windows and the input files, hence the same for any num of threads.
+ */
+static void shard_units(plp_unit_t *u, int *n, int i, int m) {
+    uint64_t c = 0, w = 0;
+    int j, k;
+    for (j = 0; j < *n; j++) { w += u[j].w + 1; }
+    for (j = k = 0; j < *n; j++) {
+        if ((int) (m * (c + (u[j].w + 1) / 2.0) / w) == i) { u[k++] = u[j]; }
+        c += u[j].w + 1;
+    }
+    *n = k;
+}
+
+static int cmp_unit_work(const void *x, const void *y) {
+    const unit_work_t *a = (const unit_work_t*) x, *b = (const unit_work_t*) y;
+    if (a->w != b->w) { return a->w < b->w ? 1 : -1; }
+    return a->i - b->i;
+}
+
 #if CSP_FIT_MULTI_SMP
 /*@abstract  Infer appropriate number of threads for multi samples to
              avoid the issue that too many open files
@@ -429,7 +876,7 @@ static inline int infer_nthread(global_settings *gs) {
     if (gs->tp_ntry == 0) { return gs->mthread; }  // the first time to try, just use the value user specified
     if (gs->tp_ntry == 1) { 
         int n0 = 3;      // FIXME!!! the initial files opened by this program. eg. the program itself and lz, lhts etc.
-        int n = gs->nin + 4 + gs->is_genotype;      // 4 is the 4 output files: base.vcf, ad.mtx, dp.mtx and oth.mtx
+        int n = gs->nin + 4 + gs->is_genotype + gs->is_sparse_geno;      // 4 is the 4 output files: base.vcf, ad.mtx, dp.mtx and oth.mtx
         int m = (gs->tp_max_open - n0) / n;
         if (m >= gs->mthread) { m = gs->mthread - 1; }
         if (m < 1) { m = 1; }
@@ -456,70 +903,119 @@ int csp_pileup(global_settings *gs) {
     /* core part. */
     int nsample = use_barcodes(gs) ? gs->nbarcode : gs->nin;
     thread_data **td = NULL, *d = NULL;
-    int ntd = 0, mtd;            // ntd: num of thread-data structures that have been created. mtd: size of td array.
+    int ntd = 0, mtd = 0;        // ntd: num of thread-data structures that have been created. mtd: size of td array.
     csp_bam_fs **bam_fs = NULL;       /* use array instead of single element to compatible with multi-input-files. */
     csp_bam_fs *bs = NULL;
+    csp_hts_pool_t *hp = NULL;
+    csp_writer_t *wrt = NULL;
+    csp_ckpt_t *ck = NULL;
+    int is_retry = 0;
+    double t0 = 0, t_run = 0;
     int nfs = 0;
-    hts_itr_t ****titer = NULL;
-    hts_itr_t ***iter = NULL;
-    hts_itr_t **itr = NULL;
-    int ntiter = 0, niter = 0, nitr = 0;
-    const char *ref = NULL;
-    char **a = NULL;
-    kstring_t ks = KS_INITIALIZE, *s = &ks;
-    int i, j, k, ret;
-    size_t ns, nr_ad, nr_dp, nr_oth, ns_merge, nr_merge;
+    plp_unit_t *units = NULL;
+    unit_work_t *uw = NULL;
+    int i, j, ret;
+    size_t ns, nr_ad, nr_dp, nr_oth, nr_gt;
     jfile_t **out_tmp_mtx_ad, **out_tmp_mtx_dp, **out_tmp_mtx_oth, **out_tmp_vcf_base, **out_tmp_vcf_cells;
+    jfile_t **out_tmp_mtx_gt, **out_tmp_mtx_pl;
     out_tmp_mtx_ad = out_tmp_mtx_dp = out_tmp_mtx_oth = out_tmp_vcf_base = out_tmp_vcf_cells = NULL;
-    /* calc number of threads and number of chroms for each thread. */
-    mtd = gs->nthread > 1 ? gs->nchrom : 1;
+    out_tmp_mtx_gt = out_tmp_mtx_pl = NULL;
+    /* create csp_bam_fs structures */
+    // open input files and construct hdr, which are shared by all threads, while the opened
+    // input handles are then moved into the pool from which each thread takes its own handles.
+    bam_fs = (csp_bam_fs**) calloc(gs->nin, sizeof(csp_bam_fs*));
+    if (NULL == bam_fs) { fprintf(stderr, "[E::%s] could not initialize csp_bam_fs* array.\n", __func__); goto fail; }
+    for (nfs = 0; nfs < gs->nin; nfs++) {
+        if (NULL == (bs = csp_bam_fs_init())) { fprintf(stderr, "[E::%s] failed to create csp_bam_fs.\n", __func__); goto fail; }
+        if (NULL == (bs->fp = csp_sam_open(gs->in_fns[nfs], csp_sam_fields(gs), gs->htp))) {
+            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfs]);
+            goto fail;
+        }
+        if (NULL == (bs->hdr = sam_hdr_read(bs->fp))) {
+            fprintf(stderr, "[E::%s] failed to read header for %s.\n", __func__, gs->in_fns[nfs]);
+            goto fail;
+        }
+        if (NULL == (bs->idx = sam_index_load(bs->fp, gs->in_fns[nfs]))) {
+            fprintf(stderr, "[E::%s] failed to load index for %s.\n", __func__, gs->in_fns[nfs]);
+            goto fail;
+        }
+        bam_fs[nfs] = bs;
+    } bs = NULL;
+    if (gs->is_out_bcf && NULL == gs->bcf_hdr_base && csp_bcf_hdr_build(gs, bam_fs[0]->hdr, gs->chroms, gs->nchrom) < 0) {
+        fprintf(stderr, "[E::%s] failed to build the BCF headers.\n", __func__);
+        goto fail;
+    }
+    /* calc number of work units. 
+       With multiple threads or shards, each chrom is split into windows and each window is one unit. */
+    if (gs->nthread > 1 || gs->nshard > 1) {
+        if (NULL == (units = split_chroms(gs, bam_fs, nfs, &mtd))) {
+            fprintf(stderr, "[E::%s] failed to split chroms into windows.\n", __func__);
+            goto fail;
+        }
+        if (gs->nshard > 1) {
+            ret = mtd;
+            shard_units(units, &mtd, gs->shard, gs->nshard);
+            fprintf(stderr, "[I::%s] shard %d/%d: pileup %d of %d windows.\n", __func__, gs->shard + 1, gs->nshard, mtd, ret);
+        }
+    } else { mtd = 1; }
+    if (0 == mtd) {       // no windows in this shard.
+        if ((ret = output_empty(gs, nsample)) < 0) { fprintf(stderr, "[E::%s] failed to output the empty files.\n", __func__); }
+        free(units);
+        for (j = 0; j < nfs; j++) { csp_bam_fs_destroy(bam_fs[j]); }
+        free(bam_fs);
+        return ret;
+    }
     /* create output tmp filenames. */
-    if (NULL == (out_tmp_mtx_ad = create_tmp_files(gs->out_mtx_ad, mtd, CSP_TMP_ZIP))) {
+    if (NULL == (out_tmp_mtx_ad = gs->is_out_stream ? create_mem_files(gs->out_mtx_ad, mtd) : \
+                     create_tmp_files(gs->out_mtx_ad, mtd, CSP_TMP_MTX_ZIP))) {
         fprintf(stderr, "[E::%s] fail to create tmp files for mtx_AD.\n", __func__);
         goto fail;
     }
-    if (NULL == (out_tmp_mtx_dp = create_tmp_files(gs->out_mtx_dp, mtd, CSP_TMP_ZIP))) {
+    if (NULL == (out_tmp_mtx_dp = gs->is_out_stream ? create_mem_files(gs->out_mtx_dp, mtd) : \
+                     create_tmp_files(gs->out_mtx_dp, mtd, CSP_TMP_MTX_ZIP))) {
         fprintf(stderr, "[E::%s] fail to create tmp files for mtx_DP.\n", __func__);
         goto fail;
     }
-    if (NULL == (out_tmp_mtx_oth = create_tmp_files(gs->out_mtx_oth, mtd, CSP_TMP_ZIP))) {
+    if (NULL == (out_tmp_mtx_oth = gs->is_out_stream ? create_mem_files(gs->out_mtx_oth, mtd) : \
+                     create_tmp_files(gs->out_mtx_oth, mtd, CSP_TMP_MTX_ZIP))) {
         fprintf(stderr, "[E::%s] fail to create tmp files for mtx_OTH.\n", __func__);
         goto fail;
     }
-    if (mtd > 1) {
-        if (NULL == (out_tmp_vcf_base = create_tmp_files(gs->out_vcf_base, mtd, CSP_TMP_ZIP))) {
-            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_BASE.\n", __func__);
+    if (gs->is_sparse_geno) {
+        if (NULL == (out_tmp_mtx_gt = gs->is_out_stream ? create_mem_files(gs->out_mtx_gt, mtd) : \
+                     create_tmp_files(gs->out_mtx_gt, mtd, CSP_TMP_MTX_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for mtx_GT.\n", __func__);
             goto fail;
         }
-        if (gs->is_genotype && NULL == (out_tmp_vcf_cells = create_tmp_files(gs->out_vcf_cells, mtd, CSP_TMP_ZIP))) {
-            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_CELLS.\n", __func__);
+        if (NULL == (out_tmp_mtx_pl = gs->is_out_stream ? create_mem_files(gs->out_mtx_pl, mtd) : \
+                     create_tmp_files(gs->out_mtx_pl, mtd, CSP_TMP_MTX_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for mtx_PL.\n", __func__);
             goto fail;
         }
     }
-    /* create csp_bam_fs structures */
-    // open input files and construct hdr for Thread-0 and 
-    // other threads would use directly hdr of Thread-0 and by themselves open input files.
-    bam_fs = (csp_bam_fs**) calloc(gs->nin, sizeof(csp_bam_fs*));
-    if (NULL == bam_fs) { fprintf(stderr, "[E::%s] could not initialize csp_bam_fs* array.\n", __func__); goto fail; }
-    for (nfs = 0; nfs < gs->nin; nfs++) {
-        if (NULL == (bs = csp_bam_fs_init())) { fprintf(stderr, "[E::%s] failed to create csp_bam_fs.\n", __func__); goto fail; }
-        if (NULL == (bs->fp = hts_open(gs->in_fns[nfs], "rb"))) {
-            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfs]);
-            goto fail;
-        }
-        if (NULL == (bs->hdr = sam_hdr_read(bs->fp))) {
-            fprintf(stderr, "[E::%s] failed to read header for %s.\n", __func__, gs->in_fns[nfs]);
+    if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {     // the BCF records are always written into tmp files (or memory), refer to output_bcf().
+        if (NULL == (out_tmp_vcf_base = gs->is_out_stream ? create_mem_files(gs->out_vcf_base, mtd) : \
+                     create_tmp_files(gs->out_vcf_base, mtd, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_BASE.\n", __func__);
             goto fail;
         }
-        if (NULL == (bs->idx = sam_index_load(bs->fp, gs->in_fns[nfs]))) {
-            fprintf(stderr, "[E::%s] failed to load index for %s.\n", __func__, gs->in_fns[nfs]);
+        if (use_vcf_cells(gs) && NULL == (out_tmp_vcf_cells = gs->is_out_stream ? \
+                create_mem_files(gs->out_vcf_cells, mtd) : create_tmp_files(gs->out_vcf_cells, mtd, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_CELLS.\n", __func__);
             goto fail;
         }
-        bam_fs[nfs] = bs;
-    } bs = NULL;
-    /* prepare hts_itr_t */
-    titer = (hts_itr_t****) calloc(mtd, sizeof(hts_itr_t***));
-    if (NULL == titer) { fprintf(stderr, "[E::%s] could not initialize hts_itr_t*** array.\n", __func__); goto fail; }
+    }
+    /* move the input handles into the pool shared by threads. */
+    if (NULL == (hp = csp_hts_pool_init(gs->in_fns, nfs, csp_hts_pool_size(gs, min2(gs->nthread, mtd)), \
+                     csp_sam_fields(gs), gs->htp, bam_fs, gs->is_out_stream ? mtd : 0))) {
+        fprintf(stderr, "[E::%s] could not create the pool of input files.\n", __func__);
+        goto fail;
+    }
+    /* start the writer, into which the threads hand their output in memory. */
+    if (gs->is_out_stream && NULL == (wrt = csp_writer_init(gs, mtd))) {
+        fprintf(stderr, "[E::%s] could not start the writer of the output files.\n", __func__);
+        goto fail;
+    }
     /* prepare data for thread pool. */
     td = (thread_data**) calloc(mtd, sizeof(thread_data*));
     if (NULL == td) { fprintf(stderr, "[E::%s] could not initialize the array of thread_data structure.\n", __func__); goto fail; }
@@ -528,114 +1024,142 @@ int csp_pileup(global_settings *gs) {
             fprintf(stderr, "[E::%s] could not initialize the thread_data structure.\n", __func__); 
             goto fail; 
         }
-        d->n = ntd; d->m = mtd > 1 ? 1 : gs->nchrom;
-        a = gs->chroms + d->n;
+        if (units) { d->n = units[ntd].ci; d->m = 1; d->beg = units[ntd].beg; d->end = units[ntd].end; }
+        else { d->n = 0; d->m = gs->nchrom; d->beg = 0; d->end = HTS_POS_MAX; }
         d->i = ntd; d->gs = gs;
         // construct csp_bam_fs
-        d->bfs = bam_fs; d->nfs = nfs;
-        // construct hts_itr_t
-        iter = (hts_itr_t***) calloc(d->m, sizeof(hts_itr_t**));
-        if (NULL == iter) { fprintf(stderr, "[E::%s] failed to allocate space for hts_itr_t***\n", __func__); goto fail; }
-        for (niter = 0; niter < d->m; niter++) {
-            itr = (hts_itr_t**) calloc(gs->nin, sizeof(hts_itr_t*));
-            if (NULL == itr) { fprintf(stderr, "[E::%s] failed to allocate space for hts_itr_t**\n", __func__); goto fail; }
-            for (nitr = 0; nitr < gs->nin; nitr++) {
-                if (NULL == (ref = csp_fmt_chr_name(a[niter], bam_fs[nitr]->hdr, s))) {
-                    fprintf(stderr, "[E::%s] could not parse name for chrom %s.\n", __func__, a[niter]);
-                    goto fail;
-                } else { ks_clear(s); }
-                if (NULL == (itr[nitr] = sam_itr_querys(bam_fs[nitr]->idx, bam_fs[nitr]->hdr, ref))) {
-                    fprintf(stderr, "[E::%s] could not parse region for chrom %s.\n", __func__, a[niter]);
-                    goto fail;
-                }
-            }
-            iter[niter] = itr;
-        } itr = NULL;
-        titer[ntiter++] = iter;
-        d->iter = iter; d->niter = niter; d->nitr = nitr; iter = NULL;
-      #if DEBUG
-        assert(niter == d->m);
-        assert(nitr == gs->nin);
-      #endif
+        d->bfs = bam_fs; d->nfs = nfs; d->hp = hp; d->wrt = wrt;
+        // the hts_itr_t of the unit are created by the thread, refer to plp_itr_create().
         // construct thdata
         d->out_mtx_ad = out_tmp_mtx_ad[ntd]; d->out_mtx_dp = out_tmp_mtx_dp[ntd]; d->out_mtx_oth = out_tmp_mtx_oth[ntd];
-        if (mtd > 1) {
-            d->out_vcf_base = out_tmp_vcf_base[ntd]; d->out_vcf_cells = gs->is_genotype ? out_tmp_vcf_cells[ntd] : NULL;
+        if (gs->is_sparse_geno) { d->out_mtx_gt = out_tmp_mtx_gt[ntd]; d->out_mtx_pl = out_tmp_mtx_pl[ntd]; }
+        if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {
+            d->out_vcf_base = out_tmp_vcf_base[ntd]; d->out_vcf_cells = use_vcf_cells(gs) ? out_tmp_vcf_cells[ntd] : NULL;
         } else {
-            d->out_vcf_base = gs->out_vcf_base; d->out_vcf_cells = gs->is_genotype ? gs->out_vcf_cells : NULL;
+            d->out_vcf_base = gs->out_vcf_base; d->out_vcf_cells = use_vcf_cells(gs) ? gs->out_vcf_cells : NULL;
         }
         td[ntd] = d;
     } d = NULL;
-    // clean hdr
-    for (i = 0; i < nfs; i++) { sam_hdr_destroy(bam_fs[i]->hdr); bam_fs[i]->hdr = NULL; }
-    // clean idx
-    for (i = 0; i < nfs; i++) { hts_idx_destroy(bam_fs[i]->idx); bam_fs[i]->idx = NULL; }
-    // run threads
+    /* checkpoint the units, whose tmp files are then kept in the output dir if the run fails, refer to --resume.
+       With one unit, the vcf is written into the output file directly, hence not checkpointed. */
+    if (mtd > 1 && NULL == wrt) {
+        if (NULL == (ck = csp_ckpt_init(gs, "pileup", td, mtd))) {
+            fprintf(stderr, "[E::%s] could not create the checkpoint.\n", __func__);
+            goto fail;
+        }
+        for (i = 0; i < mtd; i++) { td[i]->ck = ck; }
+    }
+    /* the units (chroms) are submitted in decreasing order of workload, so that the largest chroms would
+       not be left to the end while other threads are idle. The outputs are still merged in order of units. 
+       When streaming the output, the units are submitted in order, so that the unit being written by the
+       writer is always taken before the others, refer to csp_writer_t. */
     if (mtd > 1) {
+        if (NULL == (uw = (unit_work_t*) malloc(sizeof(unit_work_t) * mtd))) {
+            fprintf(stderr, "[E::%s] could not allocate the array of unit workload.\n", __func__);
+            goto fail;
+        }
+        for (i = 0; i < mtd; i++) { uw[i].i = i; uw[i].w = units[i].w; }
+        qsort(uw, mtd, sizeof(unit_work_t), cmp_unit_work);
+    }
+    // the hdr and idx are kept until all threads finish, as the units query them for their iterators.
+    // run threads
+    t0 = csp_prof_now();
+    if (gs->tp && mtd > 1) {
         for (i = 0; i < mtd; i++) {
-            if (thpool_add_work(gs->tp, (void*) csp_pileup_core, td[i]) < 0) {
-                fprintf(stderr, "[E::%s] could not add thread work (No. %d)\n", __func__, i);
+            j = wrt ? i : uw[i].i;
+            if (ck && ck->is_done[j]) { continue; }     // finished by the previous run.
+            if (thpool_add_work(gs->tp, (void*) csp_pileup_core, td[j]) < 0) {
+                fprintf(stderr, "[E::%s] could not add thread work (No. %d)\n", __func__, j);
                 goto fail;
             }
         }
         thpool_wait(gs->tp);
-    } else { csp_pileup_core(td[0]); }
+    } else {        // the windows of one shard are run one by one with one thread.
+        for (i = 0; i < mtd; i++) {
+            if (ck && ck->is_done[i]) { continue; }
+            csp_pileup_core(td[i]);
+            if (td[i]->ret < 0) { break; }
+        }
+    }
     /* check running status of threads. */
   #if DEBUG
     for (i = 0; i < mtd; i++) { fprintf(stderr, "[D::%s] ret of thread-%d is %d\n", __func__, i, td[i]->ret); }
   #endif
     for (i = 0; i < mtd; i++) { if (td[i]->ret < 0) goto fail; }
-    /* merge tmp files. */
-    ns = nr_ad = nr_dp = nr_oth = 0;
-    for (i = 0; i < mtd; i++) {
-        nr_ad += td[i]->nr_ad; nr_dp += td[i]->nr_dp; nr_oth += td[i]->nr_oth;
-        ns += td[i]->ns;
-    }
-    if (jf_open(gs->out_mtx_ad, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx AD.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_ad, "%ld\t%d\t%ld\n", ns, nsample, nr_ad);
-    merge_mtx(gs->out_mtx_ad, out_tmp_mtx_ad, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_ad) { fprintf(stderr, "[E::%s] failed to merge mtx AD.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_ad);
-
-    if (jf_open(gs->out_mtx_dp, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx DP.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_dp, "%ld\t%d\t%ld\n", ns, nsample, nr_dp);
-    merge_mtx(gs->out_mtx_dp, out_tmp_mtx_dp, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_dp) { fprintf(stderr, "[E::%s] failed to merge mtx DP.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_dp);
-
-    if (jf_open(gs->out_mtx_oth, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx OTH.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_oth, "%ld\t%d\t%ld\n", ns, nsample, nr_oth);
-    merge_mtx(gs->out_mtx_oth, out_tmp_mtx_oth, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_oth) { fprintf(stderr, "[E::%s] failed to merge mtx OTH.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_oth);
-
-    if (mtd > 1) {
-        if (jf_open(gs->out_vcf_base, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf BASE.\n", __func__); goto fail; }
-        merge_vcf(gs->out_vcf_base, out_tmp_vcf_base, mtd, &ret);
-        if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf BASE.\n", __func__); goto fail; }
-        jf_close(gs->out_vcf_base);
+    if (gs->prefetch > 0) { thdata_print_rdr_stat(stderr, td, mtd, gs->prefetch); }
+    t_run = csp_prof_now() - t0; t0 = csp_prof_now();
+    /* merge tmp files, or wait for the writer, which has written the output while the threads run. */
+    if (wrt) {
+        if ((ret = csp_writer_finish(wrt)) < 0) {
+            fprintf(stderr, "[E::%s] failed to write the output.\n", __func__);
+            goto fail;
+        } else if (ret > 0) { fprintf(stderr, "[W::%s] failed to index the BCF files, the SNPs may be unsorted.\n", __func__); }
+    } else {
+        ns = nr_ad = nr_dp = nr_oth = nr_gt = 0;
+        for (i = 0; i < mtd; i++) {
+            nr_ad += td[i]->nr_ad; nr_dp += td[i]->nr_dp; nr_oth += td[i]->nr_oth; nr_gt += td[i]->nr_gt;
+            ns += td[i]->ns;
+        }
+        if (output_mtx(gs->out_mtx_ad, out_tmp_mtx_ad, mtd, 1, ns, nsample, nr_ad) < 0) {
+            fprintf(stderr, "[E::%s] failed to merge mtx AD.\n", __func__);
+            goto fail;
+        }
+        if (output_mtx(gs->out_mtx_dp, out_tmp_mtx_dp, mtd, 1, ns, nsample, nr_dp) < 0) {
+            fprintf(stderr, "[E::%s] failed to merge mtx DP.\n", __func__);
+            goto fail;
+        }
+        if (output_mtx(gs->out_mtx_oth, out_tmp_mtx_oth, mtd, 1, ns, nsample, nr_oth) < 0) {
+            fprintf(stderr, "[E::%s] failed to merge mtx OTH.\n", __func__);
+            goto fail;
+        }
+        if (gs->is_sparse_geno) {
+            if (output_mtx(gs->out_mtx_gt, out_tmp_mtx_gt, mtd, 1, ns, nsample, nr_gt) < 0) {
+                fprintf(stderr, "[E::%s] failed to merge mtx GT.\n", __func__);
+                goto fail;
+            }
+            if (output_mtx(gs->out_mtx_pl, out_tmp_mtx_pl, mtd, gs->double_gl ? 5 : 3, ns, nsample, nr_gt) < 0) {
+                fprintf(stderr, "[E::%s] failed to merge mtx PL.\n", __func__);
+                goto fail;
+            }
+        }
+        if (gs->is_out_bcf) {
+            if ((ret = output_bcf(gs->out_vcf_base, gs->bcf_hdr_base, out_tmp_vcf_base, mtd, gs->nthread)) < 0) {
+                fprintf(stderr, "[E::%s] failed to merge BCF BASE.\n", __func__);
+                goto fail;
+            } else if (ret > 0) { fprintf(stderr, "[W::%s] failed to index BCF BASE, the SNPs may be unsorted.\n", __func__); }
+            if (use_vcf_cells(gs)) {
+                if ((ret = output_bcf(gs->out_vcf_cells, gs->bcf_hdr_cells, out_tmp_vcf_cells, mtd, gs->nthread)) < 0) {
+                    fprintf(stderr, "[E::%s] failed to merge BCF CELLS.\n", __func__);
+                    goto fail;
+                } else if (ret > 0) { fprintf(stderr, "[W::%s] failed to index BCF CELLS, the SNPs may be unsorted.\n", __func__); }
+            }
+        } else if (mtd > 1) {
+            if (jf_open(gs->out_vcf_base, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf BASE.\n", __func__); goto fail; }
+            merge_vcf(gs->out_vcf_base, out_tmp_vcf_base, mtd, &ret);
+            if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf BASE.\n", __func__); goto fail; }
+            jf_close(gs->out_vcf_base);
 
-        if (gs->is_genotype) {
-            if (jf_open(gs->out_vcf_cells, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf CELLS.\n", __func__); goto fail; }
-            merge_vcf(gs->out_vcf_cells, out_tmp_vcf_cells, mtd, &ret);
-            if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf CELLS.\n", __func__); goto fail; }    
-            jf_close(gs->out_vcf_cells);     
+            if (use_vcf_cells(gs)) {
+                if (jf_open(gs->out_vcf_cells, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf CELLS.\n", __func__); goto fail; }
+                merge_vcf(gs->out_vcf_cells, out_tmp_vcf_cells, mtd, &ret);
+                if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf CELLS.\n", __func__); goto fail; }    
+                jf_close(gs->out_vcf_cells);     
+            }
         }
     }
+    if (gs->is_profile && csp_prof_output(gs, "pileup", td, mtd, t_run, csp_prof_now() - t0) < 0) {
+        fprintf(stderr, "[W::%s] failed to output the profile.\n", __func__);
+    }
     /* clean */
+    csp_ckpt_destroy(ck, NULL); ck = NULL;
+    csp_writer_destroy(wrt); wrt = NULL;
     for (i = 0; i < mtd; i++) { thdata_destroy(td[i]); }
     free(td); td = NULL;
-    ks_free(s); s = NULL;
-    for (i = 0; i < ntiter; i++) {
-        for (j = 0; j < niter; j++) {
-            for (k = 0; k < nitr; k++) { hts_itr_destroy(titer[i][j][k]); }
-            free(titer[i][j]);
-        }
-        free(titer[i]);
-    }
-    free(titer); titer = NULL;
+    free(uw); uw = NULL;
+    free(units); units = NULL;
     // hdr of other thdata should be set to NULL before being destroyed
     // otherwise will cause double free error!
+    csp_hts_pool_destroy(hp); hp = NULL;
     for (j = 0; j < nfs; j++) { csp_bam_fs_destroy(bam_fs[j]); }
     free(bam_fs); bam_fs = NULL;
     if (destroy_tmp_files(out_tmp_mtx_ad, mtd) < 0) {
@@ -647,11 +1171,19 @@ int csp_pileup(global_settings *gs) {
     if (destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
         fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
     } out_tmp_mtx_oth = NULL;
-    if (mtd > 1) {
+    if (gs->is_sparse_geno) {
+        if (destroy_tmp_files(out_tmp_mtx_gt, mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp mtx GT files.\n", __func__);
+        } out_tmp_mtx_gt = NULL;
+        if (destroy_tmp_files(out_tmp_mtx_pl, mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp mtx PL files.\n", __func__);
+        } out_tmp_mtx_pl = NULL;
+    }
+    if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {
         if (destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
             fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
         } out_tmp_vcf_base = NULL;
-        if (gs->is_genotype) {         
+        if (use_vcf_cells(gs)) {         
             if (destroy_tmp_files(out_tmp_vcf_cells, mtd) < 0) {
                 fprintf(stderr, "[W::%s] failed to remove tmp vcf CELLS files.\n", __func__);
             } out_tmp_vcf_cells = NULL;
@@ -659,34 +1191,20 @@ int csp_pileup(global_settings *gs) {
     }
     return 0;
   fail:
+  #if CSP_FIT_MULTI_SMP
+    is_retry = gs->tp_errno & TP_EMFILE && ! (gs->tp_errno & TP_EUNDEF) && gs->nthread > 1;
+  #endif
+    if (ck) { csp_ckpt_destroy(ck, is_retry ? NULL : td); }  // the units would be re-split when re-trying.
+    if (wrt) { csp_writer_destroy(wrt); }    // the output files are truncated to the headers.
     if (td) {
         for (i = 0; i < mtd; i++) { thdata_destroy(td[i]); }
         free(td);
     }
     if (d) { thdata_destroy(d); }
-    if (s) { ks_free(s); }
-    if (titer) {
-        for (i = 0; i < ntiter; i++) {
-            for (j = 0; j < niter; j++) {
-                for (k = 0; k < nitr; k++) { hts_itr_destroy(titer[i][j][k]); }
-                free(titer[i][j]);
-            }
-            free(titer[i]);
-        }
-        free(titer);
-    }
-    if (iter) {
-        for (j = 0; j < niter; j++) {
-            for (k = 0; k < nitr; k++) { hts_itr_destroy(iter[j][k]); }
-            free(iter[j]);
-        }
-        free(iter);        
-    }
-    if (itr) {
-        for (k = 0; k < nitr; k++) { hts_itr_destroy(itr[k]); }
-        free(itr);
-    }
+    if (uw) { free(uw); }
+    if (units) { free(units); }
     if (bs) { csp_bam_fs_destroy(bs); }
+    if (hp) { csp_hts_pool_destroy(hp); }
     if (bam_fs) {
         for (j = 0; j < nfs; j++) { csp_bam_fs_destroy(bam_fs[j]); }
         free(bam_fs);
@@ -700,7 +1218,13 @@ int csp_pileup(global_settings *gs) {
     if (out_tmp_mtx_oth && destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
         fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
     }
-    if (mtd > 1) {
+    if (out_tmp_mtx_gt && destroy_tmp_files(out_tmp_mtx_gt, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp mtx GT files.\n", __func__);
+    }
+    if (out_tmp_mtx_pl && destroy_tmp_files(out_tmp_mtx_pl, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp mtx PL files.\n", __func__);
+    }
+    if (mtd > 1 || gs->is_out_bcf || gs->is_out_stream) {
         if (out_tmp_vcf_base && destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
             fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
         }
@@ -712,9 +1236,11 @@ int csp_pileup(global_settings *gs) {
     if (jf_isopen(gs->out_mtx_dp)) { jf_close(gs->out_mtx_dp); }
     if (jf_isopen(gs->out_mtx_oth)) { jf_close(gs->out_mtx_oth); }
     if (jf_isopen(gs->out_vcf_base)) { jf_close(gs->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(gs->out_vcf_cells)) { jf_close(gs->out_vcf_cells); }
+    if (use_vcf_cells(gs) && jf_isopen(gs->out_vcf_cells)) { jf_close(gs->out_vcf_cells); }
+    if (gs->is_sparse_geno && jf_isopen(gs->out_mtx_gt)) { jf_close(gs->out_mtx_gt); }
+    if (gs->is_sparse_geno && jf_isopen(gs->out_mtx_pl)) { jf_close(gs->out_mtx_pl); }
   #if CSP_FIT_MULTI_SMP
-    if (gs->tp_errno & TP_EMFILE && ! (gs->tp_errno & TP_EUNDEF) && gs->nthread > 1) {
+    if (is_retry) {
         fprintf(stderr, "================================================================================\n");
         fprintf(stderr, "[W::%s] Last try (nthreads = %d) failed due to the issue of too many open files.\n",
                          __func__, gs->nthread);
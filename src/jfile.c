@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <zlib.h>
@@ -31,26 +32,33 @@ inline jfile_t* jf_init(void) {
 
 inline void jf_destroy(jfile_t* p) {
     if (p) {
-        if (p->is_open) {
+        if (p->is_open && ! p->is_mem) {
             if (p->is_zip) { jf_zclose(p->zfp); p->zfp = NULL; }
             else { fclose(p->fp); p->fp = NULL; }
         }
         ks_free(p->buf);
+        free(p->ibuf);
         free(p->fn); free(p);
     }
 }
 
 inline void jf_set_bufsize(jfile_t *p, size_t bufsize) { p->bufsize = bufsize; }
 
+inline void jf_set_tpool(jfile_t *p, hts_tpool *tpool) { p->tpool = tpool; }
+
 /* If the jfile_t is open. 0:no; 1:yes. */
 inline int jf_isopen(jfile_t *p) { return p->is_open; }
 
 inline int jf_open(jfile_t *p, char *mode) {
     if (p->is_open) { return 0; }
+    if (p->is_mem) { p->is_open = 1; return 1; }
     char *fm = mode ? mode : p->fm;
     if (p->is_zip) {
         if (NULL == (p->zfp = jf_zopen(p->fn, fm))) { return -1; }
-        else { p->is_open = 1; return 1; }
+      #if (JF_ZIP_TYPE == JF_BGZIP)
+        if (p->tpool && bgzf_thread_pool(p->zfp, p->tpool, 0) < 0) { jf_zclose(p->zfp); p->zfp = NULL; return -1; }
+      #endif
+        p->is_open = 1; return 1;
     } else if (NULL == (p->fp = fopen(p->fn, fm))) {
         return -1;
     } else { p->is_open = 1; return 1; }
@@ -71,6 +79,7 @@ inline int jf_getln(jfile_t *p, kstring_t *s) {
 
 inline int jf_flush(jfile_t *p) {
     ssize_t l, l0 = ks_len(p->buf);
+    if (p->is_mem) { return 0; }
     l = p->is_zip ? jf_zwrite(p->zfp, ks_str(p->buf), ks_len(p->buf)) : fwrite(ks_str(p->buf), 1, ks_len(p->buf), p->fp);
     ks_clear(p->buf);
     return l == l0 ? 0 : EOF;
@@ -114,19 +123,72 @@ inline int jf_write(jfile_t *p, char *buf, size_t len) {
     return l;
 }
 
+inline int jf_put_uint(uint64_t x, jfile_t *p) {
+    int l;
+    l = kputuint(x, p->buf);
+    if (ks_len(p->buf) >= p->bufsize && jf_flush(p) < 0) { return EOF; }
+    return l;
+}
+
+/*@note  llrint() rounds half to even under the default rounding mode, as printf() does. Values that could not be
+         represented in long long (including inf and nan) fall back to jf_printf().
+ */
+inline int jf_put_round(double x, jfile_t *p) {
+    long long r;
+    int l;
+    if (! (fabs(x) < 9e18)) { return jf_printf(p, "%.0f", x); }
+    r = llrint(x);
+    if (r < 0) { l = kputc_('-', p->buf) < 0 ? EOF : 1 + kputuint(-r, p->buf); }
+    else if (0 == r && signbit(x)) { l = kputsn_("-0", 2, p->buf) < 0 ? EOF : 2; }
+    else { l = kputuint(r, p->buf); }
+    if (ks_len(p->buf) >= p->bufsize && jf_flush(p) < 0) { return EOF; }
+    return l;
+}
+
+inline int jf_put_varint(uint64_t x, jfile_t *p) {
+    int l;
+    l = kputvarint(x, p->buf);
+    if (ks_len(p->buf) >= p->bufsize && jf_flush(p) < 0) { return EOF; }
+    return l;
+}
+
+inline int jf_get_varint(jfile_t *p, uint64_t *x) {
+    ssize_t l;
+    uint64_t v = 0;
+    int i, c, shift = 0;
+    if (NULL == p->ibuf && NULL == (p->ibuf = (char*) malloc(p->bufsize))) { return -1; }
+    for (i = 0; ; i++) {
+        if (p->ipos >= p->ilen) {
+            if ((l = jf_read(p, p->ibuf, p->bufsize)) < 0) { return -1; }
+            if (0 == l) { return i ? -1 : 0; }
+            p->ilen = l; p->ipos = 0;
+        }
+        c = (unsigned char) p->ibuf[p->ipos++];
+        if (shift > 63) { return -1; }
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (! (c & 0x80)) { break; }
+        shift += 7;
+    }
+    *x = v;
+    return 1;
+}
+
 //@note        Even fail, the jfile_t will still be set to not open.
 inline int jf_close(jfile_t *p) {
     int ret = 0;
+    if (p->is_open && p->is_mem) { p->is_open = 0; }
     if (p->is_open) {
         if (ks_len(p->buf) && jf_flush(p) < 0) { ret = EOF; } // only for write mode.
         if (p->is_zip) { jf_zclose(p->zfp); p->zfp = NULL; }
         else { fclose(p->fp); p->fp = NULL; }
         p->is_open = 0;
-    } 
+    }
+    if (p->ibuf) { free(p->ibuf); p->ibuf = NULL; p->ilen = p->ipos = 0; }
     return ret;
 }
 
 inline int jf_remove(jfile_t *p) {
+    if (p->is_mem) { return 0; }
     if (0 != access(p->fn, F_OK)) { return 0; }
     if (remove(p->fn) < 0) { return -1; }
     return 1;
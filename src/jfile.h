@@ -5,6 +5,7 @@
 #define SZ_JFILE_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <zlib.h>
@@ -51,11 +52,20 @@ static inline int jf_bgzf_gets(BGZF *fp, kstring_t *s);
 @param is_zip  If the outputed file should be zipped.
 @param is_tmp  If the outputed file is a tmp file. It's only used by mtx file and has no effect on I/O.
 @param is_open If the outputed file is open.
+@param is_mem  If the content is kept in the Output buffer rather than written into file, i.e. the buffer is
+               never flushed and the caller takes the content from @p buf directly.
 @param buf     Mimic Output Buffer.
 @param bufsize Size of buffer.
+@param ibuf    Input buffer used only by jf_get_varint().
+@param ilen    Size of content in @p ibuf.
+@param ipos    Pos of the next byte to be read in @p ibuf.
+@param tpool   Pointer of htslib thread pool attached to the BGZF handle when it's open, NULL means no pool.
 @note          1. The @p fn should be valid pointer coming from strdup().
                2. The @p fm points to const string, so do not free it!
                3. Output buffer is inside the structure.
+               4. @p tpool is shared, do not free it! It's only used when JF_ZIP_TYPE is JF_BGZIP.
+               5. @p ibuf is allocated when jf_get_varint() is firstly called and is freed when jf_close() is called.
+               6. When @p is_mem is 1, jf_open() and jf_close() only set @p is_open, and jf_remove() does nothing.
 @TODO  Add is_error to save the state that if I/O has error.
  */
 typedef struct {
@@ -63,9 +73,12 @@ typedef struct {
     char *fm;
     JF_ZFILE zfp;
     FILE *fp;
-    uint8_t is_zip, is_tmp, is_open;
+    uint8_t is_zip, is_tmp, is_open, is_mem;
     kstring_t ks, *buf;
     size_t bufsize;
+    char *ibuf;
+    size_t ilen, ipos;
+    hts_tpool *tpool;
 } jfile_t;
 
 /*@abstract  Initialize the jfile_t structure.
@@ -75,6 +88,8 @@ typedef struct {
 inline jfile_t* jf_init(void); 
 inline void jf_destroy(jfile_t* p);
 inline void jf_set_bufsize(jfile_t *p, size_t bufsize);
+/* Set the thread pool used by BGZF compression/decompression. It takes effect when the jfile_t is opened next time. */
+inline void jf_set_tpool(jfile_t *p, hts_tpool *tpool);
 
 /* If the jfile_t is open. 0:no; 1:yes. */
 inline int jf_isopen(jfile_t *p);
@@ -117,6 +132,87 @@ inline int jf_putc_(int c, jfile_t *p);
 inline int jf_puts(const char *s, jfile_t *p); 
 inline int jf_write(jfile_t *p, char *buf, size_t len);
 
+/*@abstract  Append an unsigned integer to kstring_t as LEB128 varint, i.e. 7 bits each byte from the lowest bits
+             and the highest bit of each byte marks if there are more bytes.
+@param x     The integer.
+@param s     Pointer of kstring_t.
+@return      Num of bytes appended if success, EOF otherwise.
+ */
+static inline int kputvarint(uint64_t x, kstring_t *s) {
+    unsigned char b[10];
+    int l = 0;
+    while (x >= 0x80) { b[l++] = (x & 0x7f) | 0x80; x >>= 7; }
+    b[l++] = x;
+    return kputsn_((char*) b, l, s) < 0 ? EOF : l;
+}
+
+/*@abstract  Get an unsigned integer that is appended by kputvarint() from a buffer.
+@param s     Pointer of the buffer.
+@param l     Size of the buffer.
+@param i     Pointer of the pos of the next byte to be read, which is moved forward if success.
+@param x     Pointer of the integer.
+@return      1 if success, 0 if end of buffer, -1 if the varint is truncated or too long.
+ */
+static inline int kgetvarint(const char *s, size_t l, size_t *i, uint64_t *x) {
+    uint64_t v = 0;
+    size_t j = *i;
+    int c, shift = 0;
+    if (j >= l) { return 0; }
+    do {
+        if (j >= l || shift > 63) { return -1; }
+        c = (unsigned char) s[j++];
+        v |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    *i = j; *x = v;
+    return 1;
+}
+
+/*@abstract  Digit pairs "00" to "99" used by kputuint(). */
+static const char jf_digits2[] = 
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/*@abstract  Append an unsigned integer to kstring_t in decimal, i.e. the same as kputuw() but for 64 bits and
+             two digits each step.
+@param x     The integer.
+@param s     Pointer of kstring_t.
+@return      Num of bytes appended if success, EOF otherwise.
+ */
+static inline int kputuint(uint64_t x, kstring_t *s) {
+    char b[20];
+    int l = 20, r;
+    while (x >= 100) { r = (x % 100) << 1; x /= 100; b[--l] = jf_digits2[r + 1]; b[--l] = jf_digits2[r]; }
+    if (x >= 10) { r = x << 1; b[--l] = jf_digits2[r + 1]; b[--l] = jf_digits2[r]; }
+    else { b[--l] = '0' + x; }
+    return kputsn(b + l, 20 - l, s) < 0 ? EOF : 20 - l;
+}
+
+/*@abstract  Output an unsigned integer in decimal (refer to kputuint()) with Output buffer. 
+@return      Num of bytes outputed if success, EOF otherwise.
+ */
+inline int jf_put_uint(uint64_t x, jfile_t *p);
+
+/*@abstract  Output a double rounded to integer with Output buffer, the same as "%.0f" in printf(), e.g. 
+             "-0" for -0.2 and "2" for 2.5.
+@return      Num of bytes outputed if success, EOF otherwise.
+ */
+inline int jf_put_round(double x, jfile_t *p);
+
+/*@abstract  Output an unsigned integer as varint (refer to kputvarint()) with Output buffer. 
+@return      Num of bytes outputed if success, EOF otherwise.
+ */
+inline int jf_put_varint(uint64_t x, jfile_t *p);
+
+/*@abstract  Get an unsigned integer that is outputed by jf_put_varint(). 
+@param p     Pointer of jfile_t.
+@param x     Pointer of the integer.
+@return      1 if success, 0 if end-of-file, -1 if error or the varint is truncated.
+
+@note        Content is read into the Input buffer of @p p, so do not mix this function with jf_read()/jf_getln().
+ */
+inline int jf_get_varint(jfile_t *p, uint64_t *x);
+
 /*@abstract  Close jfile_t but does not destroy it.
 @param p     Pointer of jfile_t.
 @return      0 if success, EOF otherwise.
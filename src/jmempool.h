@@ -5,6 +5,7 @@
 #define SZ_JMEMPOOL_H
 
 #include <stdlib.h>
+#include <string.h>
 #include "htslib/kstring.h"        // do not use "kstring.h" as it's different from "htslib/kstring.h"
 
 /* 
@@ -167,4 +168,105 @@ The jmempool_##name##_t
  */
 #define jmempool_A(name, p, i) jmempool_A_##name(p, i)
 
+/*
+* ARENA
+ */
+
+/* The JARENA is a bump-pointer allocator for temporary data with the same lifetime, e.g. data of one SNP.
+The memory is allocated from big blocks and is never freed one by one; instead the whole arena is reset
+in O(1) time and the blocks are reused, so that no heap calls happen in steady state.
+
+An example:
+    jarena_t *a = jarena_init(0);
+    char *s = jarena_strdup(a, "ACGT");
+    int *x = (int*) jarena_alloc(a, sizeof(int) * 10);
+    // do something.
+    jarena_reset(a);       // s and x are invalid from now on.
+    jarena_destroy(a);
+ */
+
+#define JARENA_BLK_SIZE 65536
+#define JARENA_ALIGN 8
+
+/*@abstract    One memory block of the arena.
+@param next    Pointer to the next block.
+@param size    Size of @p data.
+@param data    The memory.
+ */
+typedef struct jarena_blk_t {
+    struct jarena_blk_t *next;
+    size_t size;
+    char data[];
+} jarena_blk_t;
+
+/*@abstract    The arena structure.
+@param head    Pointer to the first block.
+@param cur     Pointer to the block being used.
+@param off     Offset of the unused memory in @p cur.
+@param bsize   Default size of new blocks.
+ */
+typedef struct {
+    jarena_blk_t *head, *cur;
+    size_t off, bsize;
+} jarena_t;
+
+/*@abstract    Initialize an arena.
+@param bsize   Default size of blocks, 0 means JARENA_BLK_SIZE.
+@return        Pointer to the arena if success, NULL otherwise.
+ */
+static inline jarena_t* jarena_init(size_t bsize) {
+    jarena_t *a = (jarena_t*) calloc(1, sizeof(jarena_t));
+    if (a) { a->bsize = bsize ? bsize : JARENA_BLK_SIZE; }
+    return a;
+}
+
+static inline void jarena_destroy(jarena_t *a) {
+    jarena_blk_t *b, *t;
+    if (a) {
+        for (b = a->head; b; b = t) { t = b->next; free(b); }
+        free(a);
+    }
+}
+
+/*@abstract    Release all memory allocated from the arena for reuse, the blocks are kept. */
+static inline void jarena_reset(jarena_t *a) { a->cur = a->head; a->off = 0; }
+
+/*@abstract    Allocate memory from the arena.
+@param a       Pointer to the arena.
+@param n       Size of memory.
+@return        Pointer to the memory (aligned to JARENA_ALIGN) if success, NULL otherwise.
+
+@note          A new block is inserted after the current one only when the following blocks are used up,
+               or too small for @p n.
+ */
+static inline void* jarena_alloc(jarena_t *a, size_t n) {
+    jarena_blk_t *b;
+    void *p;
+    n = (n + JARENA_ALIGN - 1) & ~((size_t) JARENA_ALIGN - 1);
+    if (NULL == a->cur || a->off + n > a->cur->size) {
+        b = a->cur ? a->cur->next : a->head;
+        if (NULL == b || n > b->size) {
+            size_t size = n > a->bsize ? n : a->bsize;
+            if (NULL == (b = (jarena_blk_t*) malloc(sizeof(jarena_blk_t) + size))) { return NULL; }
+            b->size = size;
+            if (a->cur) { b->next = a->cur->next; a->cur->next = b; }
+            else { b->next = a->head; a->head = b; }
+        }
+        a->cur = b; a->off = 0;
+    }
+    p = a->cur->data + a->off;
+    a->off += n;
+    return p;
+}
+
+/*@abstract    Copy the string into the arena.
+@return        Pointer to the copied string if success, NULL otherwise.
+ */
+static inline char* jarena_strdup(jarena_t *a, const char *s) {
+    size_t l = strlen(s) + 1;
+    char *p = (char*) jarena_alloc(a, l);
+    if (p) { memcpy(p, s, l); }
+    return p;
+}
+
 #endif
@@ -0,0 +1,171 @@
+/* Bounded ring buffers filled by a producer thread and drained by one consumer
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "jring.h"
+
+static inline double jring_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+jring_t* jring_init(int n, int m, void* (*init)(void), void (*destroy)(void*)) {
+    jring_t *p;
+    int i;
+    if (NULL == (p = (jring_t*) calloc(1, sizeof(jring_t)))) { return NULL; }
+    p->n = n; p->m = m; p->init = init; p->destroy = destroy;
+    p->a = (void**) calloc((size_t) n * m, sizeof(void*));
+    p->code = (uint8_t*) calloc((size_t) n * m, sizeof(uint8_t));
+    p->head = (size_t*) calloc(n * 6, sizeof(size_t));
+    if (NULL == p->a || NULL == p->code || NULL == p->head) { goto fail; }
+    p->tail = p->head + n; p->ptail = p->tail + n; p->phead = p->ptail + n;
+    p->chead = p->phead + n; p->ctail = p->chead + n;
+    for (i = 0; i < n * m; i++) {
+        if (NULL == (p->a[i] = init())) { goto fail; }
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond_put, NULL);
+    pthread_cond_init(&p->cond_get, NULL);
+    return p;
+  fail:
+    if (p->a) {
+        for (i = 0; i < n * m; i++) { if (p->a[i]) { destroy(p->a[i]); } }
+        free(p->a);
+    }
+    free(p->code); free(p->head);
+    free(p);
+    return NULL;
+}
+
+void jring_destroy(jring_t *p) {
+    int i;
+    if (p) {
+        jring_stop(p);
+        for (i = 0; i < p->n * p->m; i++) { p->destroy(p->a[i]); }
+        free(p->a); free(p->code); free(p->head);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond_put);
+        pthread_cond_destroy(&p->cond_get);
+        free(p);
+    }
+}
+
+/*@abstract  Publish the filled slots of stream @p i and refresh the snapshot of released ones.
+@return      1 if the consumer asked to stop, 0 otherwise.
+ */
+static inline int jring_publish(jring_t *p, int i) {
+    int is_stop;
+    pthread_mutex_lock(&p->lock);
+    p->tail[i] = p->ptail[i];
+    p->phead[i] = p->head[i];
+    is_stop = p->is_stop;
+    pthread_cond_broadcast(&p->cond_get);
+    pthread_mutex_unlock(&p->lock);
+    return is_stop;
+}
+
+/*@note  The items of one stream are filled in batches of JRING_BATCH, the streams in turn. */
+static void* jring_run(void *args) {
+    jring_t *p = (jring_t*) args;
+    uint8_t *act = NULL;
+    double t0;
+    int i, k, r, nact, nfill, is_full;
+    size_t j;
+    if (NULL == (act = (uint8_t*) malloc(p->n))) { goto fail; }
+    while ((r = p->next(p->data)) == 0) {
+        for (i = 0; i < p->n; i++) { act[i] = 1; }
+        nact = p->n;
+        while (nact > 0) {
+            for (i = 0, nfill = 0; i < p->n; i++) {
+                if (! act[i]) { continue; }
+                for (k = 0; k < JRING_BATCH && p->ptail[i] - p->phead[i] < p->m; k++) {
+                    j = (size_t) i * p->m + p->ptail[i] % p->m;
+                    if ((r = p->read(p->data, i, p->a[j])) < 0) { goto fail; }
+                    p->code[j] = r; p->ptail[i]++;
+                    if (r > 0) { act[i] = 0; nact--; k++; break; }
+                }
+                if (k > 0) {
+                    nfill += k;
+                    if (jring_publish(p, i)) { goto stop; }
+                }
+            }
+            if (nfill || nact <= 0) { continue; }
+            /* the rings of all active streams are full. */
+            pthread_mutex_lock(&p->lock);
+            t0 = jring_now();
+            while (1) {
+                for (i = 0, is_full = 1; i < p->n; i++) {
+                    p->phead[i] = p->head[i];
+                    if (act[i] && p->ptail[i] - p->phead[i] < p->m) { is_full = 0; }
+                }
+                if (! is_full || p->is_stop) { break; }
+                pthread_cond_wait(&p->cond_put, &p->lock);
+            }
+            p->wait_put += jring_now() - t0;
+            if (p->is_stop) { pthread_mutex_unlock(&p->lock); goto stop; }
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    if (r < 0) { goto fail; }
+  stop:
+    free(act);
+    pthread_mutex_lock(&p->lock);
+    p->state = 1;
+    pthread_cond_broadcast(&p->cond_get);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+  fail:
+    fprintf(stderr, "[E::%s] the producer failed.\n", __func__);
+    free(act);
+    pthread_mutex_lock(&p->lock);
+    p->state = -1;
+    pthread_cond_broadcast(&p->cond_get);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int jring_start(jring_t *p, jring_read_f read, jring_next_f next, void *data) {
+    p->read = read; p->next = next; p->data = data;
+    if (pthread_create(&p->tid, NULL, jring_run, p) != 0) { return -1; }
+    p->is_started = 1;
+    return 0;
+}
+
+int jring_stop(jring_t *p) {
+    if (! p->is_started) { return p->state < 0 ? -1 : 0; }
+    pthread_mutex_lock(&p->lock);
+    p->is_stop = 1;
+    pthread_cond_broadcast(&p->cond_put);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->tid, NULL);
+    p->is_started = 0;
+    return p->state < 0 ? -1 : 0;
+}
+
+/*@note  The slots taken are released to the producer only when all published ones have been taken. */
+int jring_get(jring_t *p, int i, void **x) {
+    void *t;
+    double t0;
+    size_t j;
+    if (p->chead[i] == p->ctail[i]) {
+        pthread_mutex_lock(&p->lock);
+        p->head[i] = p->chead[i];
+        pthread_cond_broadcast(&p->cond_put);
+        if (p->tail[i] == p->chead[i] && 0 == p->state) {
+            t0 = jring_now();
+            while (p->tail[i] == p->chead[i] && 0 == p->state) { pthread_cond_wait(&p->cond_get, &p->lock); }
+            p->wait_get += jring_now() - t0;
+        }
+        p->ctail[i] = p->tail[i];
+        pthread_mutex_unlock(&p->lock);
+        if (p->chead[i] == p->ctail[i]) { return -1; }     // the producer has exited.
+    }
+    p->nget++; p->ndepth += p->ctail[i] - p->chead[i];
+    j = (size_t) i * p->m + p->chead[i]++ % p->m;
+    if (p->code[j]) { return p->code[j]; }
+    t = p->a[j]; p->a[j] = *x; *x = t;
+    return 0;
+}
@@ -0,0 +1,114 @@
+/* Bounded ring buffers filled by a producer thread and drained by one consumer
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef SZ_JRING_H
+#define SZ_JRING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*@abstract  Num of items filled into one ring before they are published to the consumer.
+@note        The items are published in batches, so that the lock is taken once per batch instead of once per item.
+ */
+#define JRING_BATCH 64
+
+/*@abstract  Fill one item from one stream.
+@param data  Pointer of the data passed to jring_start().
+@param i     Index of the stream.
+@param x     Pointer of the item to be filled.
+@return      0 if one item is filled, a positive code if the current region of the stream ends, which is passed
+             to the consumer by jring_get(), negative numbers if error.
+ */
+typedef int (*jring_read_f)(void *data, int i, void *x);
+
+/*@abstract  Move all streams to the next region.
+@param data  Pointer of the data passed to jring_start().
+@return      0 if success, 1 if no more regions, negative numbers if error.
+@note        It's called before the first region, and then each time all streams have reached the ends of
+             current region.
+ */
+typedef int (*jring_next_f)(void *data);
+
+/*@abstract     Ring buffers of items, one for each stream, filled by one producer thread and drained by one consumer.
+@param n        Num of streams.
+@param m        Num of slots of each ring.
+@param a        Items, stream i uses a[i * m] to a[i * m + m - 1].
+@param code     Value 0 if the slot is an item, otherwise the end code of the region returned by jring_read_f.
+@param head     Num of slots released by the consumer for each stream. Protected by @p lock.
+@param tail     Num of slots published by the producer for each stream. Protected by @p lock.
+@param ptail    Num of slots filled by the producer. Used by the producer only.
+@param phead    Snapshot of @p head. Used by the producer only.
+@param chead    Num of slots taken by the consumer. Used by the consumer only.
+@param ctail    Snapshot of @p tail. Used by the consumer only.
+@param state    0 if running, 1 if the producer finished, -1 if the producer failed.
+@param is_stop  If the consumer asked the producer to stop.
+@param wait_put Time (seconds) the producer waited for room as all rings were full.
+@param wait_get Time (seconds) the consumer waited for items as the ring was empty.
+@param nget     Num of slots taken by the consumer.
+@param ndepth   Sum of num of slots available to the consumer each time it takes one. ndepth / nget is the
+                average depth of the rings.
+
+@note           1. The consumer takes the items by exchanging pointers (refer to jring_get()), so that the items are
+                   never copied.
+                2. The producer waits only if the rings of all streams that have not reached the region end are full,
+                   so the consumer, who waits for the ring of one unfinished stream, would always be fed, no matter
+                   in which order it takes the items from the streams.
+ */
+typedef struct {
+    int n, m;
+    void **a;
+    uint8_t *code;
+    size_t *head, *tail;
+    size_t *ptail, *phead;
+    size_t *chead, *ctail;
+    void* (*init)(void);
+    void (*destroy)(void*);
+    jring_read_f read;
+    jring_next_f next;
+    void *data;
+    pthread_t tid;
+    int is_started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_put, cond_get;
+    int state, is_stop;
+    double wait_put, wait_get;
+    size_t nget, ndepth;
+} jring_t;
+
+/*@abstract  Create the jring_t structure.
+@param n     Num of streams.
+@param m     Num of slots of each ring.
+@param init  Function to create one item.
+@param destroy  Function to destroy one item.
+@return      Pointer to the structure if success, NULL otherwise.
+ */
+jring_t* jring_init(int n, int m, void* (*init)(void), void (*destroy)(void*));
+
+/*@note  The producer thread is stopped first if it's running. */
+void jring_destroy(jring_t *p);
+
+/*@abstract  Start the producer thread.
+@param p     Pointer of jring_t structure.
+@param read  Function to fill one item from one stream.
+@param next  Function to move the streams to the next region.
+@param data  Pointer of the data passed to @p read and @p next.
+@return      0 if success, -1 otherwise.
+ */
+int jring_start(jring_t *p, jring_read_f read, jring_next_f next, void *data);
+
+/*@abstract  Stop the producer thread and wait for it to exit.
+@param p     Pointer of jring_t structure.
+@return      0 if the producer has finished all regions or is stopped, -1 if it failed.
+ */
+int jring_stop(jring_t *p);
+
+/*@abstract  Take the next slot of one stream.
+@param p     Pointer of jring_t structure.
+@param i     Index of the stream.
+@param x     Pointer of the pointer to an item. If the slot is an item, the item is exchanged with @p *x,
+             i.e. @p *x is moved into the ring to be filled later.
+@return      0 if an item is taken, the positive end code if the region of the stream ends, -1 if error.
+ */
+int jring_get(jring_t *p, int i, void **x);
+
+#endif
@@ -14,6 +14,26 @@
 */
 const char csp_nt5_str[] = "ACGTN";
 
+htsFile* csp_sam_open(const char *fn, int fields, hts_tpool *tpool) {
+    htsFile *fp;
+    htsThreadPool p = {tpool, 0};
+    if (NULL == (fp = hts_open(fn, "rb"))) { return NULL; }
+    if (hts_get_format(fp)->format == cram) {
+        if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, fields) < 0 || hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0) < 0) {
+            fprintf(stderr, "[E::%s] failed to set CRAM options for %s.\n", __func__, fn);
+            goto fail;
+        }
+    }
+    if (tpool && hts_set_thread_pool(fp, &p) < 0) {
+        fprintf(stderr, "[E::%s] failed to set thread pool for %s.\n", __func__, fn);
+        goto fail;
+    }
+    return fp;
+  fail:
+    hts_close(fp);
+    return NULL;
+}
+
 /*@note      If the translation failed, this function will try "<name> - chr" if name starts with "chr", try
              "chr + <name>" otherwise. */
 inline int csp_sam_hdr_name2id(sam_hdr_t *hdr, const char *name, kstring_t *s) {
@@ -44,3 +64,14 @@ inline char* get_bam_aux_str(bam1_t *b, const char tag[2]) {
     return bam_aux2Z(data);
 }
 
+inline uint32_t get_bam_laln(const bam1_t *b) {
+    const uint32_t *cigar = bam_get_cigar(b);
+    uint32_t laln = 0;
+    int k, op;
+    for (k = 0; k < b->core.n_cigar; k++) {
+        op = get_cigar_op(cigar[k]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { laln += get_cigar_len(cigar[k]); }
+    }
+    return laln;
+}
+
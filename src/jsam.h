@@ -7,11 +7,39 @@
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
 #include "htslib/hts.h"
+#include "htslib/thread_pool.h"
 
 /* 
 * BAM/SAM/CRAM File API 
 */
 
+/*@abstract  The fields of alignment records that are always used, i.e., except the aux tags.
+@note        Refer to CRAM_OPT_REQUIRED_FIELDS and the SAM_* macros in htslib/sam.h.
+ */
+#define CSP_SAM_FIELDS (SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_SEQ | SAM_QUAL)
+
+/*@abstract  The mate fields of alignment records.
+@note        1. None of the read filters reads RNEXT, PNEXT or TLEN, and the overlaps of mates are not detected
+                in the pileup (no bam_mplp_init_overlaps()). The orphan filter (--countORPHAN) only tests the
+                BAM_FPAIRED and BAM_FPROPER_PAIR flags, which are stored with the other flags in CRAM.
+             2. However, the BAM_FMUNMAP and BAM_FMREVERSE flags of CRAM records are restored from the mate
+                fields, so these fields are needed when the flag filters test these two bits.
+ */
+#define CSP_SAM_MATE_FIELDS (SAM_RNEXT | SAM_PNEXT | SAM_TLEN)
+#define CSP_SAM_MATE_FLAGS  (BAM_FMUNMAP | BAM_FMREVERSE)
+
+/*@abstract  Open one input SAM/BAM/CRAM file for reading.
+@param fn      Filename.
+@param fields  Bitwise OR of the SAM_* macros, the fields of records to be decoded.
+@param tpool   Pointer of htslib thread pool for decompression. Could be NULL.
+@return        Pointer of htsFile if success, NULL otherwise.
+
+@note          1. For CRAM, only @p fields are decoded and the MD/NM tags are not generated, which saves most
+                  of the decoding time as the read names and the other fields are skipped.
+               2. The @p fields is ignored for SAM/BAM, whose records are always decoded as a whole.
+ */
+htsFile* csp_sam_open(const char *fn, int fields, hts_tpool *tpool);
+
 /*@abstract  Translate chr name to tid of bam/sam/cram.
 @param hdr   Pointer of sam_hdr_t structure.
 @param name  Chr name.
@@ -84,4 +112,10 @@ const char csp_nt5_str[5];
  */
 inline char* get_bam_aux_str(bam1_t *b, const char tag[2]);
 
+/*@abstract   Get length of the read part that aligned to reference, i.e. total length of M/=/X in CIGAR.
+@param b      Pointer to bam1_t structure.
+@return       The length.
+ */
+inline uint32_t get_bam_laln(const bam1_t *b);
+
 #endif
@@ -9,10 +9,12 @@
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
 #include "htslib/khash.h"
+#include "htslib/vcf.h"
 #include "kvec.h"
 #include "jnumeric.h"
 #include "jfile.h"
 #include "jmempool.h"
+#include "jsam.h"
 #include "config.h"
 #include "mplp.h"
 
@@ -62,6 +64,59 @@ inline void csp_pileup_print(FILE *fp, csp_pileup_t *p) {
     fprintf(fp, "len_aln = %d\n", p->laln);
 }
 
+inline csp_read_t* csp_read_init(void) {
+    csp_read_t *p = (csp_read_t*) calloc(1, sizeof(csp_read_t));
+    if (p) {
+        if (NULL == (p->b = bam_init1())) { free(p); return NULL; }
+    }
+    return p;
+}
+
+inline void csp_read_destroy(csp_read_t *p) {
+    if (p) {
+        if (p->b) { bam_destroy1(p->b); }
+        free(p->blk);
+        free(p);
+    }
+}
+
+int csp_read_set_cigar(csp_read_t *p) {
+    bam1_core_t *c = &(p->b->core);
+    uint32_t *cigar = bam_get_cigar(p->b);
+    csp_cigar_blk_t *blk;
+    hts_pos_t x = c->pos;
+    int32_t y = 0;
+    int k, op, l;
+    if (c->n_cigar > p->m) {
+        p->m = c->n_cigar; kroundup32(p->m);
+        if (NULL == (blk = (csp_cigar_blk_t*) realloc(p->blk, sizeof(csp_cigar_blk_t) * p->m))) { return -1; }
+        p->blk = blk;
+    }
+    for (k = 0, p->n = 0, p->laln = 0; k < c->n_cigar; k++) {
+        op = bam_cigar_op(cigar[k]);
+        l = bam_cigar_oplen(cigar[k]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF || op == BAM_CDEL || op == BAM_CREF_SKIP) {
+            blk = p->blk + p->n++;
+            blk->rpos = x; blk->qpos = y; blk->len = l; blk->op = op;
+            x += l;
+            if (op != BAM_CDEL && op != BAM_CREF_SKIP) { y += l; p->laln += l; }
+        } else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) { y += l; }
+        // else, do nothing.
+    }
+    p->endpos = (x > c->pos) ? x : c->pos + 1;   // the same as bam_endpos().
+    return 0;
+}
+
+inline int csp_read_locate(csp_read_t *p, hts_pos_t pos) {
+    int lo = 0, hi = p->n - 1, mid;
+    if (p->n <= 0 || pos < p->blk[0].rpos) { return -1; }
+    while (lo < hi) {     // find the last block whose rpos <= pos.
+        mid = (lo + hi + 1) >> 1;
+        if (p->blk[mid].rpos <= pos) { lo = mid; } else { hi = mid - 1; }
+    }
+    return pos < p->blk[lo].rpos + p->blk[lo].len ? lo : -1;
+}
+
 inline umi_unit_t* umi_unit_init(void) {
     umi_unit_t *p = (umi_unit_t*) calloc(1, sizeof(umi_unit_t));
     return p;   /* will set values just after this function is called so no need to set init values here. */
@@ -77,6 +132,59 @@ inline list_uu_t* list_uu_init(void) {
 JNUMERIC_INIT(cu_d, double)
 JNUMERIC_INIT(cu_s, size_t)
 
+/* 1 + 2-bit code of each base, 0 means not ACGT. */
+static const uint8_t umi_nt4[256] = { ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4 };
+
+inline csp_umi_set_t* csp_umi_set_init(void) { return (csp_umi_set_t*) calloc(1, sizeof(csp_umi_set_t)); }
+
+inline void csp_umi_set_destroy(csp_umi_set_t *h) { 
+    if (h) { free(h->key); free(h->used); free(h); } 
+}
+
+inline void csp_umi_set_reset(csp_umi_set_t *h) {
+    uint32_t i;
+    for (i = 0; i < h->n; i++) { h->key[h->used[i]] = CSP_UMI_SET_EMPTY; }
+    h->n = 0;
+}
+
+inline int csp_umi_set_key(int sg, const char *umi, uint64_t *x) {
+    uint64_t v = 0;
+    int i, c;
+    for (i = 0; umi[i]; i++) {
+        if (i >= 16 || 0 == (c = umi_nt4[(uint8_t) umi[i]])) { return -1; }
+        v = v << 2 | (c - 1);
+    }
+    *x = (uint64_t) sg << 37 | (uint64_t) i << 32 | v;
+    return 0;
+}
+
+static inline uint32_t csp_umi_set_hash(uint64_t x, uint32_t m) { 
+    return (uint32_t) ((x * 0x9E3779B97F4A7C15ULL) >> 32) & (m - 1); 
+}
+
+/*@note  The table is doubled and rehashed when it is half full, which rarely happens after the first few pos. */
+int csp_umi_set_put(csp_umi_set_t *h, uint64_t x) {
+    uint32_t i, k;
+    if (2 * (h->n + 1) > h->m) {
+        uint32_t m = h->m ? h->m << 1 : 1024, *used;
+        uint64_t *key;
+        if (NULL == (key = (uint64_t*) malloc(sizeof(uint64_t) * m))) { return -1; }
+        if (NULL == (used = (uint32_t*) malloc(sizeof(uint32_t) * (m >> 1)))) { free(key); return -1; }
+        memset(key, 0xff, sizeof(uint64_t) * m);
+        for (i = 0; i < h->n; i++) {
+            for (k = csp_umi_set_hash(h->key[h->used[i]], m); key[k] != CSP_UMI_SET_EMPTY; k = (k + 1) & (m - 1));
+            key[k] = h->key[h->used[i]]; used[i] = k;
+        }
+        free(h->key); free(h->used);
+        h->key = key; h->used = used; h->m = m;
+    }
+    for (k = csp_umi_set_hash(x, h->m); h->key[k] != CSP_UMI_SET_EMPTY; k = (k + 1) & (h->m - 1)) {
+        if (h->key[k] == x) { return 0; }
+    }
+    h->key[k] = x; h->used[h->n++] = k;
+    return 1;
+}
+
 inline int get_qual_vector(double qual, double cap_bq, double min_bq, double *rv) {
     double bq = max2(min2(cap_bq, qual), min_bq);
     double p = pow(0.1, bq / 10);
@@ -85,6 +193,17 @@ inline int get_qual_vector(double qual, double cap_bq, double min_bq, double *rv
     return 0;
 }
 
+double csp_qual_lut[256][4];
+
+/*@note  The qual values are int8_t in csp_pileup_t, so entry of index i is for qual value (int8_t) i. */
+int csp_qual_lut_init(void) {
+    int i;
+    for (i = 0; i < 256; i++) {
+        if (get_qual_vector((int8_t) i, 45, 0.25, csp_qual_lut[i]) < 0) { return -1; }
+    }
+    return 0;
+}
+
 /*@note         TODO: In some special cases, ref=A and alt=AG for example, the ref_idx would be equal with alt_idx.
                 Should be fixed in future.
  */
@@ -129,27 +248,27 @@ inline void infer_allele(size_t *bc, int8_t *ref_idx, int8_t *alt_idx) {
     *ref_idx = k1; *alt_idx = k2;
 }
 
-/* note that the @p qu is also initialized after calling calloc(). */
 inline csp_plp_t* csp_plp_init(void) { return (csp_plp_t*) calloc(1, sizeof(csp_plp_t)); }
 
 inline void csp_plp_destroy(csp_plp_t *p) { 
     if (p) { 
-        int i;
-        for (i = 0; i < 5; i++) { list_qu_destroy(p->qu[i]); }
-        if (p->hug) { map_ug_destroy(p->hug); }
+        csp_plp_destroy_(p);
         free(p); 
     }
 }
 
+inline void csp_plp_destroy_(csp_plp_t *p) { 
+    if (p->hug) { map_ug_destroy(p->hug); p->hug = NULL; }
+}
+
 inline void csp_plp_reset(csp_plp_t *p) {
     if (p) {   // TODO: reset based on is_genotype.
-        int i;
         memset(p->bc, 0, sizeof(p->bc));
         p->tc = p->ad = p->dp = p->oth = 0;
-        for (i = 0; i < 5; i++) { list_qu_reset(p->qu[i]); }
         memset(p->qmat, 0, sizeof(p->qmat));
         p->ngl = 0;
         if (p->hug) { map_ug_reset(p->hug); }
+        p->is_touched = 0;
     }
 }
 
@@ -200,19 +319,29 @@ int csp_plp_str_vcf(csp_plp_t *p, kstring_t *s) {
     return 0;
 }
 
+/*@note  The numbers are written by jf_put_uint() and jf_put_round() instead of printf-like functions, while the
+         output is the same as csp_plp_str_vcf().
+ */
 int csp_plp_to_vcf(csp_plp_t *p, jfile_t *s) {
     if (p->tc <= 0) { jf_puts(".:.:.:.:.:.", s); return 0; }
-    double gl[5];
     int i, m;
     double tmp = -10 / log(10);
     char *gt[] = {"0/0", "1/0", "1/1"};
     m = get_idx_of_max(cu_d, p->gl, 3);
     jf_puts(gt[m], s);
-    jf_printf(s, ":%ld:%ld:%ld:", p->ad, p->dp, p->oth);
-    for (i = 0; i < p->ngl; i++) { gl[i] = p->gl[i] * tmp; }
-    if (join_arr_to_str(cu_d, gl, p->ngl, ',', "%.0f", s->buf) < p->ngl) { return -1; }  // TODO: use internal buf directly is not good.
+    jf_putc_(':', s); jf_put_uint(p->ad, s); 
+    jf_putc_(':', s); jf_put_uint(p->dp, s); 
+    jf_putc_(':', s); jf_put_uint(p->oth, s);
     jf_putc_(':', s);
-    if (join_arr_to_str(cu_s, p->bc, 5, ',', "%ld", s->buf) < 5) { return -1; }
+    for (i = 0; i < p->ngl; i++) {
+        if (i) { jf_putc_(',', s); }
+        if (jf_put_round(p->gl[i] * tmp, s) < 0) { return -1; }
+    }
+    jf_putc_(':', s);
+    for (i = 0; i < 5; i++) {
+        if (i) { jf_putc_(',', s); }
+        if (jf_put_uint(p->bc[i], s) < 0) { return -1; }
+    }
     return 0;
 }
 
@@ -227,11 +356,16 @@ inline csp_mplp_t* csp_mplp_init(void) {
 
 inline void csp_mplp_destroy(csp_mplp_t *p) { 
     if (p) {
-        if (p->hsg) { map_sg_destroy(p->hsg); }
-        if (p->hsg_iter) { free(p->hsg_iter); }
+        if (p->plp) {
+            int i;
+            for (i = 0; i < p->nsg; i++) { csp_plp_destroy_(p->plp + i); }
+            free(p->plp);
+        }
+        free(p->tsg);
         if (p->pu) { pool_uu_destroy(p->pu); }
         if (p->pl) { pool_ul_destroy(p->pl); }
-        if (p->su) { pool_ps_destroy(p->su); }
+        jarena_destroy(p->su);
+        csp_umi_set_destroy(p->us);
         free(p); 
     }
 }
@@ -240,12 +374,14 @@ inline void csp_mplp_reset(csp_mplp_t *p) {
     if (p) {
         memset(p->bc, 0, sizeof(p->bc));
         p->tc = p->ad = p->dp = p->oth = 0;
-        p->nr_ad = p->nr_dp = p->nr_oth = 0;
-        if (p->hsg) { map_sg_reset_val(p->hsg); }
+        p->nr_ad = p->nr_dp = p->nr_oth = p->nr_gt = 0;
+        int i;
+        for (i = 0; i < p->ntsg; i++) { csp_plp_reset(p->plp + p->tsg[i]); }
+        p->ntsg = 0;
         if (p->pu) { pool_uu_reset(p->pu); }
         if (p->pl) { pool_ul_reset(p->pl); }
-        if (p->su) { pool_ps_reset(p->su); }
-        memset(p->qvec, 0, sizeof(p->qvec));
+        if (p->su) { jarena_reset(p->su); }
+        if (p->us) { csp_umi_set_reset(p->us); }
     }
 }
 
@@ -263,8 +399,8 @@ void csp_mplp_print(FILE *fp, csp_mplp_t *p, char *prefix) {
     if (p->nsg) {
         kputs(prefix, s); kputc('\t', s);
         for (i = 0; i < p->nsg; i++) {
-            fprintf(fp, "%sSG-%d = %s:\n", prefix, i, map_sg_key(p->hsg, p->hsg_iter[i]));
-            plp = map_sg_val(p->hsg, p->hsg_iter[i]);
+            fprintf(fp, "%sSG-%d = %s:\n", prefix, i, p->sgname[i]);
+            plp = p->plp + i;
             csp_plp_print(fp, plp, ks_str(s));
         }
     }
@@ -284,29 +420,33 @@ inline void csp_mplp_print_(FILE *fp, csp_mplp_t *p, char *prefix) {
 
 /*@note      1. This function should be called just one time right after csp_mplp_t structure was created
                 becuase the sgname wouldn't change once set.
-             2. The HashMap (for sgnames) in csp_mplp_t should be empty or NULL.
-             3. The keys of HashMap are exactly pointers to sg names coming directly from @p s.
+             2. The csp_plp_t array in csp_mplp_t should be NULL.
+             3. The sgname in csp_mplp_t is exactly the pointer @p s.
+             4. Repeated sg names are checked when building the barcode dictionary, refer to csp_bcd_build().
  */
+/* HashSet of sample group names, only used to detect repeated names. */
+KHASH_SET_INIT_STR(sg)
+
 int csp_mplp_set_sg(csp_mplp_t *p, char **s, const int n) {
     if (NULL == p || NULL == s || 0 == n) { return -1; }
+    khash_t(sg) *h;
     int i, r;
-    map_sg_iter k;
-    if (NULL == p->hsg && NULL == (p->hsg = map_sg_init())) { return -1; }
-    if (NULL == p->hsg_iter && NULL == (p->hsg_iter = (map_sg_iter*) malloc(sizeof(map_sg_iter) * n))) { return -1; }
-    for (i = 0; i < n; i++) {
-        if (s[i]) { 
-            k = map_sg_put(p->hsg, s[i], &r); 
-            if (r <= 0) { csp_mplp_destroy(p); return -1; } /* r = 0 means repeatd sgnames. */
-            else { map_sg_val(p->hsg, k) = NULL; }
-        } else { return -1; }
-    }
-    /* Storing iter index for each sg (sample group) name must be done after all sg names have been pushed into 
-       the HashMap in case that the internal arrays of HashMap autoly shrink or some else modifications. */
+    if (NULL == (h = kh_init(sg))) { return -1; }
     for (i = 0; i < n; i++) {
-        k = map_sg_get(p->hsg, s[i]);
-        if (k == map_sg_end(p->hsg)) { return -1; }
-        else { p->hsg_iter[i] = k; }
+        if (NULL == s[i]) { kh_destroy(sg, h); return -1; }
+        kh_put(sg, h, s[i], &r);
+        if (r < 0) { kh_destroy(sg, h); return -1; }
+        else if (r == 0) {    /* r = 0 means repeated sgnames. */
+            fprintf(stderr, "[E::%s] repeated sample name '%s'.\n", __func__, s[i]);
+            kh_destroy(sg, h);
+            return -1;
+        }
     }
+    kh_destroy(sg, h);
+    if (NULL == p->plp && NULL == (p->plp = (csp_plp_t*) calloc(n, sizeof(csp_plp_t)))) { return -1; }
+    if (NULL == p->tsg && NULL == (p->tsg = (int*) malloc(sizeof(int) * n))) { return -1; }
+    p->ntsg = 0;
+    p->sgname = s;
     p->nsg = n;
     return 0;
 }
@@ -315,25 +455,17 @@ inline int csp_mplp_str_vcf(csp_mplp_t *mplp, kstring_t *s) {
     int i;
     for (i = 0; i < mplp->nsg; i++) {
         kputc_('\t', s);
-        if (csp_plp_str_vcf(map_sg_val(mplp->hsg, mplp->hsg_iter[i]), s) < 0) { return -1; }
-    } //s->s[--(s->l)] = '\0';    /* s->l could not be negative unless no csp_plp_t(s) are printed to s->s. */
-    return 0;
-}
-
-inline int csp_mplp_to_vcf(csp_mplp_t *mplp, jfile_t *s) {
-    int i;
-    for (i = 0; i < mplp->nsg; i++) {
-        jf_putc_('\t', s);
-        if (csp_plp_to_vcf(map_sg_val(mplp->hsg, mplp->hsg_iter[i]), s) < 0) { return -1; }
+        if (csp_plp_str_vcf(mplp->plp + i, s) < 0) { return -1; }
     } //s->s[--(s->l)] = '\0';    /* s->l could not be negative unless no csp_plp_t(s) are printed to s->s. */
     return 0;
 }
 
 inline int csp_mplp_str_mtx(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp, kstring_t *ks_oth, size_t idx) {
     csp_plp_t *plp;
-    int i;
-    for (i = 1; i <= mplp->nsg; i++) {
-        plp = map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
+    int i, j;
+    for (j = 0; j < mplp->ntsg; j++) {
+        i = mplp->tsg[j] + 1;
+        plp = mplp->plp + i - 1;
         if (plp->ad) ksprintf(ks_ad, "%ld\t%d\t%ld\n", idx, i, plp->ad);
         if (plp->dp) ksprintf(ks_dp, "%ld\t%d\t%ld\n", idx, i, plp->dp);
         if (plp->oth) ksprintf(ks_oth, "%ld\t%d\t%ld\n", idx, i, plp->oth);        
@@ -345,29 +477,146 @@ inline int csp_mplp_str_mtx(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp
  */
 inline int csp_mplp_str_mtx_tmp(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp, kstring_t *ks_oth) {
     csp_plp_t *plp;
-    int i;
-    for (i = 1; i <= mplp->nsg; i++) {
-        plp = map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
-        if (plp->ad) ksprintf(ks_ad, "%d\t%ld\n", i, plp->ad);
-        if (plp->dp) ksprintf(ks_dp, "%d\t%ld\n", i, plp->dp);
-        if (plp->oth) ksprintf(ks_oth, "%d\t%ld\n", i, plp->oth);        
+    int i, j, i_ad = 0, i_dp = 0, i_oth = 0;
+    for (j = 0; j < mplp->ntsg; j++) {
+        i = mplp->tsg[j] + 1;
+        plp = mplp->plp + i - 1;
+        if (plp->ad) { kputvarint(i - i_ad, ks_ad); kputvarint(plp->ad, ks_ad); i_ad = i; }
+        if (plp->dp) { kputvarint(i - i_dp, ks_dp); kputvarint(plp->dp, ks_dp); i_dp = i; }
+        if (plp->oth) { kputvarint(i - i_oth, ks_oth); kputvarint(plp->oth, ks_oth); i_oth = i; }
     }
-    kputc('\n', ks_ad); kputc('\n', ks_dp); kputc('\n', ks_oth);
+    kputvarint(0, ks_ad); kputvarint(0, ks_dp); kputvarint(0, ks_oth);
     return 0; 
 }
 
-int csp_mplp_to_mtx(csp_mplp_t *mplp, jfile_t *fs_ad, jfile_t *fs_dp, jfile_t *fs_oth, size_t idx) {
+/*@note  The string is the same as formatted by "%s\t%ld\t.\t%c\t%c\t.\tPASS\tAD=%ld;DP=%ld;OTH=%ld". */
+int csp_mplp_str_vcf_base(csp_mplp_t *mplp, const char *chr, hts_pos_t pos, kstring_t *s) {
+    kputs(chr, s); kputc_('\t', s); kputuint(pos + 1, s);
+    kputsn("\t.\t", 3, s); kputc_(seq_nt16_int2char(mplp->ref_idx), s);
+    kputc_('\t', s); kputc_(seq_nt16_int2char(mplp->alt_idx), s);
+    kputsn("\t.\tPASS\tAD=", 11, s); kputuint(mplp->ad, s);
+    kputsn(";DP=", 4, s); kputuint(mplp->dp, s);
+    kputsn(";OTH=", 5, s);
+    return kputuint(mplp->oth, s) < 0 ? -1 : 0;
+}
+
+/*@note  1. The touched sample groups are walked only once for all the output files. When outputing the cells VCF,
+            all sample groups are walked, while the untouched ones are outputed as "." directly.
+         2. The cells VCF line should have been started by the caller, i.e. the fields before the sample fields,
+            and the caller should end the line after calling this function.
+         3. The records of one SNP in tmp files are (idx_delta, value) varint pairs and end with a 0, where idx_delta
+            is the increment of the 1-based sample index and it's always > 0 as mplp->tsg has been sorted.
+ */
+int csp_mplp_to_out(csp_mplp_t *mplp, jfile_t *fs_ad, jfile_t *fs_dp, jfile_t *fs_oth, size_t idx, jfile_t *fs_cells, 
+                    jfile_t *fs_gt, jfile_t *fs_pl) {
     csp_plp_t *plp;
-    int i;
-    for (i = 1; i <= mplp->nsg; i++) {
-        plp = map_sg_val(mplp->hsg, mplp->hsg_iter[i - 1]);
-        if (plp->ad) fs_ad->is_tmp ? jf_printf(fs_ad, "%d\t%ld\n", i, plp->ad) : jf_printf(fs_ad, "%ld\t%d\t%ld\n", idx, i, plp->ad);
-        if (plp->dp) fs_dp->is_tmp ? jf_printf(fs_dp, "%d\t%ld\n", i, plp->dp) : jf_printf(fs_dp, "%ld\t%d\t%ld\n", idx, i, plp->dp);
-        if (plp->oth) fs_oth->is_tmp ? jf_printf(fs_oth, "%d\t%ld\n", i, plp->oth) : jf_printf(fs_oth, "%ld\t%d\t%ld\n", idx, i, plp->oth);      
+    int i, j, k, l, n, gt, i_ad = 0, i_dp = 0, i_oth = 0, i_gt = 0;
+    int is_tmp = fs_ad->is_tmp;
+    double tmp = -10 / log(10);
+    long long pl;
+    n = fs_cells ? mplp->nsg : mplp->ntsg;
+    for (j = k = 0; k < n; k++) {
+        if (fs_cells) {
+            jf_putc_('\t', fs_cells);
+            if (j >= mplp->ntsg || mplp->tsg[j] != k) { jf_puts(".:.:.:.:.:.", fs_cells); continue; }
+            i = k + 1; j++;
+        } else { i = mplp->tsg[k] + 1; }
+        plp = mplp->plp + i - 1;
+        if (is_tmp) {
+            if (plp->ad) { jf_put_varint(i - i_ad, fs_ad); jf_put_varint(plp->ad, fs_ad); i_ad = i; }
+            if (plp->dp) { jf_put_varint(i - i_dp, fs_dp); jf_put_varint(plp->dp, fs_dp); i_dp = i; }
+            if (plp->oth) { jf_put_varint(i - i_oth, fs_oth); jf_put_varint(plp->oth, fs_oth); i_oth = i; }
+        } else {
+            if (plp->ad) { csp_mtx_put_rec(fs_ad, idx, i, plp->ad); }
+            if (plp->dp) { csp_mtx_put_rec(fs_dp, idx, i, plp->dp); }
+            if (plp->oth) { csp_mtx_put_rec(fs_oth, idx, i, plp->oth); }
+        }
+        if (fs_cells && csp_plp_to_vcf(plp, fs_cells) < 0) { return -1; }
+        if (fs_gt && plp->tc) {
+            gt = get_idx_of_max(cu_d, plp->gl, 3) + 1;
+            if (is_tmp) {
+                jf_put_varint(i - i_gt, fs_gt); jf_put_varint(gt, fs_gt);
+                jf_put_varint(i - i_gt, fs_pl); i_gt = i;
+            } else {
+                csp_mtx_put_rec(fs_gt, idx, i, gt);
+                jf_put_uint(idx, fs_pl); jf_putc_('\t', fs_pl);
+                jf_put_uint(i, fs_pl); jf_putc_('\t', fs_pl);
+            }
+            for (l = 0; l < plp->ngl; l++) {
+                if ((pl = llrint(plp->gl[l] * tmp)) < 0) { pl = 0; }    // PL is never negative except "-0".
+                if (is_tmp) { jf_put_varint(pl, fs_pl); }
+                else { if (l) { jf_putc_(',', fs_pl); } jf_put_uint(pl, fs_pl); }
+            }
+            if (! is_tmp) { jf_putc_('\n', fs_pl); }
+        }
     }
-    if (fs_ad->is_tmp) jf_putc('\n', fs_ad);
-    if (fs_dp->is_tmp) jf_putc('\n', fs_dp);
-    if (fs_oth->is_tmp) jf_putc('\n', fs_oth);
-    return 0; 
+    if (is_tmp) { jf_put_varint(0, fs_ad); jf_put_varint(0, fs_dp); jf_put_varint(0, fs_oth); }
+    if (is_tmp && fs_gt) { jf_put_varint(0, fs_gt); jf_put_varint(0, fs_pl); }
+    return 0;
+}
+
+int csp_mplp_to_bcf(csp_mplp_t *mplp, bcf_hdr_t *hdr, bcf1_t *rec, const char *chr, hts_pos_t pos) {
+    char als[4];
+    int32_t v;
+    int flt;
+    bcf_clear(rec);
+    if ((rec->rid = bcf_hdr_name2id(hdr, chr)) < 0) { return -1; }
+    rec->pos = pos;
+    bcf_float_set_missing(rec->qual);
+    als[0] = seq_nt16_int2char(mplp->ref_idx); als[1] = ','; 
+    als[2] = seq_nt16_int2char(mplp->alt_idx); als[3] = '\0';
+    if (bcf_update_alleles_str(hdr, rec, als) < 0) { return -1; }
+    flt = bcf_hdr_id2int(hdr, BCF_DT_ID, "PASS");
+    if (bcf_update_filter(hdr, rec, &flt, 1) < 0) { return -1; }
+    v = mplp->ad; if (bcf_update_info_int32(hdr, rec, "AD", &v, 1) < 0) { return -1; }
+    v = mplp->dp; if (bcf_update_info_int32(hdr, rec, "DP", &v, 1) < 0) { return -1; }
+    v = mplp->oth; if (bcf_update_info_int32(hdr, rec, "OTH", &v, 1) < 0) { return -1; }
+    return 0;
 }
 
+/*@note  The values of each FORMAT field are filled into @p buf in turn, as bcf_update_format() copies them. */
+int csp_mplp_to_bcf_fmt(csp_mplp_t *mplp, bcf_hdr_t *hdr, bcf1_t *rec, int ngl, int32_t *buf) {
+    csp_plp_t *plp;
+    double tmp = -10 / log(10);
+    long long pl;
+    int i, j, m, n = mplp->nsg;
+    rec->n_sample = bcf_hdr_nsamples(hdr);
+    for (i = 0; i < n; i++) {
+        plp = mplp->plp + i;
+        if (plp->tc <= 0) { buf[2 * i] = buf[2 * i + 1] = bcf_gt_missing; continue; }
+        m = get_idx_of_max(cu_d, plp->gl, 3);
+        buf[2 * i] = bcf_gt_unphased(m > 0); buf[2 * i + 1] = bcf_gt_unphased(m > 1);  // 0/0, 1/0, 1/1
+    }
+    if (bcf_update_genotypes(hdr, rec, buf, 2 * n) < 0) { return -1; }
+#define CSP_BCF_PUT_INT(key, field) do {                                                       \
+        for (i = 0; i < n; i++) {                                                          \
+            plp = mplp->plp + i;                                                           \
+            buf[i] = plp->tc > 0 ? (int32_t) plp->field : bcf_int32_missing;              \
+        }                                                                                  \
+        if (bcf_update_format_int32(hdr, rec, key, buf, n) < 0) { return -1; }            \
+    } while (0)
+    CSP_BCF_PUT_INT("AD", ad);
+    CSP_BCF_PUT_INT("DP", dp);
+    CSP_BCF_PUT_INT("OTH", oth);
+#undef CSP_BCF_PUT_INT
+    for (i = 0; i < n; i++) {
+        plp = mplp->plp + i;
+        for (j = 0; j < ngl; j++) {
+            if (plp->tc <= 0 || j >= plp->ngl) { buf[i * ngl + j] = j ? bcf_int32_vector_end : bcf_int32_missing; }
+            else {
+                if ((pl = llrint(plp->gl[j] * tmp)) < 0) { pl = 0; }    // PL is never negative except "-0".
+                buf[i * ngl + j] = (int32_t) pl;
+            }
+        }
+    }
+    if (bcf_update_format_int32(hdr, rec, "PL", buf, n * ngl) < 0) { return -1; }
+    for (i = 0; i < n; i++) {
+        plp = mplp->plp + i;
+        for (j = 0; j < 5; j++) {
+            if (plp->tc <= 0) { buf[i * 5 + j] = j ? bcf_int32_vector_end : bcf_int32_missing; }
+            else { buf[i * 5 + j] = (int32_t) plp->bc[j]; }
+        }
+    }
+    if (bcf_update_format_int32(hdr, rec, "ALL", buf, n * 5) < 0) { return -1; }
+    return 0;
+}
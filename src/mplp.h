@@ -6,9 +6,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
 #include "htslib/khash.h"
+#include "htslib/vcf.h"
 #include "kvec.h"
 #include "jfile.h"
 #include "jmempool.h"
@@ -40,6 +42,67 @@ typedef struct {
     uint32_t laln;
 } csp_pileup_t;
 
+/*@abstract    One block of CIGAR operations that consumes the reference, i.e. M/=/X/D/N.
+@param rpos    Start pos of the block in the reference. 0-based.
+@param qpos    Start pos of the block in the query seq.
+@param len     Length of the block.
+@param op      The CIGAR operation of the block.
+ */
+typedef struct {
+    hts_pos_t rpos;
+    int32_t qpos;
+    uint32_t len:28, op:4;
+} csp_cigar_blk_t;
+
+/*@abstract    Decoded info of one read that could be shared by all query pos covered by the read.
+@param b       Pointer of bam1_t structure.
+@param umi     Pointer to UMI tag.
+@param cb      Pointer to cell barcode.
+@param idx     Index of @p cb in the input barcodes, set only when using barcodes.
+@param laln    Length of the read part that aligned to reference.
+@param endpos  End pos of the alignment (exclusive), same as bam_endpos().
+@param blk     Table of CIGAR blocks, sorted by @p rpos.
+@param n       Num of elements in @p blk.
+@param m       Size of @p blk.
+
+@note  1. The read is decoded only once when it is fetched, so that each query pos covered by the read
+          only costs a binary search in @p blk. Refer to csp_read_set_cigar() and csp_read_locate().
+       2. As in csp_pileup_t, the umi and cb point to the data of @p b, do not free them.
+ */
+typedef struct {
+    bam1_t *b;
+    char *umi, *cb;
+    int idx;
+    uint32_t laln;
+    hts_pos_t endpos;
+    csp_cigar_blk_t *blk;
+    int n, m;
+} csp_read_t;
+
+/*@abstract   Initialize the csp_read_t structure.
+@return       Pointer to csp_read_t structure if success, NULL otherwise.
+
+@note         Memory for bam1_t is allocated in this function.
+ */
+inline csp_read_t* csp_read_init(void);
+
+inline void csp_read_destroy(csp_read_t *p);
+
+/*@abstract   Build the CIGAR block table of the bam1_t in csp_read_t.
+@param p      Pointer of csp_read_t structure.
+@return       0 if success, -1 otherwise.
+
+@note         The @p laln and @p endpos are also set in this function.
+ */
+int csp_read_set_cigar(csp_read_t *p);
+
+/*@abstract   Find the CIGAR block covering the query pos.
+@param p      Pointer of csp_read_t structure whose block table has been built.
+@param pos    Pos of the reference sequence. 0-based.
+@return       Index of the block if found, -1 otherwise.
+ */
+inline int csp_read_locate(csp_read_t *p, hts_pos_t pos);
+
 /*@abstract   Initialize the csp_pileup_t structure.
 @return       Pointer to csp_pileup_t structure if success, NULL otherwise.
 
@@ -61,19 +124,6 @@ inline void csp_pileup_reset_(csp_pileup_t *p);
 
 inline void csp_pileup_print(FILE *fp, csp_pileup_t *p);
 
-/*@abstract   Pool that stores char*. The real elements in the pool are char**.
-@example      Refer to the example of JMEMPOOL in general_util.h.
-@note         This structure is aimed to store dynamically allocated strings(char*).
- */
-#define pool_str_free(s) free(*(s))
-#define pool_str_reset(s) free(*(s))
-JMEMPOOL_INIT(ps, char*, pool_str_free, pool_str_reset)
-typedef jmempool_t(ps) pool_ps_t;
-#define pool_ps_init() jmempool_init(ps)
-#define pool_ps_destroy(p) jmempool_destroy(ps, p)
-#define pool_ps_get(p) jmempool_get(ps, p)
-#define pool_ps_reset(p) jmempool_reset(ps, p)
-
 /*@abstract    This structure stores stat info of one read of one UMI group for certain query pos.
 @param base    The base for the query pos in the read of the UMI gruop.
                A 4-bit integer returned by bam_seqi(), which is related to bam_nt16_table(now called seq_nt16_str).
@@ -178,21 +228,42 @@ typedef khash_t(ug) map_ug_t;
     }												\
 }
 
-/* Struct list_qu_t APIs 
-@abstract  The structure stores all qual value of one sample for certain query pos.
-@param v   The list_qu_t structure [list_qu_t].
+/*@abstract  Open-addressing HashSet of packed (sample group, UMI) keys, shared by all sample groups of one pos.
+@param key   Array of keys, CSP_UMI_SET_EMPTY means empty slot.
+@param used  Indexes of the used slots in @p key, so that resetting costs O(n) instead of O(m).
+@param n     Num of keys in the set.
+@param m     Num of slots, always power of 2.
+
+@note        1. The UMIs made of no more than 16 A/C/G/T are packed by csp_umi_set_key() with 2 bits for each base,
+                other UMIs fall back to the HashMap of the sample group, i.e. csp_plp_t::hug.
+             2. Linear probing is used and the load factor is kept below 0.5.
+ */
+typedef struct {
+    uint64_t *key;
+    uint32_t *used;
+    uint32_t n, m;
+} csp_umi_set_t;
+
+#define CSP_UMI_SET_EMPTY UINT64_MAX
+
+inline csp_umi_set_t* csp_umi_set_init(void);
+inline void csp_umi_set_destroy(csp_umi_set_t *h);
+inline void csp_umi_set_reset(csp_umi_set_t *h);
+
+/*@abstract  Pack the sample group and the UMI into one key.
+@param sg    Index of the sample group, no more than 27 bits.
+@param umi   The UMI string.
+@param x     Pointer to store the key.
+@return      0 if success, -1 if the UMI could not be packed.
+
+@note        The key is [sg:27][len:5][umi:32], so UMIs of different lengths never collide.
+ */
+inline int csp_umi_set_key(int sg, const char *umi, uint64_t *x);
 
-@example   Refer to the example in kvec.h.
+/*@abstract  Put one key into the set.
+@return      1 if the key is newly added, 0 if already exists, -1 if error.
  */
-typedef kvec_t(int8_t) list_qu_t;
-#define list_qu_init(v) kv_init(v)
-#define list_qu_resize(v, size) kv_resize(int8_t, v, size)
-#define list_qu_push(v, x) kv_push(int8_t, v, x)
-#define list_qu_A(v, i) kv_A(v, i)
-#define list_qu_size(v) kv_size(v)
-#define list_qu_max(v) kv_max(v)
-#define list_qu_destroy(v) kv_destroy(v)
-#define list_qu_reset(v) ((v).n = 0)
+int csp_umi_set_put(csp_umi_set_t *h, uint64_t x);
 
 /*@abstract    Internal function to convert the base call quality score to related values for different genotypes.
 @param qual    Qual value for the query pos in the read of the UMI gruop. The value is extracted by calling bam_get_qual() and 
@@ -207,6 +278,17 @@ typedef kvec_t(int8_t) list_qu_t;
 */
 inline int get_qual_vector(double qual, double cap_bq, double min_bq, double *rv);
 
+/*@abstract    Lookup table of the qual vectors returned by get_qual_vector(q, 45, 0.25, rv) for each
+               possible qual value q, indexed by (uint8_t) q.
+@note          It should be initialized by calling csp_qual_lut_init() once before any pileup.
+ */
+extern double csp_qual_lut[256][4];
+
+/*@abstract    Initialize the lookup table csp_qual_lut.
+@return        0 if success, -1 otherwise.
+ */
+int csp_qual_lut_init(void);
+
 /*@abstract     Internal function to translate qual matrix to vector of GL.
 @param qm       Qual matrix: 5-by-4, columns are [1-Q, 3/4-2/3Q, 1/2-1/3Q, Q]. See csp_plp_t::qmat
 @param bc       Base count: (5, ). See csp_plp_t::bc
@@ -241,27 +323,30 @@ inline void infer_allele(size_t *bc, int8_t *ref_idx, int8_t *alt_idx);
 @param ad    Read count of alt.
 @param dp    Read count of alt + ref.
 @param oth   Read count of bases except alt and ref.
-@param qu    All qual values of each base for one sample in the order of 'ACGTN'.
-@param qmat  Matrix of qual with 'ACGTN' vs. [1-Q, 3/4-2/3Q, 1/2-1/3Q, Q].
+@param qmat  Matrix of qual with 'ACGTN' vs. [1-Q, 3/4-2/3Q, 1/2-1/3Q, Q]. It's accumulated when pushing reads
+             by looking up csp_qual_lut.
 @param gl    Array of GL: loglikelihood for 
                GL1: L(rr|qual_matrix, base_count), 
                GL2-GL5: L(ra|..), L(aa|..), L(rr+ra|..), L(ra+aa|..).
 @param ngl   Num of valid elements in the array gl.
-@param hug   Pointer of hash table that stores stat info of UMI groups.
+@param hug   Pointer of hash table that stores stat info of UMI groups whose UMIs could not be packed into
+             csp_mplp_t::us. It's created when first used.
+@param is_touched  If any read has been pushed into this structure for the pos. Refer to csp_mplp_t.
  */
 typedef struct {
     size_t bc[5];
     size_t tc, ad, dp, oth;
-    list_qu_t qu[5];
     double qmat[5][4];
     double gl[5];
     int ngl;
     map_ug_t *hug;
+    uint8_t is_touched;
 } csp_plp_t;
 
-/* note that the @p qu is also initialized after calling calloc(). */
 inline csp_plp_t* csp_plp_init(void); 
 inline void csp_plp_destroy(csp_plp_t *p); 
+/* only free the memory inside csp_plp_t, used for the csp_plp_t in array. */
+inline void csp_plp_destroy_(csp_plp_t *p); 
 inline void csp_plp_reset(csp_plp_t *p);
 
 /*@abstract    Print the content to csp_plp_t to stream.
@@ -282,42 +367,6 @@ int csp_plp_str_vcf(csp_plp_t *p, kstring_t *s);
 
 int csp_plp_to_vcf(csp_plp_t *p, jfile_t *s);
 
-/*@abstract    The HashMap maps sample-group-name (char*) to csp_plp_t (*).
-@example       Refer to a simple example in khash.h.
- */
-KHASH_MAP_INIT_STR(sg, csp_plp_t*)
-typedef khash_t(sg) map_sg_t;
-#define map_sg_iter khiter_t
-#define map_sg_init() kh_init(sg)
-#define map_sg_clear(h) kh_clear(sg, h)
-#define map_sg_resize(h, s) kh_resize(sg, h, s)
-#define map_sg_put(h, k, r)  kh_put(sg, h, k, r)
-#define map_sg_get(h, k) kh_get(sg, h, k)
-#define map_sg_del(h, k) kh_del(sg, h, k)
-#define map_sg_exist(h, x) kh_exist(h, x)
-#define map_sg_key(h, x) kh_key(h, x)
-#define map_sg_val(h, x) kh_val(h, x)
-#define map_sg_begin(h) kh_begin(h)
-#define map_sg_end(h) kh_end(h)
-#define map_sg_size(h) kh_size(h)
-#define map_sg_destroy(h) {								\
-    if (h) {											\
-        map_sg_iter __k;									\
-        for (__k = map_sg_begin(h); __k != map_sg_end(h); __k++) { 			\
-            if (map_sg_exist(h, __k)) csp_plp_destroy(map_sg_val(h, __k)); 	\
-        }										\
-        kh_destroy(sg, h);									\
-    }												\
-}
-#define map_sg_reset_val(h) {								\
-    if (h) {											\
-        map_sg_iter __k;									\
-        for (__k = map_sg_begin(h); __k != map_sg_end(h); __k++) {			\
-            if (map_sg_exist(h, __k)) csp_plp_reset(map_sg_val(h, __k)); 		\
-        }											\
-    }												\
-}
-
 /*@abstract  The structure stores the stat info of all sample groups for certain query pos.
 @param ref_idx  Index of ref in "ACGTN". Negative number means not valid value.
 @param alt_idx  Index of alt in "ACGTN". Negative number means not valid value.
@@ -329,26 +378,31 @@ typedef khash_t(sg) map_sg_t;
 @param dp    Read count of alt + ref.
 @param oth   Read count of bases except alt and ref.
 @param nr_*  Num of records/lines outputed to mtx file for certain SNP/pos.
-@param hsg   HashMap that stores the stat info of all sample groups for the pos.
-@param hsg_iter Pointer of array of map_sg_iter. The iter in the array is in the same order of sg names.
-@param nsg   Size of map_sg_iter array hsg_iter.
+@param plp   Array of csp_plp_t that stores the stat info of all sample groups for the pos, in the same
+             order of sg names, i.e. indexed by the index of sample groups.
+@param sgname  Pointer of array of sg names.
+@param nsg   Num of sample groups.
+@param tsg   Array of indexes of sample groups that have pushed reads for the pos, i.e. the touched ones.
+@param ntsg  Num of elements in @p tsg.
 @param pu    Pool of umi_unit_t structures.
 @param pl    Pool of list_uu_t structures.
-@param su    Pool of UMI strings.
-@param qvec  A container for the qual vector returned by get_qual_vector().
+@param su    Arena of the copies of UMI strings, only for the UMIs that could not be packed. It's reset with
+             the csp_mplp_t structure, so that the strings cost no heap calls in steady state.
+@param us    Pointer of HashSet of packed (sample group, UMI) keys of the pos. Refer to csp_umi_set_t.
  */
 typedef struct {
     int8_t ref_idx, alt_idx, inf_rid, inf_aid;
     size_t bc[5];
     size_t tc, ad, dp, oth;
-    size_t nr_ad, nr_dp, nr_oth;
-    map_sg_t *hsg;
-    map_sg_iter *hsg_iter;
+    size_t nr_ad, nr_dp, nr_oth, nr_gt;
+    csp_plp_t *plp;
+    char **sgname;
     int nsg;
+    int *tsg, ntsg;
     pool_uu_t *pu;
     pool_ul_t *pl;
-    pool_ps_t *su;
-    double qvec[4];
+    jarena_t *su;
+    csp_umi_set_t *us;
 } csp_mplp_t;
 
 /*@abstract  Initialize the csp_mplp_t structure.
@@ -360,6 +414,7 @@ typedef struct {
  */
 inline csp_mplp_t* csp_mplp_init(void); 
 inline void csp_mplp_destroy(csp_mplp_t *p); 
+/* only the touched sample groups are reset. */
 inline void csp_mplp_reset(csp_mplp_t *p);
 
 /*@abstract    Print the content to csp_mplp_t to stream.
@@ -376,12 +431,12 @@ inline void csp_mplp_print_(FILE *fp, csp_mplp_t *p, char *prefix);
 @param p     Pointer to the csp_mplp_t structure.
 @parma s     Pointer to the array of names of sample groups.
 @param n     Num of sample groups.
-@return      0, no error; -1 otherwise.
+@return      0, no error; -1 otherwise, e.g., when there are repeated names in @p s.
 
 @note        1. This function should be called just one time right after csp_mplp_t structure was created
                 becuase the sgname wouldn't change once set.
-             2. The HashMap (for sgnames) in csp_mplp_t should be empty or NULL.
-             3. The keys of HashMap are exactly pointers to sg names coming directly from @p s.
+             2. The csp_plp_t array in csp_mplp_t is allocated in this function, so it should be NULL before.
+             3. The sgname in csp_mplp_t is exactly the pointer @p s, do not free it.
  */
 int csp_mplp_set_sg(csp_mplp_t *p, char **s, const int n);
 
@@ -392,8 +447,6 @@ int csp_mplp_set_sg(csp_mplp_t *p, char **s, const int n);
  */
 inline int csp_mplp_str_vcf(csp_mplp_t *mplp, kstring_t *s);
 
-inline int csp_mplp_to_vcf(csp_mplp_t *mplp, jfile_t *s);
-
 /*@abstract    Format the content of csp_mplp_t of certain query pos to string in the output sparse matrices file.
 @param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
 @param ks_ad   Pointer of kstring_t which is to store formatted AD string.
@@ -411,11 +464,73 @@ inline int csp_mplp_str_mtx(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp
 @param ks_oth  Pointer of kstring_t which is to store formatted OTH string.
 @return        0 if success, -1 otherwise.
 
-@note          This function is used for tmp files.
+@note          This function is used for tmp files, whose records are binary, refer to csp_mplp_to_out().
  */
 inline int csp_mplp_str_mtx_tmp(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp, kstring_t *ks_oth);
 
-int csp_mplp_to_mtx(csp_mplp_t *mplp, jfile_t *fs_ad, jfile_t *fs_dp, jfile_t *fs_oth, size_t idx); 
+/*@abstract    Format the fixed fields (CHROM to INFO) of certain query pos in the output vcf files.
+@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
+@param chr     Name of the chrom.
+@param pos     0-based pos.
+@param s       Pointer of kstring_t which stores the formatted string.
+@return        0 if success, -1 otherwise.
+ */
+int csp_mplp_str_vcf_base(csp_mplp_t *mplp, const char *chr, hts_pos_t pos, kstring_t *s);
+
+/*@abstract    Output one record "<idx>\t<i>\t<v>\n" of the sparse matrices file.
+@param fs      Pointer of jfile_t of the mtx file.
+@param idx     Index of the SNP/mplp (1-based).
+@param i       Index of the sample group (1-based).
+@param v       The value.
+@return        Void.
+ */
+static inline void csp_mtx_put_rec(jfile_t *fs, size_t idx, int i, size_t v) {
+    jf_put_uint(idx, fs); jf_putc_('\t', fs);
+    jf_put_uint(i, fs); jf_putc_('\t', fs);
+    jf_put_uint(v, fs); jf_putc_('\n', fs);
+}
+
+/*@abstract    Output the content of csp_mplp_t of certain query pos to the mtx files and the cells VCF in one pass.
+@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
+@param fs_ad   Pointer of jfile_t of AD mtx file.
+@param fs_dp   Pointer of jfile_t of DP mtx file.
+@param fs_oth  Pointer of jfile_t of OTH mtx file.
+@param idx     Index of the SNP/mplp (1-based).
+@param fs_cells  Pointer of jfile_t of the cells VCF, NULL if not outputed.
+@param fs_gt   Pointer of jfile_t of the sparse GT mtx file, NULL if not outputed.
+@param fs_pl   Pointer of jfile_t of the sparse PL mtx file, NULL if not outputed.
+@return        0 if success, -1 otherwise.
+
+@note          1. Only the touched sample groups are outputed to the mtx files, refer to csp_mplp_stat(). The records
+                  are varint-packed if the mtx files are tmp files, refer to merge_mtx().
+               2. Only the sample groups with reads are outputed to the GT and PL mtx files. The GT is 1, 2 and 3
+                  for 0/0, 1/0 and 1/1, and the PL are rounded to integers. Each record of the tmp PL mtx file 
+                  has ngl values, refer to merge_mtx().
+ */
+int csp_mplp_to_out(csp_mplp_t *mplp, jfile_t *fs_ad, jfile_t *fs_dp, jfile_t *fs_oth, size_t idx, jfile_t *fs_cells, 
+                    jfile_t *fs_gt, jfile_t *fs_pl);
+
+/*@abstract    Fill the bcf1_t record with the site fields of certain query pos, i.e. the fields of the base VCF.
+@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
+@param hdr     Pointer of the BCF header, in which @p chr should be a contig.
+@param rec     Pointer of the bcf1_t record, which is cleared first.
+@param chr     Name of the chrom.
+@param pos     0-based pos.
+@return        0 if success, -1 otherwise.
+ */
+int csp_mplp_to_bcf(csp_mplp_t *mplp, bcf_hdr_t *hdr, bcf1_t *rec, const char *chr, hts_pos_t pos);
+
+/*@abstract    Add the FORMAT fields of all sample groups to the bcf1_t record filled by csp_mplp_to_bcf().
+@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
+@param hdr     Pointer of the BCF header of the cells file.
+@param rec     Pointer of the bcf1_t record.
+@param ngl     Num of PL values of each sample group, 3 or 5 (keep doublet GT likelihood).
+@param buf     Buffer of at least nsg * 5 int32_t values, provided by the caller.
+@return        0 if success, -1 otherwise.
+
+@note          The sample groups without reads have the missing values in all fields, i.e. ./. for GT.
+ */
+int csp_mplp_to_bcf_fmt(csp_mplp_t *mplp, bcf_hdr_t *hdr, bcf1_t *rec, int ngl, int32_t *buf);
 
 #if DEVELOP
 /* 
@@ -7,80 +7,130 @@
 #include <string.h>
 #include "htslib/vcf.h"
 #include "htslib/sam.h"
-#include "kvec.h"
-#include "jstring.h"
+#include "htslib/khash.h"
+#include "htslib/kstring.h"
+#include "jsam.h"
 #include "snp.h"
 
 /* 
 * SNP List API
 */
 
-/*@note      The pointer returned successfully by snp_init() should be freed
-             by snp_destroy() when no longer used.
+void snplist_free(snplist_t *pl) {
+    int i;
+    if (NULL == pl) { return; }
+    for (i = 0; i < pl->nchrom; i++) { free(pl->chrom[i]); }
+    free(pl->chrom);
+    if (pl->h) { kh_destroy(si, pl->h); }
+    free(pl->cid); free(pl->pos); free(pl->ale);
+    memset(pl, 0, sizeof(snplist_t));
+}
+
+int snplist_chrom_id(snplist_t *pl, const char *chr) {
+    khiter_t u;
+    int r;
+    if (NULL == pl->h && NULL == (pl->h = kh_init(si))) { return -1; }
+    u = kh_put(si, pl->h, chr, &r);
+    if (r < 0) { return -1; }
+    else if (r > 0) {
+        if (pl->nchrom >= pl->mchrom) {
+            int m = pl->mchrom ? pl->mchrom << 1 : 32;
+            char **c;
+            if (NULL == (c = (char**) realloc(pl->chrom, sizeof(char*) * m))) { goto fail; }
+            pl->chrom = c; pl->mchrom = m;
+        }
+        if (NULL == (pl->chrom[pl->nchrom] = strdup(chr))) { goto fail; }
+        kh_key(pl->h, u) = pl->chrom[pl->nchrom];
+        kh_val(pl->h, u) = pl->nchrom++;
+    }
+    return kh_val(pl->h, u);
+  fail:
+    kh_del(si, pl->h, u);
+    return -1;
+}
+
+/*@abstract  Make sure the columns have space for at least @p m SNPs.
+@return      0 if success, -1 otherwise.
  */
-inline snp_t* snp_init(void) { return (snp_t*) calloc(1, sizeof(snp_t)); }
+static int snplist_reserve(snplist_t *pl, size_t m) {
+    void *p;
+    if (m <= pl->m) { return 0; }
+    if (NULL == (p = realloc(pl->cid, sizeof(int32_t) * m))) { return -1; } pl->cid = (int32_t*) p;
+    if (NULL == (p = realloc(pl->pos, sizeof(hts_pos_t) * m))) { return -1; } pl->pos = (hts_pos_t*) p;
+    if (NULL == (p = realloc(pl->ale, sizeof(uint8_t) * m))) { return -1; } pl->ale = (uint8_t*) p;
+    pl->m = m;
+    return 0;
+}
 
-inline void snp_destroy(snp_t *p) { 
-    if (p) { free(p->chr); free(p); } 
+/*@note  The columns grow by 1.5 times, which is enough for appending SNPs in one pass. */
+int snplist_push(snplist_t *pl, int cid, hts_pos_t pos, uint8_t ale) {
+    if (pl->n >= pl->m && snplist_reserve(pl, pl->m ? pl->m + (pl->m >> 1) : 1024) < 0) { return -1; }
+    pl->cid[pl->n] = cid; pl->pos[pl->n] = pos; pl->ale[pl->n] = ale;
+    pl->n++;
+    return 0;
 }
 
-inline void snp_reset(snp_t *p) {
-    if (p) { free(p->chr); memset(p, 0, sizeof(snp_t)); }
+uint8_t snp_ale_pack(char ref, char alt) {
+    uint8_t r = ref ? 1 + seq_nt16_char2int((uint8_t) ref) : 0;
+    uint8_t a = alt ? 1 + seq_nt16_char2int((uint8_t) alt) : 0;
+    return r << 4 | a;
 }
 
 /*@note        If length of Ref or Alt is larger than 1, then the SNP would be skipped.
                If length of Ref or Alt is 0, then their values would be infered during pileup.
+               The chrom index of the last rid is cached as the SNPs are usually sorted by chrom.
  */
 size_t get_snplist_from_vcf(const char *fn, snplist_t *pl, int *ret, int print_skip) {
     htsFile *fp = NULL;
     bcf_hdr_t *hdr = NULL;
     bcf1_t *rec = NULL;
-    snp_t *ip = NULL;
-    size_t l, m, n = 0;  /* use n instead of kv_size(*pl) in case that pl is not empty at the beginning. */
-    int r;
+    const char *chr = NULL;
+    size_t l, m, n = 0;  /* use n instead of snplist_size(*pl) in case that pl is not empty at the beginning. */
+    int r, rid = -1, cid = -1;
+    char ref, alt;
     *ret = -1;
     if (NULL == fn || NULL == pl) { return 0; }
     if (NULL == (fp = hts_open(fn, "rb"))) { fprintf(stderr, "[E::%s] could not open '%s'\n", __func__, fn); return 0; }
     if (NULL == (hdr = bcf_hdr_read(fp))) { fprintf(stderr, "[E::%s] could not read header for '%s'\n", __func__, fn); goto fail; }
     if (NULL == (rec = bcf_init1())) { fprintf(stderr, "[E::%s] could not initialize the bcf structure.\n", __func__); goto fail; }
     for (m = 1; (r = bcf_read1(fp, hdr, rec)) >= 0; m++) {
-        if (NULL == (ip = snp_init())) { 
-            fprintf(stderr, "[E::%s] could not initialize the snp_t structure.\n", __func__); 
-            goto fail; 
+        if (rec->rid != rid) {
+            if (NULL == (chr = bcf_hdr_id2name(hdr, rec->rid))) {
+                if (print_skip) { fprintf(stderr, "[W::%s] skip No.%ld SNP: could not get chr name.\n", __func__, m); }
+                continue;
+            }
+            rid = rec->rid; cid = -1;     // the chrom is added with its first SNP passing the checks below.
         }
-        ip->chr = safe_strdup(bcf_hdr_id2name(hdr, rec->rid));
-        if (NULL == ip->chr) {
-            if (print_skip) { fprintf(stderr, "[W::%s] skip No.%ld SNP: could not get chr name.\n", __func__, m); }
-            snp_destroy(ip);
-            continue;
-        } ip->pos = rec->pos;
+        ref = alt = 0;
         bcf_unpack(rec, BCF_UN_STR);
         if (rec->n_allele > 0) {
-            if (1 == (l = strlen(rec->d.allele[0]))) { ip->ref = rec->d.allele[0][0]; }
+            if (1 == (l = strlen(rec->d.allele[0]))) { ref = rec->d.allele[0][0]; }
             else if (l > 1) { 
                 if (print_skip) { fprintf(stderr, "[W::%s] skip No.%ld SNP: ref_len > 1.\n", __func__, m); }
-                snp_destroy(ip); 
                 continue; 
-            } // else: do nothing. keep ref = 0, 0 is its init value.               
+            } // else: do nothing. keep ref = 0.
             if (2 == rec->n_allele) {
-                if (1 == (l = strlen(rec->d.allele[1]))) { ip->alt = rec->d.allele[1][0]; }
+                if (1 == (l = strlen(rec->d.allele[1]))) { alt = rec->d.allele[1][0]; }
                 else if (l > 1) {
                     if (print_skip) { fprintf(stderr, "[W::%s] skip No.%ld SNP: alt_len > 1.\n", __func__, m); }
-                    snp_destroy(ip);
                     continue; 					
-                } // else: do nothing. keep alt = 0, 0 is its init value.
+                } // else: do nothing. keep alt = 0.
             } else if (rec->n_allele > 2) {
                 if (print_skip) { fprintf(stderr, "[W::%s] skip No.%ld SNP: n_allele > 2.\n", __func__, m); }
-                snp_destroy(ip);
                 continue;                 
             } // else: keep alt = 0.
-        } // else: do nothing. keep ref = alt = 0, 0 is their init values.
-        snplist_push(*pl, ip);
+        } // else: do nothing. keep ref = alt = 0.
+        if (cid < 0 && (cid = snplist_chrom_id(pl, chr)) < 0) {
+            fprintf(stderr, "[E::%s] could not add chrom '%s' into the SNP list.\n", __func__, chr);
+            goto fail;
+        }
+        if (snplist_push(pl, cid, rec->pos, snp_ale_pack(ref, alt)) < 0) {
+            fprintf(stderr, "[E::%s] could not add No.%ld SNP into the SNP list.\n", __func__, m);
+            goto fail;
+        }
         n++;
     }
-    if (-1 == r) { // end of bcf file.
-        snplist_resize(*pl, snplist_size(*pl));
-    } else { 
+    if (r < -1) { 
         fprintf(stderr, "[E::%s] error when parsing '%s'\n", __func__, fn); 
         goto fail; 
     }
@@ -96,9 +146,201 @@ size_t get_snplist_from_vcf(const char *fn, snplist_t *pl, int *ret, int print_s
     return n;
 }
 
+typedef struct { int cid; hts_pos_t pos; size_t k; } snp_ent_t;
+
+static int cmp_snp_ent(const void *x, const void *y) {
+    const snp_ent_t *a = (const snp_ent_t*) x, *b = (const snp_ent_t*) y;
+    if (a->cid != b->cid) { return a->cid < b->cid ? -1 : 1; }
+    if (a->pos != b->pos) { return a->pos < b->pos ? -1 : 1; }
+    return a->k < b->k ? -1 : (a->k > b->k);
+}
+
+/*@abstract  Sort the SNPs in [0, n) by (cid, pos, input order).
+@return      Pointer of the sorted entries if success, NULL otherwise. Should be freed by free().
+ */
+static snp_ent_t* snplist_sort_ent(snplist_t *pl) {
+    snp_ent_t *e;
+    size_t i, n = snplist_size(*pl);
+    if (NULL == (e = (snp_ent_t*) malloc(sizeof(snp_ent_t) * (n ? n : 1)))) { return NULL; }
+    for (i = 0; i < n; i++) { e[i].cid = pl->cid[i]; e[i].pos = pl->pos[i]; e[i].k = i; }
+    if (n) { qsort(e, n, sizeof(snp_ent_t), cmp_snp_ent); }
+    return e;
+}
+
+int snplist_sort(snplist_t *pl) {
+    snp_ent_t *e = NULL;
+    uint8_t *ale = NULL;
+    size_t i, n = snplist_size(*pl);
+    if (NULL == (e = snplist_sort_ent(pl))) { goto fail; }
+    if (NULL == (ale = (uint8_t*) malloc(sizeof(uint8_t) * (n ? n : 1)))) { goto fail; }
+    for (i = 0; i < n; i++) { 
+        pl->cid[i] = e[i].cid; pl->pos[i] = e[i].pos; ale[i] = pl->ale[e[i].k]; 
+    }
+    free(pl->ale); pl->ale = ale; pl->m = n;
+    free(e);
+    return 0;
+  fail:
+    free(e);
+    return -1;
+}
+
+size_t get_snplist(const char *fn, snplist_t *pl, int *ret, int print_skip) {
+    *ret = -1;
+    if (NULL == fn) { return 0; }
+    return snp_panel_is(fn) > 0 ? get_snplist_from_panel(fn, pl, ret) : get_snplist_from_vcf(fn, pl, ret, print_skip);
+}
+
 /*
- * Bi-Allele API
+ * Panel API
  */
-inline biallele_t* biallele_init(void) { return (biallele_t*) calloc(1, sizeof(biallele_t)); }
-inline void biallele_destroy(biallele_t *p) { if (p) { free(p); } }
-inline void biallele_reset(biallele_t *p) {}
+int snp_panel_is(const char *fn) {
+    FILE *fp;
+    char buf[SNP_PANEL_MAGIC_LEN];
+    int r;
+    if (NULL == fn) { return -1; }
+    if (0 == strcmp(fn, "-") || NULL == (fp = fopen(fn, "rb"))) { return 0; }   // e.g. stdin or remote files.
+    r = fread(buf, 1, SNP_PANEL_MAGIC_LEN, fp) == SNP_PANEL_MAGIC_LEN && 0 == memcmp(buf, SNP_PANEL_MAGIC, SNP_PANEL_MAGIC_LEN);
+    fclose(fp);
+    return r;
+}
+
+int snp_panel_write(const char *fn, snplist_t *pl) {
+    FILE *fp = NULL;
+    const char pad[8] = {0};
+    uint64_t *off = NULL, n = snplist_size(*pl);
+    int32_t nchrom = pl->nchrom;
+    uint32_t l;
+    size_t i, npad = 0;
+    int c;
+    if (snplist_sort(pl) < 0) { fprintf(stderr, "[E::%s] failed to sort the SNP list.\n", __func__); goto fail; }
+    if (NULL == (off = (uint64_t*) calloc(nchrom + 1, sizeof(uint64_t)))) { goto fail; }
+    for (i = 0; i < n; i++) { off[pl->cid[i] + 1]++; }
+    for (c = 0; c < nchrom; c++) { off[c + 1] += off[c]; }
+    if (NULL == (fp = fopen(fn, "wb"))) { fprintf(stderr, "[E::%s] could not open '%s'\n", __func__, fn); goto fail; }
+    if (fwrite(SNP_PANEL_MAGIC, 1, SNP_PANEL_MAGIC_LEN, fp) != SNP_PANEL_MAGIC_LEN) { goto write_fail; }
+    if (fwrite(&nchrom, sizeof(int32_t), 1, fp) != 1 || fwrite(pad, 1, 4, fp) != 4) { goto write_fail; }
+    if (fwrite(&n, sizeof(uint64_t), 1, fp) != 1) { goto write_fail; }
+    for (c = 0; c < nchrom; c++) {
+        l = strlen(pl->chrom[c]);
+        if (fwrite(&l, sizeof(uint32_t), 1, fp) != 1 || fwrite(pl->chrom[c], 1, l, fp) != l) { goto write_fail; }
+        npad += sizeof(uint32_t) + l;
+    }
+    if ((npad = (8 - (npad & 7)) & 7) && fwrite(pad, 1, npad, fp) != npad) { goto write_fail; }
+    if (fwrite(off, sizeof(uint64_t), nchrom + 1, fp) != nchrom + 1) { goto write_fail; }
+    if (fwrite(pl->pos, sizeof(hts_pos_t), n, fp) != n) { goto write_fail; }
+    if (fwrite(pl->ale, sizeof(uint8_t), n, fp) != n) { goto write_fail; }
+    if (fclose(fp) != 0) { fp = NULL; goto write_fail; }
+    free(off);
+    return 0;
+  write_fail:
+    fprintf(stderr, "[E::%s] failed to write '%s'\n", __func__, fn);
+  fail:
+    if (fp) { fclose(fp); }
+    free(off);
+    return -1;
+}
+
+/*@note  The chroms are interned into @p pl, so the panel could be appended to a non-empty SNP list. */
+size_t get_snplist_from_panel(const char *fn, snplist_t *pl, int *ret) {
+    FILE *fp = NULL;
+    char buf[SNP_PANEL_MAGIC_LEN];
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    uint64_t *off = NULL, n;
+    int32_t nchrom;
+    int *cid = NULL;
+    uint32_t l;
+    size_t i, b = snplist_size(*pl), npad = 0;
+    int c;
+    *ret = -1;
+    if (NULL == fn || NULL == pl) { return 0; }
+    if (NULL == (fp = fopen(fn, "rb"))) { fprintf(stderr, "[E::%s] could not open '%s'\n", __func__, fn); return 0; }
+    if (fread(buf, 1, SNP_PANEL_MAGIC_LEN, fp) != SNP_PANEL_MAGIC_LEN || memcmp(buf, SNP_PANEL_MAGIC, SNP_PANEL_MAGIC_LEN) != 0) {
+        fprintf(stderr, "[E::%s] '%s' is not a SNP panel file.\n", __func__, fn);
+        goto fail;
+    }
+    if (fread(&nchrom, sizeof(int32_t), 1, fp) != 1 || fread(buf, 1, 4, fp) != 4) { goto read_fail; }
+    if (fread(&n, sizeof(uint64_t), 1, fp) != 1 || nchrom < 0) { goto read_fail; }
+    if (NULL == (cid = (int*) malloc(sizeof(int) * (nchrom ? nchrom : 1)))) { goto fail; }
+    if (NULL == (off = (uint64_t*) malloc(sizeof(uint64_t) * (nchrom + 1)))) { goto fail; }
+    for (c = 0; c < nchrom; c++) {
+        if (fread(&l, sizeof(uint32_t), 1, fp) != 1) { goto read_fail; }
+        ks_clear(s);
+        if (ks_resize(s, l + 1) < 0) { goto fail; }
+        if (fread(s->s, 1, l, fp) != l) { goto read_fail; }
+        s->s[l] = '\0'; s->l = l;
+        if ((cid[c] = snplist_chrom_id(pl, ks_str(s))) < 0) {
+            fprintf(stderr, "[E::%s] could not add chrom '%s' into the SNP list.\n", __func__, ks_str(s));
+            goto fail;
+        }
+        npad += sizeof(uint32_t) + l;
+    }
+    if ((npad = (8 - (npad & 7)) & 7) && fread(buf, 1, npad, fp) != npad) { goto read_fail; }
+    if (fread(off, sizeof(uint64_t), nchrom + 1, fp) != nchrom + 1) { goto read_fail; }
+    for (c = 0; c < nchrom; c++) { if (off[c + 1] < off[c]) { goto read_fail; } }
+    if (off[0] != 0 || off[nchrom] != n) { goto read_fail; }
+    if (snplist_reserve(pl, b + n) < 0) { goto fail; }
+    if (fread(pl->pos + b, sizeof(hts_pos_t), n, fp) != n) { goto read_fail; }
+    if (fread(pl->ale + b, sizeof(uint8_t), n, fp) != n) { goto read_fail; }
+    for (c = 0; c < nchrom; c++) {
+        for (i = off[c]; i < off[c + 1]; i++) { pl->cid[b + i] = cid[c]; }
+    }
+    pl->n = b + n;
+    fclose(fp);
+    free(off); free(cid);
+    ks_free(s);
+    *ret = 0;
+    return n;
+  read_fail:
+    fprintf(stderr, "[E::%s] '%s' is truncated or corrupted.\n", __func__, fn);
+  fail:
+    if (fp) { fclose(fp); }
+    free(off); free(cid);
+    ks_free(s);
+    return 0;
+}
+
+/*
+ * Target API
+ */
+/*@note  1. The entries are sorted by (chrom, pos, input order), so that the first SNP of duplicates is kept.
+         2. Only the chroms with SNPs are kept, in the order of @p pl, e.g. those of a panel file could have none.
+ */
+snp_tgt_t* snp_tgt_build(snplist_t *pl) {
+    snp_tgt_t *t = NULL;
+    snp_ent_t *e = NULL;
+    size_t i, j, n = snplist_size(*pl);
+    if (NULL == (t = (snp_tgt_t*) calloc(1, sizeof(snp_tgt_t)))) { goto fail; }
+    if (NULL == (e = snplist_sort_ent(pl))) { goto fail; }
+    t->chrom = (char**) calloc(pl->nchrom ? pl->nchrom : 1, sizeof(char*));
+    t->off = (size_t*) calloc(pl->nchrom + 1, sizeof(size_t));
+    t->pos = (hts_pos_t*) malloc(sizeof(hts_pos_t) * (n ? n : 1));
+    t->ale = (uint8_t*) malloc(sizeof(uint8_t) * (n ? n : 1));
+    if (NULL == t->chrom || NULL == t->off || NULL == t->pos || NULL == t->ale) { goto fail; }
+    for (i = j = 0; i < n; i++) {
+        if (j > 0 && e[i].cid == e[i - 1].cid && e[i].pos == e[i - 1].pos) { continue; }
+        if (0 == i || e[i].cid != e[i - 1].cid) {      // the first target of the chrom.
+            if (NULL == (t->chrom[t->nchrom] = strdup(pl->chrom[e[i].cid]))) { goto fail; }
+            t->off[t->nchrom++] = j;
+        }
+        t->pos[j] = e[i].pos; t->ale[j] = pl->ale[e[i].k];
+        j++;
+    }
+    t->off[t->nchrom] = j;
+    t->n = j;
+    free(e);
+    return t;
+  fail:
+    free(e);
+    snp_tgt_destroy(t);
+    return NULL;
+}
+
+void snp_tgt_destroy(snp_tgt_t *t) {
+    int i;
+    if (t) {
+        for (i = 0; i < t->nchrom; i++) { free(t->chrom[i]); }
+        free(t->chrom);
+        free(t->off); free(t->pos); free(t->ale);
+        free(t);
+    }
+}
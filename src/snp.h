@@ -4,61 +4,83 @@
 #ifndef CSP_SNP_H
 #define CSP_SNP_H
 
+#include <stdint.h>
+#include <string.h>
 #include "htslib/sam.h"
-#include "kvec.h"
+#include "htslib/khash.h"
 
 /* 
 * SNP List API
 */
-/*@abstruct    The basic data structure to store SNP info.
-@param chr     Name of chr.
-@param pos     0-based coordinate in the reference sequence.
-@param ref     Ref base (a letter). 0 means no ref in the input SNP file for the pos.
-@param alt     Alt base (a letter). 0 means no alt in the input SNP file for the pos.
+/*@abstract    The HashMap maps chrom name (char*) to its index (int) in snplist_t.
+@example       Refer to a simple example in khash.h.
+ */
+KHASH_MAP_INIT_STR(si, int)
+typedef khash_t(si) map_si_t;
+
+/*@abstract    The SNP table, stored as struct of arrays, i.e. one column for each field.
+@param chrom   Names of chroms, in order of their first occurence in the input SNP file.
+@param nchrom  Num of chroms.
+@param mchrom  Size of @p chrom.
+@param h       Pointer of HashMap used to intern chrom names. Its keys are pointers to @p chrom, do not free them.
+@param cid     cid[i] is the index of the chrom (in @p chrom) of SNP i.
+@param pos     pos[i] is the 0-based coordinate of SNP i in the reference sequence.
+@param ale     Packed ref (high 4 bits) and alt (low 4 bits) alleles. Refer to snp_ale_pack().
+@param n       Num of SNPs.
+@param m       Size of the columns.
+
+@note          The snplist_t structure should be freed by snplist_destroy() when no longer used.
+               snplist_init() function should be called immediately after the structure was created.
  */
 typedef struct {
-    char *chr;   
-    hts_pos_t pos; 
-    int8_t ref, alt;
-} snp_t;
-
-/*@abstract  Initilize the snp_t structure.
-@return      Pointer to the snp_t structure if success, NULL if failure.
-@note        The pointer returned successfully by snp_init() should be freed
-             by snp_destroy() when no longer used.
- */
-inline snp_t* snp_init(void);
-inline void snp_destroy(snp_t *p); 
-inline void snp_reset(snp_t *p); 
-
-/*@abstract  A list containing of several pointers to the snp_t structure.
-@param a     Array of snp_t* pointers.
-@param n     The next pos of the unused element of the array.
-@param m     Size of the whole array.
-
-@note        The snplist_t structure should be freed by snplist_destroy() when no longer used.
-             snplist_init() function should be called immediately after the structure was created.
-
-@example (A simple example from kvec.h)
-    kvec_t(int) array;
-    kv_init(array);
-    kv_push(int, array, 10); // append
-    kv_A(array, 20) = 4;
-    kv_destroy(array);
- */
-typedef kvec_t(snp_t*) snplist_t;   /* kvec_t from kvec.h */
-#define snplist_init(v) kv_init(v)
-#define snplist_resize(v, size) kv_resize(snp_t*, v, size)
-#define snplist_push(v, x) kv_push(snp_t*, v, x)
-#define snplist_A(v, i) kv_A(v, i)
-#define snplist_size(v) kv_size(v)
-#define snplist_max(v) kv_max(v)
-#define snplist_destroy(v) {								\
-    size_t __j;											\
-    for (__j = 0; __j < snplist_size(v); __j++) snp_destroy(snplist_A(v, __j));	\
-    kv_destroy(v);										\
-    (v).a = NULL; (v).m = (v).n = 0;                                                            \
-}
+    char **chrom;
+    int nchrom, mchrom;
+    map_si_t *h;
+    int32_t *cid;
+    hts_pos_t *pos;
+    uint8_t *ale;
+    size_t n, m;
+} snplist_t;
+
+#define snplist_init(v) memset(&(v), 0, sizeof(snplist_t))
+#define snplist_size(v) ((v).n)
+#define snplist_chr(v, i) ((v).chrom[(v).cid[i]])
+#define snplist_destroy(v) snplist_free(&(v))
+
+/*@abstract  Free the internal arrays of the snplist_t structure and reset it.
+@param pl    Pointer of the snplist_t structure.
+ */
+void snplist_free(snplist_t *pl);
+
+/*@abstract  Get the index of the chrom, adding it into the list if not exists.
+@param pl    Pointer of the snplist_t structure.
+@param chr   Name of the chrom.
+@return      Index of the chrom if success, -1 otherwise.
+ */
+int snplist_chrom_id(snplist_t *pl, const char *chr);
+
+/*@abstract  Append one SNP into the list.
+@param pl    Pointer of the snplist_t structure.
+@param cid   Index of the chrom, returned by snplist_chrom_id().
+@param pos   0-based coordinate.
+@param ale   Packed alleles, returned by snp_ale_pack().
+@return      0 if success, -1 otherwise.
+ */
+int snplist_push(snplist_t *pl, int cid, hts_pos_t pos, uint8_t ale);
+
+/*@abstract  Pack the ref and alt alleles into one byte.
+@param ref   Ref base (a letter). 0 means no ref in the input SNP file for the pos.
+@param alt   Alt base (a letter). 0 means no alt in the input SNP file for the pos.
+@return      The packed alleles.
+
+@note        Each allele is coded as 1 + its index in "ACGTN" (Refer to seq_nt16_char2int() in jsam.h),
+             with 0 for missing. N is kept, hence 4 bits instead of 2 bits for each allele.
+ */
+uint8_t snp_ale_pack(char ref, char alt);
+#define snp_ale_ref(x) ((x) >> 4)
+#define snp_ale_alt(x) ((x) & 0xf)
+/*@abstract  Convert the code of one allele to the index in "ACGTN", -1 for missing. */
+#define snp_ale_idx(c) ((c) ? (int) (c) - 1 : -1)
 
 /*@abstract    Extract SNP info from bcf/vcf file.
 @param fn      Filename of bcf/vcf.
@@ -71,17 +93,121 @@ typedef kvec_t(snp_t*) snplist_t;   /* kvec_t from kvec.h */
                If length of Ref or Alt is 0, then their values would be infered during pileup.
  */
 size_t get_snplist_from_vcf(const char *fn, snplist_t *pl, int *ret, int print_skip);
-#define get_snplist(fn, pl, ret, print_skip) get_snplist_from_vcf(fn, pl, ret, print_skip)
+
+/*@abstract    Extract SNP info from bcf/vcf file or panel file, detected by the magic string.
+@note          Refer to get_snplist_from_vcf() and get_snplist_from_panel() for the parameters.
+ */
+size_t get_snplist(const char *fn, snplist_t *pl, int *ret, int print_skip);
+
+/*@abstract  Sort the SNPs by (chrom index, pos), keeping the input order of SNPs at the same pos.
+@param pl    Pointer of the snplist_t structure.
+@return      0 if success, -1 otherwise.
+ */
+int snplist_sort(snplist_t *pl);
+
+/*
+ * Panel API
+ */
+/*@abstract  The panel file is the binary dump of a sorted snplist_t, so that the SNP list could be loaded
+             without parsing. Values are in the native byte order.
+
+             magic    char[8], SNP_PANEL_MAGIC
+             nchrom   int32_t
+             (pad)    4 bytes
+             n        uint64_t
+             chroms   for each chrom: uint32_t len, char[len] name (no '\0'); padded with 0 to 8-byte boundary
+             off      uint64_t[nchrom + 1], the SNPs of chrom i are [off[i], off[i+1])
+             pos      int64_t[n], 0-based pos
+             ale      uint8_t[n], packed alleles, refer to snp_ale_pack()
+
+@note        The SNPs in the panel are sorted by chrom (in order of their first occurence in the VCF) and pos,
+             and have passed the same checks as get_snplist_from_vcf().
+ */
+#define SNP_PANEL_MAGIC "CSPPNL\1\0"
+#define SNP_PANEL_MAGIC_LEN 8
+
+/*@abstract  Check if the file is a panel file.
+@param fn    Filename.
+@return      1 if yes, 0 if not, -1 if @p fn is NULL.
+
+@note        Panel files are only read from local files. So "-" and the files that could not be opened by fopen(),
+             e.g. http:// or s3:// URLs, are not panel files and would be left to htslib as VCF files, which also
+             reports the error if the file does not exist.
+ */
+int snp_panel_is(const char *fn);
+
+/*@abstract  Sort the SNP list and write it into a panel file.
+@param fn    Filename of the panel.
+@param pl    Pointer of the snplist_t structure. It would be sorted in place.
+@return      0 if success, -1 otherwise.
+ */
+int snp_panel_write(const char *fn, snplist_t *pl);
+
+/*@abstract  Extract SNP info from a panel file.
+@param fn    Filename of the panel.
+@param pl    Pointer to client data used to store the extracted SNP info.
+@param ret   Pointer to store running state. 0 if success, -1 otherwise.
+@return      Num of elements successfully added into the snplist.
+ */
+size_t get_snplist_from_panel(const char *fn, snplist_t *pl, int *ret);
 
 /*
- * Bi-Allele API
+ * Target API
+ */
+/*@abstract    The targets (SNPs) grouped by chroms and sorted by pos within each chrom.
+@param chrom   Names of chroms, the same order as in the input SNP list.
+@param nchrom  Num of chroms.
+@param off     The targets of chrom i are [off[i], off[i+1]) in the arrays below. Size nchrom + 1.
+@param pos     0-based pos of targets.
+@param ale     Packed alleles of targets. Refer to snp_ale_pack().
+@param n       Num of targets.
+
+@note          Only the first one of the SNPs at the same pos is kept, and every chrom has at least one target.
+ */
+typedef struct {
+    char **chrom;
+    int nchrom;
+    size_t *off;
+    hts_pos_t *pos;
+    uint8_t *ale;
+    size_t n;
+} snp_tgt_t;
+
+/*@abstract  Build the targets from SNP list.
+@param pl    Pointer of SNP list.
+@return      Pointer of snp_tgt_t if success, NULL otherwise.
+ */
+snp_tgt_t* snp_tgt_build(snplist_t *pl);
+void snp_tgt_destroy(snp_tgt_t *t);
+
+/*@abstract  Cursor that walks through the targets of one chrom along with the coordinate-sorted streams
+             (reads or pileup columns). It only moves forward.
+@param pos   Pointer of the pos array of snp_tgt_t.
+@param i     Index of the current target, i.e. the first one whose pos >= the query pos seen so far.
+@param n     End index of the targets of the chrom.
  */
 typedef struct {
-    int8_t ref, alt;
-} biallele_t;
+    const hts_pos_t *pos;
+    size_t i, n;
+} snp_tcur_t;
+
+/*@abstract  Set the cursor to the first target whose pos >= @p beg on chrom @p cid. */
+static inline void snp_tcur_set(snp_tcur_t *c, const snp_tgt_t *t, int cid, hts_pos_t beg) {
+    size_t lo = t->off[cid], hi = t->off[cid + 1], mid;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) >> 1);
+        if (t->pos[mid] < beg) { lo = mid + 1; } else { hi = mid; }
+    }
+    c->pos = t->pos; c->i = lo; c->n = t->off[cid + 1];
+}
 
-inline biallele_t* biallele_init(void);
-inline void biallele_destroy(biallele_t *p);
-inline void biallele_reset(biallele_t *p);
+/*@abstract  Move the cursor to the first target whose pos >= @p pos.
+@return      Pos of that target, HTS_POS_MAX if no more targets.
+@note        The query pos should be nondecreasing, while a smaller one only gets the current target.
+ */
+static inline hts_pos_t snp_tcur_seek(snp_tcur_t *c, hts_pos_t pos) {
+    while (c->i < c->n && c->pos[c->i] < pos) { c->i++; }
+    return c->i < c->n ? c->pos[c->i] : HTS_POS_MAX;
+}
 
 #endif
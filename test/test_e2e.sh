@@ -0,0 +1,276 @@
+#!/bin/bash
+
+## End-to-end checks of cellsnp-lite: the outputs of the runs with different
+## options are compared with the ones of the baseline runs, which should be the same.
+##
+## It uses the 10x data of test_10x.sh, please download it first, then run
+##     REF_CSP=/path/to/released/cellsnp-lite bash test_e2e.sh [DAT_DIR]
+## The baselines are run by REF_CSP with one subprocess, which should be another binary (e.g. a released
+## version), otherwise the binary would only be compared with itself.
+## The binary and the input files could be changed by env variables too, e.g.
+##     CSP=../cellsnp-lite BAM=a.bam BARCODE=b.tsv REGION=c.vcf REF_CSP=... bash test_e2e.sh
+## The SNPs in REGION should be sorted and on the chroms of BAM, as it's also used by -T and the panel.
+##
+## Checked against the baselines:
+##   - one subprocess in Mode 1, 2 and -T, and -T with a chrom whose SNPs are all skipped;
+##   - the UMIs kept as strings;
+##   - the chroms split into windows, and merging the tmp files of multiple subprocesses;
+##   - the SNP panel (-R and -T);
+##   - --sparseGeno, i.e. the genotypes of the cells VCF;
+##   - --bcf, i.e. the records of the text VCF, if bcftools is found;
+##   - the input handles shared by the subprocesses with a low `ulimit -n`;
+##   - --shard and the merge subcommand;
+##   - --streamOut, --profile (the counters) and --resume of a killed run.
+
+DAT_DIR=${1:-$HOME/test_cellSNP}
+CSP=${CSP:-cellsnp-lite}
+REF_CSP=${REF_CSP:-}
+BAM=${BAM:-$DAT_DIR/demux.B.lite.bam}
+BARCODE=${BARCODE:-$DAT_DIR/demux.B.barcodes.400.tsv}
+REGION=${REGION:-$DAT_DIR/genome1K.subset.hg19.vcf.gz}
+CHROM=${CHROM:-}                 # e.g. chr1,chr2 for Mode 2, default all.
+MIN_COUNT=${MIN_COUNT:-20}
+EXTRA=${EXTRA:-}                 # options added to all runs, e.g. --UMItag UB.
+NPROC=${NPROC:-8}
+WIN_SIZE=${WIN_SIZE:-1048576}     # --winSize of the Mode 2 runs with multiple subprocesses.
+TIMEOUT=${TIMEOUT:-600}          # seconds, a run taking longer is treated as hung.
+OUT_DIR=${OUT_DIR:-$DAT_DIR/e2e}
+
+if [ -z "$REF_CSP" ] || cmp -s "$(command -v $CSP)" "$(command -v $REF_CSP)"; then
+    echo "[E] REF_CSP should be another binary than CSP (e.g. a released version) to run the baselines."
+    exit 1
+fi
+
+rm -rf $OUT_DIR
+mkdir -p $OUT_DIR
+
+NFAIL=0
+fail() { echo "[FAIL] $*"; NFAIL=$((NFAIL + 1)); return 1; }
+pass() { echo "[PASS] $*"; }
+
+## run NAME BIN ARGS...: run BIN with ARGS, whose output dir is $OUT_DIR/NAME.
+run() {
+    local name=$1 bin=$2
+    shift 2
+    timeout $TIMEOUT $bin "$@" -O $OUT_DIR/$name > $OUT_DIR/$name.log 2>&1
+}
+
+## print the content of one output file, the trailing spaces of the comment lines
+## of mtx files are removed (refer to --streamOut), so is the version of the VCF files.
+show() {
+    case $1 in
+        *.gz) gzip -dcf $1 ;;
+        *) cat $1 ;;
+    esac | sed -e '/^%/s/ *$//' -e '/^##source=/d'
+}
+
+## same_out DIR1 DIR2 [PATTERN]: the output files (cellSNP.* by default) in DIR1 and DIR2 should be the same.
+same_out() {
+    local f n=0
+    for f in $1/${3:-cellSNP.*}; do
+        case $f in *.ckpt|*.profile.json|*.csi) continue ;; esac
+        n=$((n + 1))
+        [ -e $2/${f##*/} ] || { echo "  ${f##*/} is missing in $2"; return 1; }
+        cmp -s <(show $f) <(show $2/${f##*/}) || { echo "  ${f##*/} differs"; return 1; }
+    done
+    [ $n -gt 0 ]
+}
+
+## run_ok NAME ARGS...: run $CSP with ARGS, a run that fails or hangs is reported.
+run_ok() {
+    local name=$1 ret
+    shift
+    run $name $CSP "$@"
+    ret=$?
+    if [ $ret -eq 124 ]; then fail "$name: hung for ${TIMEOUT}s"
+    elif [ $ret -ne 0 ]; then fail "$name: exit $ret, see $OUT_DIR/$name.log"
+    fi
+}
+
+## check NAME BASE ARGS...: run with ARGS and compare the output with the one of BASE.
+check() {
+    local name=$1 base=$2
+    shift 2
+    run_ok $name "$@" || return 1
+    if same_out $OUT_DIR/$base $OUT_DIR/$name; then pass "$name"
+    else fail "$name: output differs from $base"
+    fi
+}
+
+## shard_merge NAME BASE N ARGS...: run the N shards with ARGS, and merge them by the merge subcommand, whose
+## output should be the same with the one of BASE.
+shard_merge() {
+    local name=$1 base=$2 n=$3 i dirs=
+    shift 3
+    for ((i = 1; i <= n; i++)); do
+        run_ok $name.$i "$@" --shard $i/$n || return 1
+        dirs="$dirs $OUT_DIR/$name.$i"
+    done
+    timeout $TIMEOUT $CSP merge $OUT_DIR/$name $dirs > $OUT_DIR/$name.log 2>&1 || \
+        { fail "$name: merge failed, see $OUT_DIR/$name.log"; return 1; }
+    if same_out $OUT_DIR/$base $OUT_DIR/$name; then pass "$name"
+    else fail "$name: output differs from $base"
+    fi
+}
+
+## print "SNP cell GT PL" of the genotyped cells from the cells VCF, as in the sparse GT/PL files.
+vcf_geno() {
+    show $1 | awk -F'\t' '! /^#/ {
+        n++
+        for (i = 10; i <= NF; i++) {
+            split($i, a, ":")
+            if ("." == a[1]) { continue }
+            print n "\t" i - 9 "\t" ("0/0" == a[1] ? 1 : ("1/1" == a[1] ? 3 : 2)) "\t" a[5]
+        }
+    }'
+}
+
+## print "SNP cell GT PL" from the sparse GT mtx file and PL file.
+mtx_geno() {
+    paste <(show $1 | grep -v '^%' | tail -n +2) <(show $2 | grep -v '^%' | tail -n +2) | \
+        awk -F'\t' '{ print $1 "\t" $2 "\t" $3 "\t" $6 }'
+}
+
+## kill_resume NAME BASE ARGS...: kill the run with ARGS by SIGKILL once one of its units has been finished,
+## then re-run it with --resume, which should skip the finished units and have the output of BASE.
+kill_resume() {
+    local name=$1 base=$2 pid i
+    shift 2
+    mkdir -p $OUT_DIR/$name
+    $CSP "$@" -O $OUT_DIR/$name > $OUT_DIR/$name.kill.log 2>&1 &
+    pid=$!
+    for ((i = 0; i < TIMEOUT * 10; i++)); do
+        [ $(cat $OUT_DIR/$name/cellSNP.ckpt 2> /dev/null | wc -l) -ge 2 ] && break
+        kill -0 $pid 2> /dev/null || break
+        sleep 0.1
+    done
+    kill -9 $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    if [ ! -e $OUT_DIR/$name/cellSNP.ckpt ]; then
+        echo "[SKIP] $name: the run finished before being killed"
+        return 0
+    fi
+    check $name $base "$@" --resume || return 1
+    grep -q 'resume: [1-9][0-9]* of' $OUT_DIR/$name.log || fail "$name: no finished unit is skipped"
+}
+
+## check_profile NAME BASE: the profile of NAME should have the counters consistent with the output of BASE.
+check_profile() {
+    local f=$OUT_DIR/$1/cellSNP.profile.json k nvar
+    [ -s $f ] || { fail "$1: no profile"; return 1; }
+    for k in decode filter umi_cb pileup wait stat output run merge; do
+        grep -q "^    \"$k\": [0-9.]*,\?$" $f || { fail "$1: no time of stage $k"; return 1; }
+    done
+    nvar=$(show $OUT_DIR/$2/cellSNP.base.vcf* | grep -vc '^#')
+    awk -v nvar=$nvar '
+        /"reads": \{/ { sec = "reads" }
+        /"snps": \{/  { sec = "snps" }
+        /"rejected": \{/ { sec = "rej" }
+        sec == "reads" && /"read":/   { gsub(/[^0-9]/, ""); nread = $0 }
+        sec == "reads" && /"passed":/ { gsub(/[^0-9]/, ""); nrpass = $0 }
+        sec == "rej" && /"[a-z_]*": [0-9]/ && !/del_refskip/ { gsub(/[^0-9]/, ""); nrej += $0 }
+        sec == "snps" && /"pileup":/  { gsub(/[^0-9]/, ""); nsnp = $0 }
+        sec == "snps" && /"passed":/  { gsub(/[^0-9]/, ""); npass = $0; sec = "" }
+        /"i": [0-9]*,/ { split($0, a, /[:,]/); ur += a[4]; us += a[6]; up += a[8] }
+        END { exit !(nread == nrpass + nrej && npass == nvar && ur == nread && us == nsnp && up == npass) }
+    ' $f && pass "$1: profile" || fail "$1: counters of the profile do not match"
+}
+
+M1="-s $BAM -b $BARCODE -R $REGION --minCOUNT $MIN_COUNT --gzip $EXTRA"
+M2="-s $BAM -b $BARCODE --minCOUNT $MIN_COUNT --minMAF 0.1 --gzip ${CHROM:+--chrom $CHROM} $EXTRA"
+MT="-s $BAM -b $BARCODE -T $REGION --minCOUNT $MIN_COUNT --gzip $EXTRA"
+## Mode 3 with the BAM as 4 samples, i.e. 4 input files for each subprocess.
+M3="-s $BAM,$BAM,$BAM,$BAM -I s1,s2,s3,s4 -R $REGION --cellTAG None --UMItag None --minCOUNT $MIN_COUNT --gzip"
+
+### baseline runs with one subprocess
+run m1_base $REF_CSP $M1 -p 1 || fail "m1_base: exit $?"
+run m2_base $REF_CSP $M2 -p 1 || fail "m2_base: exit $?"
+run mT_base $REF_CSP $MT -p 1 || fail "mT_base: exit $?"
+run m1_geno_base $REF_CSP $M1 -p 1 --genotype || fail "m1_geno_base: exit $?"
+run m3_base $REF_CSP $M3 -p 1 || fail "m3_base: exit $?"
+
+### one subprocess
+check m1_one m1_base $M1 -p 1
+check m2_one m2_base $M2 -p 1
+check mT_one mT_base $MT -p 1
+
+### -T with the SNPs of the first chrom turned into indels, which are skipped, so should be the chrom,
+### i.e. the same as the targets without the chrom.
+C1=$(show $REGION | grep -v '^#' | head -n 1 | cut -f 1)
+show $REGION | awk -F'\t' -v OFS='\t' -v c="$C1" '$1 == c { $4 = $4 "A" } { print }' > $OUT_DIR/indel.vcf
+show $REGION | awk -F'\t' -v c="$C1" '$1 != c' > $OUT_DIR/no_indel.vcf
+run mT_indel_base $REF_CSP ${MT/-T $REGION/-T $OUT_DIR/no_indel.vcf} -p 1 || fail "mT_indel_base: exit $?"
+check mT_indel mT_indel_base ${MT/-T $REGION/-T $OUT_DIR/indel.vcf} -p 1
+
+### the UMIs that could not be packed into integers, e.g., the cell barcodes with the "-1" suffix, are kept
+### as strings in the arena of each subprocess, which is reset for each SNP.
+run m1_umi_base $REF_CSP $M1 -p 1 --UMItag CB || fail "m1_umi_base: exit $?"
+check m1_umi m1_umi_base $M1 -p 1 --UMItag CB
+check m1_umi_multi m1_umi_base $M1 -p $NPROC --UMItag CB
+
+### the chroms split into windows, each pileuped by its own subprocess, including the reads across the windows
+check m2_multi m2_base $M2 -p $NPROC --winSize $WIN_SIZE
+check mT_multi mT_base $MT -p $NPROC --winSize $WIN_SIZE
+
+### merging the tmp mtx and VCF files of multiple subprocesses
+check m1_multi m1_base $M1 -p $NPROC
+check m1_geno_multi m1_geno_base $M1 -p $NPROC --genotype
+
+### SNP panel made by the panel subcommand, used by -R and -T
+if timeout $TIMEOUT $CSP panel $REGION $OUT_DIR/snp.panel > $OUT_DIR/panel.log 2>&1 && \
+   timeout $TIMEOUT $CSP panel $OUT_DIR/indel.vcf $OUT_DIR/indel.panel >> $OUT_DIR/panel.log 2>&1; then
+    check m1_panel m1_base ${M1/-R $REGION/-R $OUT_DIR/snp.panel} -p $NPROC
+    check mT_panel mT_base ${MT/-T $REGION/-T $OUT_DIR/snp.panel} -p $NPROC --winSize $WIN_SIZE
+    check mT_indel_panel mT_indel_base ${MT/-T $REGION/-T $OUT_DIR/indel.panel} -p 1
+else fail "panel: failed, see $OUT_DIR/panel.log"
+fi
+
+### sparse GT and PL of the cells with reads, the same genotypes as the cells VCF
+if run_ok m1_sparse $M1 -p $NPROC --sparseGeno; then
+    if ! same_out $OUT_DIR/m1_geno_base $OUT_DIR/m1_sparse 'cellSNP.[st]*'; then fail "m1_sparse: mtx differs from m1_geno_base"
+    elif cmp -s <(vcf_geno $OUT_DIR/m1_geno_base/cellSNP.cells.vcf*) \
+                <(mtx_geno $OUT_DIR/m1_sparse/cellSNP.tag.GT.mtx* $OUT_DIR/m1_sparse/cellSNP.tag.PL.txt*); then pass "m1_sparse"
+    else fail "m1_sparse: genotypes differ from the cells VCF"
+    fi
+fi
+
+### BCF output, whose records should be the same with the text VCF (checked only if bcftools is found)
+if run_ok m1_bcf $M1 -p $NPROC --genotype --bcf; then
+    if ! same_out $OUT_DIR/m1_geno_base $OUT_DIR/m1_bcf 'cellSNP.[st]*'; then fail "m1_bcf: mtx differs from m1_geno_base"
+    elif ! command -v bcftools > /dev/null; then echo "[SKIP] m1_bcf: no bcftools to read the BCF files"
+    elif cmp -s <(show $OUT_DIR/m1_geno_base/cellSNP.base.vcf* | grep -v '^#') \
+                <(bcftools view -H $OUT_DIR/m1_bcf/cellSNP.base.bcf) && \
+         cmp -s <(show $OUT_DIR/m1_geno_base/cellSNP.cells.vcf* | grep -v '^#' | cut -f 1,2,10-) \
+                <(bcftools query -f '%CHROM\t%POS[\t%GT:%AD:%DP:%OTH:%PL:%ALL]\n' $OUT_DIR/m1_bcf/cellSNP.cells.bcf | \
+                  sed 's#\./\.#.#g'); then pass "m1_bcf"
+    else fail "m1_bcf: records differ from the text VCF"
+    fi
+fi
+
+### the input handles shared by the subprocesses, while only a few files could be open
+check m3_one m3_base $M3 -p 1
+( ulimit -n 40; check m3_pool m3_base $M3 -p $NPROC ) || NFAIL=$((NFAIL + 1))
+
+### the shards merged by the merge subcommand
+shard_merge m1_shard m1_base 3 $M1 -p 2
+shard_merge m2_shard m2_base 3 $M2 -p 2 --winSize $WIN_SIZE
+
+### streaming output
+check m1_stream m1_base $M1 -p $NPROC --streamOut
+check m2_stream m2_base $M2 -p $NPROC --streamOut --winSize $WIN_SIZE
+
+## the workers of the later units wait for the writer at once (--streamBuf 0), while the
+## handles of only one unit could be open (ulimit), which should not deadlock.
+( ulimit -n 40; check m1_stream_tiny m1_base $M1 -p $NPROC --streamOut --streamBuf 0 ) || NFAIL=$((NFAIL + 1))
+( ulimit -n 40; check m2_stream_tiny m2_base $M2 -p $NPROC --streamOut --streamBuf 0 --winSize $WIN_SIZE ) || NFAIL=$((NFAIL + 1))
+
+### the profile, which should not change the output
+check m1_profile m1_base $M1 -p $NPROC --profile && check_profile m1_profile m1_base
+check m2_profile m2_base $M2 -p $NPROC --profile --winSize $WIN_SIZE && check_profile m2_profile m2_base
+
+### resume a killed run, the manifest and the tmp files of the finished units are kept.
+kill_resume m1_resume m1_base $M1 -p $NPROC
+kill_resume m2_resume m2_base $M2 -p $NPROC --winSize $WIN_SIZE
+
+echo "$NFAIL check(s) failed."
+[ $NFAIL -eq 0 ]